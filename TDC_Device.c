@@ -2,30 +2,52 @@
 
 const char *TDC_DEVICE_NAME = "RoentDek TDC8 prototype card";
 
-static struct tdc_device *tdc_card; // needed for the timer callback function
+static void tdc_init_wakeup(struct tdc_device *self);
+static int tdc_throttled(struct tdc_device *self);
+static void tdc_acq_freeze(struct tdc_device *self);
+static void tdc_clock_sample(struct tdc_device *self);
+static void tdc_count_start(struct tdc_device *self, ktime_t now);
+static void tdc_count_event(struct tdc_device *self);
+static void tdc_count_slice_end(struct tdc_device *self, ktime_t now);
 
 
-static inline int tdc_has_detected_com_event(struct tdc_device *self)
+int tdc_has_detected_com_event(struct tdc_device *self)
 {
     return _get_bit(self, PIA1PB, 7);
 }
 
+/*
+ * Updates the rate meters from the counters of the measurement.
+ */
+static void tdc_update_rates(struct tdc_device *self, ktime_t now)
+{
+    struct tdc_measurement *m = &self->measurement;
+    unsigned long totals[TDC_NUM_METERS];
+    int ch;
+
+    totals[TDC_METER_COM] = m->num_com_signals;
+    totals[TDC_METER_HITS] = m->num_valid_hits_sum;
+    totals[TDC_METER_INVALID] = 0;
+    totals[TDC_METER_EMPTY] = m->num_com_signals_without_hits;
+    totals[TDC_METER_OVERFLOW] = m->buf_overflow_events + m->throttled_coms;
+    for (ch = 0; ch < TDC_MAX_NUM_CHANNELS; ++ch) {
+        totals[TDC_METER_INVALID] += m->num_invalid_hits[ch];
+        totals[TDC_METER_CH0 + ch] = m->num_hits[ch];
+    }
+    tdc_rates_update(&self->rates, totals, now);
+}
+
 int tdc_timer_callback(struct hrtimer *hrtimer)
 {
-    ktime_t now = ktime_get();
+    struct tdc_device *tdc_card =
+        container_of(hrtimer, struct tdc_device, timer.hrtimer);
+    ktime_t start = ktime_get(), now, com_time;
     unsigned long overruns;
-    static unsigned long counter = 1;
-
-    static unsigned long n_com_prev = 0;
-    static unsigned long n_hits_prev = 0;
+    int old_error;
     int retval = HRTIMER_NORESTART;
 
     PDEBUG_MAYBE("Timer callback function called");
 
-    if (!tdc_card) {
-        PDEBUG("tdc_card is null!");
-        return retval;
-    }
     if (unlikely(&tdc_card->measurement == NULL)) {
         PDEBUG("NO MEASUREMENT!");
         return retval;
@@ -44,20 +66,40 @@ int tdc_timer_callback(struct hrtimer *hrtimer)
         return retval; // don't lock up, since lock not acquired
     }
     PDEBUG_MAYBE("timer_callback got lock");
+    tdc_trace_timer_fire(tdc_card, ktime_sub(start, hrtimer->expires));
+    tdc_hist_add(&tdc_card->stats.hist[TDC_HIST_TIMER_LATE],
+        ktime_sub(start, hrtimer->expires));
 
     if (unlikely(tdc_card->measurement.state != M_STARTED)) {
         PDEBUG("Stopping timer now.");
         tdc_reset(tdc_card);
+        /* The records of the last events go to the stream before the end. */
+        if (!down_interruptible(&tdc_card->sem)) {
+            tdc_flush_records(tdc_card, 1);
+            up(&tdc_card->sem);
+        }
         /*
          * Wake up processes that are waiting for the callback function to
          * terminate, in order to stop the timer.
          */
         wake_up_interruptible(&tdc_card->stopq);
+        /* Readers waiting for more data will now get end of file. */
+        wake_up_interruptible(&tdc_card->bufq);
+        if (tdc_card->merge)
+            wake_up_interruptible(&tdc_card->merge->bufq);
         goto out; // retval = HRTIMER_NORESTART;
     }
 
     PDEBUG_MAYBE("Checking for COM event in %s...", __FUNCTION__);
     if (tdc_has_detected_com_event(tdc_card)) {
+        com_time = ktime_get();
+        tdc_card->measurement.com_cycles = get_cycles();
+        if (tdc_card->merge) {
+            /* The merged device holds back later events of other cards. */
+            tdc_card->measurement.merge_pending =
+                tdc_card->measurement.com_cycles;
+            smp_wmb();
+        }
         /*
          * Stop measurement if we have an upper limit
          * to the number of com signals we want to detect,
@@ -70,29 +112,34 @@ int tdc_timer_callback(struct hrtimer *hrtimer)
         {
             PDEBUG("max_num_com_signals reached. Will stop measurement.");
             tdc_card->measurement.state = M_STOPPED; // will terminate on next callback
+            tdc_notify_status(tdc_card);
         } else {
             tdc_card->measurement.num_com_signals++;
         }
         PDEBUG_MAYBE("COMMON START pulse registered.");
+        tdc_trace_com(tdc_card);
 
         udelay(10); // not really necessary, can be removed,
                     // which makes possible higher callback rates.
 
-        tdc_check_for_events(tdc_card);
-        if (tdc_card->has_events) {
-            PDEBUG_MAYBE("Hits were found; decoding them...");
-            tdc_decode_events(tdc_card);
-            if (unlikely(tdc_card->error & E_TOO_MANY_HITS)) {
-                PDEBUG("Too many hits %s:%d", __FILE__, __LINE__);
-                tdc_card->measurement.error |= E_TOO_MANY_HITS;
-            }
-        } else {
-            PDEBUG_MAYBE("No hits were found");
+        /*
+         * Read out the event and re-arm the card, with the variant of the
+         * read-out picked when the measurement started. With
+         * TDC_THROTTLE, the card may only be re-armed.
+         */
+        old_error = tdc_card->measurement.error;
+        tdc_card->acq.read_com(tdc_card, !tdc_throttled(tdc_card));
+        if (unlikely(tdc_card->measurement.error != old_error)) {
+            PDEBUG("Measurement error 0x%x", tdc_card->measurement.error);
+            tdc_notify_status(tdc_card);
+        }
+        tdc_hist_add(&tdc_card->stats.hist[TDC_HIST_COM_READOUT],
+            ktime_sub(ktime_get(), com_time));
+        if (tdc_card->merge) {
+            smp_wmb();
+            tdc_card->measurement.merge_pending = 0;
+            tdc_wake_readers(tdc_card->merge);
         }
-        PDEBUG_MAYBE("Resetting TDC card...");
-        tdc_reset(tdc_card);
-        PDEBUG_MAYBE("Preparing to wait...");
-        tdc_prepare_wait(tdc_card);
     } else {
         PDEBUG("COM event not found in %s...", __FUNCTION__);
     }
@@ -100,29 +147,47 @@ int tdc_timer_callback(struct hrtimer *hrtimer)
     now = ktime_get();
     overruns = hrtimer_forward(hrtimer, now,
         tdc_card->timer.callback_interval);
+    tdc_hist_add(&tdc_card->stats.hist[TDC_HIST_CALLBACK],
+        ktime_sub(now, start));
+
+    /* Counting mode: write the count record of each slice as it ends. */
+    if (tdc_card->acq.count_slice_ns &&
+        ktime_to_ns(ktime_sub(now, tdc_card->measurement.counts.start)) >=
+            tdc_card->acq.count_slice_ns &&
+        !down_interruptible(&tdc_card->sem)) {
+        tdc_count_slice_end(tdc_card, now);
+        tdc_flush_records(tdc_card, 0);
+        up(&tdc_card->sem);
+    }
 
     /*
-     * Update and display statistical data about the timer
-     * and measurement once per second.
+     * Update the rates every TDC_RATE_TICK_NS, and once per second
+     * display them.
      */
-    if (unlikely((counter >= tdc_card->timer.callback_rate))) {
-        tdc_card->measurement.com_rate =
-            tdc_card->measurement.num_com_signals - n_com_prev;
-        PDEBUG("Calculated current COM frequency: %lu Hz",
-            tdc_card->measurement.com_rate);
-
-        tdc_card->measurement.hit_rate =
-            tdc_card->measurement.num_valid_hits_sum - n_hits_prev;
-        PDEBUG("Calculated current hit frequency: %lu Hz",
-            tdc_card->measurement.hit_rate);
-
-        n_com_prev = tdc_card->measurement.num_com_signals;
-        n_hits_prev = tdc_card->measurement.num_valid_hits_sum;
-
-        PDEBUG("overruns: %lu", overruns);
-        counter = 1;
-    } else {
-        counter++;
+    if (unlikely(tdc_rates_due(&tdc_card->rates, now))) {
+        tdc_update_rates(tdc_card, now);
+        if (tdc_card->rates.updates % (NSEC_PER_SEC / TDC_RATE_TICK_NS) == 0) {
+            PDEBUG("Current COM frequency: %lu Hz",
+                tdc_rate_hz(&tdc_card->rates, TDC_METER_COM, TDC_RATE_1S));
+            PDEBUG("Current hit frequency: %lu Hz",
+                tdc_rate_hz(&tdc_card->rates, TDC_METER_HITS, TDC_RATE_1S));
+
+            if (tdc_card->stream_format & TDC_FMT_TIME)
+                tdc_clock_sample(tdc_card);
+
+            /*
+             * Readers shouldn't have to wait for the next event to learn
+             * about the COM signals without hits, or the clock.
+             */
+            if ((tdc_card->measurement.empty_coms ||
+                tdc_card->measurement.clock_due) &&
+                !down_interruptible(&tdc_card->sem)) {
+                tdc_flush_records(tdc_card, 0);
+                up(&tdc_card->sem);
+            }
+
+            PDEBUG("overruns: %lu", overruns);
+        }
     }
     retval = HRTIMER_RESTART;
     PDEBUG_MAYBE("Returning HRTIMER_RESTART from %s.", __FUNCTION__);
@@ -132,28 +197,44 @@ out:
 }
 
 
-struct tdc_device *tdc_new(unsigned int _baseport)
+/*
+ * Creates a card at the given base port. If simulated is set, no ports
+ * are used; the card is simulated by tdc_sim.c instead.
+ */
+struct tdc_device *tdc_new(unsigned int _baseport, int simulated)
 {
     struct tdc_device *tdc;
 
-    PDEBUG("Begär åtkomst till portar 0x%x - 0x%x...", _baseport, _baseport+TDC_NUM_PORTS);
-    if (request_region(_baseport, TDC_NUM_PORTS, TDC_DEVICE_NAME) == NULL) {
-        PDEBUG("Kunde inte få åtkomst till 0x%x och framåt...", _baseport);
-        return NULL;
+    if (!simulated) {
+        PDEBUG("Begär åtkomst till portar 0x%x - 0x%x...", _baseport, _baseport+TDC_NUM_PORTS);
+        if (request_region(_baseport, TDC_NUM_PORTS, TDC_DEVICE_NAME) == NULL) {
+            PDEBUG("Kunde inte få åtkomst till 0x%x och framåt...", _baseport);
+            return NULL;
+        }
     }
 
     PDEBUG("Skapar TDC!");
-    tdc = tdc_card =
-    kzalloc( sizeof(*tdc), GFP_KERNEL );
+    tdc = kzalloc( sizeof(*tdc), GFP_KERNEL );
     if (!tdc) return NULL;
 
+    if (simulated) {
+        tdc->sim = tdc_sim_new();
+        if (!tdc->sim) {
+            kfree(tdc);
+            return NULL;
+        }
+    }
+
     tdc->baseport = _baseport;
+    tdc->cpu = -1;
     tdc->num_channels = TDC_MAX_NUM_CHANNELS;
     tdc->max_num_hits_per_channel = TDC_MAX_NUM_HITS_PER_CHANNEL;
 
     tdc->fifo = tdc_fifo_new(TDC_BUFFER_SIZE);
     if (!tdc->fifo) {
         PDEBUG("Could not create tdc->fifo in tdc_new");
+        if (tdc->sim)
+            tdc_sim_destroy(tdc->sim);
         kfree(tdc);
         return NULL;
     }
@@ -162,8 +243,15 @@ struct tdc_device *tdc_new(unsigned int _baseport)
     tdc->t_min = 0;
     tdc->t_max = TDC_MAX_DELAY;
     tdc->max_num_hits_per_channel = TDC_MAX_NUM_HITS_PER_CHANNEL;
+    tdc->overflow_policy = TDC_DROP_NEWEST;
+    tdc->overflow_high = 100;
+    tdc->overflow_low = 100;
+    tdc_stats_reset(&tdc->stats);
+    spin_lock_init(&tdc->read_stats_lock);
+    tdc_rates_reset(&tdc->rates);
 
     tdc_set_com_mode(tdc, COMMON_START);
+    tdc_acq_freeze(tdc);
 
     tdc->timer.callback_interval = ktime_set(0, TDC_DEFAULT_COM_PERIOD_NS);
     tdc->timer.callback_rate = 1e9/TDC_DEFAULT_COM_PERIOD_NS;
@@ -187,12 +275,13 @@ struct tdc_device *tdc_new(unsigned int _baseport)
         HRTIMER_MODE_REL
     );
     tdc->timer.hrtimer.function = (void *)&tdc_timer_callback;
+    tdc_init_wakeup(tdc);
 
     /* Try to read a longword from baseport, see if it behaves as expected.
      *   a TDC card will most likely output: 0x????0203
      *   a computer without ISA bus defaults to all bits high
      */
-    if (inl(tdc->baseport) == 0xffffffff) {
+    if (!tdc->sim && inl(tdc->baseport) == 0xffffffff) {
         printk(KERN_WARNING "TDC card %s seems to be missing!\n",
             TDC_DEVICE_NAME);
         tdc->error |= E_NO_TDC_CARD;
@@ -212,7 +301,7 @@ int tdc_clear_data(struct tdc_device *dev)
     PDEBUG("Clearing data...");
     if (&dev->measurement) {
         PDEBUG("Measurement exists");
-        if (tdc_reset_measurement(&dev->measurement)) {
+        if (tdc_reset_measurement(dev)) {
             PDEBUG("Could not reset measurement.");
             return -1;
         }
@@ -223,16 +312,18 @@ int tdc_clear_data(struct tdc_device *dev)
     return 0;
 }
 
-int tdc_reset_measurement(struct tdc_measurement *measurement)
+int tdc_reset_measurement(struct tdc_device *self)
 {
+    struct tdc_measurement *measurement = &self->measurement;
+
     PDEBUG("tdc_reset_measurement called");
     /*
      * Don't allow this unless measurment is stopped.
      * No timer can be running.
      */
     // Cancel all running timers etc...
-    if (hrtimer_active(&(tdc_card->timer.hrtimer)) &&
-        (hrtimer_try_to_cancel(&(tdc_card->timer.hrtimer)) == -1))
+    if (hrtimer_active(&(self->timer.hrtimer)) &&
+        (hrtimer_try_to_cancel(&(self->timer.hrtimer)) == -1))
     {
         PDEBUG("There is a timer, and it is currently executing the callback "
             "function, and cannot be stopped!");
@@ -241,7 +332,9 @@ int tdc_reset_measurement(struct tdc_measurement *measurement)
     PDEBUG("tdc_reset_measurement done");
     memset(measurement, 0, sizeof(*measurement));
     measurement->state = M_NEW;
-    tdc_reset(tdc_card);
+    tdc_stats_reset(&self->stats);
+    tdc_rates_reset(&self->rates);
+    tdc_reset(self);
     return 0;
 }
 
@@ -251,17 +344,19 @@ void tdc_set_com_mode(struct tdc_device *self, enum com_mode mode)
     /* if bit 5 in PIA2PB is high then mode is common start else common stop */
 }
 
-int tdc_start_measurement(struct tdc_measurement *measurement)
+int tdc_start_measurement(struct tdc_device *self)
 {
+    struct tdc_measurement *measurement = &self->measurement;
+    cpumask_t saved_mask;
     int res;
 
     switch (measurement->state) {
         case M_STOPPED:
-            tdc_reset_measurement(measurement);
+            tdc_reset_measurement(self);
             // fall through
         case M_NEW:
             PDEBUG("tdc_start_measurement, starting new measurement.");
-            tdc_setup(tdc_card);
+            tdc_setup(self);
             measurement->duration = ktime_set(0,0);
             break;
 
@@ -280,33 +375,61 @@ int tdc_start_measurement(struct tdc_measurement *measurement)
 
     measurement->state = M_STARTED;
 
-    // Prepare for measurement
-    tdc_prepare_wait(tdc_card);
+    // Prepare for measurement, with the settings it will use
+    tdc_acq_freeze(self);
+    tdc_prepare_wait(self);
 
     measurement->time_started = ktime_get();
+    if (self->acq.count_slice_ns)
+        tdc_count_start(self, measurement->time_started);
 
-    res = hrtimer_start(&(tdc_card->timer.hrtimer),
-        tdc_card->timer.callback_interval,
-        HRTIMER_MODE_REL);
+    /*
+     * The timer callback runs on the CPU that started the timer, so
+     * if the card is bound to a CPU we move there while starting it.
+     * The clock is calibrated there too, as the counter of each CPU may
+     * differ.
+     */
+    if (self->cpu >= 0 && cpu_online(self->cpu)) {
+        saved_mask = current->cpus_allowed;
+        set_cpus_allowed(current, cpumask_of_cpu(self->cpu));
+        if (self->stream_format & TDC_FMT_TIME)
+            tdc_clock_sample(self);
+        res = hrtimer_start(&(self->timer.hrtimer),
+            self->timer.callback_interval,
+            HRTIMER_MODE_REL);
+        set_cpus_allowed(current, saved_mask);
+    } else {
+        if (self->stream_format & TDC_FMT_TIME)
+            tdc_clock_sample(self);
+        res = hrtimer_start(&(self->timer.hrtimer),
+            self->timer.callback_interval,
+            HRTIMER_MODE_REL);
+    }
 
     PDEBUG("Timer started? %s", res ? "yes" : "no");
+    tdc_notify_status(self);
 
     return res;
 
 }
 
-int tdc_pause_measurement(struct tdc_measurement *measurement)
+int tdc_pause_measurement(struct tdc_device *self)
 {
+    struct tdc_measurement *measurement = &self->measurement;
     int res;
     if (measurement->state != M_STARTED)
         return -1;
 
     measurement->state = M_PAUSED;
+    if (self->acq.count_slice_ns)
+        tdc_count_slice_end(self, ktime_get());
+    tdc_flush_records(self, 1);
+    tdc_notify_status(self);
 
     // Cancel all running timers etc...
-    if (&(tdc_card->timer.hrtimer)) {
+    if (&(self->timer.hrtimer)) {
         PDEBUG("Trying to stop timer...");
-        res = hrtimer_try_to_cancel(&(tdc_card->timer.hrtimer));
+        res = hrtimer_try_to_cancel(&(self->timer.hrtimer));
         PDEBUG("res = %d", res);
         #if DEBUG
         switch (res) {
@@ -335,8 +458,9 @@ int tdc_pause_measurement(struct tdc_measurement *measurement)
     return 0;
 }
 
-int tdc_stop_measurement(struct tdc_measurement *measurement)
+int tdc_stop_measurement(struct tdc_device *self)
 {
+    struct tdc_measurement *measurement = &self->measurement;
     int res;
     PDEBUG("tdc_stop_measurement called.");
 
@@ -355,11 +479,15 @@ int tdc_stop_measurement(struct tdc_measurement *measurement)
         PDEBUG("Measurement neither running nor paused!");
         return 0;
     }
+    if (measurement->state == M_STARTED && self->acq.count_slice_ns)
+        tdc_count_slice_end(self, ktime_get());
     measurement->state = M_STOPPED;
+    tdc_flush_records(self, 1);
+    tdc_notify_status(self);
     // Cancel all running timers etc...
-    if (&(tdc_card->timer.hrtimer)) {
+    if (&(self->timer.hrtimer)) {
         PDEBUG("Trying to stop timer...");
-        res = hrtimer_try_to_cancel(&(tdc_card->timer.hrtimer));
+        res = hrtimer_try_to_cancel(&(self->timer.hrtimer));
         PDEBUG("res = %d", res);
         #if DEBUG
         switch (res) {
@@ -397,18 +525,26 @@ void tdc_destroy(struct tdc_device *self)
     }
 
     // Stop all timers etc if a measurement is running
-    while (tdc_stop_measurement(&self->measurement) == -1) {
+    while (tdc_stop_measurement(self) == -1) {
         PDEBUG("Trying to stop measurement in tdc_destroy...");
         schedule();
 
     }
     PDEBUG("Measurement is stopped now...");
+    hrtimer_cancel(&self->flush_timer);
 
     tdc_clear_data(self);
     PDEBUG("Data is cleared now...");
 
     tdc_fifo_destroy(self->fifo);
     PDEBUG("Fifo buffer is destroyed now...");
+    tdc_iotrace_free(&self->iotrace);
+
+    if (self->sim) {
+        tdc_sim_destroy(self->sim);
+        kfree(self);
+        return;
+    }
 
     if (!self->baseport) {
         PDEBUG("tdc_destroy: self->baseport is NULL!");
@@ -420,6 +556,278 @@ void tdc_destroy(struct tdc_device *self)
     kfree(self);
 };
 
+/*
+ * Creates the merged device, which merges the events of all cards into
+ * one stream, in the order of their COM signals. It has no card and no
+ * timer of its own. While it has readers, it reads the FIFO of each card
+ * as a reader of the card would, and passes the events on to its own
+ * FIFO, see tdc_merge_pull. The cards' own readers still get all events.
+ */
+struct tdc_device *tdc_merge_new(struct tdc_device **cards,
+    unsigned int num_cards)
+{
+    struct tdc_device *merge;
+    unsigned int i;
+
+    merge = kzalloc(sizeof(*merge), GFP_KERNEL);
+    if (!merge)
+        return NULL;
+
+    merge->card_cursors = kzalloc(num_cards * sizeof(*merge->card_cursors),
+        GFP_KERNEL);
+    if (!merge->card_cursors) {
+        kfree(merge);
+        return NULL;
+    }
+    merge->fifo = tdc_fifo_new(TDC_BUFFER_SIZE);
+    if (!merge->fifo) {
+        PDEBUG("Could not create merge->fifo in tdc_merge_new");
+        kfree(merge->card_cursors);
+        kfree(merge);
+        return NULL;
+    }
+    merge->cpu = -1;
+    tdc_stats_reset(&merge->stats);
+    spin_lock_init(&merge->read_stats_lock);
+    spin_lock_init(&merge->merge_lock);
+    tdc_init_wakeup(merge);
+    merge->cards = cards;
+    merge->num_cards = num_cards;
+    for (i = 0; i < num_cards; ++i)
+        cards[i]->merge = merge;
+
+    return merge;
+}
+
+void tdc_merge_destroy(struct tdc_device *merge)
+{
+    unsigned int i;
+
+    if (!merge)
+        return;
+
+    for (i = 0; i < merge->num_cards; ++i)
+        merge->cards[i]->merge = NULL;
+    hrtimer_cancel(&merge->flush_timer);
+    tdc_fifo_destroy(merge->fifo);
+    kfree(merge->card_cursors);
+    kfree(merge);
+}
+
+/*
+ * Starts reading the FIFOs of the cards, when the merged device gets its
+ * first reader. Like a new reader of a card, it starts at the oldest data
+ * the card kept, and the card waits for it when its FIFO is full.
+ * Must be called with merge->sem held.
+ */
+void tdc_merge_attach(struct tdc_device *merge)
+{
+    unsigned int i;
+
+    for (i = 0; i < merge->num_cards; ++i)
+        tdc_fifo_attach(merge->cards[i]->fifo, &merge->card_cursors[i], 0);
+}
+
+/*
+ * Stops reading the FIFOs of the cards, when the last reader of the
+ * merged device is gone. Must be called with merge->sem held.
+ */
+void tdc_merge_detach(struct tdc_device *merge)
+{
+    unsigned int i;
+
+    for (i = 0; i < merge->num_cards; ++i)
+        tdc_fifo_detach(merge->cards[i]->fifo, &merge->card_cursors[i]);
+}
+
+/*
+ * The number of bytes the readers of the merged device may get: what is
+ * in its FIFO, and what it has not read from the cards yet.
+ */
+unsigned int tdc_merge_len(struct tdc_device *merge)
+{
+    unsigned int i, len = tdc_fifo_len(merge->fifo);
+
+    for (i = 0; merge->nreaders && i < merge->num_cards; ++i)
+        len += tdc_fifo_cursor_len(merge->cards[i]->fifo,
+            &merge->card_cursors[i]);
+    return len;
+}
+
+static inline u64 tdc_get_u64(const unsigned char *p)
+{
+    return (u64)p[0] | (u64)p[1] << 8 | (u64)p[2] << 16 |
+        (u64)p[3] << 24 | (u64)p[4] << 32 | (u64)p[5] << 40 |
+        (u64)p[6] << 48 | (u64)p[7] << 56;
+}
+
+/*
+ * Copies len bytes, from offset bytes after the reader's position, out of
+ * the FIFO. Only valid between tdc_fifo_read_begin and tdc_fifo_read_end.
+ */
+static void tdc_fifo_peek(struct tdc_fifo *fifo,
+    struct tdc_fifo_cursor *cursor, unsigned int offset, unsigned char *buf,
+    unsigned int len)
+{
+    unsigned int chunk;
+    unsigned char *data;
+
+    for (; len; offset += chunk, buf += chunk, len -= chunk) {
+        chunk = len;
+        data = tdc_fifo_read_ptr(fifo, cursor, offset, &chunk);
+        memcpy(buf, data, chunk);
+    }
+}
+
+/*
+ * Returns the length of the event or record offset bytes after the
+ * reader's position in the FIFO of dev, see tdc_format.h, or 0 if it is
+ * not all within the first avail bytes. In the merged stream, that
+ * includes the card number. If time is set, it gets the time of the
+ * event (TDC_FMT_TIME), 0 for a record or without TDC_FMT_TIME.
+ * Only valid between tdc_fifo_read_begin and tdc_fifo_read_end.
+ */
+unsigned int tdc_stream_item_len(struct tdc_device *dev,
+    struct tdc_fifo_cursor *cursor, unsigned int offset, unsigned int avail,
+    u64 *time)
+{
+    unsigned int fmt = dev->stream_format, card = 0, len;
+    unsigned char type, buf[8];
+
+    if (time)
+        *time = 0;
+    if (offset >= avail)
+        return 0;
+    if (dev->cards) {
+        tdc_fifo_peek(dev->fifo, cursor, offset, &type, 1);
+        if (type >= dev->num_cards)
+            return 0;
+        fmt = dev->cards[type]->stream_format;
+        card = 1;
+        if (++offset >= avail)
+            return 0;
+    }
+
+    tdc_fifo_peek(dev->fifo, cursor, offset, &type, 1);
+    if (type >= TDC_REC_MIN) {
+        len = TDC_REC_SIZE_OF(type);
+    } else {
+        len = 1 + 3 * type;
+        if (fmt & TDC_FMT_SEQ)
+            len += 4;
+        if (fmt & TDC_FMT_TIME)
+            len += 8;
+    }
+    /*
+     * Only whole events are added, so this only happens if the reader
+     * asked for less, or if the format was changed with old data left in
+     * the FIFO.
+     */
+    if (len > avail - offset)
+        return 0;
+    if (time && type < TDC_REC_MIN && (fmt & TDC_FMT_TIME)) {
+        tdc_fifo_peek(dev->fifo, cursor,
+            offset + (fmt & TDC_FMT_SEQ ? 5 : 1), buf, 8);
+        *time = tdc_get_u64(buf);
+    }
+    return card + len;
+}
+
+/**
+ * struct tdc_merge_head - what the merged device reads next from a card
+ * @avail:      The bytes of the card that may be read in this pull.
+ * @off:        How many of them were passed on.
+ * @len:        The length of the next event or record, 0 if there is none.
+ * @time:       The time of the next event (TDC_FMT_TIME), 0 for a record
+ *              or without TDC_FMT_TIME.
+ * @bound:      When the card has no more, the earliest time the events it
+ *              adds later can have.
+ */
+struct tdc_merge_head {
+    unsigned int avail, off, len;
+    u64 time, bound;
+};
+
+/*
+ * Passes the events and records of the cards on to the FIFO of the merged
+ * device, each prefixed with the number of its card, until about max
+ * bytes were passed on or its FIFO is full. The events are taken in the
+ * order of their times (TDC_FMT_TIME), as in a merge of sorted lists:
+ * each card's events are in order already, so the earliest of the next
+ * events of the cards goes first.
+ *
+ * An event of one card may only go when no other card can still add an
+ * earlier one. A card that has nothing left can't, unless it is reading
+ * out a COM signal (merge_pending), or detects one after we looked: its
+ * events are held back until then. As a card takes at most a read-out
+ * to add an event, the merged stream lags by about that much.
+ *
+ * Records have no time, and go as soon as they are next. Without
+ * TDC_FMT_TIME, the events go in the order they are found. Called by the
+ * readers of the merged device. Returns the number of bytes passed on.
+ */
+unsigned int tdc_merge_pull(struct tdc_device *merge, unsigned int max)
+{
+    struct tdc_merge_head heads[TDC_NR_DEVS], *head, *next;
+    struct tdc_fifo_cursor *cursor;
+    struct tdc_device *card;
+    unsigned char *block;
+    unsigned int i, done = 0;
+    u64 bound;
+
+    spin_lock(&merge->merge_lock);
+    for (i = 0; i < merge->num_cards; ++i) {
+        card = merge->cards[i];
+        head = &heads[i];
+        /* The card's pending COM signal, if any, is read before its FIFO. */
+        head->bound = get_cycles();
+        smp_rmb();
+        if (card->measurement.merge_pending)
+            head->bound = card->measurement.merge_pending;
+        smp_rmb();
+        head->avail = tdc_fifo_read_begin(card->fifo, &merge->card_cursors[i],
+            ~0U, 0);
+        head->off = 0;
+        head->len = tdc_stream_item_len(card, &merge->card_cursors[i], 0,
+            head->avail, &head->time);
+    }
+
+    while (done < max) {
+        next = NULL;
+        bound = ~0ULL;
+        for (i = 0; i < merge->num_cards; ++i) {
+            head = &heads[i];
+            if (!head->len)
+                bound = min(bound, head->bound);
+            else if (!next || head->time < next->time)
+                next = head;
+        }
+        if (!next || next->time > bound)
+            break;
+
+        i = next - heads;
+        card = merge->cards[i];
+        cursor = &merge->card_cursors[i];
+        block = tdc_fifo_reserve(merge->fifo, 1 + next->len, 0, 0,
+            merge->event_buf, NULL);
+        if (!block)
+            break;
+        block[0] = GET_BYTE(0, card->index);
+        tdc_fifo_peek(card->fifo, cursor, next->off, block + 1, next->len);
+        tdc_fifo_commit(merge->fifo, block, 1 + next->len);
+        done += 1 + next->len;
+        next->off += next->len;
+        next->len = tdc_stream_item_len(card, cursor, next->off, next->avail,
+            &next->time);
+    }
+
+    for (i = 0; i < merge->num_cards; ++i)
+        tdc_fifo_read_end(merge->cards[i]->fifo, &merge->card_cursors[i],
+            heads[i].off);
+    spin_unlock(&merge->merge_lock);
+    return done;
+}
+
 
 
 int tdc_setup(struct tdc_device *self)
@@ -431,6 +839,7 @@ int tdc_setup(struct tdc_device *self)
     // setup max wait time 8ns + bits(4-15)*0.5 ns, and number of Hits bits 0-3 (0 = 16 hits)
     cfgH = self->t_max >> 8;
     cfgL = ((self->t_max % 0xff) & 0xf0) | self->max_num_hits_per_channel;
+    self->iotrace.phase = TDC_IO_SETUP;
 
     // NOTE: The comments to the right are from RoentDek's documentation
     // but seems to be mixed up! It's probably vice versa.
@@ -448,34 +857,53 @@ int tdc_setup(struct tdc_device *self)
 }
 
 
-int tdc_prepare_wait(struct tdc_device *self)
+/*
+ * Runs a sequence of self->acq, see tdc_seq.h, putting what is read in
+ * slots.
+ */
+static __always_inline void tdc_seq_run(struct tdc_device *self,
+    enum tdc_seq_id id, unsigned int *slots)
 {
-    unsigned int cfgH, cfgL;
-    self->is_initialized = 0;
-    self->error = 0;
-
-    /* NOTE: It is necessary to send the cfgH and cfgL each time
-     * we want to wait for a new COM signal apparently. Otherwise
-     * new hits will not be detected after approx 3 seconds of acquring. */
-
-    // setup max wait time 8ns + bits(4-15)*0.5 ns, and number of Hits bits 0-3 (0 = 16 hits)
-    cfgH = self->t_max >> 8;
-    cfgL = ((self->t_max % 0xff) & 0xf0) | self->max_num_hits_per_channel;
-
-    // NOTE: The comments to the right are from RoentDek's documentation
-    // but seems to be mixed up! It's probably vice versa.
-    _outb(self, PIA1PA, cfgH);    // set number of Hits bits 0-3 (0 = 16 hits)
-    _outb(self, PIA2PA, cfgL);    // setup max wait time 8ns + bits(4-15)*0.5 ns
+    struct tdc_seq_stats *stats = &self->measurement.seq_stats[id];
+    const struct tdc_op *op;
+
+    stats->runs++;
+    self->iotrace.phase = id;   // see enum tdc_io_phase
+    for (op = self->acq.seq[id].ops; op->code != TDC_OP_END; ++op) {
+        switch (op->code) {
+        case TDC_OP_OUT:
+            _outb(self, op->port, op->arg);
+            break;
+        case TDC_OP_IN:
+            slots[op->arg] = _inb(self, op->port);
+            break;
+        case TDC_OP_INW: {
+            unsigned int val = _inw(self, op->port);
+            slots[op->arg] = val & 0xff;
+            slots[op->arg + 1] = val >> 8;
+            break;
+        }
+        case TDC_OP_SETTLE:
+            udelay(op->arg);
+            break;
+        }
+    }
+}
 
-    udelay(10); // probably not necessary
+/*
+ * The read-out of a COM signal is written once, below, as inline functions
+ * taking whether hits are checked against t_min and t_max. tdc_acq_freeze
+ * picks a variant made with a constant argument, so that the check is
+ * left out when every hit passes. The port I/O is done by the sequences
+ * in self->acq, built for the measurement when it starts.
+ */
 
-    // Initialize
+static __always_inline int __tdc_prepare_wait(struct tdc_device *self)
+{
+    self->is_initialized = 0;
+    self->error = 0;
 
-    // Reset TDC chip
-    _outb(self, PIA2PB, 0x19 | self->com_mode); // 00X11001 - enable goes high, reset goes high
-    if (self->com_mode == COMMON_STOP)
-        _outb(self, PIA2PB, 0x51); // 01010001 - common stop trig goes high, reset goes low
-    _outb(self, PIA2PB, 0x10 | self->com_mode); // 00X10000 - reset goes low, enable goes low
+    tdc_seq_run(self, TDC_SEQ_PREPARE, NULL);
 
     if (!self->error) {
         self->is_initialized = 1;
@@ -486,65 +914,47 @@ int tdc_prepare_wait(struct tdc_device *self)
     return self->error;
 }
 
-int tdc_check_for_events(struct tdc_device *self)
+static __always_inline int __tdc_check_for_events(struct tdc_device *self)
 {
-    int i;
-
-    #if DEBUG
-    if (!self->is_initialized) {
-        PDEBUG("TDC_Device is not initialized in tdc_check_for_events");
-        return -1;
-    }
-    #endif
+    unsigned int slots[TDC_SEQ_SLOTS];
 
     // MTD133B acquisition and readout
-
-    // Set Enable* leave rest unchanged
-    _outb(self, PIA2PB, 0x11 | self->com_mode); // 00X10001
-    // 3 pulses on RCLK*
-    for (i=0; i<3; ++i) {
-        _outb(self, PIA2PB, 0x91 | self->com_mode); // 10X10001
-        _outb(self, PIA2PB, 0x11 | self->com_mode); // 00X10001
-    }
-    // Disable p.in*
-    _outb(self, PIA2PB, 0x01 | self->com_mode); // 00X00001
+    tdc_seq_run(self, TDC_SEQ_CHECK, slots);
 
     // Get status and test for p.out*
-    i = _inb(self, PIA1PB);
-    PDEBUG_MAYBE("Testing for p.out* i is 0x%x", i);
-    self->has_events = (i & P_OUT);
-    if (!self->has_events)
+    PDEBUG_MAYBE("Testing for p.out* i is 0x%x", slots[0]);
+    self->has_events = (slots[0] & P_OUT);
+    if (!self->has_events) {
         self->measurement.num_com_signals_without_hits += 1;
+        // for the empty records, see tdc_format.h
+        if (!self->measurement.empty_coms++)
+            self->measurement.empty_first =
+                self->measurement.num_com_signals - 1;
+    }
 
     return self->error;
 }
 
-
 // MTD133B acquisition and readout, continued...
-int tdc_decode_events(struct tdc_device *self)
+static __always_inline int __tdc_decode_events(struct tdc_device *self,
+    const int range_filter)
 {
     struct event_cache *cache = &self->measurement.cache;
+    const struct tdc_acq *acq = &self->acq;
+    unsigned int slots[TDC_SEQ_SLOTS];
     unsigned short channel, delay, num_hits_sum=0;
     int status, retval = 0;
-
-    #if DEBUG
-    if (!self->is_initialized) {
-        PDEBUG("TDC_Device is not initialized in tdc_decode_events");
-        return -1;
-    }
-    #endif
+    ktime_t start = tdc_trace_clock();
 
     while (self->has_events) {
         PDEBUG_MAYBE("Will decode the hits for this event. Number of hits: %d", cache->num_hits_sum);
 
-        _outb(self, PIA2PB, 0x81 | self->com_mode); // 10X00001
-        _outb(self, PIA2PB, 0x01 | self->com_mode); // 00X00001
+        tdc_seq_run(self, TDC_SEQ_HIT, slots);
 
         // get TDC data
-        delay = (_inb(self, PIA1PA) << 8) | _inb(self, PIA2PA);
+        delay = (slots[0] << 8) | slots[2];
 
-        udelay(10);
-        status = _inb(self, PIA1PB); // bit 4,3,2 talar om vilken kanal som eventet registrerats på
+        status = slots[1]; // bit 4,3,2 talar om vilken kanal som eventet registrerats på
         channel = (status & 0x1C) >> 2; // ch 0 - 7 är möjliga kanaler. 0x1c = 00011100b
 
         // Test if more hits are available after these?
@@ -555,17 +965,22 @@ int tdc_decode_events(struct tdc_device *self)
         self->measurement.num_hits_sum++;
         num_hits_sum++;
 
-        if (likely(cache->ch[channel].num_hits < self->max_num_hits_per_channel))
+        if (likely(cache->ch[channel].num_hits < acq->max_hits))
         {
-            if (likely(self->t_min <= delay && delay <= self->t_max)) {
+            /* Without the filter, every delay is within t_min and t_max. */
+            if (!range_filter ||
+                likely(acq->t_min <= delay && delay <= acq->t_max)) {
                 PDEBUG("Valid hit.");
                 self->measurement.num_hits[channel]++;
                 cache->ch[channel].hits[cache->ch[channel].num_hits] = delay;
             } else {
                 PDEBUG("Hit not within valid t-range");
                 self->measurement.num_invalid_hits[channel]++;
+                /* Sent with delay 0; the cache isn't cleared between events. */
+                cache->ch[channel].hits[cache->ch[channel].num_hits] = 0;
             }
             cache->ch[channel].num_hits++;
+            cache->dirty |= 1 << channel;
             cache->num_hits_sum++;
             self->measurement.num_valid_hits_sum++;
 
@@ -573,8 +988,8 @@ int tdc_decode_events(struct tdc_device *self)
             // This is not supposed to happen, but it WILL happen if
             // the module is loaded on a computer with no ISA bus...
             PDEBUG("Event overflow on channel %d: event #%d, (max_num_hits_per_channel is %d)",
-                channel, cache->ch[channel].num_hits, self->max_num_hits_per_channel);
-            if (unlikely(self->max_num_hits_per_channel * self->num_channels < num_hits_sum)) {
+                channel, cache->ch[channel].num_hits, acq->max_hits);
+            if (unlikely(acq->max_hits * acq->num_channels < num_hits_sum)) {
                 PDEBUG("Way too many hits detected. Exiting decoding loop.");
                 // This will happen on a computer that doesn't have a TDC card, since all ports
                 // will always be high by default in that case...
@@ -592,10 +1007,110 @@ int tdc_decode_events(struct tdc_device *self)
     retval = 0;
 
 out:
-    retval |= tdc_add_hits_to_fifo(self);
+    tdc_trace_decoded(self, start);
+    if (acq->count_slice_ns)
+        tdc_count_event(self);
+    else
+        retval |= tdc_add_hits_to_fifo(self);
     return retval; // todo: bättre return value?
 }
 
+static __always_inline int __tdc_reset(struct tdc_device *self)
+{
+    // Reenable P.in*
+    tdc_seq_run(self, TDC_SEQ_RESET, NULL);
+
+    self->is_initialized = 0;
+    return self->error;
+}
+
+/*
+ * The steps 4-6 and 2 of a COM signal (see TDC_Device.h), without the
+ * checks of the public functions below.
+ */
+static __always_inline int __tdc_read_com(struct tdc_device *self,
+    const int range_filter, int read_out)
+{
+    self->has_events = 0;
+    if (read_out)
+        __tdc_check_for_events(self);
+    if (self->has_events) {
+        PDEBUG_MAYBE("Hits were found; decoding them...");
+        __tdc_decode_events(self, range_filter);
+    } else {
+        PDEBUG_MAYBE("No hits were found");
+    }
+    PDEBUG_MAYBE("Resetting TDC card...");
+    __tdc_reset(self);
+    PDEBUG_MAYBE("Preparing to wait...");
+    return __tdc_prepare_wait(self);
+}
+
+#define TDC_DEFINE_READ_COM(name, range_filter) \
+static int name(struct tdc_device *self, int read_out) \
+{ \
+    return __tdc_read_com(self, range_filter, read_out); \
+}
+
+TDC_DEFINE_READ_COM(tdc_read_com, 0)
+TDC_DEFINE_READ_COM(tdc_read_com_range, 1)
+
+/*
+ * Copies the settings for the measurement to self->acq, builds the
+ * sequences for them and picks the read-out. Called when the measurement
+ * is started or resumed, while the timer is not running.
+ */
+static void tdc_acq_freeze(struct tdc_device *self)
+{
+    struct tdc_acq *acq = &self->acq;
+
+    acq->com_mode = self->com_mode;
+    acq->t_min = self->t_min;
+    acq->t_max = self->t_max;
+    acq->max_hits = self->max_num_hits_per_channel;
+    acq->num_channels = self->num_channels;
+
+    // setup max wait time 8ns + bits(4-15)*0.5 ns, and number of Hits bits 0-3 (0 = 16 hits)
+    acq->cfg_h = self->t_max >> 8;
+    acq->cfg_l = ((self->t_max % 0xff) & 0xf0) | self->max_num_hits_per_channel;
+    tdc_seq_build(acq->seq, acq->com_mode, acq->cfg_h, acq->cfg_l,
+        self->wide_io);
+
+    if (self->t_min > 0 || self->t_max < TDC_MAX_DELAY)
+        acq->read_com = tdc_read_com_range;
+    else
+        acq->read_com = tdc_read_com;
+
+    acq->count_slice_ns = (s64)self->count_slice_us * NSEC_PER_USEC;
+}
+
+int tdc_prepare_wait(struct tdc_device *self)
+{
+    return __tdc_prepare_wait(self);
+}
+
+int tdc_check_for_events(struct tdc_device *self)
+{
+    #if DEBUG
+    if (!self->is_initialized) {
+        PDEBUG("TDC_Device is not initialized in tdc_check_for_events");
+        return -1;
+    }
+    #endif
+    return __tdc_check_for_events(self);
+}
+
+int tdc_decode_events(struct tdc_device *self)
+{
+    #if DEBUG
+    if (!self->is_initialized) {
+        PDEBUG("TDC_Device is not initialized in tdc_decode_events");
+        return -1;
+    }
+    #endif
+    return __tdc_decode_events(self, 1);
+}
+
 int tdc_reset(struct tdc_device *self)
 {
     #if DEBUG
@@ -604,19 +1119,310 @@ int tdc_reset(struct tdc_device *self)
         return -1;
     }
     #endif
-    // Reenable P.in*
-    _outb(self, PIA2PB, 0x81 | self->com_mode); // 10X00001
-    _outb(self, PIA2PB, 0x11 | self->com_mode); // 00X10001
+    return __tdc_reset(self);
+}
 
-    self->is_initialized = 0;
-    return self->error;
+
+static inline unsigned char *tdc_put_u32(unsigned char *p, u32 value)
+{
+    *p++ = GET_BYTE(0, value);
+    *p++ = GET_BYTE(1, value);
+    *p++ = GET_BYTE(2, value);
+    *p++ = GET_BYTE(3, value);
+    return p;
+}
+
+static inline unsigned char *tdc_put_u64(unsigned char *p, u64 value)
+{
+    p = tdc_put_u32(p, (u32)value);
+    return tdc_put_u32(p, (u32)(value >> 32));
+}
+
+/* The rate of get_cycles() in kHz, 0 if not known. */
+u32 tdc_cycles_khz(void)
+{
+#ifdef CONFIG_X86
+    return cpu_khz;
+#else
+    return 0;
+#endif
+}
+
+/*
+ * Reads get_cycles() and the clocks at the same time. The counter is read
+ * before and after the clocks, and the middle taken.
+ */
+void tdc_clock_read(struct tdc_clock *clock)
+{
+    cycles_t before, after;
+    ktime_t mono, real;
+
+    before = get_cycles();
+    mono = ktime_get();
+    real = ktime_get_real();
+    after = get_cycles();
+    clock->cycles = before + (after - before) / 2;
+    clock->mono_ns = ktime_to_ns(mono);
+    clock->real_ns = ktime_to_ns(real);
+}
+
+/* Reads the clocks for a clock record. */
+static void tdc_clock_sample(struct tdc_device *self)
+{
+    tdc_clock_read(&self->measurement.clock);
+    self->measurement.clock_due = 1;
+}
+
+/*
+ * The records of the stream format that are written. In counting mode,
+ * the gap and empty records are left out, as no events are written.
+ */
+static inline unsigned int tdc_record_format(struct tdc_device *self)
+{
+    if (self->acq.count_slice_ns)
+        return self->stream_format & TDC_FMT_TIME;
+    return self->stream_format;
+}
+
+/*
+ * Room kept free in the FIFO for the gap and empty records, so that they
+ * can be written when the measurement stops even if the FIFO is full.
+ */
+static inline unsigned int tdc_record_reserve(struct tdc_device *self)
+{
+    unsigned int fmt = tdc_record_format(self), n = 0;
+
+    if (fmt & TDC_FMT_GAPS)
+        n += 1 + TDC_REC_SIZE;
+    if (fmt & TDC_FMT_EMPTY)
+        n += 1 + TDC_REC_SIZE;
+    if (fmt & TDC_FMT_TIME)
+        n += 1 + TDC_REC_CLOCK_SIZE;
+    if (self->acq.count_slice_ns)
+        n += 1 + TDC_REC_COUNTS_SIZE;
+    return n;
+}
+
+/*
+ * Appends the records that are due to p: those of the stream format, and
+ * the count record in counting mode. See tdc_format.h.
+ * Returns the end of what was appended.
+ */
+static unsigned char *tdc_put_records(struct tdc_device *self,
+    unsigned char *p)
+{
+    struct tdc_measurement *m = &self->measurement;
+    unsigned int fmt = tdc_record_format(self);
+
+    if ((fmt & TDC_FMT_TIME) && m->clock_due) {
+        *p++ = TDC_REC_CLOCK;
+        p = tdc_put_u64(p, m->clock.cycles);
+        p = tdc_put_u64(p, m->clock.mono_ns);
+        p = tdc_put_u64(p, m->clock.real_ns);
+        p = tdc_put_u32(p, tdc_cycles_khz());
+    }
+    if (m->counts_due) {
+        memcpy(p, m->counts.record, TDC_REC_COUNTS_SIZE);
+        p += TDC_REC_COUNTS_SIZE;
+    }
+    if ((fmt & TDC_FMT_EMPTY) && m->empty_coms) {
+        *p++ = TDC_REC_EMPTY;
+        p = tdc_put_u32(p, m->empty_coms);
+        p = tdc_put_u32(p, m->empty_first);
+    }
+    if ((fmt & TDC_FMT_GAPS) && m->gap_events) {
+        *p++ = TDC_REC_GAP;
+        p = tdc_put_u32(p, m->gap_events);
+        p = tdc_put_u32(p, m->gap_first);
+    }
+    return p;
+}
+
+/*
+ * Writes the records that are due, e.g. when the measurement stops.
+ * If use_reserve is set, the room kept for them may be used. Must be
+ * called with the device semaphore held.
+ * Returns 0 on success, -1 if they did not fit.
+ */
+int tdc_flush_records(struct tdc_device *self, int use_reserve)
+{
+    unsigned char *p;
+
+    if (!self->fifo)
+        return -1;
+    p = tdc_put_records(self, self->event_buf);
+    if (p == self->event_buf)
+        return 0;
+    if (tdc_fifo_put_reserve(self->fifo, self->event_buf,
+            p - self->event_buf,
+            use_reserve ? 0 : tdc_record_reserve(self)))
+        return -1;
+    self->measurement.empty_coms = 0;
+    self->measurement.gap_events = 0;
+    self->measurement.clock_due = 0;
+    self->measurement.counts_due = 0;
+    tdc_wake_readers(self);
+    return 0;
+}
+
+/*
+ * TDC_THROTTLE: if an event might not fit in the FIFO, the card is not
+ * read out, only re-armed, and the COM signal is counted as a gap.
+ * Returns 1 if the COM signal was skipped.
+ */
+static int tdc_throttled(struct tdc_device *self)
+{
+    struct tdc_measurement *m = &self->measurement;
+
+    if (self->overflow_policy != TDC_THROTTLE || !self->fifo ||
+        self->acq.count_slice_ns ||
+        tdc_fifo_has_room(self->fifo,
+            TDC_MAX_EVENT_SIZE + tdc_record_reserve(self)))
+        return 0;
+
+    if (down_interruptible(&self->sem))
+        return 0;
+    tdc_trace_overflow(self, m->num_com_signals - 1);
+    m->throttled_coms++;
+    if (!m->gap_events++)
+        m->gap_first = m->num_com_signals - 1;
+    up(&self->sem);
+    if (!m->in_overflow) {
+        m->in_overflow = 1;
+        m->overflows++;
+        tdc_notify_status(self);
+    }
+    return 1;
+}
+
+/*
+ * The room to keep free in the FIFO when putting an event: the room for
+ * the records, and for TDC_DROP_NEWEST what is above the high watermark.
+ */
+static inline unsigned int tdc_event_reserve(struct tdc_device *self)
+{
+    unsigned int reserve = tdc_record_reserve(self);
+
+    if (self->overflow_policy == TDC_DROP_NEWEST)
+        reserve += self->fifo->size / 100 * (100 - self->overflow_high);
+    return reserve;
+}
+
+/* The length of the records that tdc_put_records would append now. */
+static inline unsigned int tdc_records_len(struct tdc_device *self)
+{
+    struct tdc_measurement *m = &self->measurement;
+    unsigned int fmt = tdc_record_format(self), n = 0;
+
+    if ((fmt & TDC_FMT_TIME) && m->clock_due)
+        n += TDC_REC_CLOCK_SIZE;
+    if (m->counts_due)
+        n += TDC_REC_COUNTS_SIZE;
+    if ((fmt & TDC_FMT_EMPTY) && m->empty_coms)
+        n += TDC_REC_SIZE;
+    if ((fmt & TDC_FMT_GAPS) && m->gap_events)
+        n += TDC_REC_SIZE;
+    return n;
+}
+
+/*
+ * The channels with hits in the cache, those past num_channels left out.
+ */
+static inline unsigned int tdc_cache_channels(struct tdc_device *self)
+{
+    return self->measurement.cache.dirty & ((1 << self->num_channels) - 1);
+}
+
+/* Empties the cache, only touching the channels that have hits. */
+static inline void tdc_cache_clear(struct event_cache *cache)
+{
+    unsigned int mask;
+
+    for (mask = cache->dirty; mask; mask &= mask - 1)
+        cache->ch[__ffs(mask)].num_hits = 0;
+    cache->dirty = 0;
+    cache->num_hits_sum = 0;
+}
+
+/* Counting mode: starts a new slice at now, see TDC_REC_COUNTS. */
+static void tdc_count_start(struct tdc_device *self, ktime_t now)
+{
+    struct tdc_measurement *m = &self->measurement;
+    struct tdc_counts *counts = &m->counts;
+
+    counts->start = now;
+    counts->first = m->num_com_signals;
+    memcpy(counts->hits, m->num_hits, sizeof(counts->hits));
+    memcpy(counts->invalid, m->num_invalid_hits, sizeof(counts->invalid));
+    memset(counts->mult, 0, sizeof(counts->mult));
 }
 
+/*
+ * Counting mode: counts the event in the cache instead of putting it in
+ * the FIFO. The hits themselves were counted when they were decoded.
+ */
+static void tdc_count_event(struct tdc_device *self)
+{
+    struct event_cache *cache = &self->measurement.cache;
+    struct tdc_counts *counts = &self->measurement.counts;
+    unsigned int mask, ch;
+
+    counts->mult[min_t(unsigned int, cache->num_hits_sum,
+        TDC_COUNT_MULT_BINS - 1)]++;
+    for (mask = tdc_cache_channels(self); mask; mask &= mask - 1) {
+        ch = __ffs(mask);
+        self->measurement.num_hits_of_type[ch][cache->ch[ch].num_hits]++;
+    }
+    tdc_cache_clear(cache);
+}
 
+/*
+ * Counting mode: ends the slice at now, builds its count record and
+ * starts the next one. A record still due from the slice before is
+ * replaced. Must be called with the device semaphore held.
+ */
+static void tdc_count_slice_end(struct tdc_device *self, ktime_t now)
+{
+    struct tdc_measurement *m = &self->measurement;
+    struct tdc_counts *counts = &m->counts;
+    unsigned char *p = counts->record;
+    u32 coms = m->num_com_signals - counts->first, with_hits = 0;
+    u64 len = ktime_to_ns(ktime_sub(now, counts->start));
+    int i;
+
+    do_div(len, 1000);
+    *p++ = TDC_REC_COUNTS;
+    p = tdc_put_u32(p, counts->first);
+    p = tdc_put_u32(p, coms);
+    p = tdc_put_u64(p, ktime_to_ns(counts->start));
+    p = tdc_put_u32(p, (u32)len);
+    for (i = 0; i < TDC_MAX_NUM_CHANNELS; ++i)
+        p = tdc_put_u32(p, m->num_hits[i] - counts->hits[i]);
+    for (i = 0; i < TDC_MAX_NUM_CHANNELS; ++i)
+        p = tdc_put_u32(p, m->num_invalid_hits[i] - counts->invalid[i]);
+    /* The COM signals without hits are those not counted in the others. */
+    for (i = 1; i < TDC_COUNT_MULT_BINS; ++i)
+        with_hits += counts->mult[i];
+    p = tdc_put_u32(p, coms - with_hits);
+    for (i = 1; i < TDC_COUNT_MULT_BINS; ++i)
+        p = tdc_put_u32(p, counts->mult[i]);
+
+    m->counts_due = 1;
+    tdc_count_start(self, now);
+}
+
+/*
+ * Puts the event in the cache in the FIFO, preceded by the records that
+ * are due. It is written straight into the FIFO's buffer, see
+ * tdc_fifo_reserve, so its length is worked out first.
+ */
 int tdc_add_hits_to_fifo(struct tdc_device *self)
 {
     struct event_cache *cache = &self->measurement.cache;
+    unsigned char *p, *block;
     unsigned short num, ch, hit, *delay;
+    unsigned int mask, len, dropped;
+    u32 seq = self->measurement.num_com_signals - 1;
 
     if (!self->fifo) {
         PDEBUG("No FIFO exists!");
@@ -626,66 +1432,189 @@ int tdc_add_hits_to_fifo(struct tdc_device *self)
     if (down_interruptible(&self->sem))
         return -ERESTARTSYS;
 
-    if (tdc_fifo_spacefree(self->fifo) == 0)
-        goto fail_bufsize;
-
     #if DEBUG_DETAILED
     PDEBUG("Will try to add hits to FIFO. (free space: %d)",
         tdc_fifo_spacefree(self->fifo));
     #endif
 
-    num = cache->num_hits_sum; // How many hits belong to this event?
+    len = tdc_records_len(self) + 1;
+    if (self->stream_format & TDC_FMT_SEQ)
+        len += 4;
+    if (self->stream_format & TDC_FMT_TIME)
+        len += 8;
+    for (mask = tdc_cache_channels(self); mask; mask &= mask - 1)
+        len += 3 * cache->ch[__ffs(mask)].num_hits;
 
-    // Is there enough space in the FIFO to store all bytes
-    // needed for this many hits?
-    if (tdc_fifo_spacefree(self->fifo) < 1 + (3 * num))
-        goto fail_bufsize;
+    /*
+     * The whole event is added at once, or not at all if it doesn't fit.
+     * Room for the records is kept, so that the records of the events
+     * dropped now can always be written when the measurement stops.
+     */
+    if (self->overflow_policy == TDC_OVERWRITE_OLDEST) {
+        block = tdc_fifo_reserve(self->fifo, len,
+            tdc_record_reserve(self), 1, self->event_buf, &dropped);
+        if (!block)
+            goto fail_bufsize;
+        if (dropped > 0) {
+            self->measurement.overwrites++;
+            self->measurement.overwritten_bytes += dropped;
+        }
+    } else {
+        /* Once full, drop until the FIFO is down to the low watermark. */
+        if (self->measurement.in_overflow &&
+            self->overflow_policy == TDC_DROP_NEWEST &&
+            tdc_fifo_len(self->fifo) >
+                self->fifo->size / 100 * self->overflow_low)
+            goto fail_bufsize;
+        block = tdc_fifo_reserve(self->fifo, len,
+            tdc_event_reserve(self), 0, self->event_buf, NULL);
+        if (!block)
+            goto fail_bufsize;
+    }
+
+    /* The records of what happened before this event go first. */
+    p = tdc_put_records(self, block);
+
+    num = cache->num_hits_sum; // How many hits belong to this event?
 
     /*
      * The first byte tells how many hits that was detected with this COM event
      */
-    tdc_fifo_putbyte(self->fifo, GET_BYTE(0, num));
+    *p++ = GET_BYTE(0, num);
+
+    if (self->stream_format & TDC_FMT_SEQ)
+        p = tdc_put_u32(p, seq);
+    if (self->stream_format & TDC_FMT_TIME)
+        p = tdc_put_u64(p, self->measurement.com_cycles);
 
-    for (ch = 0; ch < self->num_channels; ch++) {
+    for (mask = tdc_cache_channels(self); mask; mask &= mask - 1) {
+        ch = __ffs(mask);
         num = cache->ch[ch].num_hits;
-        if (num <= 0)
-            continue;
-        self->measurement.num_hits_of_type[ch][num]++;
         for (hit = 0; hit < num; hit++) {
             /* Next byte represents the channel no (from 0-7)
                (Max 8 channels, so one byte is enough). */
-            tdc_fifo_putbyte(self->fifo, GET_BYTE(0, ch));
+            *p++ = GET_BYTE(0, ch);
 
             delay = &cache->ch[ch].hits[hit];
-            /* Next two bytes (16 bits) gives the delay
-               using Big Endian ordering. */
-            tdc_fifo_putbyte(self->fifo, GET_BYTE(0, *delay));
-            tdc_fifo_putbyte(self->fifo, GET_BYTE(1, *delay));
+            /* Next two bytes (16 bits) gives the delay,
+               low byte first. */
+            *p++ = GET_BYTE(0, *delay);
+            *p++ = GET_BYTE(1, *delay);
         }
     }
-    memset(cache, 0, sizeof(*cache));
+    tdc_fifo_commit(self->fifo, block, p - block);
+
+    for (mask = tdc_cache_channels(self); mask; mask &= mask - 1) {
+        ch = __ffs(mask);
+        self->measurement.num_hits_of_type[ch][cache->ch[ch].num_hits]++;
+    }
+    self->measurement.in_overflow = 0;
+    self->measurement.empty_coms = 0;
+    self->measurement.gap_events = 0;
+    self->measurement.clock_due = 0;
+    self->measurement.counts_due = 0;
+    tdc_cache_clear(cache);
     up(&self->sem);
-    wake_up_interruptible(&self->bufq);  /* awake buffer readers */
+    tdc_trace_fifo_commit(self, len);
+    tdc_wake_readers(self);  /* awake buffer readers */
     return 0;
 
 fail_bufsize:
-    up(&self->sem);
     #if DEBUG_DETAILED
     PDEBUG("FIFO is too full in tdc_write_events_to_fifo");
     PDEBUG("tdc_fifo_spacefree : %d", tdc_fifo_spacefree(self->fifo));
     PDEBUG("tdc_fifo_len : %d", tdc_fifo_len(self->fifo));
     #endif
+    tdc_trace_overflow(self, seq);
     self->measurement.buf_overflow++;
     self->measurement.buf_overflow_events++;
     self->measurement.buf_overflow_hits += cache->num_hits_sum;
+    if (!self->measurement.gap_events++)
+        self->measurement.gap_first = seq;
+    /* The hits of the dropped event must not end up in the next one. */
+    tdc_cache_clear(cache);
+    up(&self->sem);
+    if (!self->measurement.in_overflow) {
+        self->measurement.in_overflow = 1;
+        self->measurement.overflows++;
+        tdc_notify_status(self);
+    }
     return -ENOSPC;
 }
 
+/*
+ * Called after data was added to the FIFO. Instead of waking the readers
+ * for every event, they are only woken when wake_watermark bytes are
+ * buffered, or by the flush timer at most wake_max_wait later.
+ */
+void tdc_wake_readers(struct tdc_device *self)
+{
+    unsigned int len;
+
+    /* The readers of the merged device get the data of the cards, too. */
+    if (self->merge)
+        tdc_wake_readers(self->merge);
+    if (!waitqueue_active(&self->bufq))
+        return;
+
+    len = self->cards ? tdc_merge_len(self) : tdc_fifo_len(self->fifo);
+    if (len >= self->wake_watermark) {
+        tdc_trace_wakeup(self, 0);
+        wake_up_interruptible(&self->bufq);
+    } else if (self->wake_max_wait.tv64 &&
+        !hrtimer_active(&self->flush_timer)) {
+        hrtimer_start(&self->flush_timer, self->wake_max_wait,
+            HRTIMER_MODE_REL);
+    }
+}
+
+static enum hrtimer_restart tdc_flush_timer_callback(struct hrtimer *hrtimer)
+{
+    struct tdc_device *self =
+        container_of(hrtimer, struct tdc_device, flush_timer);
+
+    self->flush_seq++;
+    tdc_trace_wakeup(self, 1);
+    wake_up_interruptible(&self->bufq);
+    return HRTIMER_NORESTART;
+}
+
+/*
+ * Initializes what is needed by tdc_wake_readers.
+ */
+static void tdc_init_wakeup(struct tdc_device *self)
+{
+    self->wake_watermark = 1;
+    self->wake_max_wait = ktime_set(0, 0);
+    hrtimer_init(&self->flush_timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+    self->flush_timer.function = tdc_flush_timer_callback;
+}
+
+/*
+ * Tells processes polling the device (and the merged device) that the
+ * status of the measurement has changed.
+ */
+void tdc_notify_status(struct tdc_device *self)
+{
+    self->status_seq++;
+    wake_up_interruptible(&self->bufq);
+    if (self->merge) {
+        self->merge->status_seq++;
+        wake_up_interruptible(&self->merge->bufq);
+    }
+}
+
 void _outb(struct tdc_device *self, enum port _port, unsigned int val)
 {
     #if DEBUG_IO
     PDEBUG("Writing 0x%x to 0x%x.", val, _port + self->baseport);
     #endif
+    if (unlikely(self->iotrace.on))
+        tdc_iotrace_add(&self->iotrace, _port, TDC_IO_OUT, val);
+    if (unlikely(self->sim)) {
+        tdc_sim_outb(self->sim, _port, val);
+        return;
+    }
     outb_p(val, _port + self->baseport);
     //outb(val, _port + self->baseport); // this one actually works as well, faster    
 }
@@ -693,13 +1622,61 @@ void _outb(struct tdc_device *self, enum port _port, unsigned int val)
 unsigned int _inb(struct tdc_device *self, enum port _port)
 {
     unsigned int retval;
-    retval = inb(_port + self->baseport);
+    if (unlikely(self->sim))
+        retval = tdc_sim_inb(self->sim, _port);
+    else
+        retval = inb(_port + self->baseport);
+    if (unlikely(self->iotrace.on))
+        tdc_iotrace_add(&self->iotrace, _port, TDC_IO_IN, retval);
     #if DEBUG_IO
     PDEBUG("Reading from 0x%x, value is: 0x%x", (_port + self->baseport), retval);
     #endif
     return retval;
 }
 
+/* Reads _port and _port + 1, the first in the low byte. */
+unsigned int _inw(struct tdc_device *self, enum port _port)
+{
+    unsigned int retval;
+    if (unlikely(self->sim))
+        retval = tdc_sim_inb(self->sim, _port) |
+            (tdc_sim_inb(self->sim, _port + 1) << 8);
+    else
+        retval = inw(_port + self->baseport);
+    if (unlikely(self->iotrace.on))
+        tdc_iotrace_add(&self->iotrace, _port, TDC_IO_INW, retval);
+    #if DEBUG_IO
+    PDEBUG("Reading a word from 0x%x, value is: 0x%x", (_port + self->baseport), retval);
+    #endif
+    return retval;
+}
+
+#define TDC_WIDE_IO_TESTS 16
+
+/*
+ * Checks that one inw of PIA1PA gives the same as inb of PIA1PA and
+ * PIA1PB, as it must for the read-out to use it, while the card is idle.
+ * Returns 1 if it does.
+ */
+int tdc_wide_io_test(struct tdc_device *self)
+{
+    unsigned int bytes, word;
+    int i;
+
+    if (self->error & E_NO_TDC_CARD)
+        return 0;
+    self->iotrace.phase = TDC_IO_SETUP;
+    for (i = 0; i < TDC_WIDE_IO_TESTS; ++i) {
+        bytes = _inb(self, PIA1PA) | (_inb(self, PIA1PB) << 8);
+        word = _inw(self, PIA1PA);
+        if (word != bytes || word == 0xffff) {
+            PDEBUG("Wide read gave 0x%x, byte reads 0x%x.", word, bytes);
+            return 0;
+        }
+    }
+    return 1;
+}
+
 unsigned int _get_bit(struct tdc_device *self, volatile enum port _port, short bit)
 {
     unsigned int retval = (_inb(self, _port) & (1 << bit));
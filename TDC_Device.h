@@ -8,11 +8,19 @@
 #include <asm/io.h>
 
 #include <linux/delay.h>
+#include <linux/bitops.h>
+#include <linux/timex.h>    /* get_cycles */
 
 #include "tdc_fifo.h"
 #include "tdc_common.h"
+#include "tdc_sim.h"
+#include "tdc_trace.h"
 
-#define DEBUG_IO 0              /* if port i/o is to be watched */
+/*
+ * If port i/o is to be watched in the kernel log. This changes the timing,
+ * see tdc_iotrace.h for a trace that doesn't.
+ */
+#define DEBUG_IO 0
 
 
 /*
@@ -53,22 +61,42 @@ inline int tdc_has_detected_com_event(struct tdc_device *self);
 
 int tdc_clear_data(struct tdc_device *dev);
 
-int tdc_reset_measurement(struct tdc_measurement *measurement);
-int tdc_start_measurement(struct tdc_measurement *measurement);
-int tdc_pause_measurement(struct tdc_measurement *measurement);
-int tdc_stop_measurement(struct tdc_measurement *measurement);
+int tdc_reset_measurement(struct tdc_device *self);
+int tdc_start_measurement(struct tdc_device *self);
+int tdc_pause_measurement(struct tdc_device *self);
+int tdc_stop_measurement(struct tdc_device *self);
 
 int tdc_add_hits_to_fifo(struct tdc_device *self);
+int tdc_flush_records(struct tdc_device *self, int use_reserve);
+
+void tdc_notify_status(struct tdc_device *self);
+void tdc_wake_readers(struct tdc_device *self);
 
 int tdc_timer_callback(struct hrtimer *hrtimer);
 
+u32 tdc_cycles_khz(void);
+void tdc_clock_read(struct tdc_clock *clock);
+
 void tdc_set_com_mode(struct tdc_device *self, enum com_mode mode);
 
-struct tdc_device *tdc_new(unsigned int _baseport);
+struct tdc_device *tdc_new(unsigned int _baseport, int simulated);
 void tdc_destroy(struct tdc_device *self);
 
+struct tdc_device *tdc_merge_new(struct tdc_device **cards,
+    unsigned int num_cards);
+void tdc_merge_destroy(struct tdc_device *merge);
+void tdc_merge_attach(struct tdc_device *merge);
+void tdc_merge_detach(struct tdc_device *merge);
+unsigned int tdc_merge_len(struct tdc_device *merge);
+unsigned int tdc_merge_pull(struct tdc_device *merge, unsigned int max);
+unsigned int tdc_stream_item_len(struct tdc_device *dev,
+    struct tdc_fifo_cursor *cursor, unsigned int offset, unsigned int avail,
+    u64 *time);
+
 inline void _outb(struct tdc_device *self, enum port _port, unsigned int val);
 inline unsigned int _inb(struct tdc_device *self, enum port _port);
+unsigned int _inw(struct tdc_device *self, enum port _port);
+int tdc_wide_io_test(struct tdc_device *self);
 
 /**
  * Returns the value of a specific bit of a port. Bit 0 is the LSB.
@@ -11,7 +11,9 @@
 MODULE_LICENSE("Dual BSD/GPL");
 MODULE_AUTHOR("Isak Bakken");
 
-struct tdc_device *tdc_device; /* allocated in tdc_init_module */
+struct tdc_device *tdc_devices[TDC_NR_DEVS]; /* allocated in tdc_init_module */
+struct tdc_device *tdc_merge_device; /* only if tdc_merge is set */
+struct dentry *tdc_debugfs_dir; /* NULL if debugfs is missing */
 
 /*
  *
@@ -26,10 +28,16 @@ struct tdc_device *tdc_device; /* allocated in tdc_init_module */
  */
 int tdc_major =   TDC_MAJOR;
 int tdc_minor =   0;
-int tdc_nr_devs = 1;
+int tdc_nr_devs = 1; /* the number of base addresses given */
 
-int tdc_base_address = TDC_BASE_ADDRESS;
+int tdc_base_address[TDC_NR_DEVS] = { TDC_BASE_ADDRESS };
+int tdc_cpu[TDC_NR_DEVS] = { [0 ... TDC_NR_DEVS-1] = -1 };
+int tdc_nr_cpus;
+int tdc_merge = 0;
+int tdc_max_readers = 1;
 int tdc_buffer_size = TDC_BUFFER_SIZE;
+int tdc_sim = 0; /* the number of simulated cards */
+int tdc_wide_io = 0;
 
 /*
  * module_param(foo, int, 0000)
@@ -40,14 +48,79 @@ int tdc_buffer_size = TDC_BUFFER_SIZE;
  */
 module_param(tdc_major, int, S_IRUGO);
 module_param(tdc_minor, int, S_IRUGO);
-module_param(tdc_base_address, int, S_IRUGO);
+module_param_array(tdc_base_address, int, &tdc_nr_devs, S_IRUGO);
 MODULE_PARM_DESC(tdc_base_address,
-    "The base address of the TDC Card, default: 0x320");
+    "The base addresses of the TDC Cards, one per card, default: 0x320");
+module_param_array(tdc_cpu, int, &tdc_nr_cpus, S_IRUGO);
+MODULE_PARM_DESC(tdc_cpu,
+    "The CPU to run the acquisition of each card on, default: -1 (any CPU)");
+module_param(tdc_merge, bool, S_IRUGO);
+MODULE_PARM_DESC(tdc_merge,
+    "Create a device which merges the events of all cards, default: 0");
+module_param(tdc_max_readers, int, S_IRUGO);
+MODULE_PARM_DESC(tdc_max_readers,
+    "How many processes may read from a device at the same time, "
+    "at most 16, default: 1");
 module_param(tdc_buffer_size, int, S_IRUGO);
 MODULE_PARM_DESC(tdc_buffer_size,
     "The size of the FIFO buffer (in bytes) used for storing events between reads.");
+module_param(tdc_sim, int, S_IRUGO);
+MODULE_PARM_DESC(tdc_sim,
+    "The number of cards to simulate instead of using real ones, replaying "
+    "events written to debugfs, default: 0");
+module_param(tdc_wide_io, bool, S_IRUGO);
+MODULE_PARM_DESC(tdc_wide_io,
+    "Read the delay and status of a hit with one 16 bit port read, if a "
+    "test at load time shows the card supports it, default: 0");
 
 
+/*
+ * Tells whether cursor is where the merged device reads the FIFO of the
+ * card dev, rather than that of an open file.
+ */
+static int tdc_is_merge_cursor(struct tdc_device *dev,
+    struct tdc_fifo_cursor *cursor)
+{
+    struct tdc_device *merge = dev->merge;
+
+    return merge && cursor >= merge->card_cursors &&
+        cursor < merge->card_cursors + merge->num_cards;
+}
+
+/*
+ * Lists the readers of a device for /proc/tdc_measurement, in at most
+ * size bytes. The list stops at the first reader that doesn't fit.
+ */
+static int tdc_proc_readers(char *buf, size_t size, struct tdc_device *tdc)
+{
+    struct tdc_fifo_cursor *cursor;
+    unsigned long flags;
+    size_t len = 0, n;
+    int i = 0;
+
+    spin_lock_irqsave(&tdc->fifo->lock, flags);
+    list_for_each_entry(cursor, &tdc->fifo->cursors, list) {
+        n = snprintf(buf + len, size - len, "reader %d%s: %s, %u bytes "
+            "unread, skipped %lu times, dropped %lu bytes\n", ++i,
+            tdc_is_merge_cursor(tdc, cursor) ? " (merged device)" : "",
+            cursor->lossy ? "lossy" : "lossless",
+            tdc->fifo->in - cursor->out, cursor->skips, cursor->dropped);
+        if (n >= size - len) {
+            buf[len] = '\0';
+            break;
+        }
+        len += n;
+    }
+    spin_unlock_irqrestore(&tdc->fifo->lock, flags);
+    return len;
+}
+
+static const char *tdc_overflow_policy_names[TDC_NUM_POLICIES] = {
+    "drop newest",
+    "overwrite oldest",
+    "throttle"
+};
+
 /*
  * This function outputs information about current measurement.
  * Access it by reading the virtual file /proc/tdc_measurement.
@@ -84,11 +157,27 @@ int tdc_proc_measurement(char *buf, char **start, off_t offset,
         tdc->num_channels, TDC_MAX_NUM_CHANNELS);
     buf2 += sprintf(buf2,"com_mode = %s.\n",
         tdc->com_mode == COMMON_START ? "common start" : "common stop");
+    buf2 += sprintf(buf2, "stream_format = %#x.\n", tdc->stream_format);
+    buf2 += sprintf(buf2, "overflow_policy = %s",
+        tdc_overflow_policy_names[tdc->overflow_policy]);
+    if (tdc->overflow_policy == TDC_DROP_NEWEST)
+        buf2 += sprintf(buf2, " (%u%% / %u%%)", tdc->overflow_high,
+            tdc->overflow_low);
+    buf2 += sprintf(buf2, ".\n");
+    if (tdc->count_slice_us)
+        buf2 += sprintf(buf2, "counting in slices of %u us.\n",
+            tdc->count_slice_us);
+    if (tdc->sim)
+        buf2 += sprintf(buf2, "simulated card: %lu events replayed, "
+            "%u bytes queued.\n", tdc->sim->num_events,
+            tdc_fifo_len(tdc->sim->queue));
 
     PDEBUG("tdc ptr: %p", tdc);
     PDEBUG("FIFO real size: %d", tdc_fifo_len(tdc->fifo));
     buf2 += sprintf(buf2,"buffer contains %d bytes, and has %d bytes free.\n",
         tdc_fifo_len(tdc->fifo), tdc_fifo_spacefree(tdc->fifo));
+    /* The readers get at most half of the page. */
+    buf2 += tdc_proc_readers(buf2, PAGE_SIZE / 2 - (buf2 - buf), tdc);
 
     buf2 += sprintf(buf2,"\n");
     buf2 += sprintf(buf2,"Measurement info:\n");
@@ -132,10 +221,10 @@ int tdc_proc_measurement(char *buf, char **start, off_t offset,
                 tdc->measurement.error);
 
         buf2 += sprintf(buf2, "current COM signal rate: %lu Hz\n",
-                tdc->measurement.com_rate);
+                tdc_rate_hz(&tdc->rates, TDC_METER_COM, TDC_RATE_1S));
 
         buf2 += sprintf(buf2, "current hit rate: %lu Hz (valid hits only)\n",
-                tdc->measurement.hit_rate);
+                tdc_rate_hz(&tdc->rates, TDC_METER_HITS, TDC_RATE_1S));
 
         buf2 += sprintf(buf2, "buffer_full: %lu times\n",
                 tdc->measurement.buf_overflow);
@@ -144,6 +233,15 @@ int tdc_proc_measurement(char *buf, char **start, off_t offset,
                 tdc->measurement.buf_overflow_events);
         buf2 += sprintf(buf2, "buffer_full resulted in %lu missed hits\n",
                 tdc->measurement.buf_overflow_hits);
+        buf2 += sprintf(buf2, "buffer_full started %lu times\n",
+                tdc->measurement.overflows);
+        if (tdc->overflow_policy == TDC_OVERWRITE_OLDEST)
+            buf2 += sprintf(buf2, "overwritten: %lu times, %llu bytes\n",
+                tdc->measurement.overwrites,
+                tdc->measurement.overwritten_bytes);
+        if (tdc->overflow_policy == TDC_THROTTLE)
+            buf2 += sprintf(buf2, "throttled: %lu COM signals skipped\n",
+                tdc->measurement.throttled_coms);
 
         /*
          * Show info about number of singles, doubles, etc...
@@ -182,37 +280,58 @@ static int tdc_open(struct inode *inode, struct file *filp)
 {
     int retval = -ENOMEM;
     struct tdc_device *dev; // device information
+    struct tdc_reader *rd;
     dev = container_of(inode->i_cdev, struct tdc_device, cdev);
-    filp->private_data = dev; /* for other methods */
 
-    if (down_interruptible(&dev->sem))
+    rd = kzalloc(sizeof(*rd), GFP_KERNEL);
+    if (!rd)
+        return -ENOMEM;
+    rd->dev = dev;
+    init_MUTEX(&rd->sem);
+    rd->low_watermark = 1;
+    rd->status_seen = dev->status_seq;
+    rd->flush_seen = dev->flush_seq;
+    filp->private_data = rd; /* for other methods */
+
+    if (down_interruptible(&dev->sem)) {
+        kfree(rd);
         return -ERESTARTSYS;
+    }
 
     if (!dev->fifo) {
         PDEBUG("No FIFO!");
-        goto out;
+        goto fail;
     }
     PDEBUG("FIFO size at %s:%d: %d bytes", __FILE__, __LINE__,
         tdc_fifo_len(dev->fifo));
 
     if (filp->f_mode & FMODE_READ) {
-        if (0 < dev->nreaders++) // only allow one reader at a time
+        /*
+         * Several readers each get all the data; see set_read_mode
+         * for what happens when one of them is too slow.
+         */
+        if (dev->nreaders >= tdc_max_readers)
             goto fail_busy;
+        if (dev->cards && !dev->nreaders)
+            tdc_merge_attach(dev);
+        dev->nreaders++;
+        tdc_fifo_attach(dev->fifo, &rd->cursor, TDC_READ_LOSSLESS);
+        tdc_update_wakeup(dev);
     }
     if (filp->f_mode & FMODE_WRITE)
         dev->nwriters++;
 
 
     retval = nonseekable_open(inode, filp);
-    goto out;
+    up(&dev->sem);
+    return retval;
 
 
 fail_busy:
+    retval = -EBUSY;
+fail:
     up(&dev->sem);
-    return -EBUSY;
-
-out:
-    up(&dev->sem);
+    kfree(rd);
     return retval;
 
 }
@@ -221,27 +340,171 @@ out:
  */
 static int tdc_release(struct inode *inode, struct file *filp)
 {
-    struct tdc_device *dev = filp->private_data;
+    struct tdc_reader *rd = filp->private_data;
+    struct tdc_device *dev = rd->dev;
 
     down(&dev->sem);
-    if (filp->f_mode & FMODE_READ)
+    if (filp->f_mode & FMODE_READ) {
+        tdc_fifo_detach(dev->fifo, &rd->cursor);
         dev->nreaders--;
+        if (dev->cards && !dev->nreaders)
+            tdc_merge_detach(dev);
+        tdc_update_wakeup(dev);
+    }
     if (filp->f_mode & FMODE_WRITE)
         dev->nwriters--;
     up(&dev->sem);
+    kfree(rd);
     return 0;
 }
 
 
-/* Called when a process, which already opened the dev file, attempts to
- * read from it.
+/*
+ * Tells whether no more data will be added to the FIFO of dev.
+ * The merged device is stopped when all its cards are.
  */
-static ssize_t tdc_read(struct file *filp, char __user *buf,
-    size_t count, loff_t *f_pos)
+static int tdc_is_stopped(struct tdc_device *dev)
 {
-    struct tdc_device *dev = filp->private_data;
-    long len = 0;
-    unsigned char tmp;
+    unsigned int i;
+
+    if (!dev->cards)
+        return dev->measurement.state == M_STOPPED;
+
+    for (i = 0; i < dev->num_cards; ++i) {
+        if (dev->cards[i]->measurement.state != M_STOPPED)
+            return 0;
+    }
+    return 1;
+}
+
+/*
+ * Tells whether a reader of dev can be skipped ahead: if it is lossy, or
+ * if the oldest events are overwritten (TDC_OVERWRITE_OLDEST). Such
+ * readers only get whole events, so that being skipped ahead never
+ * leaves them in the middle of one. Nothing is overwritten in the FIFO
+ * of the merged device, whatever the policy of the cards.
+ */
+static int tdc_whole_events(struct tdc_reader *rd)
+{
+    return rd->cursor.lossy ||
+        rd->dev->overflow_policy == TDC_OVERWRITE_OLDEST;
+}
+
+/*
+ * For the merged device: passes the events of the cards on to its FIFO,
+ * until the reader has want bytes to read, as far as their order allows.
+ * See tdc_merge_pull.
+ */
+static void tdc_merge_fill(struct tdc_reader *rd, unsigned int want)
+{
+    struct tdc_device *dev = rd->dev;
+    unsigned int len;
+
+    if (!dev->cards)
+        return;
+    len = tdc_fifo_cursor_len(dev->fifo, &rd->cursor);
+    if (len < want)
+        tdc_merge_pull(dev, want - len);
+}
+
+/*
+ * Tells whether a read on this file would return now: when there are
+ * low_watermark bytes, when the flush timer went off since the last read
+ * and there is any data, or when the measurement is stopped.
+ */
+static int tdc_is_readable(struct tdc_reader *rd)
+{
+    struct tdc_device *dev = rd->dev;
+    unsigned int len;
+
+    tdc_merge_fill(rd, rd->low_watermark);
+    len = tdc_fifo_cursor_len(dev->fifo, &rd->cursor);
+
+    if (len >= rd->low_watermark || tdc_is_stopped(dev))
+        return 1;
+    return len > 0 && rd->max_wait_us && rd->flush_seen != dev->flush_seq;
+}
+
+/*
+ * Recomputes when the acquisition shall wake the readers of dev, from
+ * the low watermarks and max wait times of all its readers.
+ * Must be called with dev->sem held.
+ */
+static void tdc_update_wakeup(struct tdc_device *dev)
+{
+    struct tdc_fifo_cursor *cursor;
+    struct tdc_reader *rd;
+    unsigned int watermark = 0, max_wait_us = 0;
+    unsigned long flags;
+
+    spin_lock_irqsave(&dev->fifo->lock, flags);
+    list_for_each_entry(cursor, &dev->fifo->cursors, list) {
+        /* The merged device is woken with the readers of the card. */
+        if (tdc_is_merge_cursor(dev, cursor))
+            continue;
+        rd = container_of(cursor, struct tdc_reader, cursor);
+        if (!watermark || rd->low_watermark < watermark)
+            watermark = rd->low_watermark;
+        if (rd->max_wait_us && (!max_wait_us || rd->max_wait_us < max_wait_us))
+            max_wait_us = rd->max_wait_us;
+    }
+    spin_unlock_irqrestore(&dev->fifo->lock, flags);
+
+    dev->wake_watermark = watermark ? watermark : 1;
+    dev->wake_max_wait = ktime_set(max_wait_us / USEC_PER_SEC,
+        (max_wait_us % USEC_PER_SEC) * NSEC_PER_USEC);
+}
+
+/*
+ * Counts how long the oldest data of a read waited in the FIFO. since is
+ * the reader's cursor.since when the read began.
+ */
+static void tdc_count_read(struct tdc_device *dev, ktime_t since)
+{
+    ktime_t waited;
+
+    if (!since.tv64)
+        return;
+    waited = ktime_sub(ktime_get(), since);
+    /* Readers of the device may read at the same time. */
+    spin_lock(&dev->read_stats_lock);
+    tdc_hist_add(&dev->stats.hist[TDC_HIST_COMMIT_READ], waited);
+    spin_unlock(&dev->read_stats_lock);
+}
+
+/*
+ * Returns how far a reader may be moved past the first len bytes of what
+ * it is reading: to the end of the last whole event or record in them if
+ * it reads whole events, else all of them.
+ */
+static unsigned int tdc_whole_len(struct tdc_reader *rd, unsigned int len)
+{
+    unsigned int off = 0, n;
+
+    if (!tdc_whole_events(rd))
+        return len;
+    while ((n = tdc_stream_item_len(rd->dev, &rd->cursor, off, len, NULL)))
+        off += n;
+    return off;
+}
+
+/*
+ * Reads into the count bytes of the nr_segs buffers in iov, filling one
+ * before the next. Used by both read and readv (aio_read).
+ * If a buffer can't be written, what was copied before it is still read,
+ * up to the last event boundary; only if that is nothing, it fails with
+ * -EFAULT.
+ */
+static ssize_t tdc_read_iov(struct file *filp, const struct iovec *iov,
+    unsigned long nr_segs, size_t count, loff_t *f_pos)
+{
+    struct tdc_reader *rd = filp->private_data;
+    struct tdc_device *dev = rd->dev;
+    unsigned int len, off, chunk;
+    unsigned long seg = 0, left;
+    size_t seg_off = 0;
+    unsigned char *data;
+    ktime_t since;
 
     ssize_t retval = -EFAULT;
 
@@ -249,10 +512,14 @@ static ssize_t tdc_read(struct file *filp, char __user *buf,
         (unsigned long)count,
         (unsigned long)*f_pos);
 
-    if (down_interruptible(&dev->sem))
+    /*
+     * Only this reader's cursor is used, so the device lock is not needed,
+     * and the acquisition is not held up while we copy to userspace.
+     */
+    if (down_interruptible(&rd->sem))
         return -ERESTARTSYS;
 
-    PDEBUG("fifo len: %d", tdc_fifo_len(dev->fifo));
+    PDEBUG("fifo len: %d", tdc_fifo_cursor_len(dev->fifo, &rd->cursor));
     PDEBUG("fifo spacefree: %d", tdc_fifo_spacefree(dev->fifo));
 
     /*
@@ -260,131 +527,316 @@ static ssize_t tdc_read(struct file *filp, char __user *buf,
      * if a measurement is is started/paused, or about to start.
      * If the measurement is stopped, and there is no data in buffer,
      * consider it end of file and don't wait for more data.
+     * Wait for low_watermark bytes, or at most max_wait_us for them,
+     * so that the data is read in fewer and larger pieces.
      */
-    while (tdc_fifo_len(dev->fifo) == 0 && dev->measurement.state != M_STOPPED)
+    while (!tdc_is_readable(rd))
     {
-        up(&dev->sem); /* release the lock */
+        if ((filp->f_flags & O_NONBLOCK) &&
+            tdc_fifo_cursor_len(dev->fifo, &rd->cursor) > 0)
+            break;
+        up(&rd->sem); /* release the lock */
         if (filp->f_flags & O_NONBLOCK)
             return -EAGAIN;
 
         PDEBUG("\"%s\" reading: going to sleep\n", current->comm);
-        if (wait_event_interruptible(dev->bufq,
-            (tdc_fifo_len(dev->fifo) > 0 || dev->measurement.state == M_STOPPED)))
+        if (wait_event_interruptible(dev->bufq, tdc_is_readable(rd)))
         {
             return -ERESTARTSYS; /* signal: tell the fs layer to handle it */
         }
         /* otherwise loop, but first reacquire the lock */
-        if (down_interruptible(&dev->sem))
+        if (down_interruptible(&rd->sem))
             return -ERESTARTSYS;
     }
 
-    PDEBUG("Copying byte by byte from FIFO to userspace... count is: %lu", (unsigned long)count);
-    // Copy byte by byte from FIFO buffer to the buf in
-    // userspace. Don't copy more than requested number
-    // of bytes though!
-    for (len = 0; tdc_fifo_len(dev->fifo) && count > len; len++) {
-        if (tdc_fifo_getbyte(dev->fifo, &tmp)) {
-            PDEBUG("Could not get byte from FIFO!");
-            goto out;
+    tdc_merge_fill(rd, count);
+    len = tdc_fifo_read_begin(dev->fifo, &rd->cursor, count,
+        tdc_whole_events(rd));
+    since = rd->cursor.since;
+    PDEBUG("Copying %u bytes from FIFO to userspace... count is: %lu",
+        len, (unsigned long)count);
+    for (off = 0; off < len; off += chunk) {
+        chunk = len - off;
+        data = tdc_fifo_read_ptr(dev->fifo, &rd->cursor, off, &chunk);
+        if (chunk > iov[seg].iov_len - seg_off)
+            chunk = iov[seg].iov_len - seg_off;
+        left = copy_to_user(iov[seg].iov_base + seg_off, data, chunk);
+        if (left) {
+            PDEBUG("copy_to_user failed! off = %u, len = %u", off, len);
+            len = tdc_whole_len(rd, off + chunk - left);
+            tdc_fifo_read_end(dev->fifo, &rd->cursor, len);
+            if (!len)
+                goto out;
+            goto done;
         }
-        if (put_user(tmp, buf+len)) {
-            PDEBUG("put_user failed! len = %lu, count = %lu", len, (unsigned long)count);
-            goto out;
+        seg_off += chunk;
+        if (seg_off == iov[seg].iov_len) {
+            seg++;
+            seg_off = 0;
         }
     }
+    tdc_fifo_read_end(dev->fifo, &rd->cursor, len);
+done:
+    rd->flush_seen = dev->flush_seq;
     PDEBUG("Done.");
     PDEBUG("fifo_len is now: %u", tdc_fifo_len(dev->fifo));
 
-    PDEBUG("f_pos före: %lu", (long unsigned int)*f_pos);
     *f_pos += len;
     retval = len;
-    PDEBUG("f_pos efter: %lu", (long unsigned int)*f_pos);
+    if (len)
+        tdc_count_read(dev, since);
+    tdc_trace_read(dev, len);
 out:
-    up(&dev->sem);
+    up(&rd->sem);
     PDEBUG("tdc_read done");
     return retval;
 }
 
-/*  Called when a process writes to dev file. */
-static ssize_t tdc_write(struct file *filp, const char __user *buf,
-     size_t count, loff_t *f_pos)
+/* Called when a process, which already opened the dev file, attempts to
+ * read from it.
+ */
+static ssize_t tdc_read(struct file *filp, char __user *buf,
+    size_t count, loff_t *f_pos)
 {
-    /*
-     * TODO in future? Tokenize the string, separate different keywords with ';'
-     * Parse each token. Use strsep()
-     */
+    struct iovec iov = { .iov_base = buf, .iov_len = count };
 
-    static const short STR_LEN_MAX = 127;
-    struct tdc_device *dev = filp->private_data;
+    return tdc_read_iov(filp, &iov, 1, count, f_pos);
+}
 
-    // Variables for sscanf
-    char keyword[STR_LEN_MAX]; // the size must be large enough for an additional '\0'.
-    int value[2];
+/*
+ * Called for readv, and for reads submitted with io_submit. The read
+ * completes before returning, and waits for data like tdc_read does.
+ */
+static ssize_t tdc_aio_read(struct kiocb *iocb, const struct iovec *iov,
+    unsigned long nr_segs, loff_t pos)
+{
+    return tdc_read_iov(iocb->ki_filp, iov, nr_segs, iov_length(iov, nr_segs),
+        &iocb->ki_pos);
+}
 
-    int i, cmd_id=TDC_CMD_INVALID, num_params=0, retval=-EINVAL;
-    unsigned char *data;
+/*
+ * Called by poll, select and epoll.
+ * POLLIN:  at least low_watermark bytes can be read, max_wait_us has
+ *          passed since data arrived, or the measurement is stopped.
+ *          In other words, read will not block.
+ * POLLPRI: the measurement was started, paused or stopped, the buffer
+ *          overflowed, or an error occurred since the last poll.
+ *          See /proc/tdc_measurement for the details.
+ * POLLOUT: commands can always be written.
+ */
+static unsigned int tdc_poll(struct file *filp, poll_table *wait)
+{
+    struct tdc_reader *rd = filp->private_data;
+    struct tdc_device *dev = rd->dev;
+    unsigned int mask = 0, status_seq;
 
-    PDEBUG("tdc_write");
+    poll_wait(filp, &dev->bufq, wait);
 
-    if (down_interruptible(&dev->sem))
+    if ((filp->f_mode & FMODE_READ) && tdc_is_readable(rd))
+        mask |= POLLIN | POLLRDNORM;
+    if (filp->f_mode & FMODE_WRITE)
+        mask |= POLLOUT | POLLWRNORM;
+
+    status_seq = dev->status_seq;
+    if (status_seq != rd->status_seen) {
+        rd->status_seen = status_seq;
+        mask |= POLLPRI;
+    }
+    return mask;
+}
+
+/*
+ * Pages given to a pipe by tdc_splice_read are our own copies of the
+ * FIFO data, so the pipe may do what it wants with them.
+ */
+static void tdc_pipe_buf_release(struct pipe_inode_info *pipe,
+    struct pipe_buffer *buf)
+{
+    page_cache_release(buf->page);
+}
+
+static const struct pipe_buf_operations tdc_pipe_buf_ops = {
+    .can_merge = 0,
+    .map =      generic_pipe_buf_map,
+    .unmap =    generic_pipe_buf_unmap,
+    .confirm =  generic_pipe_buf_confirm,
+    .release =  tdc_pipe_buf_release,
+    .steal =    generic_pipe_buf_steal,
+    .get =      generic_pipe_buf_get,
+};
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,25)
+static void tdc_spd_release_page(struct splice_pipe_desc *spd, unsigned int i)
+{
+    page_cache_release(spd->pages[i]);
+}
+#endif
+
+/*
+ * Called by splice and sendfile, e.g. to move the data to a file through
+ * a pipe without it passing through userspace. The FIFO data is copied
+ * into new pages which are handed over to the pipe, so it is copied once,
+ * as by tdc_read. Each page holds whole events and records only, unless
+ * not even one fits in what was asked for, as with tdc_read.
+ *
+ * The pipe takes whole pages, so when it has room for fewer than were
+ * filled, the reader is only moved past those it took, which still ends
+ * at an event boundary. Pages that can't be allocated are left for the
+ * next call.
+ */
+static ssize_t tdc_splice_read(struct file *filp, loff_t *f_pos,
+    struct pipe_inode_info *pipe, size_t count, unsigned int flags)
+{
+    struct tdc_reader *rd = filp->private_data;
+    struct tdc_device *dev = rd->dev;
+    struct page *pages[PIPE_BUFFERS];
+    struct partial_page partial[PIPE_BUFFERS];
+    struct splice_pipe_desc spd = {
+        .pages =    pages,
+        .partial =  partial,
+        .flags =    flags,
+        .ops =      &tdc_pipe_buf_ops,
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,25)
+        .spd_release = tdc_spd_release_page,
+#endif
+    };
+    unsigned int len, off, done, chunk, page_len, n;
+    unsigned char *data, *dst;
+    ktime_t since;
+    int nonblock = (filp->f_flags & O_NONBLOCK) || (flags & SPLICE_F_NONBLOCK);
+    ssize_t retval;
+
+    if (down_interruptible(&rd->sem))
         return -ERESTARTSYS;
 
-    if (*f_pos != 0)
-        goto out2;
+    /* Wait for data the same way as tdc_read does. */
+    while (!tdc_is_readable(rd))
+    {
+        if (nonblock && tdc_fifo_cursor_len(dev->fifo, &rd->cursor) > 0)
+            break;
+        up(&rd->sem);
+        if (nonblock)
+            return -EAGAIN;
+        if (wait_event_interruptible(dev->bufq, tdc_is_readable(rd)))
+            return -ERESTARTSYS;
+        if (down_interruptible(&rd->sem))
+            return -ERESTARTSYS;
+    }
 
-    if (count >= STR_LEN_MAX) {
-        PDEBUG("Too much data.");
-        goto out2;
+    count = min_t(size_t, count, PIPE_BUFFERS * PAGE_SIZE);
+    tdc_merge_fill(rd, count);
+    len = tdc_fifo_read_begin(dev->fifo, &rd->cursor, count,
+        tdc_whole_events(rd));
+    since = rd->cursor.since;
+
+    // Fill one page at a time from the FIFO, with whole events.
+    for (off = 0; off < len && spd.nr_pages < PIPE_BUFFERS; off += page_len) {
+        page_len = 0;
+        while ((n = tdc_stream_item_len(dev, &rd->cursor, off + page_len,
+                len, NULL)) && page_len + n <= PAGE_SIZE)
+            page_len += n;
+        if (!page_len) {
+            if (off)
+                break;
+            page_len = min_t(unsigned int, len, PAGE_SIZE);
+        }
+        pages[spd.nr_pages] = alloc_page(GFP_KERNEL);
+        if (!pages[spd.nr_pages])
+            break;
+        dst = page_address(pages[spd.nr_pages]);
+        for (done = 0; done < page_len; done += chunk) {
+            chunk = page_len - done;
+            data = tdc_fifo_read_ptr(dev->fifo, &rd->cursor, off + done,
+                &chunk);
+            memcpy(dst + done, data, chunk);
+        }
+        partial[spd.nr_pages].offset = 0;
+        partial[spd.nr_pages].len = page_len;
+        spd.nr_pages++;
     }
 
-    data = kzalloc(count * sizeof(*data), GFP_KERNEL);
-    if (!data) {
-        PDEBUG("Sorry, no memory.");
+    /* What the pipe took ends at a page, so at an event boundary. */
+    retval = spd.nr_pages ? splice_to_pipe(pipe, &spd) : 0;
+    tdc_fifo_read_end(dev->fifo, &rd->cursor, retval > 0 ? retval : 0);
+    if (retval > 0) {
+        rd->flush_seen = dev->flush_seq;
+        *f_pos += retval;
+        tdc_count_read(dev, since);
+        tdc_trace_read(dev, retval);
+    } else if (!spd.nr_pages && len) {
         retval = -ENOMEM;
-        goto out2;
     }
-    PDEBUG("data: '%s'...", data);
-    if (copy_from_user(data, buf, count)) {
-        PDEBUG("copy_from_user failed");
-        retval = -EFAULT;
-        goto out;
-    }
-    data[count] = '\0';
-    PDEBUG("string passed to tdc_write: '%s'...", data);
-    PDEBUG("count: %lu", (unsigned long)count);
+    up(&rd->sem);
+    return retval;
+}
 
-    /*
-     * See http://linux.about.com/library/cmd/blcmdl3_vsscanf.htm
-     * for examples and details.
-     *
-     * %s: Matches a sequence of non-white-space characters; the next pointer
-     * must be a pointer to char, and the array must be large enough to accept
-     * all the sequence and the terminating NUL character.
-     * The input string stops at white space or at the maximum field width,
-     * whichever occurs first.
-     *
-     * %i: The integer is read in base 16 if it begins with `0x' or `0X',
-     * in base 8 if it begins with `0', and in base 10 otherwise.
-     * Only characters that correspond to the base are used.
-     */
-    num_params = sscanf(data, "%s %i, %i", keyword, &value[0], &value[1]) - 1;
-    if (num_params < 0) {
-        PDEBUG("Error: '%s'; At least a keyword is needed.", data);
-        goto out;
-    }
+/*
+ * set_read_mode: Chooses what happens when this reader is too slow.
+ * 0 (lossless): The FIFO keeps the data until this reader has read it,
+ *               and new events are dropped if it gets full.
+ * 1 (lossy):    This reader is skipped ahead, past the oldest events,
+ *               and the skipped bytes are counted for this reader.
+ */
+static int tdc_set_read_mode(struct tdc_reader *rd, struct file *filp,
+    int num_params, int *value)
+{
+    if (!(filp->f_mode & FMODE_READ))
+        return -EINVAL;
+    if (num_params != 1 ||
+        (value[0] != TDC_READ_LOSSLESS && value[0] != TDC_READ_LOSSY))
+        return -EINVAL;
+
+    PDEBUG("Setting read mode: %s", value[0] ? "lossy" : "lossless");
+    tdc_fifo_set_lossy(rd->dev->fifo, &rd->cursor, value[0]);
+    return 0;
+}
 
-    PDEBUG("num_params: %d, keyword: %s, value[0]: %#x, value[1]: %#x",
-        num_params, keyword, value[0], value[1]);
+/*
+ * set_low_watermark: How many bytes read waits for, and poll requires.
+ * set_max_wait_us:   How long read and poll wait for them at most after
+ *                    data has arrived. 0 means no limit.
+ * The readers are only woken when one of them has enough data, so that
+ * the data can be read in larger pieces with fewer wakeups.
+ */
+static int tdc_set_batching(struct tdc_reader *rd, int cmd_id,
+    int num_params, int *value)
+{
+    struct tdc_device *dev = rd->dev;
 
-    // Compare keyword with all valid commands:
-    for (i=0; i < TDC_NUM_COMMANDS; ++i) {
-        if (strcmp(keyword, TDC_COMMANDS[i]) == 0) {
-            PDEBUG("Keyword found: %s", TDC_COMMANDS[i]);
-            cmd_id = i;
-            break;
-        }
+    if (num_params != 1)
+        return -EINVAL;
+
+    if (cmd_id == TDC_CMD_SET_LOW_WATERMARK) {
+        if (value[0] < 1 || value[0] > dev->fifo->size)
+            return -EINVAL;
+    } else {
+        if (value[0] < 0 || value[0] > TDC_MAX_WAIT_US)
+            return -EINVAL;
     }
 
+    if (down_interruptible(&dev->sem))
+        return -ERESTARTSYS;
+    if (cmd_id == TDC_CMD_SET_LOW_WATERMARK)
+        rd->low_watermark = value[0];
+    else
+        rd->max_wait_us = value[0];
+    tdc_update_wakeup(dev);
+    up(&dev->sem);
+    return 0;
+}
+
+/*
+ * Executes a command parsed by tdc_write on one card.
+ * Returns 0 on success, or a negative error code.
+ */
+static int tdc_command(struct tdc_device *dev, struct file *filp,
+    int cmd_id, int num_params, int *value)
+{
+    int retval = -EINVAL;
+
+    if (down_interruptible(&dev->sem))
+        return -ERESTARTSYS;
+
     switch (cmd_id) {
     case TDC_CMD_SET_CONFIG: // set_config: Initiate TDC with config data
         PDEBUG("max_delay: %d", (unsigned short)value[0]);
@@ -409,7 +861,7 @@ static ssize_t tdc_write(struct file *filp, const char __user *buf,
             dev->measurement.max_num_com_signals = (unsigned int)value[0];
             PDEBUG("max_num_com_signals: %d", dev->measurement.max_num_com_signals);
         }
-        if (tdc_start_measurement(&dev->measurement)) {
+        if (tdc_start_measurement(dev)) {
             PDEBUG("Could not start.");
             retval = -EFAULT;
             goto out;
@@ -417,14 +869,14 @@ static ssize_t tdc_write(struct file *filp, const char __user *buf,
         break;
 
     case TDC_CMD_PAUSE: // pause
-        if (tdc_pause_measurement(&dev->measurement)) {
+        if (tdc_pause_measurement(dev)) {
             retval = -EFAULT;
             goto out;
         }
         break;
 
     case TDC_CMD_STOP: // stop
-        while (tdc_stop_measurement(&dev->measurement) == -1)
+        while (tdc_stop_measurement(dev) == -1)
         {
             up(&dev->sem); /* release the lock */
             if (filp->f_flags & O_NONBLOCK) {
@@ -523,15 +975,71 @@ static ssize_t tdc_write(struct file *filp, const char __user *buf,
         dev->t_max = value[1];
         break;
 
+    case TDC_CMD_SET_STREAM_FORMAT: // set_stream_format, see tdc_format.h
+        if (num_params != 1 || value[0] & ~TDC_FMT_ALL) {
+            retval = -EINVAL;
+            goto out;
+        }
+        /* Readers can't tell where the format would change. */
+        if (dev->measurement.state == M_STARTED ||
+            dev->measurement.state == M_PAUSED) {
+            retval = -EBUSY;
+            goto out;
+        }
+        dev->stream_format = value[0];
+        break;
+
+    case TDC_CMD_SET_OVERFLOW_POLICY:
+    /*
+     * set_overflow_policy POLICY [HIGH LOW], see enum tdc_overflow_policy.
+     * HIGH and LOW are the watermarks of TDC_DROP_NEWEST in percent.
+     */
+        if ((num_params != 1 && num_params != 3) ||
+            value[0] < 0 || value[0] >= TDC_NUM_POLICIES) {
+            retval = -EINVAL;
+            goto out;
+        }
+        if (num_params == 3 && (value[1] < 1 || value[1] > 100 ||
+            value[2] < 0 || value[2] > value[1])) {
+            retval = -EINVAL;
+            goto out;
+        }
+        if (dev->measurement.state == M_STARTED ||
+            dev->measurement.state == M_PAUSED) {
+            retval = -EBUSY;
+            goto out;
+        }
+        dev->overflow_policy = value[0];
+        dev->overflow_high = num_params == 3 ? value[1] : 100;
+        dev->overflow_low = num_params == 3 ? value[2] : 100;
+        break;
+
+    case TDC_CMD_SET_COUNT_SLICE_US:
+    /*
+     * set_count_slice_us US: count the events in slices of US instead of
+     * writing them, see TDC_REC_COUNTS. 0 writes the events again.
+     */
+        if (num_params != 1 || (value[0] != 0 &&
+            (value[0] < TDC_MIN_COUNT_SLICE_US ||
+            value[0] > TDC_MAX_COUNT_SLICE_US))) {
+            retval = -EINVAL;
+            goto out;
+        }
+        if (dev->measurement.state == M_STARTED ||
+            dev->measurement.state == M_PAUSED) {
+            retval = -EBUSY;
+            goto out;
+        }
+        dev->count_slice_us = value[0];
+        break;
+
     case TDC_CMD_INVALID: // Fall through
     default:
         PDEBUG("No keyword found in string!");
         goto out;
     }
-    retval = count;
+    retval = 0;
 out:
-    kfree(data);
-out2:
     up(&dev->sem);
     wake_up_interruptible(&dev->bufq);
     /* awake those who are trying to read
@@ -539,10 +1047,119 @@ out2:
     return retval;
 }
 
+/*  Called when a process writes to dev file. */
+static ssize_t tdc_write(struct file *filp, const char __user *buf,
+     size_t count, loff_t *f_pos)
+{
+    /*
+     * TODO in future? Tokenize the string, separate different keywords with ';'
+     * Parse each token. Use strsep()
+     */
+
+    static const short STR_LEN_MAX = 127;
+    struct tdc_reader *rd = filp->private_data;
+    struct tdc_device *dev = rd->dev;
+
+    // Variables for sscanf
+    char keyword[STR_LEN_MAX]; // the size must be large enough for an additional '\0'.
+    int value[2];
+
+    int i, cmd_id=TDC_CMD_INVALID, num_params=0, retval=-EINVAL;
+    unsigned char *data;
+
+    PDEBUG("tdc_write");
+
+    if (*f_pos != 0)
+        return -EINVAL;
+
+    if (count >= STR_LEN_MAX) {
+        PDEBUG("Too much data.");
+        return -EINVAL;
+    }
+
+    data = kzalloc((count + 1) * sizeof(*data), GFP_KERNEL);
+    if (!data) {
+        PDEBUG("Sorry, no memory.");
+        return -ENOMEM;
+    }
+    if (copy_from_user(data, buf, count)) {
+        PDEBUG("copy_from_user failed");
+        retval = -EFAULT;
+        goto out;
+    }
+    data[count] = '\0';
+    PDEBUG("string passed to tdc_write: '%s'...", data);
+    PDEBUG("count: %lu", (unsigned long)count);
+
+    /*
+     * See http://linux.about.com/library/cmd/blcmdl3_vsscanf.htm
+     * for examples and details.
+     *
+     * %s: Matches a sequence of non-white-space characters; the next pointer
+     * must be a pointer to char, and the array must be large enough to accept
+     * all the sequence and the terminating NUL character.
+     * The input string stops at white space or at the maximum field width,
+     * whichever occurs first.
+     *
+     * %i: The integer is read in base 16 if it begins with `0x' or `0X',
+     * in base 8 if it begins with `0', and in base 10 otherwise.
+     * Only characters that correspond to the base are used.
+     */
+    num_params = sscanf(data, "%s %i, %i", keyword, &value[0], &value[1]) - 1;
+    if (num_params < 0) {
+        PDEBUG("Error: '%s'; At least a keyword is needed.", data);
+        goto out;
+    }
+
+    PDEBUG("num_params: %d, keyword: %s, value[0]: %#x, value[1]: %#x",
+        num_params, keyword, value[0], value[1]);
+
+    // Compare keyword with all valid commands:
+    for (i=0; i < TDC_NUM_COMMANDS; ++i) {
+        if (strcmp(keyword, TDC_COMMANDS[i]) == 0) {
+            PDEBUG("Keyword found: %s", TDC_COMMANDS[i]);
+            cmd_id = i;
+            break;
+        }
+    }
+
+    if (cmd_id == TDC_CMD_SET_READ_MODE) {
+        /* set_read_mode only concerns this file, not the device. */
+        retval = tdc_set_read_mode(rd, filp, num_params, value);
+    } else if (cmd_id == TDC_CMD_SET_LOW_WATERMARK ||
+        cmd_id == TDC_CMD_SET_MAX_WAIT_US) {
+        retval = tdc_set_batching(rd, cmd_id, num_params, value);
+    } else if (dev->cards) {
+        /*
+         * Commands written to the merged device are given to all cards,
+         * so that e.g. all of them can be started at once.
+         */
+        for (i = 0; i < dev->num_cards; ++i) {
+            retval = tdc_command(dev->cards[i], filp, cmd_id,
+                num_params, value);
+            if (retval)
+                break;
+        }
+        if (!retval && cmd_id == TDC_CMD_CLEAR)
+            tdc_fifo_reset(dev->fifo);
+        wake_up_interruptible(&dev->bufq);
+    } else {
+        retval = tdc_command(dev, filp, cmd_id, num_params, value);
+    }
+    if (!retval)
+        retval = count;
+out:
+    kfree(data);
+    return retval;
+}
+
 struct file_operations tdc_fops = {
     .owner =    THIS_MODULE,
     .read =     tdc_read,
+    .aio_read = tdc_aio_read,
     .write =    tdc_write,
+    .poll =     tdc_poll,
+    .splice_read = tdc_splice_read,
     .open =     tdc_open,
     .release =  tdc_release
 };
@@ -550,10 +1167,10 @@ struct file_operations tdc_fops = {
 /*
  * Set up the char_dev structure for this device.
  */
-static void tdc_setup_cdev(struct tdc_device *dev)
+static void tdc_setup_cdev(struct tdc_device *dev, int index)
 {
     // This function assumes that dev->sem is already locked
-    int err, devno = MKDEV(tdc_major, tdc_minor);
+    int err, devno = MKDEV(tdc_major, tdc_minor + index);
 
     cdev_init(&dev->cdev, &tdc_fops);
     dev->cdev.owner = THIS_MODULE;
@@ -562,15 +1179,27 @@ static void tdc_setup_cdev(struct tdc_device *dev)
     err = cdev_add (&dev->cdev, devno, 1);
     /* Fail gracefully if need be */
     if (err) {
-        printk(KERN_ERR "Error %d adding tdc", err);
+        printk(KERN_ERR "Error %d adding %s", err, dev->name);
     }
 }
 
+/*
+ * Initializes the parts of a tdc_device that are used by the char device.
+ */
+static void tdc_setup_device(struct tdc_device *dev, int index)
+{
+    init_waitqueue_head(&dev->bufq);
+    init_waitqueue_head(&dev->stopq);
+    init_MUTEX(&dev->sem);
+    tdc_setup_cdev(dev, index);
+}
+
 
 static int __init tdc_init_module(void)
 {
-    int result;
+    int result, i;
     struct timespec tp;
+    char proc_name[32];
     dev_t dev = 0;
 
     /*
@@ -587,16 +1216,28 @@ static int __init tdc_init_module(void)
         return -ENOPKG; /* "Package not installed", referring to linux-rt */
     }
 
+    if (tdc_max_readers < 1 || tdc_max_readers > TDC_MAX_READERS) {
+        printk(KERN_ERR "tdc: tdc_max_readers must be 1 to %d\n",
+            TDC_MAX_READERS);
+        return -EINVAL;
+    }
+
+    /* Simulated cards need no base addresses. */
+    if (tdc_sim > 0)
+        tdc_nr_devs = min(tdc_sim, TDC_NR_DEVS);
+
     /*
      * Get a range of minor numbers to work with, asking for a dynamic
      * major unless directed otherwise at load time.
+     * One minor number per card, and one more for the merged device.
      */
     if (tdc_major) {
         dev = MKDEV(tdc_major, tdc_minor);
-        result = register_chrdev_region(dev, tdc_nr_devs, TDC_MODULE_NAME);
-    } else {
-        result = alloc_chrdev_region(&dev, tdc_minor, tdc_nr_devs,
+        result = register_chrdev_region(dev, tdc_nr_devs + !!tdc_merge,
                 TDC_MODULE_NAME);
+    } else {
+        result = alloc_chrdev_region(&dev, tdc_minor,
+                tdc_nr_devs + !!tdc_merge, TDC_MODULE_NAME);
         tdc_major = MAJOR(dev);
     }
     if (result < 0) {
@@ -604,29 +1245,84 @@ static int __init tdc_init_module(void)
         return result;
     }
 
-    PDEBUG("Skapar tdc_device");
-    tdc_device = tdc_new(tdc_base_address);
-    if (!tdc_device) {
-        printk(KERN_ALERT "Could not create tdc_device! Out of memory.\n");
-        goto fail_no_mem;
-    }
-    if (tdc_device->error & E_NO_TDC_CARD) {
-        // If no TDC card is detected, it is possible to give an error.
-        // Otherwise all readouts from the device will be all bits high.
-        PDEBUG("No TDC card found, but we ignore this.");
+    /* The latency histograms are shown in debugfs, if there is one. */
+    tdc_debugfs_dir = debugfs_create_dir(TDC_MODULE_NAME, NULL);
+    if (IS_ERR(tdc_debugfs_dir) || !tdc_debugfs_dir) {
+        tdc_debugfs_dir = NULL;
+        if (tdc_sim > 0) {
+            printk(KERN_WARNING "tdc: debugfs is needed by tdc_sim\n");
+            unregister_chrdev_region(dev, tdc_nr_devs + !!tdc_merge);
+            return -ENODEV;
+        }
+        printk(KERN_WARNING "tdc: no debugfs, latencies not shown\n");
     }
 
-    init_waitqueue_head(&tdc_device->bufq);
-    init_waitqueue_head(&tdc_device->stopq);
-    init_MUTEX(&tdc_device->sem);
-    tdc_setup_cdev(tdc_device);
+    for (i = 0; i < tdc_nr_devs; ++i) {
+        PDEBUG("Skapar tdc_device %d at 0x%x", i, tdc_base_address[i]);
+        tdc_devices[i] = tdc_new(tdc_base_address[i], tdc_sim > 0);
+        if (!tdc_devices[i]) {
+            printk(KERN_ALERT "Could not create tdc_device %d! Out of memory.\n", i);
+            goto fail_no_mem;
+        }
+        if (tdc_devices[i]->error & E_NO_TDC_CARD) {
+            // If no TDC card is detected, it is possible to give an error.
+            // Otherwise all readouts from the device will be all bits high.
+            PDEBUG("No TDC card found, but we ignore this.");
+        }
+        tdc_devices[i]->index = i;
+        if (i < tdc_nr_cpus)
+            tdc_devices[i]->cpu = tdc_cpu[i];
+        if (i == 0)
+            sprintf(tdc_devices[i]->name, "tdc");
+        else
+            sprintf(tdc_devices[i]->name, "tdc%d", i);
+        if (tdc_wide_io) {
+            tdc_devices[i]->wide_io = tdc_wide_io_test(tdc_devices[i]);
+            if (!tdc_devices[i]->wide_io)
+                printk(KERN_WARNING "tdc: %s: 16 bit port reads don't match "
+                    "8 bit ones, using 8 bit reads.\n", tdc_devices[i]->name);
+        }
 
-    create_proc_read_entry("tdc_measurement", 0, NULL, tdc_proc_measurement, (void *)tdc_device);
+        tdc_setup_device(tdc_devices[i], i);
+        if (tdc_devices[i]->sim)
+            tdc_sim_create_feed(tdc_devices[i]->sim, tdc_devices[i]->name,
+                tdc_debugfs_dir);
+        if (tdc_debugfs_dir) {
+            tdc_stats_create_files(&tdc_devices[i]->stats,
+                tdc_devices[i]->name, tdc_debugfs_dir,
+                tdc_devices[i]->stats_files);
+            tdc_rates_create_files(&tdc_devices[i]->rates,
+                tdc_devices[i]->name, tdc_debugfs_dir,
+                tdc_devices[i]->rates_files);
+            tdc_devices[i]->io_file = tdc_seq_create_file(tdc_devices[i],
+                tdc_debugfs_dir);
+            tdc_devices[i]->iotrace_file = tdc_iotrace_create_file(
+                tdc_devices[i], tdc_debugfs_dir);
+        }
+
+        sprintf(proc_name, "%s_measurement", tdc_devices[i]->name);
+        create_proc_read_entry(proc_name, 0, NULL, tdc_proc_measurement,
+            (void *)tdc_devices[i]);
+    }
+
+    if (tdc_merge) {
+        tdc_merge_device = tdc_merge_new(tdc_devices, tdc_nr_devs);
+        if (!tdc_merge_device) {
+            printk(KERN_ALERT "Could not create merged device! Out of memory.\n");
+            goto fail_no_mem;
+        }
+        sprintf(tdc_merge_device->name, "tdcm");
+        tdc_setup_device(tdc_merge_device, tdc_nr_devs);
+        if (tdc_debugfs_dir)
+            tdc_stats_create_files(&tdc_merge_device->stats, "tdcm",
+                tdc_debugfs_dir, tdc_merge_device->stats_files);
+    }
 
     PDEBUG("module loaded successfully");
     return 0; /* succeed */
 
 fail_no_mem:
+    tdc_cleanup_module();
     return -ENOMEM;
 }
 
@@ -635,24 +1331,48 @@ fail_no_mem:
  * Thefore, it must be careful to work correctly even if some of the items
  * have not been initialized
  */
-static void __exit tdc_cleanup_module(void)
+static void tdc_cleanup_module(void)
 {
     dev_t devno = MKDEV(tdc_major, tdc_minor);
+    char proc_name[32];
+    int i;
 
     PDEBUG("Cleaning up tdc module.");
-    tdc_clear_data(tdc_device);
-    cdev_del(&tdc_device->cdev);
-
-    PDEBUG("Will now destroy tdc_device");
-    tdc_destroy(tdc_device);
-
-    /* cleanup_module is never called if registering failed */
-    unregister_chrdev_region(devno, tdc_nr_devs);
+    if (tdc_merge_device) {
+        tdc_stats_remove_files(tdc_merge_device->stats_files);
+        cdev_del(&tdc_merge_device->cdev);
+        tdc_merge_destroy(tdc_merge_device);
+        tdc_merge_device = NULL;
+    }
 
-    tdc_device = NULL;
+    for (i = 0; i < tdc_nr_devs; ++i) {
+        if (!tdc_devices[i])
+            continue;
+
+        sprintf(proc_name, "%s_measurement", tdc_devices[i]->name);
+        remove_proc_entry(proc_name, NULL);
+        tdc_stats_remove_files(tdc_devices[i]->stats_files);
+        tdc_rates_remove_files(tdc_devices[i]->rates_files);
+        if (tdc_devices[i]->io_file)
+            debugfs_remove(tdc_devices[i]->io_file);
+        if (tdc_devices[i]->iotrace_file)
+            debugfs_remove(tdc_devices[i]->iotrace_file);
+
+        tdc_clear_data(tdc_devices[i]);
+        cdev_del(&tdc_devices[i]->cdev);
+
+        PDEBUG("Will now destroy tdc_device %d", i);
+        tdc_destroy(tdc_devices[i]);
+        tdc_devices[i] = NULL;
+    }
 
-    remove_proc_entry("tdc_measurement", NULL);
+    if (tdc_debugfs_dir) {
+        debugfs_remove(tdc_debugfs_dir);
+        tdc_debugfs_dir = NULL;
+    }
 
+    /* cleanup_module is never called if registering failed */
+    unregister_chrdev_region(devno, tdc_nr_devs + !!tdc_merge);
 }
 
 module_init(tdc_init_module);
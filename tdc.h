@@ -17,12 +17,20 @@
 #include <linux/poll.h>
 #include <linux/kfifo.h>
 #include <linux/sched.h>
+#include <linux/version.h>
+#include <linux/mm.h>
+#include <linux/pipe_fs_i.h>
+#include <linux/splice.h>
+#include <linux/uio.h>
+#include <linux/debugfs.h>
+#include <linux/err.h>
 
 #include <asm/uaccess.h>    /* copy_*_user */
 
 #include "tdc_fifo.h"
 #include "tdc_common.h"
 #include "TDC_Device.h"
+#include "tdc_trace.h"
 
 /*
  * Name of module, as it appears in /proc/devices
@@ -42,7 +50,13 @@ static const char *TDC_COMMANDS[] = {
     "set_trigger_period_ns",
     "set_trigger_rate_hz",
     "set_com_mode",
-    "set_time_range"
+    "set_time_range",
+    "set_read_mode",
+    "set_low_watermark",
+    "set_max_wait_us",
+    "set_stream_format",
+    "set_overflow_policy",
+    "set_count_slice_us"
 };
 
 enum {
@@ -59,33 +73,87 @@ enum {
     TDC_CMD_SET_TRIGGER_RATE_HZ,
     TDC_CMD_SET_COM_MODE,
     TDC_CMD_SET_TIME_RANGE,
+    TDC_CMD_SET_READ_MODE,
+    TDC_CMD_SET_LOW_WATERMARK,
+    TDC_CMD_SET_MAX_WAIT_US,
+    TDC_CMD_SET_STREAM_FORMAT,
+    TDC_CMD_SET_OVERFLOW_POLICY,
+    TDC_CMD_SET_COUNT_SLICE_US,
 /* Finally, a counter that must match the number of commands
  * in the array TDC_COMMANDS: */
     TDC_NUM_COMMANDS
 };
 
 
+/*
+ * Read modes for set_read_mode, only used when several readers are allowed.
+ */
+enum {
+    TDC_READ_LOSSLESS = 0, /* the acquisition waits for this reader */
+    TDC_READ_LOSSY = 1     /* this reader is skipped ahead if it is too slow */
+};
+
+/**
+ * struct tdc_reader - state of an open device file
+ * @dev:        The device that was opened.
+ * @cursor:     Where in the FIFO this file reads, if opened for reading.
+ * @sem:        Serializes reads on this file.
+ * @low_watermark: read waits for, and poll reports the file readable
+ *              when, at least this many bytes can be read (or when the
+ *              measurement is stopped).
+ * @max_wait_us: If not zero, read and poll don't wait for low_watermark
+ *              bytes longer than this many microseconds after data arrived.
+ * @status_seen: The device's status_seq last reported by poll (POLLPRI).
+ * @flush_seen: The device's flush_seq when this file last read data.
+ */
+struct tdc_reader
+{
+    struct tdc_device *dev;
+    struct tdc_fifo_cursor cursor;
+    struct semaphore sem;
+    unsigned int low_watermark;
+    unsigned int max_wait_us;
+    unsigned int status_seen;
+    unsigned int flush_seen;
+};
+
 /*
  * The different configurable parameters
  */
 extern int tdc_major;
 extern int tdc_nr_devs;
-extern int tdc_base_address;
+extern int tdc_base_address[TDC_NR_DEVS];
+extern int tdc_cpu[TDC_NR_DEVS];
+extern int tdc_merge;
+extern int tdc_max_readers;
+
+/* Upper limit for set_max_wait_us */
+#define TDC_MAX_WAIT_US 10000000
 extern int tdc_buffer_size;
+extern int tdc_sim;
+extern struct dentry *tdc_debugfs_dir;
 
 /*
  * Prototypes for shared functions
  */
 static int __init tdc_init_module(void);
-static void __exit tdc_cleanup_module(void);
+static void tdc_cleanup_module(void);
 
 static ssize_t tdc_read(struct file *filp, char __user *buf, size_t count,
                    loff_t *f_pos);
+static ssize_t tdc_aio_read(struct kiocb *iocb, const struct iovec *iov,
+                   unsigned long nr_segs, loff_t pos);
 static ssize_t tdc_write(struct file *filp, const char __user *buf, size_t count,
                     loff_t *f_pos);
+static unsigned int tdc_poll(struct file *filp, poll_table *wait);
+static ssize_t tdc_splice_read(struct file *filp, loff_t *f_pos,
+                    struct pipe_inode_info *pipe, size_t count,
+                    unsigned int flags);
 
-static void tdc_setup_cdev(struct tdc_device *dev);
+static void tdc_setup_cdev(struct tdc_device *dev, int index);
+static void tdc_setup_device(struct tdc_device *dev, int index);
 static int tdc_open(struct inode *inode, struct file *filp);
 static int tdc_release(struct inode *inode, struct file *filp);
+static void tdc_update_wakeup(struct tdc_device *dev);
 
 #endif /* _TDC_H_ */
@@ -8,6 +8,11 @@
 #include <linux/sched.h>
 
 #include "tdc_fifo.h"
+#include "tdc_format.h"
+#include "tdc_stats.h"
+#include "tdc_rate.h"
+#include "tdc_seq.h"
+#include "tdc_iotrace.h"
 
 #define DEBUG_DETAILED 0        /* if detailed info about TDC is wanted */
 
@@ -91,16 +96,84 @@
 #define TDC_MAJOR 0   /* dynamic major by default */
 #endif
 
-/* The number of TDC devices that can be used at the same time in a PC. */
+/* The max number of TDC devices that can be used at the same time in a PC. */
 #ifndef TDC_NR_DEVS
-#define TDC_NR_DEVS 1
+#define TDC_NR_DEVS 8
 #endif
 
+/*
+ * The max number of processes that may read a device at the same time,
+ * the upper limit of tdc_max_readers. Each one takes a line in
+ * /proc/tdc_measurement.
+ */
+#ifndef TDC_MAX_READERS
+#define TDC_MAX_READERS 16
+#endif
+
+/*
+ * The largest event that can be written to a FIFO at once: one byte for
+ * the card number (merged stream only), one byte for the number of hits,
+ * the sequence number, the time and three bytes per hit, preceded by a
+ * gap record, an empty record, a clock record and a count record. See
+ * tdc_format.h.
+ */
+#define TDC_MAX_EVENT_SIZE \
+    (2 + 4 + 8 + 3 * TDC_MAX_NUM_CHANNELS * TDC_MAX_NUM_HITS_PER_CHANNEL + \
+    2 * (1 + TDC_REC_SIZE) + 1 + TDC_REC_CLOCK_SIZE + \
+    1 + TDC_REC_COUNTS_SIZE)
+
+/* The shortest and longest time slice of counting mode, in us. */
+#define TDC_MIN_COUNT_SLICE_US 100
+#define TDC_MAX_COUNT_SLICE_US 60000000
+
+/**
+ * struct tdc_clock - a calibration of the counter of TDC_FMT_TIME
+ * @cycles:     get_cycles() when the clocks were read.
+ * @mono_ns:    CLOCK_MONOTONIC, in ns.
+ * @real_ns:    CLOCK_REALTIME, in ns.
+ */
+struct tdc_clock
+{
+    u64 cycles;
+    s64 mono_ns;
+    s64 real_ns;
+};
+
+/**
+ * struct tdc_counts - the time slice being counted, in counting mode
+ * @start:      When it started.
+ * @first:      num_com_signals when it started.
+ * @hits, @invalid: num_hits and num_invalid_hits when it started.
+ * @mult:       COM signals with 1, 2, ... hits in it, see
+ *              TDC_COUNT_MULT_BINS. Bin 0 is worked out at the end.
+ * @record:     The count record of the last slice, while it is due.
+ */
+struct tdc_counts
+{
+    ktime_t start;
+    u32 first;
+    unsigned long hits[TDC_MAX_NUM_CHANNELS];
+    unsigned long invalid[TDC_MAX_NUM_CHANNELS];
+    u32 mult[TDC_COUNT_MULT_BINS];
+    unsigned char record[TDC_REC_COUNTS_SIZE];
+};
+
 enum com_mode {
     COMMON_STOP=0,
     COMMON_START=0x20
 };
 
+/*
+ * What is done with a new event when the FIFO is full, see
+ * tdc_add_hits_to_fifo.
+ */
+enum tdc_overflow_policy {
+    TDC_DROP_NEWEST = 0,    /* drop the new events, with hysteresis */
+    TDC_OVERWRITE_OLDEST,   /* drop the oldest events, even if unread */
+    TDC_THROTTLE,           /* don't read out the card until there is room */
+    TDC_NUM_POLICIES
+};
+
 typedef enum {
     M_NEW = 0,
     M_STARTED,
@@ -135,6 +208,8 @@ enum bitmasks {
     RCLK =          0x80    // bit 7, RCLK
 };
 
+struct tdc_sim;
+
 /**
  * struct channel_info - information about hits for a channel
  *                       Used for temporary storage of data from TDC-card
@@ -152,13 +227,18 @@ struct channel_info
  * struct event_cache - a temp struct with all the hits for a COM signal. *
  * @ch: Struct with list of the hits on each channel.
  * @num_hits_sum: Total number of hits detected in response to this COM signal.
+ * @dirty:  Bit ch is set if channel ch has hits. Only those channels are
+ *          written out and cleared.
  *
- * Used to store data temporarily before writing to FIFO.
+ * Used to store data temporarily before writing to FIFO. The hits are
+ * grouped by channel in the stream, so they are kept here until the whole
+ * event is read out.
  */
 struct event_cache
 {
     struct channel_info ch[TDC_MAX_NUM_CHANNELS]; // list of the hits on each channel
     unsigned short num_hits_sum;
+    unsigned int dirty;
 };
 
 /**
@@ -171,8 +251,6 @@ struct event_cache
  *                  to store all the data
  * @buf_overflow_hits:   How many hits could not be saved due to full buffer
  * @buf_overflow_events: How many events could not be saved due to full buffer
- * @com_rate:       How many times per second we receive a com signal
- * @hit_rate:       How many times per second we receive a hit.
  * @state:          The current state of the measurement.
  * @max_num_com_signals:    Measurement automatically stops if num_com_signals
  *                  reaches this limit, unless it is 0.
@@ -185,6 +263,29 @@ struct event_cache
  *                  for each channel.
  * @num_hits_of_type: count how many singles, doubles, triples, etc,
  *                  got detected per channel.
+ * @in_overflow:    1 while events are being dropped because the buffer is
+ *                  full, so that only the start of an overflow is reported.
+ * @gap_events:     Events dropped since the last gap record was written.
+ * @gap_first:      Sequence number of the first of them.
+ * @empty_coms:     COM signals without hits since the last empty record
+ *                  was written.
+ * @empty_first:    Sequence number of the first of them.
+ * @com_cycles:     get_cycles() when the COM signal being read out was
+ *                  detected, for TDC_FMT_TIME.
+ * @merge_pending:  With a merged device: com_cycles while the COM signal
+ *                  is being read out, else 0. See tdc_merge_pull.
+ * @clock:          The latest calibration of get_cycles(),
+ * @clock_due:      and if it is still to be written as a clock record.
+ * @counts:         Counting mode: the slice being counted,
+ * @counts_due:     and if the count record of the last one is still to be
+ *                  written.
+ * @overflows:      How many times the buffer started to overflow.
+ * @overwrites:     TDC_OVERWRITE_OLDEST: how many times old events were
+ *                  dropped to make room,
+ * @overwritten_bytes: and how many bytes of them.
+ * @throttled_coms: TDC_THROTTLE: COM signals that were not read out
+ *                  because the buffer was full.
+ * @seq_stats:      How often each port I/O sequence ran, see tdc_seq.h.
  */
 struct tdc_measurement
 {
@@ -194,8 +295,6 @@ struct tdc_measurement
     unsigned long buf_overflow;
     unsigned long buf_overflow_hits;
     unsigned long buf_overflow_events;
-    unsigned long com_rate;
-    unsigned long hit_rate;
     tdc_measurement_state state;
     unsigned int max_num_com_signals;
     unsigned long num_com_signals;
@@ -205,6 +304,22 @@ struct tdc_measurement
     unsigned long num_valid_hits_sum;
     unsigned long num_invalid_hits[TDC_MAX_NUM_CHANNELS];
     unsigned long num_hits_of_type[TDC_MAX_NUM_CHANNELS][TDC_MAX_NUM_HITS_PER_CHANNEL+1];
+    int in_overflow;
+    unsigned long gap_events;
+    u32 gap_first;
+    unsigned long empty_coms;
+    u32 empty_first;
+    u64 com_cycles;
+    u64 merge_pending;
+    struct tdc_clock clock;
+    int clock_due;
+    struct tdc_counts counts;
+    int counts_due;
+    unsigned long overflows;
+    unsigned long overwrites;
+    unsigned long long overwritten_bytes;
+    unsigned long throttled_coms;
+    struct tdc_seq_stats seq_stats[TDC_NUM_SEQS];
 };
 
 /**
@@ -228,6 +343,33 @@ struct tdc_timer
     struct semaphore lock;
 };
 
+struct tdc_device;
+
+/**
+ * struct tdc_acq - the card settings of a running measurement
+ * @com_mode, @t_min, @t_max, @max_hits, @num_channels: Copied from the
+ *              device when the measurement is started or resumed.
+ *              Changes made while it runs apply from the next start.
+ * @cfg_h, @cfg_l: What tdc_prepare_wait writes to the card.
+ * @seq:        The port I/O sequences for these settings, see tdc_seq.h.
+ * @read_com:   Reads out the event of a COM signal, if read_out is set,
+ *              and re-arms the card: a variant of the read-out made for
+ *              these settings. See tdc_acq_freeze.
+ * @count_slice_ns: Copied from the device: if not 0, the events are only
+ *              counted, in slices of this many ns.
+ */
+struct tdc_acq
+{
+    enum com_mode com_mode;
+    unsigned short t_min, t_max;
+    unsigned short max_hits;
+    unsigned short num_channels;
+    unsigned int cfg_h, cfg_l;
+    struct tdc_seq seq[TDC_NUM_SEQS];
+    int (*read_com)(struct tdc_device *self, int read_out);
+    s64 count_slice_ns;
+};
+
 /**
  * struct tdc_device - basic struct representing the TDC card
  * @is_initialized: tells whether the TDC card has been initialized or not
@@ -242,6 +384,7 @@ struct tdc_timer
  * @t_min:      Min allowed flight-time (in units of 0.5 ns) for valid hits.
  * @t_max:      Max allowed flight-time (in units of 0.5 ns) for valid hits.
  * @num_channels: The number of channels the TDC card has, usually 8.
+ * @acq:        The settings the acquisition uses while it runs.
  * @baseport:   The baseport of the TDC card (ISA), usually: 0x320
  * @measurement: tdc_measurement struct
  * @timer:      tdc_timer struct
@@ -250,6 +393,48 @@ struct tdc_timer
  * @nwriters:   Number of processes having open write connections to module.
  * @sem:        Mutual exclusion semaphore
  * @cdev:       Char device structure
+ * @index:      Which card this is (0 for the first card), also the minor
+ *              number offset of its device file.
+ * @name:       Name of the device file, e.g. "tdc" or "tdc1".
+ * @cpu:        CPU to start the acquisition timer on, or -1 for any CPU.
+ * @merge:      The merged device, if any. While it has readers, it reads
+ *              our FIFO like they read its own.
+ * @cards:      Only set for the merged device: the cards it merges.
+ * @num_cards:  Only set for the merged device: the number of cards.
+ * @card_cursors: Only set for the merged device: where it reads the FIFO
+ *              of each card, while it has readers.
+ * @merge_lock: Only for the merged device: serializes tdc_merge_pull.
+ * @event_buf:  Where an event is assembled when it wraps around the end of
+ *              the FIFO's buffer, see tdc_fifo_reserve.
+ * @status_seq: Incremented each time the measurement is started, paused or
+ *              stopped, the buffer overflows or an error occurs, so that
+ *              readers can be notified (POLLPRI).
+ * @wake_watermark: Readers are woken when this many bytes are buffered,
+ *              the smallest low watermark of the readers.
+ * @wake_max_wait: If not zero, readers are woken at most this long after
+ *              data was added, even if there is less than wake_watermark.
+ * @flush_timer: Timer which wakes the readers after wake_max_wait.
+ * @flush_seq:  Incremented each time flush_timer has woken the readers.
+ * @sim:        The simulated card used instead of the ports, or NULL.
+ * @stream_format: TDC_FMT_* flags telling what is written to the stream
+ *              besides the events, see tdc_format.h.
+ * @overflow_policy: What is done when the FIFO is full.
+ * @overflow_high, @overflow_low: TDC_DROP_NEWEST: events are dropped when
+ *              the FIFO would be fuller than overflow_high percent, until
+ *              it is at most overflow_low percent full.
+ * @stats:      Latency histograms, see tdc_stats.h.
+ * @read_stats_lock: Serializes the readers counting TDC_HIST_COMMIT_READ;
+ *              the other histograms are only counted by the timer callback.
+ * @rates:      Rate meters, see tdc_rate.h.
+ * @stats_files: The debugfs files showing stats, or NULL.
+ * @rates_files: The debugfs files showing the rates, or NULL.
+ * @wide_io:    Read PIA1PA and PIA1PB of a hit with one inw, see
+ *              tdc_wide_io_test. Applies from the next start.
+ * @io_file:    The debugfs file showing the port I/O, or NULL.
+ * @iotrace:    The port I/O trace, see tdc_iotrace.h.
+ * @count_slice_us: If not 0, only count records are written, one per time
+ *              slice of this many us, see tdc_format.h.
+ * @iotrace_file: The debugfs file of the trace, or NULL.
  */
 struct tdc_device
 {
@@ -261,6 +446,7 @@ struct tdc_device
     unsigned short max_num_hits_per_channel;
     unsigned short t_min, t_max;
     unsigned short num_channels;
+    struct tdc_acq acq;
     int baseport;
     struct tdc_measurement measurement;
     struct tdc_timer timer;
@@ -268,6 +454,34 @@ struct tdc_device
     unsigned int nreaders, nwriters;
     struct semaphore sem;
     struct cdev cdev;
+    unsigned int index;
+    char name[8];
+    int cpu;
+    struct tdc_device *merge;
+    struct tdc_device **cards;
+    unsigned int num_cards;
+    struct tdc_fifo_cursor *card_cursors;
+    spinlock_t merge_lock;
+    unsigned char event_buf[TDC_MAX_EVENT_SIZE];
+    unsigned int status_seq;
+    unsigned int wake_watermark;
+    ktime_t wake_max_wait;
+    struct hrtimer flush_timer;
+    unsigned int flush_seq;
+    struct tdc_sim *sim;
+    unsigned int stream_format;
+    enum tdc_overflow_policy overflow_policy;
+    unsigned int overflow_high, overflow_low;
+    struct tdc_stats stats;
+    spinlock_t read_stats_lock;
+    struct tdc_rates rates;
+    struct dentry *stats_files[2];
+    struct dentry *rates_files[2];
+    int wide_io;
+    struct dentry *io_file;
+    struct tdc_iotrace iotrace;
+    struct dentry *iotrace_file;
+    unsigned int count_slice_us;
 };
 
 #endif /* _TDC_COMMON_H_ */
@@ -1,3 +1,5 @@
+#include <linux/log2.h>
+
 #include "tdc_fifo.h"
 
 struct tdc_fifo *tdc_fifo_new(unsigned int size)
@@ -8,6 +10,8 @@ struct tdc_fifo *tdc_fifo_new(unsigned int size)
     if (!fifo)
         return NULL;
 
+    /* The free-running positions require a power of 2. */
+    size = roundup_pow_of_two(size);
     fifo->buffer = kmalloc(size, GFP_KERNEL);
     if (!fifo->buffer) {
         kfree(fifo);
@@ -16,6 +20,7 @@ struct tdc_fifo *tdc_fifo_new(unsigned int size)
 
     fifo->size = size;
     fifo->lock = SPIN_LOCK_UNLOCKED;
+    INIT_LIST_HEAD(&fifo->cursors);
 
     return fifo;
 }
@@ -28,24 +33,197 @@ void tdc_fifo_destroy(struct tdc_fifo *fifo)
 
 void tdc_fifo_reset(struct tdc_fifo *fifo)
 {
+    struct tdc_fifo_cursor *cursor;
     unsigned long flags;
+
     spin_lock_irqsave(&fifo->lock, flags);
     fifo->in = fifo->out = 0;
+    fifo->nmarks = 0;
+    list_for_each_entry(cursor, &fifo->cursors, list) {
+        cursor->out = 0;
+        cursor->since = ktime_set(0, 0);
+    }
     spin_unlock_irqrestore(&fifo->lock, flags);
 }
 
+/* Is position a before position b? Works when the positions wrap around. */
+static inline int tdc_fifo_before(unsigned int a, unsigned int b)
+{
+    return (int)(a - b) < 0;
+}
+
 /* Must be called with lock held: */
 static inline unsigned int __tdc_fifo_len(struct tdc_fifo *fifo)
 {
-    if (fifo->in == fifo->out)
-        return 0;
-    return (fifo->size - fifo->out + fifo->in) % fifo->size;
+    return fifo->in - fifo->out;
 }
 /* Must be called with lock held: */
 static inline unsigned int __tdc_fifo_spacefree(struct tdc_fifo *fifo)
 {
-    return fifo->size - 1 - __tdc_fifo_len(fifo);
+    return fifo->size - __tdc_fifo_len(fifo);
+}
+/* Must be called with lock held: */
+static inline unsigned int __tdc_fifo_mark(struct tdc_fifo *fifo,
+    unsigned int i)
+{
+    return fifo->marks[i & (TDC_FIFO_NR_MARKS - 1)];
+}
+
+/*
+ * The FIFO remembers where the latest TDC_FIFO_NR_MARKS blocks added by
+ * tdc_fifo_put end. A reader that is skipped ahead, or that only wants
+ * whole blocks, is moved to such a boundary, so that it never ends up in
+ * the middle of an event.
+ *
+ * Boundaries closer together than TDC_FIFO_MARK_GAP are merged, so that
+ * the remembered ones cover the whole FIFO even when the blocks are small.
+ * A reader reading more than about TDC_FIFO_MARK_GAP bytes at a time then
+ * always gets whole blocks, however far behind it is.
+ */
+#define TDC_FIFO_MARK_GAP(fifo) ((fifo)->size / (TDC_FIFO_NR_MARKS / 2))
+
+/*
+ * Must be called with lock held.
+ * Returns the oldest remembered block boundary at or after pos, or the
+ * write position if there is none.
+ */
+static unsigned int __tdc_fifo_boundary_from(struct tdc_fifo *fifo,
+    unsigned int pos)
+{
+    unsigned int lo, hi, mid;
+
+    lo = fifo->nmarks > TDC_FIFO_NR_MARKS ?
+        fifo->nmarks - TDC_FIFO_NR_MARKS : 0;
+    hi = fifo->nmarks;
+    while (lo < hi) {
+        mid = lo + (hi - lo) / 2;
+        if (tdc_fifo_before(__tdc_fifo_mark(fifo, mid), pos))
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo < fifo->nmarks ? __tdc_fifo_mark(fifo, lo) : fifo->in;
+}
+
+/*
+ * Must be called with lock held.
+ * Returns the number of bytes from pos to the newest remembered block
+ * boundary within max bytes from pos, or 0 if there is none.
+ */
+static unsigned int __tdc_fifo_boundary_within(struct tdc_fifo *fifo,
+    unsigned int pos, unsigned int max)
+{
+    unsigned int lo, hi, mid, end = pos + max;
+
+    lo = fifo->nmarks > TDC_FIFO_NR_MARKS ?
+        fifo->nmarks - TDC_FIFO_NR_MARKS : 0;
+    hi = fifo->nmarks;
+    /* find the first mark after end, the one before it is the newest */
+    while (lo < hi) {
+        mid = lo + (hi - lo) / 2;
+        if (tdc_fifo_before(end, __tdc_fifo_mark(fifo, mid)))
+            hi = mid;
+        else
+            lo = mid + 1;
+    }
+    if (lo == 0 || lo + TDC_FIFO_NR_MARKS <= fifo->nmarks)
+        return 0;
+    if (!tdc_fifo_before(pos, __tdc_fifo_mark(fifo, lo - 1)))
+        return 0;
+    return __tdc_fifo_mark(fifo, lo - 1) - pos;
+}
+
+/*
+ * Must be called with lock held.
+ * Returns when the block holding the data at pos began to be added, or 0
+ * if there is no data at pos or it is older than the remembered blocks.
+ * As close blocks are merged, the time may be a little early.
+ */
+static ktime_t __tdc_fifo_time_at(struct tdc_fifo *fifo, unsigned int pos)
+{
+    unsigned int lo, hi, mid, oldest;
+
+    oldest = fifo->nmarks > TDC_FIFO_NR_MARKS ?
+        fifo->nmarks - TDC_FIFO_NR_MARKS : 0;
+    lo = oldest;
+    hi = fifo->nmarks;
+    /* find the first block ending after pos */
+    while (lo < hi) {
+        mid = lo + (hi - lo) / 2;
+        if (tdc_fifo_before(pos, __tdc_fifo_mark(fifo, mid)))
+            hi = mid;
+        else
+            lo = mid + 1;
+    }
+    /* where the oldest remembered block begins is not known */
+    if (lo == fifo->nmarks || (lo == oldest && oldest > 0))
+        return ktime_set(0, 0);
+    return fifo->mark_times[lo & (TDC_FIFO_NR_MARKS - 1)];
+}
+
+/* Must be called with lock held: */
+static void __tdc_fifo_update_tail(struct tdc_fifo *fifo)
+{
+    struct tdc_fifo_cursor *cursor;
+    unsigned int tail = fifo->in;
+
+    if (list_empty(&fifo->cursors))
+        return;
+
+    list_for_each_entry(cursor, &fifo->cursors, list) {
+        if (tdc_fifo_before(cursor->out, tail))
+            tail = cursor->out;
+    }
+    fifo->out = tail;
+}
+
+/*
+ * Must be called with lock held.
+ * Tries to make room for len more bytes by skipping lossy readers ahead.
+ * If overwrite is set, all readers are skipped, and without readers the
+ * oldest data is dropped, unless a reader in the way is copying data.
+ * Returns 1 if there is room now, else 0.
+ */
+static int __tdc_fifo_make_room(struct tdc_fifo *fifo, unsigned int len,
+    int overwrite)
+{
+    struct tdc_fifo_cursor *cursor;
+    unsigned int needed = fifo->in + len - fifo->size; // new tail
+    unsigned int boundary;
+
+    if (len > fifo->size)
+        return 0;
+    if (!tdc_fifo_before(fifo->out, needed))
+        return 1;
+    /* Without readers, the data is kept for the next reader. */
+    if (list_empty(&fifo->cursors)) {
+        if (!overwrite)
+            return 0;
+        fifo->out = __tdc_fifo_boundary_from(fifo, needed);
+        return 1;
+    }
+
+    // First check that all readers in the way can be skipped...
+    list_for_each_entry(cursor, &fifo->cursors, list) {
+        if (tdc_fifo_before(cursor->out, needed) &&
+            ((!cursor->lossy && !overwrite) || cursor->reading))
+            return 0;
+    }
+
+    // ...then skip them to the first block that is not overwritten.
+    boundary = __tdc_fifo_boundary_from(fifo, needed);
+    list_for_each_entry(cursor, &fifo->cursors, list) {
+        if (tdc_fifo_before(cursor->out, needed)) {
+            cursor->dropped += boundary - cursor->out;
+            cursor->skips++;
+            cursor->out = boundary;
+            cursor->since = __tdc_fifo_time_at(fifo, boundary);
+        }
+    }
+    __tdc_fifo_update_tail(fifo);
+    return 1;
 }
+
 inline unsigned int tdc_fifo_len(struct tdc_fifo *fifo)
 {
     unsigned long flags;
@@ -66,21 +244,75 @@ inline unsigned int tdc_fifo_spacefree(struct tdc_fifo *fifo)
     spin_unlock_irqrestore(&fifo->lock, flags);
     return result;
 }
+
+/*
+ * Must be called with lock held.
+ * Adds the len bytes written at the write position as one block.
+ */
+static void __tdc_fifo_add_block(struct tdc_fifo *fifo, unsigned int len)
+{
+    struct tdc_fifo_cursor *cursor;
+    unsigned int i;
+    ktime_t now = ktime_get();
+
+    // The readers that had read everything wait for this block now.
+    list_for_each_entry(cursor, &fifo->cursors, list) {
+        if (cursor->out == fifo->in)
+            cursor->since = now;
+    }
+    fifo->in += len;
+    if (fifo->nmarks >= 2 && fifo->in - __tdc_fifo_mark(fifo,
+            fifo->nmarks - 2) <= TDC_FIFO_MARK_GAP(fifo)) {
+        fifo->marks[(fifo->nmarks - 1) & (TDC_FIFO_NR_MARKS - 1)] = fifo->in;
+    } else {
+        i = fifo->nmarks++ & (TDC_FIFO_NR_MARKS - 1);
+        fifo->marks[i] = fifo->in;
+        fifo->mark_times[i] = now;
+    }
+}
+
+/* Must be called with lock held: */
+static void __tdc_fifo_copy_in(struct tdc_fifo *fifo,
+    const unsigned char *data, unsigned int len)
+{
+    unsigned int n, pos;
+
+    // Copy up to the end of the buffer, then the rest from the beginning.
+    pos = fifo->in & (fifo->size - 1);
+    n = min(len, fifo->size - pos);
+    memcpy(fifo->buffer + pos, data, n);
+    memcpy(fifo->buffer, data + n, len - n);
+    __tdc_fifo_add_block(fifo, len);
+}
+
 /*
+ * Puts all len bytes in the FIFO as one block, or nothing at all if they
+ * don't fit. Since the whole block is added under the lock, blocks from
+ * different writers never get interleaved.
  * Returns 0 on success, -1 on error (FIFO full)
  */
-int tdc_fifo_putbyte(struct tdc_fifo *fifo,
-    unsigned char byte)
+int tdc_fifo_put(struct tdc_fifo *fifo, const unsigned char *data,
+    unsigned int len)
+{
+    return tdc_fifo_put_reserve(fifo, data, len, 0);
+}
+
+/*
+ * Like tdc_fifo_put, but only puts the data if reserve more bytes would
+ * still be free afterwards, so that the writer can be sure that a later
+ * block of at most reserve bytes fits.
+ */
+int tdc_fifo_put_reserve(struct tdc_fifo *fifo, const unsigned char *data,
+    unsigned int len, unsigned int reserve)
 {
     unsigned long flags;
     int retval = -1;
 
     spin_lock_irqsave(&fifo->lock, flags);
-    if (__tdc_fifo_spacefree(fifo) == 0)
+    if (__tdc_fifo_spacefree(fifo) < len + reserve &&
+        !__tdc_fifo_make_room(fifo, len + reserve, 0))
         goto out;
-
-    fifo->buffer[fifo->in] = byte;
-    fifo->in = (fifo->in + 1) % fifo->size;
+    __tdc_fifo_copy_in(fifo, data, len);
     retval = 0;
 out:
     spin_unlock_irqrestore(&fifo->lock, flags);
@@ -88,21 +320,221 @@ out:
 }
 
 /*
- * Returns 0 on success, -1 on error.
+ * Like tdc_fifo_put_reserve, but when the FIFO is full, the oldest blocks
+ * are dropped to make room, also for the lossless readers. Only fails if
+ * a reader in the way is copying data.
+ * Returns the number of bytes dropped, or -1 on error.
  */
-int tdc_fifo_getbyte(struct tdc_fifo *fifo, unsigned char *byte)
+int tdc_fifo_put_overwrite(struct tdc_fifo *fifo, const unsigned char *data,
+    unsigned int len, unsigned int reserve)
 {
     unsigned long flags;
+    unsigned int out;
     int retval = -1;
 
     spin_lock_irqsave(&fifo->lock, flags);
-    if (fifo->out == fifo->in)
+    out = fifo->out;
+    if (__tdc_fifo_spacefree(fifo) < len + reserve &&
+        !__tdc_fifo_make_room(fifo, len + reserve, 1))
         goto out;
-
-    *byte = fifo->buffer[fifo->out];
-    fifo->out = (fifo->out + 1) % fifo->size;
-    retval = 0;
+    __tdc_fifo_copy_in(fifo, data, len);
+    retval = fifo->out - out;
 out:
     spin_unlock_irqrestore(&fifo->lock, flags);
     return retval;
 }
+
+/*
+ * Reserves room for a block of at most len bytes, so that it can be
+ * written in place and then added with tdc_fifo_commit, instead of being
+ * assembled elsewhere and copied. As with tdc_fifo_put_reserve, reserve
+ * more bytes must still be free afterwards. If overwrite is set, the
+ * oldest blocks are dropped to make room as with tdc_fifo_put_overwrite,
+ * and *dropped is set to the number of bytes dropped.
+ *
+ * The lock is held until tdc_fifo_commit, which keeps the blocks of
+ * different writers apart, so the block must be written quickly. If the
+ * room wraps around the end of the buffer, bounce (at least len bytes) is
+ * returned instead, and the block is copied in when it is committed.
+ * Returns where to write the block, or NULL if it doesn't fit, in which
+ * case the lock is not held.
+ */
+unsigned char *tdc_fifo_reserve(struct tdc_fifo *fifo, unsigned int len,
+    unsigned int reserve, int overwrite, unsigned char *bounce,
+    unsigned int *dropped)
+{
+    unsigned long flags;
+    unsigned int out, pos;
+
+    spin_lock_irqsave(&fifo->lock, flags);
+    out = fifo->out;
+    if (__tdc_fifo_spacefree(fifo) < len + reserve &&
+        !__tdc_fifo_make_room(fifo, len + reserve, overwrite)) {
+        spin_unlock_irqrestore(&fifo->lock, flags);
+        return NULL;
+    }
+    if (dropped)
+        *dropped = fifo->out - out;
+    fifo->flags = flags;
+
+    pos = fifo->in & (fifo->size - 1);
+    if (len > fifo->size - pos)
+        return bounce;
+    return fifo->buffer + pos;
+}
+
+/*
+ * Adds the len bytes written at block, as returned by tdc_fifo_reserve,
+ * to the FIFO, and releases the lock. len may be less than was reserved,
+ * or 0 to add nothing.
+ */
+void tdc_fifo_commit(struct tdc_fifo *fifo, const unsigned char *block,
+    unsigned int len)
+{
+    unsigned long flags = fifo->flags;
+
+    if (len) {
+        if (block == fifo->buffer + (fifo->in & (fifo->size - 1)))
+            __tdc_fifo_add_block(fifo, len);
+        else
+            __tdc_fifo_copy_in(fifo, block, len);
+    }
+    spin_unlock_irqrestore(&fifo->lock, flags);
+}
+
+/*
+ * Tells if len bytes could be put in the FIFO now. Lossy readers may be
+ * skipped ahead to make room for them.
+ */
+int tdc_fifo_has_room(struct tdc_fifo *fifo, unsigned int len)
+{
+    unsigned long flags;
+    int retval;
+
+    spin_lock_irqsave(&fifo->lock, flags);
+    retval = __tdc_fifo_spacefree(fifo) >= len ||
+        __tdc_fifo_make_room(fifo, len, 0);
+    spin_unlock_irqrestore(&fifo->lock, flags);
+    return retval;
+}
+
+/*
+ * Adds a reader. It starts reading at the oldest data kept in the FIFO.
+ */
+void tdc_fifo_attach(struct tdc_fifo *fifo, struct tdc_fifo_cursor *cursor,
+    int lossy)
+{
+    unsigned long flags;
+
+    spin_lock_irqsave(&fifo->lock, flags);
+    cursor->out = fifo->out;
+    cursor->lossy = lossy;
+    cursor->reading = 0;
+    cursor->dropped = 0;
+    cursor->skips = 0;
+    cursor->since = __tdc_fifo_time_at(fifo, cursor->out);
+    list_add_tail(&cursor->list, &fifo->cursors);
+    spin_unlock_irqrestore(&fifo->lock, flags);
+}
+
+/*
+ * Removes a reader. If it was the last one, what it did not read
+ * is kept for the next reader.
+ */
+void tdc_fifo_detach(struct tdc_fifo *fifo, struct tdc_fifo_cursor *cursor)
+{
+    unsigned long flags;
+
+    spin_lock_irqsave(&fifo->lock, flags);
+    list_del(&cursor->list);
+    if (list_empty(&fifo->cursors))
+        fifo->out = cursor->out;
+    else
+        __tdc_fifo_update_tail(fifo);
+    spin_unlock_irqrestore(&fifo->lock, flags);
+}
+
+void tdc_fifo_set_lossy(struct tdc_fifo *fifo, struct tdc_fifo_cursor *cursor,
+    int lossy)
+{
+    unsigned long flags;
+
+    spin_lock_irqsave(&fifo->lock, flags);
+    cursor->lossy = lossy;
+    spin_unlock_irqrestore(&fifo->lock, flags);
+}
+
+/*
+ * Returns the number of bytes the reader has not read yet.
+ */
+unsigned int tdc_fifo_cursor_len(struct tdc_fifo *fifo,
+    struct tdc_fifo_cursor *cursor)
+{
+    unsigned long flags;
+    unsigned int result;
+
+    spin_lock_irqsave(&fifo->lock, flags);
+    result = fifo->in - cursor->out;
+    spin_unlock_irqrestore(&fifo->lock, flags);
+    return result;
+}
+
+/*
+ * Returns how many bytes, at most max, the reader may read now.
+ * If whole_blocks is set, the read ends at a block boundary when possible.
+ * Must be followed by tdc_fifo_read_end.
+ */
+unsigned int tdc_fifo_read_begin(struct tdc_fifo *fifo,
+    struct tdc_fifo_cursor *cursor, unsigned int max, int whole_blocks)
+{
+    unsigned long flags;
+    unsigned int n, boundary;
+
+    spin_lock_irqsave(&fifo->lock, flags);
+    n = fifo->in - cursor->out;
+    if (n > max) {
+        n = max;
+        if (whole_blocks) {
+            boundary = __tdc_fifo_boundary_within(fifo, cursor->out, max);
+            if (boundary)
+                n = boundary;
+        }
+    }
+    cursor->reading = 1;
+    spin_unlock_irqrestore(&fifo->lock, flags);
+    return n;
+}
+
+/*
+ * Returns a pointer to the data offset bytes after the reader's position,
+ * and limits *len to what is contiguous in memory from there.
+ * Only valid between tdc_fifo_read_begin and tdc_fifo_read_end.
+ */
+unsigned char *tdc_fifo_read_ptr(struct tdc_fifo *fifo,
+    struct tdc_fifo_cursor *cursor, unsigned int offset, unsigned int *len)
+{
+    unsigned int pos = (cursor->out + offset) & (fifo->size - 1);
+
+    if (*len > fifo->size - pos)
+        *len = fifo->size - pos;
+    return fifo->buffer + pos;
+}
+
+/*
+ * Moves the reader len bytes ahead, and frees what all readers have read.
+ */
+void tdc_fifo_read_end(struct tdc_fifo *fifo, struct tdc_fifo_cursor *cursor,
+    unsigned int len)
+{
+    unsigned long flags;
+
+    spin_lock_irqsave(&fifo->lock, flags);
+    cursor->out += len;
+    /* The FIFO may have been reset while we were reading. */
+    if (tdc_fifo_before(fifo->in, cursor->out))
+        cursor->out = fifo->in;
+    cursor->since = __tdc_fifo_time_at(fifo, cursor->out);
+    cursor->reading = 0;
+    __tdc_fifo_update_tail(fifo);
+    spin_unlock_irqrestore(&fifo->lock, flags);
+}
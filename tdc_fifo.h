@@ -3,6 +3,37 @@
 
 #include <linux/init.h>
 #include <linux/module.h>
+#include <linux/list.h>
+#include <linux/ktime.h>
+
+/*
+ * The number of block boundaries remembered by the FIFO, see tdc_fifo.c.
+ * Must be a power of 2.
+ */
+#define TDC_FIFO_NR_MARKS 256
+
+/**
+ * struct tdc_fifo_cursor - a reader's position in a FIFO
+ * @out:        data is read from offset (out & (size - 1))
+ * @lossy:      If 1, the writer skips this reader ahead when the FIFO is
+ *              full, instead of waiting for it to read.
+ * @reading:    Set while the reader copies data out of the FIFO. The
+ *              writer never skips a reader that is copying.
+ * @dropped:    Number of bytes this reader has been skipped past.
+ * @skips:      Number of times this reader has been skipped ahead.
+ * @since:      About when the oldest data not read yet was put in the
+ *              FIFO, 0 if there is none or it is not known.
+ * @list:       Entry in the FIFO's list of cursors.
+ */
+struct tdc_fifo_cursor {
+    unsigned int out;
+    int lossy;
+    int reading;
+    unsigned long dropped;
+    unsigned long skips;
+    ktime_t since;
+    struct list_head list;
+};
 
 /*
  * A custom FIFO, inspired by <linux/kfifo.h>
@@ -11,13 +42,26 @@
  * driver is to be more standardized. (kfifo was quite
  * new when this code was developed, and seemed to
  * be causing memory leaks when it was tested)
+ *
+ * There is one writer position, and each reader has its own cursor, so
+ * all readers see all data while it is only stored once. Data is freed
+ * when every reader has read it. Without readers, the data is kept for
+ * the next reader to open the device.
+ *
+ * in, out and the cursors are free-running, like in kfifo, so the size
+ * must be a power of 2.
  */
 struct tdc_fifo {
     unsigned char *buffer;  /* the buffer holding the data */
     unsigned int size;      /* the size of the allocated buffer */
-    unsigned int in;        /* data is added at offset (in % size) */
-    unsigned int out;       /* data is extracted from off. (out % size) */
+    unsigned int in;        /* data is added at offset (in & (size - 1)) */
+    unsigned int out;       /* oldest data still kept, at (out & (size - 1)) */
+    unsigned int marks[TDC_FIFO_NR_MARKS]; /* where the latest blocks end */
+    ktime_t mark_times[TDC_FIFO_NR_MARKS]; /* when the blocks began */
+    unsigned int nmarks;    /* number of blocks added so far */
+    struct list_head cursors; /* the readers */
     spinlock_t lock;        /* protects concurrent modifications */
+    unsigned long flags;    /* saved by tdc_fifo_reserve for the commit */
 };
 
 struct tdc_fifo *tdc_fifo_new(unsigned int size);
@@ -27,7 +71,45 @@ void tdc_fifo_reset(struct tdc_fifo *fifo);
 
 unsigned int tdc_fifo_len(struct tdc_fifo *fifo);
 unsigned int tdc_fifo_spacefree(struct tdc_fifo *fifo);
-int tdc_fifo_putbyte(struct tdc_fifo *fifo, unsigned char byte);
-int tdc_fifo_getbyte(struct tdc_fifo *fifo, unsigned char *byte);
+int tdc_fifo_put(struct tdc_fifo *fifo, const unsigned char *data,
+    unsigned int len);
+int tdc_fifo_put_reserve(struct tdc_fifo *fifo, const unsigned char *data,
+    unsigned int len, unsigned int reserve);
+int tdc_fifo_put_overwrite(struct tdc_fifo *fifo, const unsigned char *data,
+    unsigned int len, unsigned int reserve);
+int tdc_fifo_has_room(struct tdc_fifo *fifo, unsigned int len);
+
+/*
+ * Writing in place is done in two steps, with the lock held in between:
+ *  1. tdc_fifo_reserve gives room for a block of at most len bytes,
+ *  2. tdc_fifo_commit adds the bytes actually written.
+ */
+unsigned char *tdc_fifo_reserve(struct tdc_fifo *fifo, unsigned int len,
+    unsigned int reserve, int overwrite, unsigned char *bounce,
+    unsigned int *dropped);
+void tdc_fifo_commit(struct tdc_fifo *fifo, const unsigned char *block,
+    unsigned int len);
+
+void tdc_fifo_attach(struct tdc_fifo *fifo, struct tdc_fifo_cursor *cursor,
+    int lossy);
+void tdc_fifo_detach(struct tdc_fifo *fifo, struct tdc_fifo_cursor *cursor);
+void tdc_fifo_set_lossy(struct tdc_fifo *fifo, struct tdc_fifo_cursor *cursor,
+    int lossy);
+unsigned int tdc_fifo_cursor_len(struct tdc_fifo *fifo,
+    struct tdc_fifo_cursor *cursor);
+
+/*
+ * Reading is done in three steps, so that the data can be copied without
+ * holding the lock:
+ *  1. tdc_fifo_read_begin tells how many bytes may be read,
+ *  2. tdc_fifo_read_ptr gives the data, one contiguous piece at a time,
+ *  3. tdc_fifo_read_end tells how many bytes were actually read.
+ */
+unsigned int tdc_fifo_read_begin(struct tdc_fifo *fifo,
+    struct tdc_fifo_cursor *cursor, unsigned int max, int whole_blocks);
+unsigned char *tdc_fifo_read_ptr(struct tdc_fifo *fifo,
+    struct tdc_fifo_cursor *cursor, unsigned int offset, unsigned int *len);
+void tdc_fifo_read_end(struct tdc_fifo *fifo, struct tdc_fifo_cursor *cursor,
+    unsigned int len);
 
 #endif /* _TDC_FIFO_H_ */
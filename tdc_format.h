@@ -0,0 +1,91 @@
+#ifndef _TDC_FORMAT_H_
+#define _TDC_FORMAT_H_
+
+/*
+ * The format of the stream read from /dev/tdc. This file is shared by the
+ * driver and the tools in tools/, so it only has plain definitions.
+ *
+ * Each event starts with one byte holding the number of hits, followed by
+ * three bytes per hit: the channel (0-7) and the delay (unit 0.5 ns), low
+ * byte first. In the merged stream of several cards (/dev/tdcm), each
+ * event and record starts with one more byte holding the card number.
+ *
+ * More is added to the stream with set_stream_format, which takes these
+ * flags. The default, 0, is the format above.
+ */
+
+/*
+ * After the number of hits, the sequence number of the event's COM signal
+ * (counted from 0 when the measurement starts, modulo 2^32) as 4 bytes,
+ * low byte first.
+ */
+#define TDC_FMT_SEQ     0x1
+/* Gap records tell how many events were dropped because the FIFO was full. */
+#define TDC_FMT_GAPS    0x2
+/* Empty records tell how many COM signals had no hits. */
+#define TDC_FMT_EMPTY   0x4
+/*
+ * After the number of hits and the sequence number, when the event's COM
+ * signal was detected, as 8 bytes, low byte first. It is the value of a
+ * cheap counter (the TSC on x86), which the clock records relate to the
+ * system clocks.
+ */
+#define TDC_FMT_TIME    0x8
+
+#define TDC_FMT_ALL (TDC_FMT_SEQ | TDC_FMT_GAPS | TDC_FMT_EMPTY | TDC_FMT_TIME)
+
+/*
+ * Records are told apart from events by their first byte, which is never
+ * a number of hits (at most 8 * 16). A record is followed by its count
+ * and the sequence number of the first COM signal it covers, both as 4
+ * bytes, low byte first. The COM signals a record covers all came after
+ * the previous record of the same type, and before the next event in the
+ * stream, but may be interleaved with other records' COM signals.
+ */
+#define TDC_REC_MIN     0xf0    /* first byte of all records */
+#define TDC_REC_GAP     0xff    /* count: events dropped or not read out */
+#define TDC_REC_EMPTY   0xfe    /* count: COM signals without hits */
+
+/* The size of a record, not counting the card number. */
+#define TDC_REC_SIZE 9
+
+/*
+ * With TDC_FMT_TIME, clock records relate the counter to the clocks. One
+ * is written when the measurement starts, and about once a second after
+ * that. Instead of a count and a sequence number, it has the counter,
+ * CLOCK_MONOTONIC and CLOCK_REALTIME in ns, read at the same time, as 8
+ * bytes each, and the rate of the counter in kHz as known to the kernel
+ * (0 if not known) as 4 bytes, all low byte first. A time between two
+ * clock records is best converted using both.
+ */
+#define TDC_REC_CLOCK   0xfd
+#define TDC_REC_CLOCK_SIZE 29
+
+/*
+ * In counting mode (set_count_slice_us), no events are written. Instead,
+ * a count record is written for each time slice, whatever the stream
+ * format. After the type, all low byte first:
+ *   4 bytes    sequence number of the first COM signal of the slice
+ *   4 bytes    number of COM signals in the slice
+ *   8 bytes    when the slice started, CLOCK_MONOTONIC in ns
+ *   4 bytes    how long it was, in us
+ *   8 x 4 bytes  hits within t_min..t_max on each channel
+ *   8 x 4 bytes  hits outside t_min..t_max on each channel
+ *   TDC_COUNT_MULT_BINS x 4 bytes  number of COM signals with 0, 1, 2, ...
+ *              hits, the last bin also counting those with more
+ * A slice is ended by the first timer callback after it has lasted the
+ * slice length, so its length varies by up to the callback interval. If
+ * a count record can't be written as the buffer is full, the sequence
+ * number of the next one tells which COM signals were lost.
+ */
+#define TDC_REC_COUNTS  0xfc
+#define TDC_COUNT_MULT_BINS 17
+#define TDC_REC_COUNTS_SIZE (1 + 4 + 4 + 8 + 4 + 2 * 8 * 4 + \
+    TDC_COUNT_MULT_BINS * 4)
+
+/* The size of a record of the given type, not counting the card number. */
+#define TDC_REC_SIZE_OF(type) \
+    ((type) == TDC_REC_CLOCK ? TDC_REC_CLOCK_SIZE : \
+     (type) == TDC_REC_COUNTS ? TDC_REC_COUNTS_SIZE : TDC_REC_SIZE)
+
+#endif /* _TDC_FORMAT_H_ */
@@ -0,0 +1,186 @@
+#include <linux/kernel.h>
+#include <linux/slab.h>
+#include <linux/vmalloc.h>
+#include <linux/fs.h>
+#include <linux/debugfs.h>
+#include <asm/uaccess.h>    /* copy_*_user */
+
+#include "TDC_Device.h"
+#include "tdc_iotrace.h"
+
+void tdc_iotrace_free(struct tdc_iotrace *trace)
+{
+    trace->on = 0;
+    vfree(trace->ring);
+    trace->ring = NULL;
+}
+
+/*
+ * Clears the ring and starts recording. A port access being recorded
+ * while it is restarted may leave one stale entry at the start.
+ * Returns 0 on success, -ENOMEM if the ring can't be allocated.
+ */
+static int tdc_iotrace_start(struct tdc_iotrace *trace)
+{
+    struct tdc_io_entry *ring = trace->ring;
+
+    if (!ring) {
+        ring = vmalloc(TDC_IOTRACE_ENTRIES * sizeof(*ring));
+        if (!ring)
+            return -ENOMEM;
+    }
+    trace->on = 0;
+    trace->ring = ring;
+    trace->head = 0;
+    smp_wmb();
+    trace->on = 1;
+    return 0;
+}
+
+/*
+ * Copies the entries, oldest first, after a header. The ring is written
+ * while it is copied, so the entries that may have been overwritten by
+ * then are left out: those older than the last TDC_IOTRACE_ENTRIES
+ * recorded when the copy was done.
+ * Returns the length of what was copied.
+ */
+static size_t tdc_iotrace_snapshot(struct tdc_device *dev, void *data)
+{
+    struct tdc_iotrace *trace = &dev->iotrace;
+    struct tdc_iotrace_header *header = data;
+    struct tdc_io_entry *entries = (struct tdc_io_entry *)(header + 1);
+    struct tdc_clock clock;
+    unsigned long end = 0, first, num = 0, slot;
+
+    memset(header, 0, sizeof(*header));
+    header->magic = TDC_IOTRACE_MAGIC;
+    header->version = TDC_IOTRACE_VERSION;
+    header->entry_size = sizeof(*entries);
+    header->khz = tdc_cycles_khz();
+    header->baseport = dev->baseport;
+    tdc_clock_read(&clock);
+    header->cycles = clock.cycles;
+    header->mono_ns = clock.mono_ns;
+    header->real_ns = clock.real_ns;
+
+    if (trace->ring) {
+        end = trace->head;
+        smp_rmb();
+        // The oldest possible entry first, as if the ring were full.
+        slot = end & (TDC_IOTRACE_ENTRIES - 1);
+        memcpy(entries, trace->ring + slot,
+            (TDC_IOTRACE_ENTRIES - slot) * sizeof(*entries));
+        memcpy(entries + TDC_IOTRACE_ENTRIES - slot, trace->ring,
+            slot * sizeof(*entries));
+        smp_rmb();
+        first = trace->head;
+        first = first > TDC_IOTRACE_ENTRIES ?
+            first - TDC_IOTRACE_ENTRIES : 0;
+        if (first < end) {
+            num = end - first;
+            memmove(entries, entries + TDC_IOTRACE_ENTRIES - num,
+                num * sizeof(*entries));
+        }
+    }
+    header->recorded = end;
+    header->num_entries = num;
+    return sizeof(*header) + num * sizeof(*entries);
+}
+
+/**
+ * struct tdc_iotrace_file - an open trace file
+ * @dev:    The device traced.
+ * @len:    Length of data.
+ * @data:   A copy of the trace taken when the file was opened for reading,
+ *          or NULL.
+ */
+struct tdc_iotrace_file {
+    struct tdc_device *dev;
+    size_t len;
+    void *data;
+};
+
+static int tdc_iotrace_open(struct inode *inode, struct file *filp)
+{
+    struct tdc_iotrace_file *file;
+
+    file = kzalloc(sizeof(*file), GFP_KERNEL);
+    if (!file)
+        return -ENOMEM;
+    file->dev = inode->i_private;
+    if (filp->f_mode & FMODE_READ) {
+        file->data = vmalloc(sizeof(struct tdc_iotrace_header) +
+            TDC_IOTRACE_ENTRIES * sizeof(struct tdc_io_entry));
+        if (!file->data) {
+            kfree(file);
+            return -ENOMEM;
+        }
+        file->len = tdc_iotrace_snapshot(file->dev, file->data);
+    }
+    filp->private_data = file;
+    return 0;
+}
+
+static ssize_t tdc_iotrace_read(struct file *filp, char __user *buf,
+    size_t count, loff_t *f_pos)
+{
+    struct tdc_iotrace_file *file = filp->private_data;
+
+    return simple_read_from_buffer(buf, count, f_pos, file->data, file->len);
+}
+
+/* Writing 1 clears the trace and starts it, 0 stops it. */
+static ssize_t tdc_iotrace_write(struct file *filp, const char __user *buf,
+    size_t count, loff_t *f_pos)
+{
+    struct tdc_iotrace_file *file = filp->private_data;
+    struct tdc_device *dev = file->dev;
+    char kbuf[16];
+    size_t len = min(count, sizeof(kbuf) - 1);
+    int res = 0;
+
+    if (copy_from_user(kbuf, buf, len))
+        return -EFAULT;
+    kbuf[len] = '\0';
+
+    if (down_interruptible(&dev->sem))
+        return -ERESTARTSYS;
+    if (simple_strtoul(kbuf, NULL, 0))
+        res = tdc_iotrace_start(&dev->iotrace);
+    else
+        dev->iotrace.on = 0;
+    up(&dev->sem);
+    return res ? res : count;
+}
+
+static int tdc_iotrace_release(struct inode *inode, struct file *filp)
+{
+    struct tdc_iotrace_file *file = filp->private_data;
+
+    vfree(file->data);
+    kfree(file);
+    return 0;
+}
+
+static struct file_operations tdc_iotrace_fops = {
+    .owner = THIS_MODULE,
+    .open = tdc_iotrace_open,
+    .read = tdc_iotrace_read,
+    .write = tdc_iotrace_write,
+    .release = tdc_iotrace_release,
+};
+
+/*
+ * Creates <name>_iotrace in the debugfs directory dir, to start, stop and
+ * read the port I/O trace of dev.
+ * Returns the file, or NULL on error.
+ */
+struct dentry *tdc_iotrace_create_file(struct tdc_device *dev,
+    struct dentry *dir)
+{
+    char file_name[32];
+
+    snprintf(file_name, sizeof(file_name), "%s_iotrace", dev->name);
+    return debugfs_create_file(file_name, S_IRUGO | S_IWUSR, dir, dev,
+        &tdc_iotrace_fops);
+}
@@ -0,0 +1,135 @@
+#ifndef _TDC_IOTRACE_H_
+#define _TDC_IOTRACE_H_
+
+/*
+ * A binary trace of the port I/O of a card, for finding out the exact
+ * timing of the card protocol at full speed. While it is on, each port
+ * access is stored in a ring of TDC_IOTRACE_ENTRIES, with the cycle
+ * counter (see get_cycles), the port, the value and the phase of the
+ * protocol it belongs to. Writing 1 to tdcmod/<name>_iotrace in debugfs
+ * clears the ring and starts the trace, writing 0 stops it. Reading the
+ * file gives a struct tdc_iotrace_header followed by the entries, oldest
+ * first; tools/tdc-iotrace decodes them.
+ *
+ * The layout of the structs is shared with userspace, so this file only
+ * has plain definitions outside __KERNEL__.
+ */
+
+#include <linux/types.h>
+
+#define TDC_IOTRACE_MAGIC   0x49434454  /* "TDCI" */
+#define TDC_IOTRACE_VERSION 1
+
+/* The size of the ring, a power of 2. */
+#define TDC_IOTRACE_ENTRIES 65536
+
+enum tdc_io_dir {
+    TDC_IO_OUT = 0,         /* outb */
+    TDC_IO_IN,              /* inb */
+    TDC_IO_INW              /* inw, of port and port + 1 */
+};
+
+/* The phases of the protocol are the sequences of tdc_seq.h, in order. */
+enum tdc_io_phase {
+    TDC_IO_PREPARE_WAIT = 0,    /* arm the card for the next COM signal */
+    TDC_IO_CHECK,               /* latch the hits, and read the status */
+    TDC_IO_DECODE,              /* read one hit */
+    TDC_IO_RESET,               /* re-enable the inputs */
+    TDC_IO_SETUP,               /* configuring or probing the card */
+    TDC_NUM_IO_PHASES
+};
+
+/**
+ * struct tdc_io_entry - a port access
+ * @cycles:     get_cycles() just after it.
+ * @value:      The value written or read.
+ * @port:       The port, relative to the base address (enum port).
+ * @dir:        enum tdc_io_dir
+ * @phase:      enum tdc_io_phase
+ */
+struct tdc_io_entry {
+    __u64 cycles;
+    __u16 value;
+    __u8 port;
+    __u8 dir;
+    __u8 phase;
+    __u8 pad[3];
+};
+
+/**
+ * struct tdc_iotrace_header - what is read before the entries
+ * @magic:      TDC_IOTRACE_MAGIC
+ * @version:    TDC_IOTRACE_VERSION
+ * @entry_size: sizeof(struct tdc_io_entry)
+ * @num_entries: Number of entries that follow.
+ * @recorded:   Number of entries recorded since the trace was started. The
+ *              oldest recorded - num_entries were overwritten.
+ * @cycles, @mono_ns, @real_ns: get_cycles(), CLOCK_MONOTONIC and
+ *              CLOCK_REALTIME, read at the same time when the file was
+ *              opened, to relate the times of the entries to the clocks.
+ * @khz:        The rate of get_cycles(), 0 if not known.
+ * @baseport:   The base address of the card.
+ */
+struct tdc_iotrace_header {
+    __u32 magic;
+    __u32 version;
+    __u32 entry_size;
+    __u32 num_entries;
+    __u64 recorded;
+    __u64 cycles;
+    __s64 mono_ns;
+    __s64 real_ns;
+    __u32 khz;
+    __u32 baseport;
+};
+
+#ifdef __KERNEL__
+
+#include <linux/timex.h>    /* get_cycles */
+#include <asm/system.h>     /* smp_wmb */
+
+struct tdc_device;
+struct dentry;
+
+/**
+ * struct tdc_iotrace - the port I/O trace of a device
+ * @on:         Set while port accesses are recorded.
+ * @phase:      The phase of the next port accesses.
+ * @ring:       TDC_IOTRACE_ENTRIES entries, allocated when the trace is
+ *              first started.
+ * @head:       Number of entries recorded. The next goes to
+ *              ring[head % TDC_IOTRACE_ENTRIES].
+ */
+struct tdc_iotrace {
+    int on;
+    unsigned int phase;
+    struct tdc_io_entry *ring;
+    unsigned long head;
+};
+
+/*
+ * Records a port access. Only the acquisition writes to the ring, and the
+ * readers check head before and after copying it, so no lock is taken.
+ */
+static inline void tdc_iotrace_add(struct tdc_iotrace *trace,
+    unsigned int port, enum tdc_io_dir dir, unsigned int value)
+{
+    struct tdc_io_entry *entry =
+        &trace->ring[trace->head & (TDC_IOTRACE_ENTRIES - 1)];
+
+    entry->cycles = get_cycles();
+    entry->value = value;
+    entry->port = port;
+    entry->dir = dir;
+    entry->phase = trace->phase;
+    smp_wmb();
+    trace->head++;
+}
+
+void tdc_iotrace_free(struct tdc_iotrace *trace);
+struct dentry *tdc_iotrace_create_file(struct tdc_device *dev,
+    struct dentry *dir);
+
+#endif /* __KERNEL__ */
+
+#endif /* _TDC_IOTRACE_H_ */
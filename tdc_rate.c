@@ -0,0 +1,222 @@
+#include <linux/kernel.h>
+#include <linux/slab.h>
+#include <linux/fs.h>
+#include <asm/uaccess.h>    /* copy_*_user */
+#include <asm/div64.h>
+
+#include "tdc_stats.h"
+#include "tdc_rate.h"
+
+/*
+ * Each update, a rate moves towards the rate since the last update by
+ * 1 - e^(-dt / window). These are e^(-TDC_RATE_TICK_NS / window), times
+ * TDC_RATE_ONE; an update after n ticks uses their n'th power.
+ */
+static const u64 tdc_rate_decay[TDC_NUM_WINDOWS] = {
+    59299,  /* 1 s */
+    64884,  /* 10 s */
+    65427   /* 60 s */
+};
+
+static const char *tdc_window_names[TDC_NUM_WINDOWS] = {
+    "1s",
+    "10s",
+    "60s"
+};
+
+static const char *tdc_meter_names[TDC_NUM_METERS] = {
+    "com",
+    "hits",
+    "invalid",
+    "empty",
+    "overflow",
+    "ch0", "ch1", "ch2", "ch3", "ch4", "ch5", "ch6", "ch7"
+};
+
+void tdc_rates_reset(struct tdc_rates *rates)
+{
+    memset(rates, 0, sizeof(*rates));
+    rates->magic = TDC_RATES_MAGIC;
+    rates->version = TDC_RATES_VERSION;
+    rates->num_meters = TDC_NUM_METERS;
+    rates->num_windows = TDC_NUM_WINDOWS;
+}
+
+/* x^n, both times TDC_RATE_ONE. */
+static u64 tdc_rate_pow(u64 x, unsigned int n)
+{
+    u64 result = TDC_RATE_ONE;
+
+    while (n) {
+        if (n & 1)
+            result = (result * x) >> TDC_RATE_SHIFT;
+        x = (x * x) >> TDC_RATE_SHIFT;
+        n >>= 1;
+    }
+    return result;
+}
+
+/* count events in dt_us, as events per second times TDC_RATE_ONE. */
+static u64 tdc_rate_sample(unsigned long count, u32 dt_us)
+{
+    u64 q = (u64)count * 1000000;
+    u64 r = do_div(q, dt_us);
+
+    r <<= TDC_RATE_SHIFT;
+    do_div(r, dt_us);
+    return (q << TDC_RATE_SHIFT) + r;
+}
+
+/*
+ * Updates the rates from totals, the counters of the meters, now. The
+ * first update after a reset only takes the counters.
+ */
+void tdc_rates_update(struct tdc_rates *rates, const unsigned long *totals,
+    ktime_t now)
+{
+    struct tdc_meter *meter;
+    u64 decay[TDC_NUM_WINDOWS], sample, dt = ktime_to_ns(now) -
+        rates->updated_ns;
+    unsigned long count;
+    unsigned int ticks;
+    u32 dt_us;
+    int m, w;
+
+    if (rates->updated_ns) {
+        // The decay is in whole ticks, the sample uses the exact time.
+        sample = dt + TDC_RATE_TICK_NS / 2;
+        do_div(sample, TDC_RATE_TICK_NS);
+        ticks = max_t(u64, sample, 1);
+        for (w = 0; w < TDC_NUM_WINDOWS; ++w)
+            decay[w] = tdc_rate_pow(tdc_rate_decay[w], ticks);
+        do_div(dt, 1000);
+        dt_us = dt > 0xffffffff ? 0xffffffff : max_t(u32, dt, 1);
+    }
+
+    for (m = 0; m < TDC_NUM_METERS; ++m) {
+        meter = &rates->meter[m];
+        // Works when the counter has wrapped around since.
+        count = totals[m] - (unsigned long)meter->total;
+        meter->total = totals[m];
+        if (!rates->updated_ns)
+            continue;
+        sample = tdc_rate_sample(count, dt_us);
+        for (w = 0; w < TDC_NUM_WINDOWS; ++w)
+            meter->rate[w] = (meter->rate[w] * decay[w] +
+                sample * (TDC_RATE_ONE - decay[w])) >> TDC_RATE_SHIFT;
+    }
+    rates->updated_ns = ktime_to_ns(now);
+    rates->updates++;
+}
+
+/* Formats a copy of the rates as text. Returns the length. */
+static int tdc_rates_format(const struct tdc_rates *copy, char *buf,
+    size_t size)
+{
+    u64 rate;
+    int len = 0, m, w;
+
+    len += scnprintf(buf + len, size - len, "%-10s %14s", "(Hz)", "total");
+    for (w = 0; w < TDC_NUM_WINDOWS; ++w)
+        len += scnprintf(buf + len, size - len, " %12s", tdc_window_names[w]);
+    len += scnprintf(buf + len, size - len, "\n");
+    for (m = 0; m < TDC_NUM_METERS; ++m) {
+        len += scnprintf(buf + len, size - len, "%-10s %14llu",
+            tdc_meter_names[m], (unsigned long long)copy->meter[m].total);
+        for (w = 0; w < TDC_NUM_WINDOWS; ++w) {
+            rate = copy->meter[m].rate[w];
+            len += scnprintf(buf + len, size - len, " %9llu.%02u",
+                (unsigned long long)(rate >> TDC_RATE_SHIFT),
+                (unsigned int)(((rate & (TDC_RATE_ONE - 1)) * 100) >>
+                    TDC_RATE_SHIFT));
+        }
+        len += scnprintf(buf + len, size - len, "\n");
+    }
+    return len;
+}
+
+#define TDC_RATES_TEXT_SIZE 2048
+
+/*
+ * The files show a copy of the rates taken when the file is opened. The
+ * rates are updated without a lock, so a meter may be mid-update.
+ */
+static int tdc_rates_show_text(void *data, char *buf, size_t size)
+{
+    struct tdc_rates *copy;
+    int len;
+
+    copy = kmalloc(sizeof(*copy), GFP_KERNEL);
+    if (!copy)
+        return -ENOMEM;
+    memcpy(copy, data, sizeof(*copy));
+    len = tdc_rates_format(copy, buf, size);
+    kfree(copy);
+    return len;
+}
+
+static int tdc_rates_show_bin(void *data, char *buf, size_t size)
+{
+    memcpy(buf, data, sizeof(struct tdc_rates));
+    return sizeof(struct tdc_rates);
+}
+
+static int tdc_rates_open_text(struct inode *inode, struct file *filp)
+{
+    return tdc_snapshot_open(inode, filp, tdc_rates_show_text,
+        TDC_RATES_TEXT_SIZE);
+}
+
+static int tdc_rates_open_bin(struct inode *inode, struct file *filp)
+{
+    return tdc_snapshot_open(inode, filp, tdc_rates_show_bin,
+        sizeof(struct tdc_rates));
+}
+
+static struct file_operations tdc_rates_text_fops = {
+    .owner = THIS_MODULE,
+    .open = tdc_rates_open_text,
+    .read = tdc_snapshot_read,
+    .release = tdc_snapshot_release,
+};
+
+static struct file_operations tdc_rates_bin_fops = {
+    .owner = THIS_MODULE,
+    .open = tdc_rates_open_bin,
+    .read = tdc_snapshot_read,
+    .release = tdc_snapshot_release,
+};
+
+/*
+ * Creates <name>_rates and <name>_rates.bin in the debugfs directory dir,
+ * and stores them in files[0] and files[1].
+ * Returns 0 on success, -1 on error.
+ */
+int tdc_rates_create_files(struct tdc_rates *rates, const char *name,
+    struct dentry *dir, struct dentry **files)
+{
+    char file_name[32];
+
+    snprintf(file_name, sizeof(file_name), "%s_rates", name);
+    files[0] = debugfs_create_file(file_name, S_IRUGO, dir, rates,
+        &tdc_rates_text_fops);
+    snprintf(file_name, sizeof(file_name), "%s_rates.bin", name);
+    files[1] = debugfs_create_file(file_name, S_IRUGO, dir, rates,
+        &tdc_rates_bin_fops);
+    if (!files[0] || !files[1]) {
+        tdc_rates_remove_files(files);
+        return -1;
+    }
+    return 0;
+}
+
+void tdc_rates_remove_files(struct dentry **files)
+{
+    int i;
+
+    for (i = 0; i < 2; ++i) {
+        if (files[i])
+            debugfs_remove(files[i]);
+        files[i] = NULL;
+    }
+}
@@ -0,0 +1,108 @@
+#ifndef _TDC_RATE_H_
+#define _TDC_RATE_H_
+
+/*
+ * Rate meters of the acquisition: exponentially weighted rates over about
+ * 1 s, 10 s and 60 s of COM signals, hits and losses. They are updated
+ * from the measurement's counters every TDC_RATE_TICK_NS, using the time
+ * that really passed, so they cost nothing per event. They can be read
+ * from debugfs, as text from tdcmod/<name>_rates, and as a struct
+ * tdc_rates from tdcmod/<name>_rates.bin. Starting a new measurement
+ * clears them.
+ *
+ * The layout of struct tdc_rates is shared with userspace, so this file
+ * only has plain definitions outside __KERNEL__.
+ */
+
+#include <linux/types.h>
+
+#define TDC_RATES_MAGIC     0x52434454  /* "TDCR" */
+#define TDC_RATES_VERSION   1
+
+/* A rate of 1 event per second. */
+#define TDC_RATE_SHIFT      16
+#define TDC_RATE_ONE        (1 << TDC_RATE_SHIFT)
+
+/* How often the rates are updated. */
+#define TDC_RATE_TICK_NS    100000000
+
+enum tdc_rate_window {
+    TDC_RATE_1S = 0,
+    TDC_RATE_10S,
+    TDC_RATE_60S,
+    TDC_NUM_WINDOWS
+};
+
+enum tdc_meter_id {
+    TDC_METER_COM = 0,      /* COM signals */
+    TDC_METER_HITS,         /* hits read out, also those out of range */
+    TDC_METER_INVALID,      /* hits out of t_min..t_max */
+    TDC_METER_EMPTY,        /* COM signals without hits */
+    TDC_METER_OVERFLOW,     /* events dropped or not read out as the
+                               buffer was full */
+    TDC_METER_CH0,          /* hits in range on channel 0, ... */
+    TDC_NUM_METERS = TDC_METER_CH0 + 8
+};
+
+/**
+ * struct tdc_meter - the rates of one counter
+ * @total:      The counter at the last update. It wraps around like the
+ *              counter, at 2^32 on 32 bit machines.
+ * @rate:       Events per second times TDC_RATE_ONE, indexed by enum
+ *              tdc_rate_window.
+ */
+struct tdc_meter {
+    __u64 total;
+    __u64 rate[TDC_NUM_WINDOWS];
+};
+
+/**
+ * struct tdc_rates - the rate meters of a card
+ * @magic:      TDC_RATES_MAGIC
+ * @version:    TDC_RATES_VERSION
+ * @num_meters: TDC_NUM_METERS
+ * @num_windows: TDC_NUM_WINDOWS
+ * @updated_ns: When the rates were last updated, in ns of the monotonic
+ *              clock, 0 if never.
+ * @updates:    Number of updates.
+ * @meter:      Indexed by enum tdc_meter_id.
+ */
+struct tdc_rates {
+    __u32 magic;
+    __u32 version;
+    __u32 num_meters;
+    __u32 num_windows;
+    __s64 updated_ns;
+    __u64 updates;
+    struct tdc_meter meter[TDC_NUM_METERS];
+};
+
+#ifdef __KERNEL__
+
+#include <linux/ktime.h>
+#include <linux/debugfs.h>
+
+/* Is it time to update the rates? */
+static inline int tdc_rates_due(const struct tdc_rates *rates, ktime_t now)
+{
+    return ktime_to_ns(now) - rates->updated_ns >= TDC_RATE_TICK_NS;
+}
+
+/* The rate of meter over window, in events per second. */
+static inline unsigned long tdc_rate_hz(const struct tdc_rates *rates,
+    enum tdc_meter_id meter, enum tdc_rate_window window)
+{
+    return (rates->meter[meter].rate[window] + TDC_RATE_ONE / 2) >>
+        TDC_RATE_SHIFT;
+}
+
+void tdc_rates_reset(struct tdc_rates *rates);
+void tdc_rates_update(struct tdc_rates *rates, const unsigned long *totals,
+    ktime_t now);
+int tdc_rates_create_files(struct tdc_rates *rates, const char *name,
+    struct dentry *dir, struct dentry **files);
+void tdc_rates_remove_files(struct dentry **files);
+
+#endif /* __KERNEL__ */
+
+#endif /* _TDC_RATE_H_ */
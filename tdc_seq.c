@@ -0,0 +1,193 @@
+#include <linux/kernel.h>
+#include <linux/slab.h>
+#include <linux/fs.h>
+#include <linux/debugfs.h>
+#include <asm/uaccess.h>    /* copy_*_user */
+
+#include "tdc_common.h"
+#include "tdc_seq.h"
+
+/*
+ * Flags of the templates below, in the high bits of the op code:
+ * the value written is ORed with the COM mode, or is cfgH (arg 0) or cfgL
+ * (arg 1), or the op is only done in common stop mode, or only with or
+ * without wide port reads.
+ */
+#define T_WIDE      0x08
+#define T_COM       0x10
+#define T_CFG       0x20
+#define T_BYTE      0x40
+#define T_STOP      0x80
+#define T_CODE      0x07
+
+#define OUT_B(val)          { TDC_OP_OUT | T_COM, PIA2PB, val }
+#define IN(port, slot)      { TDC_OP_IN, port, slot }
+#define SETTLE(us)          { TDC_OP_SETTLE, 0, us }
+
+/*
+ * The MTD133B protocol. See the PIA2PB bitmask in TDC_Device.h, X is the
+ * COM mode bit.
+ */
+static const struct tdc_op tdc_seq_templates[TDC_NUM_SEQS][TDC_SEQ_MAX_OPS] = {
+    [TDC_SEQ_PREPARE] = {
+        /*
+         * It is necessary to send the cfgH and cfgL each time we want to
+         * wait for a new COM signal apparently. Otherwise new hits will
+         * not be detected after approx 3 seconds of acquiring.
+         * The comments are from RoentDek's documentation, but seem to
+         * be mixed up! It's probably vice versa.
+         */
+        { TDC_OP_OUT | T_CFG, PIA1PA, 0 },  // set number of Hits bits 0-3 (0 = 16 hits)
+        { TDC_OP_OUT | T_CFG, PIA2PA, 1 },  // setup max wait time 8ns + bits(4-15)*0.5 ns
+        SETTLE(10),                         // probably not necessary
+        // Reset TDC chip
+        OUT_B(0x19),                        // 00X11001 - enable goes high, reset goes high
+        { TDC_OP_OUT | T_STOP, PIA2PB, 0x51 }, // 01010001 - common stop trig goes high, reset goes low
+        OUT_B(0x10),                        // 00X10000 - reset goes low, enable goes low
+    },
+    [TDC_SEQ_CHECK] = {
+        OUT_B(0x11),                        // 00X10001 - set Enable*
+        OUT_B(0x91), OUT_B(0x11),           // 3 pulses on RCLK*
+        OUT_B(0x91), OUT_B(0x11),
+        OUT_B(0x91), OUT_B(0x11),
+        OUT_B(0x01),                        // 00X00001 - disable p.in*
+        IN(PIA1PB, 0),                      // status, for p.out*
+    },
+    [TDC_SEQ_HIT] = {
+        /*
+         * Slot 0 is the high byte of the delay, 1 the status (channel in
+         * bits 4-2, p.out*) and 2 the low byte. PIA1PA and PIA1PB are
+         * next to each other, so with wide_io they are read with one inw
+         * after the wait.
+         */
+        OUT_B(0x81),                        // 10X00001
+        OUT_B(0x01),                        // 00X00001
+        { TDC_OP_IN | T_BYTE, PIA1PA, 0 },
+        IN(PIA2PA, 2),
+        SETTLE(10),
+        { TDC_OP_IN | T_BYTE, PIA1PB, 1 },
+        { TDC_OP_INW | T_WIDE, PIA1PA, 0 },
+    },
+    [TDC_SEQ_RESET] = {
+        // Reenable P.in*
+        OUT_B(0x81),                        // 10X00001
+        OUT_B(0x11),                        // 00X10001
+    },
+};
+
+static const char *tdc_seq_names[TDC_NUM_SEQS] = {
+    "prepare",
+    "check",
+    "hit",
+    "reset"
+};
+
+/*
+ * Builds the sequences for a measurement from the templates, with the
+ * COM mode and the cfgH and cfgL bytes filled in, and with wide or byte
+ * port reads.
+ */
+void tdc_seq_build(struct tdc_seq *seqs, unsigned int com_mode,
+    unsigned int cfg_h, unsigned int cfg_l, int wide_io)
+{
+    const struct tdc_op *t;
+    struct tdc_seq *seq;
+    struct tdc_op *op;
+    int s;
+
+    for (s = 0; s < TDC_NUM_SEQS; ++s) {
+        seq = &seqs[s];
+        memset(seq, 0, sizeof(*seq));
+        op = seq->ops;
+        for (t = tdc_seq_templates[s]; t->code != TDC_OP_END; ++t) {
+            if ((t->code & T_STOP) && com_mode != COMMON_STOP)
+                continue;
+            if ((t->code & T_WIDE) && !wide_io)
+                continue;
+            if ((t->code & T_BYTE) && wide_io)
+                continue;
+            op->code = t->code & T_CODE;
+            op->port = t->port;
+            if (t->code & T_CFG)
+                op->arg = t->arg ? cfg_l : cfg_h;
+            else if (t->code & T_COM)
+                op->arg = t->arg | com_mode;
+            else
+                op->arg = t->arg;
+
+            if (op->code == TDC_OP_OUT)
+                seq->outs++;
+            else if (op->code == TDC_OP_IN || op->code == TDC_OP_INW)
+                seq->ins++;
+            else
+                seq->settle_us += op->arg;
+            op++;
+        }
+        op->code = TDC_OP_END;
+    }
+}
+
+/* Formats the port I/O of the measurement of dev. Returns the length. */
+static int tdc_seq_format(struct tdc_device *dev, char *buf, size_t size)
+{
+    const struct tdc_seq_stats *stats;
+    const struct tdc_seq *seq;
+    unsigned long long outs, ins, settle, cost, total = 0;
+    int len = 0, s;
+
+    len += scnprintf(buf + len, size - len, "%-8s %12s %12s %12s "
+        "%12s %8s %12s\n", "", "runs", "out", "in", "settle_us", "us/run",
+        "est_us");
+    for (s = 0; s < TDC_NUM_SEQS; ++s) {
+        seq = &dev->acq.seq[s];
+        stats = &dev->measurement.seq_stats[s];
+        outs = (unsigned long long)stats->runs * seq->outs;
+        ins = (unsigned long long)stats->runs * seq->ins;
+        settle = (unsigned long long)stats->runs * seq->settle_us;
+        cost = settle + (outs * TDC_OUT_NS + ins * TDC_IN_NS) / 1000;
+        total += cost;
+        len += scnprintf(buf + len, size - len, "%-8s %12lu %12llu %12llu "
+            "%12llu %8u %12llu\n", tdc_seq_names[s], stats->runs,
+            outs, ins, settle,
+            seq->settle_us + (seq->outs * TDC_OUT_NS +
+                seq->ins * TDC_IN_NS) / 1000, cost);
+    }
+    len += scnprintf(buf + len, size - len, "\n%llu us estimated for %lu "
+        "COM signals\n", total, dev->measurement.num_com_signals);
+    len += scnprintf(buf + len, size - len, "wide port reads: %s\n",
+        dev->wide_io ? "on" : "off");
+    return len;
+}
+
+#define TDC_SEQ_TEXT_SIZE 1024
+
+static int tdc_seq_show(void *data, char *buf, size_t size)
+{
+    return tdc_seq_format(data, buf, size);
+}
+
+static int tdc_seq_open(struct inode *inode, struct file *filp)
+{
+    return tdc_snapshot_open(inode, filp, tdc_seq_show, TDC_SEQ_TEXT_SIZE);
+}
+
+static struct file_operations tdc_seq_fops = {
+    .owner = THIS_MODULE,
+    .open = tdc_seq_open,
+    .read = tdc_snapshot_read,
+    .release = tdc_snapshot_release,
+};
+
+/*
+ * Creates <name>_io in the debugfs directory dir, showing the port I/O
+ * of the sequences in the current measurement of dev.
+ * Returns the file, or NULL on error.
+ */
+struct dentry *tdc_seq_create_file(struct tdc_device *dev,
+    struct dentry *dir)
+{
+    char file_name[32];
+
+    snprintf(file_name, sizeof(file_name), "%s_io", dev->name);
+    return debugfs_create_file(file_name, S_IRUGO, dir, dev, &tdc_seq_fops);
+}
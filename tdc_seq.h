@@ -0,0 +1,73 @@
+#ifndef _TDC_SEQ_H_
+#define _TDC_SEQ_H_
+
+/*
+ * The port I/O sequences of the card protocol, as tables of micro-ops.
+ * The tables in tdc_seq.c are built for the settings of a measurement
+ * when it starts, and TDC_Device.c runs them. Each port access is an ISA
+ * cycle of about 1 us, so each sequence counts how often it ran and what
+ * it cost, see tdcmod/<name>_io in debugfs.
+ */
+
+#include <linux/types.h>
+
+struct tdc_device;
+struct dentry;
+
+enum tdc_seq_id {
+    TDC_SEQ_PREPARE = 0,    /* arm the card for the next COM signal */
+    TDC_SEQ_CHECK,          /* latch the hits, and read the status */
+    TDC_SEQ_HIT,            /* read one hit */
+    TDC_SEQ_RESET,          /* re-enable the inputs */
+    TDC_NUM_SEQS
+};
+
+enum tdc_op_code {
+    TDC_OP_END = 0,
+    TDC_OP_OUT,             /* write arg to port */
+    TDC_OP_IN,              /* read port into slots[arg] */
+    TDC_OP_INW,             /* read port and port + 1 with one inw into
+                               slots[arg] and slots[arg + 1] */
+    TDC_OP_SETTLE           /* wait arg us */
+};
+
+/* The longest sequence, and the most values one can read. */
+#define TDC_SEQ_MAX_OPS 12
+#define TDC_SEQ_SLOTS   4
+
+/* Estimated cost of the port accesses: outb_p is two ISA cycles. */
+#define TDC_ISA_CYCLE_NS    1000
+#define TDC_OUT_NS          (2 * TDC_ISA_CYCLE_NS)
+#define TDC_IN_NS           TDC_ISA_CYCLE_NS
+
+struct tdc_op {
+    unsigned char code;
+    unsigned char port;
+    unsigned char arg;
+};
+
+/**
+ * struct tdc_seq - a sequence, built for the settings of a measurement
+ * @ops:        The micro-ops, ending with TDC_OP_END.
+ * @outs, @ins, @settle_us: Port writes, port reads and us waited in one
+ *              run of the sequence.
+ */
+struct tdc_seq {
+    struct tdc_op ops[TDC_SEQ_MAX_OPS];
+    unsigned int outs, ins, settle_us;
+};
+
+/**
+ * struct tdc_seq_stats - how often a sequence ran in a measurement
+ * @runs:       Number of times it ran.
+ */
+struct tdc_seq_stats {
+    unsigned long runs;
+};
+
+void tdc_seq_build(struct tdc_seq *seqs, unsigned int com_mode,
+    unsigned int cfg_h, unsigned int cfg_l, int wide_io);
+struct dentry *tdc_seq_create_file(struct tdc_device *dev,
+    struct dentry *dir);
+
+#endif /* _TDC_SEQ_H_ */
@@ -0,0 +1,217 @@
+#include <asm/uaccess.h>    /* copy_*_user */
+
+#include "tdc_sim.h"
+
+/*
+ * The simulated card replays events written to its feed file in debugfs,
+ * e.g. /sys/kernel/debug/tdcmod/tdc_sim, by tools/tdc-replay. It models the
+ * MTD133B protocol as far as TDC_Device.c uses it, so that the real
+ * acquisition code reads out the replayed events:
+ *
+ *  - The falling edge of RESET arms the chip, and drops the event that
+ *    was read out after the previous COM signal.
+ *  - An armed chip "detects" a COM signal as soon as a whole event is
+ *    queued: bit 7 of PIA1PB is then set.
+ *  - Each rising edge of RCLK while P.in* is low clocks out the next hit:
+ *    its delay to PIA1PA (high byte) and PIA2PA (low byte), and its
+ *    channel to bits 2-4 of PIA1PB.
+ *  - p.out* (bit 1 of PIA1PB) is set while there are hits left.
+ *
+ * Each COM signal the driver detects takes one event, so the events are
+ * replayed at most at the trigger rate, as with a real card.
+ */
+
+struct tdc_sim *tdc_sim_new(void)
+{
+    struct tdc_sim *sim;
+
+    sim = kzalloc(sizeof(*sim), GFP_KERNEL);
+    if (!sim)
+        return NULL;
+
+    sim->queue = tdc_fifo_new(TDC_SIM_QUEUE_SIZE);
+    if (!sim->queue) {
+        kfree(sim);
+        return NULL;
+    }
+    // Lossless, so the feed waits instead of events being dropped.
+    tdc_fifo_attach(sim->queue, &sim->cursor, 0);
+    init_waitqueue_head(&sim->feedq);
+    return sim;
+}
+
+void tdc_sim_destroy(struct tdc_sim *sim)
+{
+    if (sim->feed)
+        debugfs_remove(sim->feed);
+    tdc_fifo_detach(sim->queue, &sim->cursor);
+    tdc_fifo_destroy(sim->queue);
+    kfree(sim);
+}
+
+/*
+ * Copies len bytes from the queue, starting offset bytes after the cursor.
+ * Must be called between tdc_fifo_read_begin and tdc_fifo_read_end.
+ */
+static void tdc_sim_copy(struct tdc_sim *sim, unsigned int offset,
+    unsigned char *to, unsigned int len)
+{
+    unsigned char *from;
+    unsigned int n;
+
+    while (len > 0) {
+        n = len;
+        from = tdc_fifo_read_ptr(sim->queue, &sim->cursor, offset, &n);
+        memcpy(to, from, n);
+        to += n;
+        offset += n;
+        len -= n;
+    }
+}
+
+/*
+ * Takes the next event from the queue, if a whole event is there.
+ * Returns 1 if an event was taken, else 0.
+ */
+static int tdc_sim_next_event(struct tdc_sim *sim)
+{
+    unsigned char hit[3], num;
+    unsigned int avail, i;
+
+    avail = tdc_fifo_read_begin(sim->queue, &sim->cursor,
+        1 + 3 * ARRAY_SIZE(sim->channel), 0);
+    if (avail < 1)
+        goto none;
+    tdc_sim_copy(sim, 0, &num, 1);
+    if (num > ARRAY_SIZE(sim->channel) || avail < 1 + 3 * num)
+        goto none;  /* not all of it is queued yet */
+
+    for (i = 0; i < num; ++i) {
+        tdc_sim_copy(sim, 1 + 3 * i, hit, 3);
+        sim->channel[i] = hit[0] & 7;
+        sim->delay[i] = hit[1] | (hit[2] << 8);
+    }
+    sim->num_hits = num;
+    sim->hit = 0;
+    sim->num_events++;
+    tdc_fifo_read_end(sim->queue, &sim->cursor, 1 + 3 * num);
+    wake_up_interruptible(&sim->feedq);
+    return 1;
+
+none:
+    tdc_fifo_read_end(sim->queue, &sim->cursor, 0);
+    return 0;
+}
+
+void tdc_sim_outb(struct tdc_sim *sim, enum port _port, unsigned int val)
+{
+    unsigned char old = sim->pia2pb;
+
+    if (_port != PIA2PB)
+        return;     // the configuration ports are not modelled
+    sim->pia2pb = val;
+
+    if ((old & RESET) && !(val & RESET)) {
+        sim->armed = 1;
+        sim->triggered = 0;
+        sim->num_hits = sim->hit = 0;
+    }
+    if (!(old & RCLK) && (val & RCLK) && !(val & P_IN) &&
+        sim->hit < sim->num_hits)
+        sim->hit++;
+}
+
+unsigned int tdc_sim_inb(struct tdc_sim *sim, enum port _port)
+{
+    /* The hit clocked out last, if any. */
+    unsigned int i = sim->hit ? sim->hit - 1 : 0;
+    unsigned int val = 0;
+
+    switch (_port) {
+    case PIA1PA:
+        return sim->hit ? sim->delay[i] >> 8 : 0;
+    case PIA2PA:
+        return sim->hit ? sim->delay[i] & 0xff : 0;
+    case PIA1PB:
+        if (sim->armed && tdc_sim_next_event(sim)) {
+            sim->armed = 0;
+            sim->triggered = 1;
+        }
+        if (sim->triggered)
+            val |= COM_DISABLED;
+        if (sim->hit < sim->num_hits)
+            val |= P_OUT;
+        if (sim->hit)
+            val |= sim->channel[i] << 2;
+        return val;
+    default:
+        return 0;
+    }
+}
+
+/*
+ * Writing to the feed file queues events for replay. A write waits for
+ * room in the queue, unless the file was opened with O_NONBLOCK.
+ */
+static ssize_t tdc_sim_feed_write(struct file *filp, const char __user *buf,
+    size_t count, loff_t *f_pos)
+{
+    struct tdc_sim *sim = filp->private_data;
+    unsigned char *data;
+    size_t done = 0, n;
+    int retval = 0;
+
+    data = kmalloc(PAGE_SIZE, GFP_KERNEL);
+    if (!data)
+        return -ENOMEM;
+
+    while (done < count) {
+        n = min(count - done, (size_t)PAGE_SIZE);
+        if (copy_from_user(data, buf + done, n)) {
+            retval = -EFAULT;
+            break;
+        }
+        while (tdc_fifo_put(sim->queue, data, n)) {
+            if (filp->f_flags & O_NONBLOCK) {
+                retval = -EAGAIN;
+                goto out;
+            }
+            if (wait_event_interruptible(sim->feedq,
+                    tdc_fifo_spacefree(sim->queue) >= n)) {
+                retval = -ERESTARTSYS;
+                goto out;
+            }
+        }
+        done += n;
+    }
+out:
+    kfree(data);
+    return done ? done : retval;
+}
+
+static int tdc_sim_feed_open(struct inode *inode, struct file *filp)
+{
+    filp->private_data = inode->i_private;
+    return 0;
+}
+
+static struct file_operations tdc_sim_feed_fops = {
+    .owner = THIS_MODULE,
+    .open = tdc_sim_feed_open,
+    .write = tdc_sim_feed_write,
+};
+
+/*
+ * Creates the feed file, <name>_sim in the debugfs directory dir.
+ * Returns 0 on success, -1 on error.
+ */
+int tdc_sim_create_feed(struct tdc_sim *sim, const char *name,
+    struct dentry *dir)
+{
+    char file_name[16];
+
+    snprintf(file_name, sizeof(file_name), "%s_sim", name);
+    sim->feed = debugfs_create_file(file_name, S_IWUSR, dir, sim,
+        &tdc_sim_feed_fops);
+    return sim->feed ? 0 : -1;
+}
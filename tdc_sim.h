@@ -0,0 +1,59 @@
+#ifndef _TDC_SIM_H_
+#define _TDC_SIM_H_
+
+#include <linux/init.h>
+#include <linux/module.h>
+#include <linux/wait.h>
+#include <linux/fs.h>
+#include <linux/debugfs.h>
+
+#include "tdc_fifo.h"
+#include "tdc_common.h"
+
+/*
+ * The size of the queue of events waiting to be replayed, in bytes.
+ */
+#define TDC_SIM_QUEUE_SIZE 0x40000 // 256 kB
+
+/**
+ * struct tdc_sim - a software model of a TDC card, used instead of the
+ *                  card's ports when the module is loaded with tdc_sim=1
+ * @queue:      Events waiting to be replayed, in the format read from
+ *              /dev/tdc (of a single card).
+ * @cursor:     Where the next event starts in queue.
+ * @feedq:      Writers to the feed file wait here for room in queue.
+ * @pia2pb:     The last value written to PIA2PB.
+ * @armed:      Set when the TDC chip is reset, waiting for a COM signal.
+ * @triggered:  Set when a COM signal was "detected", i.e. an event was
+ *              taken from queue. Cleared by the next reset.
+ * @num_hits:   Number of hits of the event being read out.
+ * @hit:        Number of hits clocked out so far.
+ * @channel:    Channel of each hit.
+ * @delay:      Delay of each hit.
+ * @num_events: Number of events replayed.
+ * @feed:       The debugfs file events are written to.
+ */
+struct tdc_sim {
+    struct tdc_fifo *queue;
+    struct tdc_fifo_cursor cursor;
+    wait_queue_head_t feedq;
+    unsigned char pia2pb;
+    int armed;
+    int triggered;
+    unsigned int num_hits;
+    unsigned int hit;
+    unsigned char channel[TDC_MAX_NUM_CHANNELS * TDC_MAX_NUM_HITS_PER_CHANNEL];
+    unsigned short delay[TDC_MAX_NUM_CHANNELS * TDC_MAX_NUM_HITS_PER_CHANNEL];
+    unsigned long num_events;
+    struct dentry *feed;
+};
+
+struct tdc_sim *tdc_sim_new(void);
+void tdc_sim_destroy(struct tdc_sim *sim);
+int tdc_sim_create_feed(struct tdc_sim *sim, const char *name,
+    struct dentry *dir);
+
+void tdc_sim_outb(struct tdc_sim *sim, enum port _port, unsigned int val);
+unsigned int tdc_sim_inb(struct tdc_sim *sim, enum port _port);
+
+#endif /* _TDC_SIM_H_ */
@@ -0,0 +1,287 @@
+#include <linux/kernel.h>
+#include <linux/slab.h>
+#include <linux/fs.h>
+#include <asm/uaccess.h>    /* copy_*_user */
+#include <asm/div64.h>
+
+#include "tdc_stats.h"
+
+/*
+ * The files in debugfs show a snapshot of the histograms, taken when the
+ * file is opened. The snapshot is taken without a lock, so it may be
+ * off by the few times counted while it is taken.
+ */
+
+static const char *tdc_hist_names[TDC_NUM_HISTS] = {
+    "timer_late",
+    "callback",
+    "com_readout",
+    "commit_read"
+};
+
+void tdc_stats_reset(struct tdc_stats *stats)
+{
+    memset(stats, 0, sizeof(*stats));
+    stats->magic = TDC_STATS_MAGIC;
+    stats->version = TDC_STATS_VERSION;
+    stats->num_hists = TDC_NUM_HISTS;
+    stats->num_buckets = TDC_HIST_BUCKETS;
+}
+
+/* The upper end of bucket i, in ns. */
+static inline u64 tdc_hist_bucket_end(int i)
+{
+    return (2ULL << i) - 1;
+}
+
+/*
+ * Returns the upper end of the bucket holding the per_mille'th time,
+ * but at most the longest time.
+ */
+static u64 tdc_hist_percentile(const struct tdc_hist *hist, u64 total,
+    unsigned int per_mille)
+{
+    u64 sum = 0, wanted;
+    int i;
+
+    if (!total)
+        return 0;
+    // The rank of the time wanted, rounded up.
+    wanted = total * per_mille + 999;
+    do_div(wanted, 1000);
+    for (i = 0; i < TDC_HIST_BUCKETS; ++i) {
+        sum += hist->buckets[i];
+        if (sum >= wanted)
+            break;
+    }
+    if (i == TDC_HIST_BUCKETS - 1 || tdc_hist_bucket_end(i) > hist->max_ns)
+        return hist->max_ns;
+    return tdc_hist_bucket_end(i);
+}
+
+static void tdc_stats_snapshot(const struct tdc_stats *stats,
+    struct tdc_stats *snap)
+{
+    struct tdc_hist *hist;
+    u64 total;
+    int h, i;
+
+    memcpy(snap, stats, sizeof(*snap));
+    for (h = 0; h < TDC_NUM_HISTS; ++h) {
+        hist = &snap->hist[h];
+        total = 0;
+        for (i = 0; i < TDC_HIST_BUCKETS; ++i)
+            total += hist->buckets[i];
+        hist->p50_ns = tdc_hist_percentile(hist, total, 500);
+        hist->p90_ns = tdc_hist_percentile(hist, total, 900);
+        hist->p99_ns = tdc_hist_percentile(hist, total, 990);
+        hist->p999_ns = tdc_hist_percentile(hist, total, 999);
+    }
+}
+
+/* Formats a snapshot as text. Returns the length. */
+static int tdc_stats_format(const struct tdc_stats *snap, char *buf,
+    size_t size)
+{
+    const struct tdc_hist *hist;
+    int len = 0, h, i, first, last;
+
+    len += scnprintf(buf + len, size - len, "%-12s %12s %10s %10s %10s "
+        "%10s %10s %10s\n", "(ns)", "count", "mean", "p50", "p90", "p99",
+        "p99.9", "max");
+    for (h = 0; h < TDC_NUM_HISTS; ++h) {
+        u64 mean;
+
+        hist = &snap->hist[h];
+        mean = hist->sum_ns;
+        if (hist->count)
+            do_div(mean, hist->count);
+        len += scnprintf(buf + len, size - len, "%-12s %12llu %10llu "
+            "%10llu %10llu %10llu %10llu %10llu\n", tdc_hist_names[h],
+            (unsigned long long)hist->count, (unsigned long long)mean,
+            (unsigned long long)hist->p50_ns,
+            (unsigned long long)hist->p90_ns,
+            (unsigned long long)hist->p99_ns,
+            (unsigned long long)hist->p999_ns,
+            (unsigned long long)hist->max_ns);
+    }
+
+    // The buckets, leaving out the empty rows at both ends.
+    first = TDC_HIST_BUCKETS;
+    last = -1;
+    for (h = 0; h < TDC_NUM_HISTS; ++h) {
+        for (i = 0; i < TDC_HIST_BUCKETS; ++i) {
+            if (!snap->hist[h].buckets[i])
+                continue;
+            first = min(first, i);
+            last = max(last, i);
+        }
+    }
+    len += scnprintf(buf + len, size - len, "\n%-12s", "< ns");
+    for (h = 0; h < TDC_NUM_HISTS; ++h)
+        len += scnprintf(buf + len, size - len, " %12s", tdc_hist_names[h]);
+    len += scnprintf(buf + len, size - len, "\n");
+    for (i = first; i <= last; ++i) {
+        if (i == TDC_HIST_BUCKETS - 1)
+            len += scnprintf(buf + len, size - len, "%-12s", "more");
+        else
+            len += scnprintf(buf + len, size - len, "%-12llu",
+                (unsigned long long)tdc_hist_bucket_end(i) + 1);
+        for (h = 0; h < TDC_NUM_HISTS; ++h)
+            len += scnprintf(buf + len, size - len, " %12llu",
+                (unsigned long long)snap->hist[h].buckets[i]);
+        len += scnprintf(buf + len, size - len, "\n");
+    }
+    return len;
+}
+
+/**
+ * struct tdc_snapshot_file - an open snapshot file
+ * @data:   What the file shows, the i_private of its inode.
+ * @len:    Length of text.
+ * @text:   What is read, written by the show function at open.
+ */
+struct tdc_snapshot_file {
+    void *data;
+    size_t len;
+    char text[0];
+};
+
+/*
+ * Opens a debugfs file showing a snapshot of inode->i_private, taken now
+ * by show into a buffer of size bytes. Its read is tdc_snapshot_read and
+ * its release tdc_snapshot_release; tdc_snapshot_data gives its write the
+ * data it shows.
+ */
+int tdc_snapshot_open(struct inode *inode, struct file *filp,
+    tdc_show_t show, size_t size)
+{
+    struct tdc_snapshot_file *file;
+    int len;
+
+    file = kmalloc(sizeof(*file) + size, GFP_KERNEL);
+    if (!file)
+        return -ENOMEM;
+    file->data = inode->i_private;
+    len = show(file->data, file->text, size);
+    if (len < 0) {
+        kfree(file);
+        return len;
+    }
+    file->len = len;
+    filp->private_data = file;
+    return 0;
+}
+
+ssize_t tdc_snapshot_read(struct file *filp, char __user *buf,
+    size_t count, loff_t *f_pos)
+{
+    struct tdc_snapshot_file *file = filp->private_data;
+
+    return simple_read_from_buffer(buf, count, f_pos, file->text, file->len);
+}
+
+int tdc_snapshot_release(struct inode *inode, struct file *filp)
+{
+    kfree(filp->private_data);
+    return 0;
+}
+
+void *tdc_snapshot_data(struct file *filp)
+{
+    struct tdc_snapshot_file *file = filp->private_data;
+
+    return file->data;
+}
+
+#define TDC_STATS_TEXT_SIZE 4096
+
+static int tdc_stats_show_text(void *data, char *buf, size_t size)
+{
+    struct tdc_stats *snap;
+    int len;
+
+    snap = kmalloc(sizeof(*snap), GFP_KERNEL);
+    if (!snap)
+        return -ENOMEM;
+    tdc_stats_snapshot(data, snap);
+    len = tdc_stats_format(snap, buf, size);
+    kfree(snap);
+    return len;
+}
+
+static int tdc_stats_show_bin(void *data, char *buf, size_t size)
+{
+    tdc_stats_snapshot(data, (struct tdc_stats *)buf);
+    return sizeof(struct tdc_stats);
+}
+
+static int tdc_stats_open_text(struct inode *inode, struct file *filp)
+{
+    return tdc_snapshot_open(inode, filp, tdc_stats_show_text,
+        TDC_STATS_TEXT_SIZE);
+}
+
+static int tdc_stats_open_bin(struct inode *inode, struct file *filp)
+{
+    return tdc_snapshot_open(inode, filp, tdc_stats_show_bin,
+        sizeof(struct tdc_stats));
+}
+
+/* Writing anything clears the histograms. */
+static ssize_t tdc_stats_write(struct file *filp, const char __user *buf,
+    size_t count, loff_t *f_pos)
+{
+    tdc_stats_reset(tdc_snapshot_data(filp));
+    return count;
+}
+
+static struct file_operations tdc_stats_text_fops = {
+    .owner = THIS_MODULE,
+    .open = tdc_stats_open_text,
+    .read = tdc_snapshot_read,
+    .write = tdc_stats_write,
+    .release = tdc_snapshot_release,
+};
+
+static struct file_operations tdc_stats_bin_fops = {
+    .owner = THIS_MODULE,
+    .open = tdc_stats_open_bin,
+    .read = tdc_snapshot_read,
+    .write = tdc_stats_write,
+    .release = tdc_snapshot_release,
+};
+
+/*
+ * Creates <name>_latency and <name>_latency.bin in the debugfs directory
+ * dir, and stores them in files[0] and files[1].
+ * Returns 0 on success, -1 on error.
+ */
+int tdc_stats_create_files(struct tdc_stats *stats, const char *name,
+    struct dentry *dir, struct dentry **files)
+{
+    char file_name[32];
+
+    snprintf(file_name, sizeof(file_name), "%s_latency", name);
+    files[0] = debugfs_create_file(file_name, S_IRUGO | S_IWUSR, dir, stats,
+        &tdc_stats_text_fops);
+    snprintf(file_name, sizeof(file_name), "%s_latency.bin", name);
+    files[1] = debugfs_create_file(file_name, S_IRUGO | S_IWUSR, dir, stats,
+        &tdc_stats_bin_fops);
+    if (!files[0] || !files[1]) {
+        tdc_stats_remove_files(files);
+        return -1;
+    }
+    return 0;
+}
+
+void tdc_stats_remove_files(struct dentry **files)
+{
+    int i;
+
+    for (i = 0; i < 2; ++i) {
+        if (files[i])
+            debugfs_remove(files[i]);
+        files[i] = NULL;
+    }
+}
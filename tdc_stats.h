@@ -0,0 +1,122 @@
+#ifndef _TDC_STATS_H_
+#define _TDC_STATS_H_
+
+/*
+ * Latency histograms of the acquisition, always collected. They can be
+ * read from debugfs, as text from tdcmod/<name>_latency, and as a struct
+ * tdc_stats from tdcmod/<name>_latency.bin. Writing to either file
+ * clears them, and so does starting a new measurement.
+ *
+ * The layout of struct tdc_stats is shared with userspace, so this file
+ * only has plain definitions outside __KERNEL__.
+ */
+
+#include <linux/types.h>
+
+#define TDC_STATS_MAGIC     0x53434454  /* "TDCS" */
+#define TDC_STATS_VERSION   1
+
+/*
+ * Bucket i counts the times from 2^i to 2^(i+1) - 1 ns. The first bucket
+ * also counts 0, and the last everything longer (over 2 s).
+ */
+#define TDC_HIST_BUCKETS    32
+
+enum tdc_hist_id {
+    TDC_HIST_TIMER_LATE = 0,    /* how late the timer callback ran */
+    TDC_HIST_CALLBACK,          /* how long the timer callback ran */
+    TDC_HIST_COM_READOUT,       /* from a COM signal being detected until
+                                   its event is read out and the card is
+                                   re-armed */
+    TDC_HIST_COMMIT_READ,       /* from data being put in the FIFO until a
+                                   reader reads it */
+    TDC_NUM_HISTS
+};
+
+/**
+ * struct tdc_hist - a histogram of times in ns, with log2 buckets
+ * @count:      Number of times counted.
+ * @sum_ns:     Their sum.
+ * @max_ns:     The longest.
+ * @p50_ns, @p90_ns, @p99_ns, @p999_ns: Percentiles, as the upper end of
+ *              the bucket they fall in. Only filled in when read.
+ * @buckets:    See TDC_HIST_BUCKETS.
+ */
+struct tdc_hist {
+    __u64 count;
+    __u64 sum_ns;
+    __u64 max_ns;
+    __u64 p50_ns, p90_ns, p99_ns, p999_ns;
+    __u64 buckets[TDC_HIST_BUCKETS];
+};
+
+/**
+ * struct tdc_stats - the histograms of a device
+ * @magic:      TDC_STATS_MAGIC
+ * @version:    TDC_STATS_VERSION
+ * @num_hists:  TDC_NUM_HISTS
+ * @num_buckets: TDC_HIST_BUCKETS
+ * @hist:       Indexed by enum tdc_hist_id.
+ */
+struct tdc_stats {
+    __u32 magic;
+    __u32 version;
+    __u32 num_hists;
+    __u32 num_buckets;
+    struct tdc_hist hist[TDC_NUM_HISTS];
+};
+
+#ifdef __KERNEL__
+
+#include <linux/ktime.h>
+#include <linux/bitops.h>
+#include <linux/debugfs.h>
+
+/*
+ * Counts a time in a histogram. Called in the acquisition, so it is kept
+ * cheap; the percentiles are only worked out when the stats are read.
+ */
+static inline void tdc_hist_add(struct tdc_hist *hist, ktime_t time)
+{
+    s64 ns = ktime_to_ns(time);
+    int i;
+
+    if (ns < 0)
+        ns = 0;
+    i = fls64(ns) - 1;
+    if (i < 0)
+        i = 0;
+    else if (i >= TDC_HIST_BUCKETS)
+        i = TDC_HIST_BUCKETS - 1;
+    hist->buckets[i]++;
+    hist->count++;
+    hist->sum_ns += ns;
+    if (ns > hist->max_ns)
+        hist->max_ns = ns;
+}
+
+/*
+ * Writes what a debugfs file shows of data to buf, at most size bytes.
+ * Returns the length, or a negative error.
+ */
+typedef int (*tdc_show_t)(void *data, char *buf, size_t size);
+
+/*
+ * debugfs files showing a snapshot taken when they are opened, such as
+ * the stats, the rates and the io of a device; see tdc_stats.c.
+ */
+int tdc_snapshot_open(struct inode *inode, struct file *filp,
+    tdc_show_t show, size_t size);
+ssize_t tdc_snapshot_read(struct file *filp, char __user *buf,
+    size_t count, loff_t *f_pos);
+int tdc_snapshot_release(struct inode *inode, struct file *filp);
+void *tdc_snapshot_data(struct file *filp);
+
+void tdc_stats_reset(struct tdc_stats *stats);
+int tdc_stats_create_files(struct tdc_stats *stats, const char *name,
+    struct dentry *dir, struct dentry **files);
+void tdc_stats_remove_files(struct dentry **files);
+
+#endif /* __KERNEL__ */
+
+#endif /* _TDC_STATS_H_ */
@@ -0,0 +1,69 @@
+#ifndef _TDC_TRACE_H_
+#define _TDC_TRACE_H_
+
+/*
+ * Trace points of the acquisition, as kernel markers. A disabled marker
+ * costs one predicted branch, and its arguments are not evaluated, so
+ * they stay in production builds. Without CONFIG_MARKERS they compile to
+ * nothing.
+ *
+ * The markers are enabled by attaching a probe to them, e.g. with
+ * SystemTap:
+ *   stap -e 'probe module("tdcmod").mark("tdc_fifo_commit") {
+ *       println($arg3) }'
+ * Each marker's format string names its arguments.
+ */
+
+#include <linux/marker.h>
+#include <linux/ktime.h>
+
+/* The timer callback ran late_ns after it was due. */
+#define tdc_trace_timer_fire(dev, late) \
+    trace_mark(tdc_timer_fire, "card %u late_ns %lld", \
+        (dev)->index, (long long)ktime_to_ns(late))
+
+/* A COM signal was detected, num_com_signals is its number + 1. */
+#define tdc_trace_com(dev) \
+    trace_mark(tdc_com, "card %u com %lu", \
+        (dev)->index, (dev)->measurement.num_com_signals)
+
+/*
+ * The hits of an event were read out of the card, which took from start
+ * (see tdc_trace_clock) until now.
+ */
+#define tdc_trace_decoded(dev, start) \
+    trace_mark(tdc_decoded, "card %u hits %u decode_ns %lld", \
+        (dev)->index, (unsigned int)(dev)->measurement.cache.num_hits_sum, \
+        (long long)ktime_to_ns(ktime_sub(ktime_get(), start)))
+
+/* len bytes were put in the FIFO. */
+#define tdc_trace_fifo_commit(dev, len) \
+    trace_mark(tdc_fifo_commit, "card %u bytes %u fill %u", \
+        (dev)->index, (unsigned int)(len), tdc_fifo_len((dev)->fifo))
+
+/* An event was dropped, or a COM signal skipped, as the FIFO was full. */
+#define tdc_trace_overflow(dev, seq) \
+    trace_mark(tdc_overflow, "card %u seq %u policy %d", \
+        (dev)->index, (unsigned int)(seq), (int)(dev)->overflow_policy)
+
+/* The readers of dev were woken, by the flush timer if timer is set. */
+#define tdc_trace_wakeup(dev, timer) \
+    trace_mark(tdc_wakeup, "dev %s fill %u timer %d", \
+        (dev)->name, tdc_fifo_len((dev)->fifo), (int)(timer))
+
+/* A read or splice of len bytes from dev returned. */
+#define tdc_trace_read(dev, len) \
+    trace_mark(tdc_read, "dev %s bytes %zu pid %d", \
+        (dev)->name, (size_t)(len), current->pid)
+
+/*
+ * The start time for tdc_trace_decoded. The clock is only read when the
+ * markers are compiled in.
+ */
+#ifdef CONFIG_MARKERS
+#define tdc_trace_clock() ktime_get()
+#else
+#define tdc_trace_clock() ktime_set(0, 0)
+#endif
+
+#endif /* _TDC_TRACE_H_ */
@@ -0,0 +1,211 @@
+/*
+ * Times the read-out of COM signals from the simulated card into the
+ * stream, for each COM mode, with and without the range check, and with
+ * the sequence numbers and times in the stream. Run with "make bench"
+ * here.
+ *
+ * Only the driver's own work is timed, with the same events in each
+ * setting: the simulated card stands in for the ports, and ktime_get and
+ * get_cycles are the counter of kernel.h, so what reading the TSC costs is
+ * not in the figures. On a card the ISA port cycles take far longer,
+ * so the figures only compare versions of the read-out on one machine.
+ *
+ * Each setting is run several times; the fastest and the median run are
+ * reported, in ns per COM signal.
+ */
+#include <getopt.h>
+#include <time.h>
+
+#include "kernel.h"
+#include "TDC_Device.h"
+
+/* Distinct events, replayed over and over. */
+#define BENCH_NUM_EVENTS 4096
+#define BENCH_EVENT_SIZE \
+    (1 + 3 * TDC_MAX_NUM_CHANNELS * TDC_MAX_NUM_HITS_PER_CHANNEL)
+#define BENCH_MAX_RUNS 99
+
+/* Big enough for what a full queue of the simulated card is read out to. */
+#define BENCH_FIFO_SIZE (16 * TDC_SIM_QUEUE_SIZE)
+
+static struct {
+    unsigned long coms;
+    unsigned int runs;
+} opt = {
+    .coms = 1000000,
+    .runs = 5,
+};
+
+/**
+ * struct setting - what a run reads out with
+ * @name:       As printed.
+ * @com_mode:   COMMON_START or COMMON_STOP.
+ * @t_min, @t_max: The range of the delays; the range check is left out if
+ *              it is all of them.
+ * @fmt:        The stream format.
+ */
+struct setting {
+    const char *name;
+    enum com_mode com_mode;
+    unsigned short t_min, t_max;
+    unsigned int fmt;
+};
+
+static const struct setting settings[] = {
+    { "common start", COMMON_START, 0, TDC_MAX_DELAY, 0 },
+    { "common stop", COMMON_STOP, 0, TDC_MAX_DELAY, 0 },
+    { "range check", COMMON_START, 0x1000, 0x8000, 0 },
+    { "seq", COMMON_START, 0, TDC_MAX_DELAY, TDC_FMT_SEQ },
+    { "seq+time", COMMON_START, 0, TDC_MAX_DELAY, TDC_FMT_SEQ | TDC_FMT_TIME },
+};
+
+static unsigned char events[BENCH_NUM_EVENTS][BENCH_EVENT_SIZE];
+static unsigned int event_len[BENCH_NUM_EVENTS];
+static unsigned char drain_buf[BENCH_FIFO_SIZE];
+
+static unsigned int rnd_state;
+
+/* A fixed sequence of pseudo-random numbers below n, so runs are alike. */
+static unsigned int rnd(unsigned int n)
+{
+    rnd_state = rnd_state * 1103515245 + 12345;
+    return (rnd_state >> 16) % n;
+}
+
+/*
+ * Makes the events, as tdc_test.c does: a fifth of them without hits, the
+ * others with up to 3 hits on about a third of the channels.
+ */
+static void events_make(void)
+{
+    unsigned int i, ch, k, nh, delay;
+    unsigned char *p;
+
+    for (i = 0; i < BENCH_NUM_EVENTS; ++i) {
+        p = events[i] + 1;
+        for (ch = 0; ch < TDC_MAX_NUM_CHANNELS && i % 5; ++ch) {
+            nh = rnd(3) ? 0 : 1 + rnd(3);
+            for (k = 0; k < nh; ++k) {
+                delay = rnd(0x10000);
+                *p++ = ch;
+                *p++ = delay & 0xff;
+                *p++ = delay >> 8;
+            }
+        }
+        event_len[i] = p - events[i];
+        events[i][0] = (event_len[i] - 1) / 3;
+    }
+}
+
+static double now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/* Throws away what the reader may read. */
+static void drain(struct tdc_fifo *fifo, struct tdc_fifo_cursor *cursor)
+{
+    unsigned int n, off, len;
+    unsigned char *p;
+
+    n = tdc_fifo_read_begin(fifo, cursor, sizeof(drain_buf), 0);
+    for (off = 0; off < n; off += len) {
+        len = n - off;
+        p = tdc_fifo_read_ptr(fifo, cursor, off, &len);
+        memcpy(drain_buf + off, p, len);
+    }
+    tdc_fifo_read_end(fifo, cursor, n);
+}
+
+/*
+ * Reads out opt.coms COM signals with setting s. The queue of the
+ * simulated card is filled, and the stream drained, between the timed
+ * stretches. Returns the ns per COM signal.
+ */
+static double run(const struct setting *s)
+{
+    struct tdc_fifo_cursor cursor;
+    struct tdc_device *tdc;
+    struct tdc_sim *sim;
+    unsigned long done = 0;
+    unsigned int next = 0;
+    double ns = 0, start;
+
+    tdc = tdc_new(0x320, 1);
+    sim = tdc->sim;
+    tdc_fifo_destroy(tdc->fifo);
+    tdc->fifo = tdc_fifo_new(BENCH_FIFO_SIZE);
+    tdc->stream_format = s->fmt;
+    tdc_set_com_mode(tdc, s->com_mode);
+    tdc->t_min = s->t_min;
+    tdc->t_max = s->t_max;
+    tdc_fifo_attach(tdc->fifo, &cursor, 0);
+    tdc_start_measurement(tdc);
+    while (done < opt.coms) {
+        while (!tdc_fifo_put(sim->queue, events[next], event_len[next]))
+            next = (next + 1) % BENCH_NUM_EVENTS;
+        start = now_ns();
+        while (tdc_fifo_len(sim->queue) && done < opt.coms) {
+            tdc_timer_callback(&tdc->timer.hrtimer);
+            done++;
+        }
+        ns += now_ns() - start;
+        drain(tdc->fifo, &cursor);
+    }
+    tdc_stop_measurement(tdc);
+    tdc_fifo_detach(tdc->fifo, &cursor);
+    tdc_destroy(tdc);
+    return ns / done;
+}
+
+static int compare(const void *a, const void *b)
+{
+    double x = *(const double *)a, y = *(const double *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr,
+        "Usage: %s [-n COMS] [-r RUNS]\n"
+        "Times the read-out of the simulated card, in ns per COM signal.\n"
+        "  -n COMS   COM signals per run, default %lu\n"
+        "  -r RUNS   runs of each setting, default %u\n",
+        prog, opt.coms, opt.runs);
+}
+
+int main(int argc, char **argv)
+{
+    double ns[BENCH_MAX_RUNS];
+    unsigned int i, r;
+    int c;
+
+    while ((c = getopt(argc, argv, "n:r:h")) != -1) {
+        switch (c) {
+        case 'n': opt.coms = strtoul(optarg, NULL, 0); break;
+        case 'r': opt.runs = strtoul(optarg, NULL, 0); break;
+        default: usage(argv[0]); return c == 'h' ? 0 : 2;
+        }
+    }
+    if (optind != argc || !opt.coms || !opt.runs ||
+        opt.runs > BENCH_MAX_RUNS) {
+        usage(argv[0]);
+        return 2;
+    }
+
+    events_make();
+    printf("%-14s %10s %10s   (ns per COM, %u runs of %lu)\n",
+        "", "fastest", "median", opt.runs, opt.coms);
+    for (i = 0; i < ARRAY_SIZE(settings); ++i) {
+        for (r = 0; r < opt.runs; ++r)
+            ns[r] = run(&settings[i]);
+        qsort(ns, opt.runs, sizeof(ns[0]), compare);
+        printf("%-14s %10.1f %10.1f\n", settings[i].name, ns[0],
+            ns[opt.runs / 2]);
+    }
+    return 0;
+}
@@ -0,0 +1,358 @@
+/*
+ * The kernel functions the driver core uses, for running it in userspace,
+ * see kernel.h.
+ */
+#include <stdarg.h>
+
+#include "kernel.h"
+
+/* Advanced by each read of the time, see kernel.h. */
+static s64 now_ns;
+
+static struct task_struct init_task;
+struct task_struct *current = &init_task;
+unsigned int cpu_khz = 1000000;
+
+int scnprintf(char *buf, size_t size, const char *fmt, ...)
+{
+    va_list ap;
+    int n;
+
+    va_start(ap, fmt);
+    n = vsnprintf(buf, size, fmt, ap);
+    va_end(ap);
+    if (n >= (int)size)
+        n = size ? size - 1 : 0;
+    return n;
+}
+
+unsigned long simple_strtoul(const char *s, char **end, unsigned int base)
+{
+    return strtoul(s, end, base);
+}
+
+void *kmalloc(size_t size, gfp_t flags)
+{
+    return malloc(size);
+}
+
+void *kzalloc(size_t size, gfp_t flags)
+{
+    return calloc(1, size);
+}
+
+void kfree(const void *p)
+{
+    free((void *)p);
+}
+
+void *vmalloc(unsigned long size)
+{
+    return malloc(size);
+}
+
+void vfree(const void *p)
+{
+    free((void *)p);
+}
+
+unsigned long roundup_pow_of_two(unsigned long n)
+{
+    unsigned long r = 1;
+
+    while (r < n)
+        r <<= 1;
+    return r;
+}
+
+int is_power_of_2(unsigned long n)
+{
+    return n && !(n & (n - 1));
+}
+
+int fls64(u64 x)
+{
+    return x ? 64 - __builtin_clzll(x) : 0;
+}
+
+unsigned long __ffs(unsigned long x)
+{
+    return __builtin_ctzl(x);
+}
+
+void INIT_LIST_HEAD(struct list_head *head)
+{
+    head->next = head->prev = head;
+}
+
+void list_add(struct list_head *entry, struct list_head *head)
+{
+    entry->next = head->next;
+    entry->prev = head;
+    head->next->prev = entry;
+    head->next = entry;
+}
+
+void list_add_tail(struct list_head *entry, struct list_head *head)
+{
+    list_add(entry, head->prev);
+}
+
+void list_del(struct list_head *entry)
+{
+    entry->prev->next = entry->next;
+    entry->next->prev = entry->prev;
+}
+
+int list_empty(const struct list_head *head)
+{
+    return head->next == head;
+}
+
+ktime_t ktime_get(void)
+{
+    ktime_t k;
+
+    now_ns += 1000;
+    k.tv64 = now_ns;
+    return k;
+}
+
+ktime_t ktime_get_real(void)
+{
+    ktime_t k = ktime_get();
+
+    k.tv64 += 1000000000000000000LL;
+    return k;
+}
+
+ktime_t ktime_set(long secs, unsigned long nsecs)
+{
+    ktime_t k;
+
+    k.tv64 = secs * NSEC_PER_SEC + nsecs;
+    return k;
+}
+
+ktime_t ktime_add(ktime_t a, ktime_t b)
+{
+    a.tv64 += b.tv64;
+    return a;
+}
+
+ktime_t ktime_sub(ktime_t a, ktime_t b)
+{
+    a.tv64 -= b.tv64;
+    return a;
+}
+
+ktime_t ktime_add_ns(ktime_t k, u64 ns)
+{
+    k.tv64 += ns;
+    return k;
+}
+
+ktime_t ns_to_ktime(u64 ns)
+{
+    ktime_t k;
+
+    k.tv64 = ns;
+    return k;
+}
+
+s64 ktime_to_ns(ktime_t k)
+{
+    return k.tv64;
+}
+
+/* One cycle per ns, as cpu_khz says. */
+cycles_t get_cycles(void)
+{
+    return ktime_get().tv64;
+}
+
+void udelay(unsigned long usecs)
+{
+}
+
+void ndelay(unsigned long nsecs)
+{
+}
+
+void schedule(void)
+{
+}
+
+unsigned long msecs_to_jiffies(unsigned int ms)
+{
+    return ms;
+}
+
+unsigned long usecs_to_jiffies(unsigned int us)
+{
+    return (us + 999) / 1000;
+}
+
+void hrtimer_init(struct hrtimer *timer, int clock, enum hrtimer_mode mode)
+{
+}
+
+int hrtimer_start(struct hrtimer *timer, ktime_t t, enum hrtimer_mode mode)
+{
+    timer->expires = t;
+    return 0;
+}
+
+int hrtimer_try_to_cancel(struct hrtimer *timer)
+{
+    return 0;
+}
+
+int hrtimer_cancel(struct hrtimer *timer)
+{
+    return 0;
+}
+
+int hrtimer_active(const struct hrtimer *timer)
+{
+    return 0;
+}
+
+unsigned long hrtimer_forward(struct hrtimer *timer, ktime_t now,
+    ktime_t interval)
+{
+    timer->expires = ktime_add(now, interval);
+    return 1;
+}
+
+int hrtimer_get_res(int clock, struct timespec *res)
+{
+    res->tv_sec = 0;
+    res->tv_nsec = 1;
+    return 0;
+}
+
+cpumask_t cpumask_of_cpu(int cpu)
+{
+    return 1UL << cpu;
+}
+
+int set_cpus_allowed(struct task_struct *task, cpumask_t mask)
+{
+    return 0;
+}
+
+int cpu_online(int cpu)
+{
+    return cpu == 0;
+}
+
+int smp_processor_id(void)
+{
+    return 0;
+}
+
+int signal_pending(struct task_struct *task)
+{
+    return 0;
+}
+
+int capable(int cap)
+{
+    return 1;
+}
+
+unsigned char inb(unsigned long port)
+{
+    return 0xff;
+}
+
+unsigned short inw(unsigned long port)
+{
+    return 0xffff;
+}
+
+unsigned int inl(unsigned long port)
+{
+    return 0xffffffff;
+}
+
+void outb(unsigned char value, unsigned long port)
+{
+}
+
+void outb_p(unsigned char value, unsigned long port)
+{
+}
+
+struct resource *request_region(unsigned long start, unsigned long n,
+    const char *name)
+{
+    return (struct resource *)1;
+}
+
+void release_region(unsigned long start, unsigned long n)
+{
+}
+
+loff_t no_llseek(struct file *file, loff_t offset, int whence)
+{
+    return -1;
+}
+
+int nonseekable_open(struct inode *inode, struct file *file)
+{
+    return 0;
+}
+
+unsigned long copy_to_user(void __user *to, const void *from,
+    unsigned long n)
+{
+    memcpy(to, from, n);
+    return 0;
+}
+
+unsigned long copy_from_user(void *to, const void __user *from,
+    unsigned long n)
+{
+    memcpy(to, from, n);
+    return 0;
+}
+
+ssize_t simple_read_from_buffer(void __user *to, size_t count, loff_t *ppos,
+    const void *from, size_t available)
+{
+    size_t pos = *ppos;
+
+    if (pos >= available)
+        return 0;
+    if (count > available - pos)
+        count = available - pos;
+    memcpy(to, (const char *)from + pos, count);
+    *ppos += count;
+    return count;
+}
+
+struct dentry *debugfs_create_file(const char *name, int mode,
+    struct dentry *parent, void *data, const struct file_operations *fops)
+{
+    return NULL;
+}
+
+void debugfs_remove(struct dentry *dentry)
+{
+}
+
+void cdev_init(struct cdev *cdev, const struct file_operations *fops)
+{
+    cdev->ops = fops;
+}
+
+int cdev_add(struct cdev *cdev, dev_t dev, unsigned int count)
+{
+    return 0;
+}
+
+void cdev_del(struct cdev *cdev)
+{
+}
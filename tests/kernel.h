@@ -0,0 +1,287 @@
+#ifndef _TDC_TEST_KERNEL_H_
+#define _TDC_TEST_KERNEL_H_
+
+/*
+ * Just enough of the kernel for the driver core to build and run as a
+ * single-threaded userspace program, see tdc_test.c. Every <linux/...>
+ * and <asm/...> header of the driver is made to include this file.
+ *
+ * Locks do nothing, nothing ever waits, the ports are those of no card
+ * (all bits high), and time is a counter that goes up 1 us each time it
+ * is read, so that the tests always see the same.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>      /* struct timespec, timeval */
+#include <sys/types.h>     /* loff_t, dev_t */
+
+#define __KERNEL__ 1
+
+typedef uint8_t u8;
+typedef uint16_t u16;
+typedef uint32_t u32;
+typedef uint64_t u64;
+typedef int8_t s8;
+typedef int16_t s16;
+typedef int32_t s32;
+typedef int64_t s64;
+typedef uint8_t __u8;
+typedef uint16_t __u16;
+typedef uint32_t __u32;
+typedef uint64_t __u64;
+typedef int64_t __s64;
+typedef unsigned long long cycles_t;
+typedef unsigned int gfp_t;
+
+#define __user
+#define __init
+#define __exit
+#undef __always_inline
+#define __always_inline inline
+#define likely(x) (x)
+#define unlikely(x) (x)
+#define __FUNCTION__ __func__
+
+#define GFP_KERNEL 0
+#define GFP_ATOMIC 1
+#define THIS_MODULE NULL
+#define MODULE_LICENSE(x)
+#define MODULE_AUTHOR(x)
+#define MODULE_DESCRIPTION(x)
+#define MODULE_PARM_DESC(a, b)
+#define module_param(a, b, c)
+#define module_param_array(a, b, c, d)
+#define module_init(x)
+#define module_exit(x)
+#define EXPORT_SYMBOL(x)
+
+#define S_IRUGO 0444
+#define S_IWUSR 0200
+#define S_IRUSR 0400
+#define KERN_ERR ""
+#define KERN_WARNING ""
+#define KERN_ALERT ""
+#define KERN_INFO ""
+#define KERN_NOTICE ""
+#define KERN_DEBUG ""
+
+#define EFAULT 14
+#define ENOMEM 12
+#define EBUSY 16
+#define EINVAL 22
+#define EAGAIN 11
+#define ENOSPC 28
+#define ENOPKG 65
+#define ERESTARTSYS 512
+#define ENODEV 19
+#define EPIPE 32
+#define EIO 5
+#define ENXIO 6
+#define ENOENT 2
+#define EOPNOTSUPP 95
+
+#define O_NONBLOCK 04000
+#define FMODE_READ 1
+#define FMODE_WRITE 2
+#define PAGE_SIZE 4096UL
+#define PAGE_SHIFT 12
+#define HZ 1000
+#define NSEC_PER_SEC 1000000000L
+#define NSEC_PER_USEC 1000L
+#define USEC_PER_SEC 1000000L
+#define POLLIN 1
+#define POLLPRI 2
+#define POLLOUT 4
+#define POLLERR 8
+#define POLLHUP 0x10
+#define POLLRDNORM 0x40
+#define POLLWRNORM 0x100
+#define SPLICE_F_NONBLOCK 2
+#define PIPE_BUFFERS 16
+#define NR_CPUS 32
+#define CAP_SYS_ADMIN 21
+
+#define ARRAY_SIZE(a) (sizeof(a) / sizeof((a)[0]))
+#define container_of(ptr, type, member) \
+    ((type *)((char *)(ptr) - offsetof(type, member)))
+#define min(a, b) ((a) < (b) ? (a) : (b))
+#define max(a, b) ((a) > (b) ? (a) : (b))
+#define min_t(t, a, b) ((t)(a) < (t)(b) ? (t)(a) : (t)(b))
+#define max_t(t, a, b) ((t)(a) > (t)(b) ? (t)(a) : (t)(b))
+#define MKDEV(a, b) (((a) << 20) | (b))
+#define MAJOR(d) ((d) >> 20)
+#define MINOR(d) ((d) & 0xfffff)
+#define BUG_ON(x) ((void)(x))
+#define WARN_ON(x) ((void)(x))
+#define do_div(n, base) \
+    ({ unsigned int __r = (n) % (base); (n) /= (base); __r; })
+#define KERNEL_VERSION(a, b, c) (((a) << 16) + ((b) << 8) + (c))
+#define LINUX_VERSION_CODE KERNEL_VERSION(2, 6, 24)
+
+#define printk printf
+int scnprintf(char *buf, size_t size, const char *fmt, ...)
+    __attribute__((format(printf, 3, 4)));
+unsigned long simple_strtoul(const char *s, char **end, unsigned int base);
+
+void *kmalloc(size_t size, gfp_t flags);
+void *kzalloc(size_t size, gfp_t flags);
+void kfree(const void *p);
+void *vmalloc(unsigned long size);
+void vfree(const void *p);
+
+unsigned long roundup_pow_of_two(unsigned long n);
+int is_power_of_2(unsigned long n);
+int fls64(u64 x);
+unsigned long __ffs(unsigned long x);
+
+/* Lists */
+struct list_head {
+    struct list_head *next, *prev;
+};
+#define LIST_HEAD_INIT(n) { &(n), &(n) }
+void INIT_LIST_HEAD(struct list_head *head);
+void list_add(struct list_head *entry, struct list_head *head);
+void list_add_tail(struct list_head *entry, struct list_head *head);
+void list_del(struct list_head *entry);
+int list_empty(const struct list_head *head);
+#define list_for_each_entry(pos, head, member) \
+    for (pos = container_of((head)->next, typeof(*pos), member); \
+         &pos->member != (head); \
+         pos = container_of(pos->member.next, typeof(*pos), member))
+
+/* Locks, all single-threaded */
+typedef struct { int unused; } spinlock_t;
+#define SPIN_LOCK_UNLOCKED ((spinlock_t){0})
+#define spin_lock_init(l) ((void)(l))
+#define spin_lock_irqsave(l, f) ((void)(l), (f) = 0)
+#define spin_unlock_irqrestore(l, f) ((void)(l), (void)(f))
+#define spin_lock(l) ((void)(l))
+#define spin_unlock(l) ((void)(l))
+struct semaphore { int count; };
+#define init_MUTEX(s) ((void)(s))
+#define down_interruptible(s) ((void)(s), 0)
+#define down_trylock(s) ((void)(s), 0)
+#define down(s) ((void)(s))
+#define up(s) ((void)(s))
+typedef struct { int counter; } atomic_t;
+#define atomic_read(a) ((a)->counter)
+#define atomic_set(a, v) ((a)->counter = (v))
+#define atomic_inc(a) ((a)->counter++)
+#define smp_wmb() __sync_synchronize()
+#define smp_rmb() __sync_synchronize()
+#define smp_mb() __sync_synchronize()
+
+/* Waiting, which never happens */
+typedef struct { int unused; } wait_queue_head_t;
+#define init_waitqueue_head(q) ((void)(q))
+#define wake_up_interruptible(q) ((void)(q))
+#define waitqueue_active(q) ((void)(q), 0)
+#define wait_event_interruptible(q, cond) ({ (void)(cond); 0; })
+#define wait_event_interruptible_timeout(q, cond, t) \
+    ({ (void)(cond); (long)(t); })
+
+/* Time */
+typedef union { s64 tv64; } ktime_t;
+ktime_t ktime_get(void);
+ktime_t ktime_get_real(void);
+ktime_t ktime_set(long secs, unsigned long nsecs);
+ktime_t ktime_add(ktime_t a, ktime_t b);
+ktime_t ktime_sub(ktime_t a, ktime_t b);
+ktime_t ktime_add_ns(ktime_t k, u64 ns);
+ktime_t ns_to_ktime(u64 ns);
+s64 ktime_to_ns(ktime_t k);
+cycles_t get_cycles(void);
+extern unsigned int cpu_khz;
+void udelay(unsigned long usecs);
+void ndelay(unsigned long nsecs);
+void schedule(void);
+unsigned long msecs_to_jiffies(unsigned int ms);
+unsigned long usecs_to_jiffies(unsigned int us);
+
+enum hrtimer_restart { HRTIMER_NORESTART, HRTIMER_RESTART };
+enum hrtimer_mode { HRTIMER_MODE_ABS, HRTIMER_MODE_REL };
+#define CLOCK_REALTIME 0
+#define CLOCK_MONOTONIC 1
+struct hrtimer {
+    ktime_t expires;
+    enum hrtimer_restart (*function)(struct hrtimer *);
+};
+void hrtimer_init(struct hrtimer *timer, int clock, enum hrtimer_mode mode);
+int hrtimer_start(struct hrtimer *timer, ktime_t t, enum hrtimer_mode mode);
+int hrtimer_try_to_cancel(struct hrtimer *timer);
+int hrtimer_cancel(struct hrtimer *timer);
+int hrtimer_active(const struct hrtimer *timer);
+unsigned long hrtimer_forward(struct hrtimer *timer, ktime_t now,
+    ktime_t interval);
+int hrtimer_get_res(int clock, struct timespec *res);
+
+/* Scheduling */
+typedef unsigned long cpumask_t;
+struct task_struct { char comm[16]; int pid; cpumask_t cpus_allowed; };
+extern struct task_struct *current;
+cpumask_t cpumask_of_cpu(int cpu);
+int set_cpus_allowed(struct task_struct *task, cpumask_t mask);
+int cpu_online(int cpu);
+int smp_processor_id(void);
+int signal_pending(struct task_struct *task);
+int capable(int cap);
+
+/* Ports, of no card */
+unsigned char inb(unsigned long port);
+unsigned short inw(unsigned long port);
+unsigned int inl(unsigned long port);
+void outb(unsigned char value, unsigned long port);
+void outb_p(unsigned char value, unsigned long port);
+struct resource;
+struct resource *request_region(unsigned long start, unsigned long n,
+    const char *name);
+void release_region(unsigned long start, unsigned long n);
+
+/* Files, enough for the declarations */
+struct inode;
+struct file;
+struct dentry;
+struct page;
+struct pipe_inode_info;
+struct poll_table_struct;
+typedef struct poll_table_struct poll_table;
+struct iovec { void __user *iov_base; size_t iov_len; };
+struct kiocb { struct file *ki_filp; loff_t ki_pos; };
+struct file { unsigned int f_flags; unsigned int f_mode; void *private_data; };
+struct inode { void *i_private; };
+struct file_operations {
+    void *owner;
+    loff_t (*llseek)(struct file *, loff_t, int);
+    ssize_t (*read)(struct file *, char __user *, size_t, loff_t *);
+    ssize_t (*write)(struct file *, const char __user *, size_t, loff_t *);
+    unsigned int (*poll)(struct file *, struct poll_table_struct *);
+    int (*open)(struct inode *, struct file *);
+    int (*release)(struct inode *, struct file *);
+};
+loff_t no_llseek(struct file *file, loff_t offset, int whence);
+int nonseekable_open(struct inode *inode, struct file *file);
+unsigned long copy_to_user(void __user *to, const void *from,
+    unsigned long n);
+unsigned long copy_from_user(void *to, const void __user *from,
+    unsigned long n);
+ssize_t simple_read_from_buffer(void __user *to, size_t count, loff_t *ppos,
+    const void *from, size_t available);
+struct dentry *debugfs_create_file(const char *name, int mode,
+    struct dentry *parent, void *data, const struct file_operations *fops);
+void debugfs_remove(struct dentry *dentry);
+
+/* Char devices, never registered */
+struct cdev { void *owner; const struct file_operations *ops; };
+void cdev_init(struct cdev *cdev, const struct file_operations *fops);
+int cdev_add(struct cdev *cdev, dev_t dev, unsigned int count);
+void cdev_del(struct cdev *cdev);
+
+/* Markers, compiled out */
+#define trace_mark(name, fmt, args...) \
+    do { if (0) printf(fmt, ## args); } while (0)
+
+#endif /* _TDC_TEST_KERNEL_H_ */
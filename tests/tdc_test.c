@@ -0,0 +1,938 @@
+/*
+ * Tests of the driver core: the FIFO (tdc_fifo.c), and the read-out of
+ * events from the simulated card (tdc_sim.c) into the stream, in each
+ * stream format and with each overflow policy (TDC_Device.c).
+ *
+ * The driver's own sources are built as a userspace program, with
+ * kernel.h standing in for the kernel. Run with "make check" here, or
+ * "make test" at the top. Prints the failed checks, and exits with 1 if
+ * there were any.
+ */
+#include "kernel.h"
+#include "TDC_Device.h"
+
+static unsigned int checks, failures;
+
+#define CHECK(cond) \
+    do { \
+        checks++; \
+        if (!(cond)) { \
+            failures++; \
+            fprintf(stderr, "%s:%d: %s: check failed: %s\n", \
+                __FILE__, __LINE__, __func__, #cond); \
+        } \
+    } while (0)
+
+/* A small FIFO, so that it wraps around quickly. */
+#define TEST_FIFO_SIZE 4096
+
+/* The number of events replayed by each test of the stream. */
+#define TEST_NUM_EVENTS 3000
+
+/* The largest event in the format the simulated card replays. */
+#define TEST_EVENT_SIZE \
+    (1 + 3 * TDC_MAX_NUM_CHANNELS * TDC_MAX_NUM_HITS_PER_CHANNEL)
+
+static unsigned int rnd_state;
+
+/* A fixed sequence of pseudo-random numbers below n, so runs are alike. */
+static unsigned int rnd(unsigned int n)
+{
+    rnd_state = rnd_state * 1103515245 + 12345;
+    return (rnd_state >> 16) % n;
+}
+
+static u32 get_u32(const unsigned char *p)
+{
+    return p[0] | p[1] << 8 | p[2] << 16 | (u32)p[3] << 24;
+}
+
+static u64 get_u64(const unsigned char *p)
+{
+    return get_u32(p) | (u64)get_u32(p + 4) << 32;
+}
+
+/*
+ * Reads what the reader may read now, at most max bytes, into buf.
+ * Returns the number of bytes read.
+ */
+static unsigned int fifo_read(struct tdc_fifo *fifo,
+    struct tdc_fifo_cursor *cursor, unsigned char *buf, unsigned int max,
+    int whole_blocks)
+{
+    unsigned int n, off, len;
+    unsigned char *p;
+
+    n = tdc_fifo_read_begin(fifo, cursor, max, whole_blocks);
+    for (off = 0; off < n; off += len) {
+        len = n - off;
+        p = tdc_fifo_read_ptr(fifo, cursor, off, &len);
+        memcpy(buf + off, p, len);
+    }
+    tdc_fifo_read_end(fifo, cursor, n);
+    return n;
+}
+
+/* Fills buf with len bytes counting up from first. */
+static void fill(unsigned char *buf, unsigned int len, unsigned int first)
+{
+    unsigned int i;
+
+    for (i = 0; i < len; ++i)
+        buf[i] = first + i;
+}
+
+/* Tells if buf holds len bytes counting up from first. */
+static int filled(const unsigned char *buf, unsigned int len,
+    unsigned int first)
+{
+    unsigned int i;
+
+    for (i = 0; i < len; ++i)
+        if (buf[i] != (unsigned char)(first + i))
+            return 0;
+    return 1;
+}
+
+/*
+ * Puts blocks through a FIFO of 64 bytes many times around, with the
+ * reader keeping up, and fills it up without a reader.
+ */
+static void test_fifo_wrap(void)
+{
+    struct tdc_fifo *fifo = tdc_fifo_new(60);
+    struct tdc_fifo_cursor cursor;
+    unsigned char in[64], out[64];
+    unsigned int i, n = 0;
+
+    CHECK(fifo->size == 64);
+    tdc_fifo_attach(fifo, &cursor, 0);
+    for (i = 0; i < 100; ++i) {
+        fill(in, 7 + i % 20, n);
+        CHECK(tdc_fifo_put(fifo, in, 7 + i % 20) == 0);
+        CHECK(tdc_fifo_len(fifo) == 7 + i % 20);
+        CHECK(fifo_read(fifo, &cursor, out, sizeof(out), 0) == 7 + i % 20);
+        CHECK(filled(out, 7 + i % 20, n));
+        CHECK(tdc_fifo_len(fifo) == 0);
+        n += 7 + i % 20;
+    }
+    CHECK(fifo->in == n);
+    tdc_fifo_detach(fifo, &cursor);
+
+    /* Without readers, the data is kept, so the FIFO fills up. */
+    fill(in, 40, 0);
+    CHECK(tdc_fifo_put(fifo, in, 40) == 0);
+    CHECK(tdc_fifo_put(fifo, in, 25) == -1);
+    CHECK(tdc_fifo_put_reserve(fifo, in, 20, 5) == -1);
+    CHECK(tdc_fifo_put_reserve(fifo, in, 20, 4) == 0);
+    CHECK(tdc_fifo_spacefree(fifo) == 4);
+    CHECK(!tdc_fifo_has_room(fifo, 5));
+    CHECK(tdc_fifo_has_room(fifo, 4));
+
+    /* ...and kept for the next reader. */
+    tdc_fifo_attach(fifo, &cursor, 0);
+    CHECK(tdc_fifo_cursor_len(fifo, &cursor) == 60);
+    CHECK(fifo_read(fifo, &cursor, out, sizeof(out), 0) == 60);
+    CHECK(filled(out, 40, 0) && filled(out + 40, 20, 0));
+    CHECK(tdc_fifo_len(fifo) == 0);
+
+    tdc_fifo_reset(fifo);
+    CHECK(tdc_fifo_len(fifo) == 0 && tdc_fifo_cursor_len(fifo, &cursor) == 0);
+    tdc_fifo_detach(fifo, &cursor);
+    tdc_fifo_destroy(fifo);
+}
+
+/*
+ * Two readers: a lossless one holds the writer back, a lossy one is
+ * skipped ahead to a block boundary. With overwrite, both are skipped.
+ */
+static void test_fifo_cursors(void)
+{
+    struct tdc_fifo *fifo = tdc_fifo_new(64);
+    struct tdc_fifo_cursor lossless, lossy;
+    unsigned char in[16], out[64];
+    unsigned int i;
+
+    tdc_fifo_attach(fifo, &lossless, 0);
+    tdc_fifo_attach(fifo, &lossy, 1);
+    for (i = 0; i < 6; ++i) {
+        fill(in, 10, 10 * i);
+        CHECK(tdc_fifo_put(fifo, in, 10) == 0);
+    }
+    /* Both see all data. */
+    CHECK(tdc_fifo_cursor_len(fifo, &lossless) == 60);
+    CHECK(tdc_fifo_cursor_len(fifo, &lossy) == 60);
+
+    /* The lossless reader is in the way. */
+    CHECK(tdc_fifo_put(fifo, in, 10) == -1);
+    CHECK(fifo_read(fifo, &lossless, out, 20, 0) == 20);
+    CHECK(filled(out, 20, 0));
+
+    /* Now only the lossy one is, and it is skipped past whole blocks. */
+    fill(in, 10, 60);
+    CHECK(tdc_fifo_put(fifo, in, 10) == 0);
+    CHECK(lossy.skips == 1 && lossy.dropped == 10);
+    CHECK(tdc_fifo_cursor_len(fifo, &lossy) == 60);
+    CHECK(fifo_read(fifo, &lossy, out, sizeof(out), 0) == 60);
+    CHECK(filled(out, 60, 10));
+    CHECK(tdc_fifo_len(fifo) == 50);
+
+    /* A reader that is copying is never skipped, even with overwrite. */
+    fill(in, 14, 70);
+    CHECK(tdc_fifo_put(fifo, in, 14) == 0);
+    tdc_fifo_read_begin(fifo, &lossless, 1, 0);
+    CHECK(tdc_fifo_put_overwrite(fifo, in, 10, 0) == -1);
+    tdc_fifo_read_end(fifo, &lossless, 0);
+
+    /* With overwrite, the lossless reader is skipped too. */
+    CHECK(tdc_fifo_put_overwrite(fifo, in, 10, 0) == 10);
+    CHECK(lossless.skips == 1 && lossless.dropped == 10);
+    CHECK(tdc_fifo_cursor_len(fifo, &lossless) == 64);
+    CHECK(fifo_read(fifo, &lossless, out, sizeof(out), 0) == 64);
+    CHECK(filled(out, 40, 30));
+
+    tdc_fifo_set_lossy(fifo, &lossless, 1);
+    CHECK(lossless.lossy);
+    tdc_fifo_detach(fifo, &lossy);
+    CHECK(tdc_fifo_len(fifo) == 0);
+    tdc_fifo_detach(fifo, &lossless);
+    tdc_fifo_destroy(fifo);
+}
+
+/*
+ * A reader asking for whole blocks gets them, however far behind it is,
+ * also after more blocks were added than TDC_FIFO_NR_MARKS.
+ */
+static void test_fifo_marks(void)
+{
+    struct tdc_fifo *fifo = tdc_fifo_new(256);
+    struct tdc_fifo_cursor cursor;
+    unsigned char in[16], out[256];
+    unsigned int i, n, read = 0, len;
+
+    tdc_fifo_attach(fifo, &cursor, 0);
+    for (i = 0; i < 3 * TDC_FIFO_NR_MARKS; ++i) {
+        len = 1 + i % 13;
+        if (tdc_fifo_put(fifo, in, len) == 0)
+            continue;
+        /* Full: read a bit, which must end where a block ends. */
+        n = fifo_read(fifo, &cursor, out, 100, 1);
+        CHECK(n > 0 && n <= 100);
+        read += n;
+        CHECK(tdc_fifo_put(fifo, in, len) == 0);
+    }
+    CHECK(fifo->nmarks > TDC_FIFO_NR_MARKS);
+
+    /* Whatever was read must end at a block boundary: replay the sizes. */
+    for (i = 0, n = 0; n < read; ++i)
+        n += 1 + i % 13;
+    CHECK(n == read);
+
+    /* Without whole_blocks, the read stops at max. */
+    CHECK(fifo_read(fifo, &cursor, out, 5, 0) == 5);
+    tdc_fifo_detach(fifo, &cursor);
+    tdc_fifo_destroy(fifo);
+}
+
+/*
+ * Writing in place: the block is written in the buffer, or in the bounce
+ * buffer where it wraps around, and less than reserved may be committed.
+ */
+static void test_fifo_reserve(void)
+{
+    struct tdc_fifo *fifo = tdc_fifo_new(64);
+    struct tdc_fifo_cursor cursor;
+    unsigned char bounce[32], out[64], *p;
+    unsigned int dropped;
+
+    tdc_fifo_attach(fifo, &cursor, 0);
+    p = tdc_fifo_reserve(fifo, 32, 0, 0, bounce, NULL);
+    CHECK(p == fifo->buffer);
+    fill(p, 20, 0);
+    tdc_fifo_commit(fifo, p, 20);
+    CHECK(tdc_fifo_len(fifo) == 20);
+
+    /* Nothing committed adds nothing. */
+    p = tdc_fifo_reserve(fifo, 32, 0, 0, bounce, NULL);
+    CHECK(p == fifo->buffer + 20);
+    tdc_fifo_commit(fifo, p, 0);
+    CHECK(tdc_fifo_len(fifo) == 20);
+
+    /* The room kept by reserve counts. */
+    CHECK(tdc_fifo_reserve(fifo, 32, 13, 0, bounce, NULL) == NULL);
+    p = tdc_fifo_reserve(fifo, 32, 12, 0, bounce, NULL);
+    CHECK(p == fifo->buffer + 20);
+    fill(p, 32, 20);
+    tdc_fifo_commit(fifo, p, 32);
+    CHECK(fifo_read(fifo, &cursor, out, sizeof(out), 0) == 52);
+    CHECK(filled(out, 52, 0));
+
+    /* Where the room wraps around, the bounce buffer is used. */
+    p = tdc_fifo_reserve(fifo, 20, 0, 0, bounce, NULL);
+    CHECK(p == bounce);
+    fill(p, 20, 52);
+    tdc_fifo_commit(fifo, p, 20);
+    CHECK(fifo->buffer[63] == 63 && fifo->buffer[0] == 64);
+    CHECK(fifo_read(fifo, &cursor, out, sizeof(out), 0) == 20);
+    CHECK(filled(out, 20, 52));
+
+    /* With overwrite, what is dropped is told. */
+    p = tdc_fifo_reserve(fifo, 40, 0, 0, bounce, NULL);
+    fill(p, 40, 0);
+    tdc_fifo_commit(fifo, p, 40);
+    CHECK(tdc_fifo_reserve(fifo, 40, 0, 0, bounce, NULL) == NULL);
+    p = tdc_fifo_reserve(fifo, 40, 0, 1, bounce, &dropped);
+    CHECK(p != NULL && dropped == 40);
+    tdc_fifo_commit(fifo, p, 0);
+    CHECK(cursor.skips == 1 && cursor.dropped == 40);
+
+    tdc_fifo_detach(fifo, &cursor);
+    tdc_fifo_destroy(fifo);
+}
+
+/*
+ * The events replayed through the simulated card, in its format: the
+ * number of hits, then channel and delay of each hit. The hits are in
+ * the order of the channels, as the driver writes them.
+ */
+struct source {
+    unsigned char ev[TEST_NUM_EVENTS][TEST_EVENT_SIZE];
+    unsigned int len[TEST_NUM_EVENTS];
+    unsigned int n;
+    unsigned long hits;     /* hits on all channels, of all events */
+};
+
+static struct source sources[2];
+
+/*
+ * Makes n events of up to max_hits hits per channel. Every fifth has no
+ * hits. Delays are below max_delay.
+ */
+static void source_make(struct source *src, unsigned int n,
+    unsigned int max_hits, unsigned int max_delay)
+{
+    unsigned int i, ch, k, nh, delay;
+    unsigned char *p;
+
+    src->n = n;
+    src->hits = 0;
+    for (i = 0; i < n; ++i) {
+        p = src->ev[i] + 1;
+        for (ch = 0; ch < TDC_MAX_NUM_CHANNELS && i % 5; ++ch) {
+            nh = rnd(3) ? 0 : 1 + rnd(max_hits);
+            for (k = 0; k < nh; ++k) {
+                delay = rnd(max_delay);
+                *p++ = ch;
+                *p++ = delay & 0xff;
+                *p++ = delay >> 8;
+            }
+        }
+        src->len[i] = p - src->ev[i];
+        src->ev[i][0] = (src->len[i] - 1) / 3;
+        src->hits += src->ev[i][0];
+    }
+}
+
+/* What was found in the stream of a card, see stream_parse. */
+struct stream {
+    unsigned long events, empty, gaps, clocks, counts;
+    unsigned long count_coms, count_hits;
+    long last_seq;          /* sequence number of the last event */
+    unsigned int next;      /* the source event expected next, without SEQ */
+    u64 last_time;
+};
+
+/*
+ * Checks an event of the stream against the source. Without sequence
+ * numbers, it must be the next source event with hits.
+ */
+static void stream_event(struct stream *s, struct source *src,
+    const unsigned char *p, unsigned int fmt)
+{
+    unsigned int num = p[0], i;
+    const unsigned char *hits = p + 1;
+    u64 time;
+
+    if (fmt & TDC_FMT_SEQ) {
+        i = get_u32(hits);
+        hits += 4;
+        CHECK((long)i > s->last_seq);
+    } else {
+        for (i = s->next; i < src->n && src->ev[i][0] == 0; ++i)
+            ;
+    }
+    s->last_seq = i;
+    s->next = i + 1;
+    if (fmt & TDC_FMT_TIME) {
+        time = get_u64(hits);
+        hits += 8;
+        CHECK(time > s->last_time);
+        s->last_time = time;
+    }
+    CHECK(i < src->n);
+    if (i >= src->n)
+        return;
+    CHECK(num > 0 && num == src->ev[i][0]);
+    CHECK(memcmp(hits, src->ev[i] + 1, 3 * num) == 0);
+    s->events++;
+}
+
+/* Adds up a count record, see TDC_REC_COUNTS. */
+static void stream_counts(struct stream *s, const unsigned char *p)
+{
+    unsigned int i, coms = get_u32(p + 5), mult = 0;
+
+    CHECK(get_u32(p + 1) == s->count_coms);
+    s->count_coms += coms;
+    for (i = 0; i < TDC_MAX_NUM_CHANNELS; ++i)
+        s->count_hits += get_u32(p + 21 + 4 * i);
+    for (i = 0; i < TDC_COUNT_MULT_BINS; ++i)
+        mult += get_u32(p + 21 + 2 * 8 * 4 + 4 * i);
+    CHECK(mult == coms);
+    s->counts++;
+}
+
+/*
+ * Walks through len bytes of the stream of the given format, checking
+ * the events against the sources. In the merged stream, each event and
+ * record starts with the card number, which picks the source, and the
+ * events of all cards must be in the order of their times.
+ */
+static void stream_parse(struct stream *streams, const unsigned char *p,
+    unsigned int len, unsigned int fmt, int merged)
+{
+    unsigned int pos = 0, card = 0, type;
+    struct stream *s;
+    u64 time, last_time = 0;
+
+    while (pos < len) {
+        if (merged) {
+            card = p[pos++];
+            CHECK(card < ARRAY_SIZE(sources));
+            if (card >= ARRAY_SIZE(sources))
+                return;
+        }
+        s = &streams[card];
+        type = p[pos];
+        if (type < TDC_REC_MIN) {
+            if (merged && (fmt & TDC_FMT_TIME)) {
+                time = get_u64(p + pos + (fmt & TDC_FMT_SEQ ? 5 : 1));
+                CHECK(time >= last_time);
+                last_time = time;
+            }
+            stream_event(s, &sources[card], p + pos, fmt);
+            pos += 1 + 3 * type;
+            if (fmt & TDC_FMT_SEQ)
+                pos += 4;
+            if (fmt & TDC_FMT_TIME)
+                pos += 8;
+            continue;
+        }
+        switch (type) {
+        case TDC_REC_GAP:
+            CHECK(fmt & TDC_FMT_GAPS);
+            s->gaps += get_u32(p + pos + 1);
+            break;
+        case TDC_REC_EMPTY:
+            CHECK(fmt & TDC_FMT_EMPTY);
+            CHECK(sources[card].ev[get_u32(p + pos + 5)][0] == 0);
+            s->empty += get_u32(p + pos + 1);
+            break;
+        case TDC_REC_CLOCK:
+            CHECK(fmt & TDC_FMT_TIME);
+            s->clocks++;
+            break;
+        case TDC_REC_COUNTS:
+            stream_counts(s, p + pos);
+            break;
+        default:
+            CHECK(!"unknown record");
+            return;
+        }
+        pos += TDC_REC_SIZE_OF(type);
+    }
+    CHECK(pos == len);
+}
+
+/* The stream read from a card, and the reader reading it. */
+static unsigned char stream_buf[TEST_NUM_EVENTS * 2 * (TEST_EVENT_SIZE + 64)];
+static unsigned int stream_len;
+
+/*
+ * Reads the stream of dev through cursor. The merged device first passes
+ * on what it can of the cards, as tdc_read does.
+ */
+static void stream_read(struct tdc_device *dev, struct tdc_fifo_cursor *cursor)
+{
+    unsigned int n;
+
+    do {
+        if (dev->cards)
+            tdc_merge_pull(dev, sizeof(stream_buf) - stream_len);
+        n = fifo_read(dev->fifo, cursor, stream_buf + stream_len,
+            sizeof(stream_buf) - stream_len, 1);
+        stream_len += n;
+    } while (n > 0);
+}
+
+/*
+ * Makes a simulated card, with a small FIFO so that the events wrap
+ * around it, and starts a measurement in the given format.
+ */
+static struct tdc_device *card_new(unsigned int fmt, unsigned int fifo_size)
+{
+    struct tdc_device *tdc = tdc_new(0x320, 1);
+
+    tdc_fifo_destroy(tdc->fifo);
+    tdc->fifo = tdc_fifo_new(fifo_size);
+    tdc->stream_format = fmt;
+    return tdc;
+}
+
+/*
+ * Replays the source events through the simulated cards, one COM signal
+ * of each card per round. The stream of dev is read through cursor every
+ * given number of rounds, and at the end.
+ */
+static void replay(struct tdc_device **cards, unsigned int num_cards,
+    struct tdc_device *dev, struct tdc_fifo_cursor *cursor,
+    unsigned int every)
+{
+    unsigned int fed[2] = { 0, 0 }, c, busy, round = 0;
+    struct tdc_sim *sim;
+
+    for (c = 0; c < num_cards; ++c)
+        tdc_start_measurement(cards[c]);
+    do {
+        busy = 0;
+        for (c = 0; c < num_cards; ++c) {
+            sim = cards[c]->sim;
+            while (fed[c] < sources[c].n && !tdc_fifo_put(sim->queue,
+                    sources[c].ev[fed[c]], sources[c].len[fed[c]]))
+                fed[c]++;
+            if (fed[c] < sources[c].n || tdc_fifo_len(sim->queue)) {
+                tdc_timer_callback(&cards[c]->timer.hrtimer);
+                busy = 1;
+            }
+        }
+        if (++round % every == 0)
+            stream_read(dev, cursor);
+    } while (busy);
+    for (c = 0; c < num_cards; ++c)
+        tdc_stop_measurement(cards[c]);
+    stream_read(dev, cursor);
+}
+
+/*
+ * Replays events in each stream format, reading the stream as it comes.
+ * Every COM signal must show up as an event or in an empty record.
+ */
+static void test_stream_formats(void)
+{
+    struct tdc_fifo_cursor cursor;
+    struct tdc_device *tdc;
+    struct stream s;
+    unsigned int fmt, last;
+
+    for (fmt = 0; fmt <= TDC_FMT_ALL; ++fmt) {
+        source_make(&sources[0], TEST_NUM_EVENTS, 3, 0x10000);
+        tdc = card_new(fmt, TEST_FIFO_SIZE);
+        tdc_fifo_attach(tdc->fifo, &cursor, 0);
+        stream_len = 0;
+        replay(&tdc, 1, tdc, &cursor, 1);
+
+        memset(&s, 0, sizeof(s));
+        s.last_seq = -1;
+        stream_parse(&s, stream_buf, stream_len, fmt, 0);
+        CHECK(tdc->measurement.num_com_signals == TEST_NUM_EVENTS);
+        CHECK(tdc->measurement.buf_overflow_events == 0);
+        CHECK(s.events == TEST_NUM_EVENTS -
+            tdc->measurement.num_com_signals_without_hits);
+        CHECK(s.gaps == 0);
+        if (fmt & TDC_FMT_EMPTY)
+            CHECK(s.events + s.empty == TEST_NUM_EVENTS);
+        else
+            CHECK(s.empty == 0);
+        if (fmt & TDC_FMT_TIME)
+            CHECK(s.clocks >= 1);
+        else
+            CHECK(s.clocks == 0);
+        for (last = TEST_NUM_EVENTS - 1; !sources[0].ev[last][0]; --last)
+            ;
+        CHECK(s.last_seq == last);
+
+        tdc_fifo_detach(tdc->fifo, &cursor);
+        tdc_destroy(tdc);
+    }
+}
+
+/*
+ * Events with 0 to 16 hits on each channel come out as they went in.
+ * More than max_num_hits_per_channel hits on a channel are left out.
+ */
+static void test_decode_hits(void)
+{
+    struct tdc_fifo_cursor cursor;
+    struct tdc_device *tdc;
+    struct source *src = &sources[0];
+    struct stream s;
+    unsigned int i, ch, k;
+    unsigned char *p;
+
+    /* Event i has (i + ch) % 17 hits on channel ch. */
+    src->n = 3 * 17;
+    for (i = 0; i < src->n; ++i) {
+        p = src->ev[i] + 1;
+        for (ch = 0; ch < TDC_MAX_NUM_CHANNELS; ++ch) {
+            for (k = 0; k < (i + ch) % 17; ++k) {
+                *p++ = ch;
+                *p++ = k;
+                *p++ = i;
+            }
+        }
+        src->len[i] = p - src->ev[i];
+        src->ev[i][0] = (src->len[i] - 1) / 3;
+    }
+    tdc = card_new(TDC_FMT_SEQ, TEST_FIFO_SIZE);
+    tdc_fifo_attach(tdc->fifo, &cursor, 0);
+    stream_len = 0;
+    replay(&tdc, 1, tdc, &cursor, 1);
+    memset(&s, 0, sizeof(s));
+    s.last_seq = -1;
+    stream_parse(&s, stream_buf, stream_len, TDC_FMT_SEQ, 0);
+    CHECK(s.events == src->n);
+    for (ch = 0; ch < TDC_MAX_NUM_CHANNELS; ++ch)
+        for (k = 0; k <= 16; ++k)
+            CHECK(tdc->measurement.num_hits_of_type[ch][k] == (k ? 3 : 0));
+    tdc_fifo_detach(tdc->fifo, &cursor);
+    tdc_destroy(tdc);
+
+    /* 20 hits on channel 5, of which 16 are kept. */
+    src->n = 1;
+    p = src->ev[0];
+    *p++ = 20;
+    for (k = 0; k < 20; ++k) {
+        *p++ = 5;
+        *p++ = k;
+        *p++ = 0;
+    }
+    src->len[0] = p - src->ev[0];
+    tdc = card_new(0, TEST_FIFO_SIZE);
+    tdc_fifo_attach(tdc->fifo, &cursor, 0);
+    stream_len = 0;
+    replay(&tdc, 1, tdc, &cursor, 1);
+    CHECK(stream_len == 1 + 3 * 16);
+    CHECK(stream_buf[0] == 16);
+    CHECK(memcmp(stream_buf + 1, src->ev[0] + 1, 3 * 16) == 0);
+    CHECK(tdc->measurement.num_hits_of_type[5][16] == 1);
+    tdc_fifo_detach(tdc->fifo, &cursor);
+    tdc_destroy(tdc);
+}
+
+/*
+ * With t_min and t_max set, the hits outside them are still sent, with
+ * delay 0, and counted as invalid.
+ */
+static void test_range_filter(void)
+{
+    struct tdc_fifo_cursor cursor;
+    struct tdc_device *tdc;
+    struct source *src = &sources[0];
+    struct stream s;
+    unsigned long invalid = 0, counted = 0;
+    unsigned int i, k, delay;
+
+    source_make(src, TEST_NUM_EVENTS, 3, 0x10000);
+    tdc = card_new(TDC_FMT_SEQ, TEST_FIFO_SIZE);
+    tdc->t_min = 0x1000;
+    tdc->t_max = 0x8000;
+    tdc_fifo_attach(tdc->fifo, &cursor, 0);
+    stream_len = 0;
+    replay(&tdc, 1, tdc, &cursor, 1);
+
+    /* What is expected back: the source with those delays cleared. */
+    for (i = 0; i < src->n; ++i) {
+        for (k = 0; k < src->ev[i][0]; ++k) {
+            delay = src->ev[i][2 + 3 * k] | src->ev[i][3 + 3 * k] << 8;
+            if (delay >= 0x1000 && delay <= 0x8000)
+                continue;
+            src->ev[i][2 + 3 * k] = src->ev[i][3 + 3 * k] = 0;
+            invalid++;
+        }
+    }
+    memset(&s, 0, sizeof(s));
+    s.last_seq = -1;
+    stream_parse(&s, stream_buf, stream_len, TDC_FMT_SEQ, 0);
+    CHECK(s.events == TEST_NUM_EVENTS -
+        tdc->measurement.num_com_signals_without_hits);
+    for (i = 0; i < TDC_MAX_NUM_CHANNELS; ++i)
+        counted += tdc->measurement.num_invalid_hits[i];
+    CHECK(invalid > 0 && counted == invalid);
+    tdc_fifo_detach(tdc->fifo, &cursor);
+    tdc_destroy(tdc);
+}
+
+/*
+ * Replays more events than fit, under the given overflow policy, with a
+ * reader that only reads now and then, and parses what it read.
+ */
+static struct tdc_device *overflow_run(enum tdc_overflow_policy policy,
+    unsigned int fmt, struct stream *s)
+{
+    struct tdc_fifo_cursor cursor;
+    struct tdc_device *tdc;
+
+    source_make(&sources[0], TEST_NUM_EVENTS, 3, 0x10000);
+    tdc = card_new(fmt, 1024);
+    tdc->overflow_policy = policy;
+    tdc->overflow_high = 90;
+    tdc->overflow_low = 50;
+    tdc_fifo_attach(tdc->fifo, &cursor, 0);
+    stream_len = 0;
+    replay(&tdc, 1, tdc, &cursor, 500);
+    tdc_fifo_detach(tdc->fifo, &cursor);
+    memset(s, 0, sizeof(*s));
+    s->last_seq = -1;
+    stream_parse(s, stream_buf, stream_len, fmt, 0);
+    return tdc;
+}
+
+/*
+ * Each overflow policy, with its counters: what is dropped must show up
+ * in the gap records, so that every COM signal is accounted for.
+ */
+static void test_overflow_policies(void)
+{
+    const unsigned int fmt = TDC_FMT_SEQ | TDC_FMT_GAPS | TDC_FMT_EMPTY;
+    struct tdc_measurement *m;
+    struct tdc_device *tdc;
+    struct stream s;
+
+    /* The newest events are dropped, until the reader has caught up. */
+    tdc = overflow_run(TDC_DROP_NEWEST, fmt, &s);
+    m = &tdc->measurement;
+    CHECK(m->buf_overflow_events > 0);
+    CHECK(m->overflows > 1);
+    CHECK(s.gaps == m->buf_overflow_events);
+    CHECK(s.events + s.empty + s.gaps == TEST_NUM_EVENTS);
+    tdc_destroy(tdc);
+
+    /* The oldest events are dropped; the newest are kept. */
+    tdc = overflow_run(TDC_OVERWRITE_OLDEST, fmt, &s);
+    m = &tdc->measurement;
+    CHECK(m->overwrites > 0 && m->overwritten_bytes > 0);
+    CHECK(m->buf_overflow_events == 0);
+    CHECK(s.gaps == 0);
+    CHECK(s.events > 0 && s.last_seq == TEST_NUM_EVENTS - 1);
+    tdc_destroy(tdc);
+
+    /* The card is not read out while the FIFO might not have room. */
+    tdc = overflow_run(TDC_THROTTLE, fmt, &s);
+    m = &tdc->measurement;
+    CHECK(m->throttled_coms > 0);
+    CHECK(m->buf_overflow_events == 0);
+    CHECK(s.gaps == m->throttled_coms);
+    CHECK(s.events + s.empty + s.gaps == TEST_NUM_EVENTS);
+    tdc_destroy(tdc);
+}
+
+/*
+ * Counting mode: only count records are written, which add up to all
+ * COM signals and hits.
+ */
+static void test_counting(void)
+{
+    struct tdc_fifo_cursor cursor;
+    struct tdc_device *tdc;
+    struct stream s;
+
+    source_make(&sources[0], TEST_NUM_EVENTS, 3, 0x10000);
+    tdc = card_new(TDC_FMT_ALL, TEST_FIFO_SIZE);
+    tdc->count_slice_us = TDC_MIN_COUNT_SLICE_US;
+    tdc_fifo_attach(tdc->fifo, &cursor, 0);
+    stream_len = 0;
+    replay(&tdc, 1, tdc, &cursor, 1);
+
+    memset(&s, 0, sizeof(s));
+    s.last_seq = -1;
+    stream_parse(&s, stream_buf, stream_len, TDC_FMT_ALL, 0);
+    CHECK(s.events == 0 && s.gaps == 0 && s.empty == 0);
+    CHECK(s.counts > 1);
+    CHECK(s.clocks >= 1);
+    CHECK(s.count_coms == TEST_NUM_EVENTS);
+    CHECK(s.count_hits == sources[0].hits);
+    tdc_fifo_detach(tdc->fifo, &cursor);
+    tdc_destroy(tdc);
+}
+
+/*
+ * Two cards read through the merged device, which is read every few
+ * rounds, so that it has to merge the events of both: each card's events
+ * come out whole, prefixed with its number, and in the order of their
+ * times. A reader of one card still gets all of its events.
+ */
+static void test_merged(void)
+{
+    const unsigned int fmt = TDC_FMT_ALL;
+    struct tdc_device *cards[2], *merge;
+    struct tdc_fifo_cursor cursor, card_cursor;
+    struct stream s[2];
+    unsigned int c;
+
+    for (c = 0; c < 2; ++c) {
+        source_make(&sources[c], TEST_NUM_EVENTS, 3, 0x10000);
+        cards[c] = card_new(fmt, TEST_FIFO_SIZE);
+        cards[c]->index = c;
+    }
+    /* Room for the whole stream of the first card, which is read last. */
+    tdc_fifo_destroy(cards[0]->fifo);
+    cards[0]->fifo = tdc_fifo_new(sizeof(stream_buf));
+    merge = tdc_merge_new(cards, 2);
+    tdc_fifo_destroy(merge->fifo);
+    merge->fifo = tdc_fifo_new(8 * TEST_FIFO_SIZE);
+    merge->nreaders = 1;
+    tdc_merge_attach(merge);
+    tdc_fifo_attach(cards[0]->fifo, &card_cursor, 0);
+
+    tdc_fifo_attach(merge->fifo, &cursor, 0);
+    stream_len = 0;
+    replay(cards, 2, merge, &cursor, 16);
+
+    memset(s, 0, sizeof(s));
+    s[0].last_seq = s[1].last_seq = -1;
+    stream_parse(s, stream_buf, stream_len, fmt, 1);
+    for (c = 0; c < 2; ++c) {
+        CHECK(cards[c]->measurement.num_com_signals == TEST_NUM_EVENTS);
+        CHECK(s[c].events + s[c].empty + s[c].gaps == TEST_NUM_EVENTS);
+        CHECK(s[c].clocks >= 1);
+    }
+
+    stream_len = 0;
+    stream_read(cards[0], &card_cursor);
+    memset(s, 0, sizeof(s));
+    s[0].last_seq = -1;
+    stream_parse(s, stream_buf, stream_len, fmt, 0);
+    CHECK(s[0].gaps == 0);
+    CHECK(s[0].events + s[0].empty == TEST_NUM_EVENTS);
+
+    tdc_fifo_detach(cards[0]->fifo, &card_cursor);
+    tdc_fifo_detach(merge->fifo, &cursor);
+    tdc_merge_detach(merge);
+    tdc_merge_destroy(merge);
+    for (c = 0; c < 2; ++c)
+        tdc_destroy(cards[c]);
+}
+
+/*
+ * The merged device must hold back the events of one card while another
+ * card is reading out a COM signal, which may turn out to be earlier.
+ */
+static void test_merged_pending(void)
+{
+    struct tdc_device *cards[2], *merge;
+    struct tdc_fifo_cursor cursor;
+    unsigned int c;
+
+    for (c = 0; c < 2; ++c) {
+        source_make(&sources[c], 2, 3, 0x10000);
+        cards[c] = card_new(TDC_FMT_TIME, TEST_FIFO_SIZE);
+        cards[c]->index = c;
+    }
+    merge = tdc_merge_new(cards, 2);
+    merge->nreaders = 1;
+    tdc_merge_attach(merge);
+    tdc_fifo_attach(merge->fifo, &cursor, 0);
+
+    /* The second card saw its COM signal before the first card's. */
+    cards[1]->measurement.merge_pending = get_cycles();
+    for (c = 0; c < 2; ++c)
+        tdc_start_measurement(cards[c]);
+    tdc_fifo_put(cards[0]->sim->queue, sources[0].ev[1], sources[0].len[1]);
+    tdc_timer_callback(&cards[0]->timer.hrtimer);
+    CHECK(tdc_fifo_cursor_len(cards[0]->fifo, &merge->card_cursors[0]) > 0);
+
+    /* Only the clock records go, the event waits for the second card. */
+    tdc_merge_pull(merge, ~0U);
+    CHECK(tdc_fifo_cursor_len(cards[0]->fifo, &merge->card_cursors[0]) > 0);
+    cards[1]->measurement.merge_pending = 0;
+    tdc_merge_pull(merge, ~0U);
+    CHECK(tdc_fifo_cursor_len(cards[0]->fifo, &merge->card_cursors[0]) == 0);
+
+    for (c = 0; c < 2; ++c)
+        tdc_stop_measurement(cards[c]);
+    tdc_fifo_detach(merge->fifo, &cursor);
+    tdc_merge_detach(merge);
+    tdc_merge_destroy(merge);
+    for (c = 0; c < 2; ++c)
+        tdc_destroy(cards[c]);
+}
+
+/*
+ * Two cards read through a merged device with a small FIFO, which is
+ * only read at the end: the cards' FIFOs fill up while they wait for it,
+ * and the events they drop must show up in their gap records, so that
+ * every COM signal is accounted for. The events are all of the same
+ * size, so that each FIFO is left with no more room than the records'.
+ */
+static void test_merged_overflow(void)
+{
+    const unsigned int fmt = TDC_FMT_SEQ | TDC_FMT_GAPS | TDC_FMT_EMPTY;
+    struct tdc_device *cards[2], *merge;
+    struct tdc_fifo_cursor cursor;
+    struct stream s[2];
+    unsigned int c, i;
+
+    for (c = 0; c < 2; ++c) {
+        /* Every fifth event is empty, the others have one hit. */
+        sources[c].n = TEST_NUM_EVENTS;
+        for (i = 0; i < TEST_NUM_EVENTS; ++i) {
+            memcpy(sources[c].ev[i], "\001\003\042\001", 4);
+            sources[c].ev[i][0] = i % 5 != 0;
+            sources[c].len[i] = 1 + 3 * sources[c].ev[i][0];
+        }
+        cards[c] = card_new(fmt, TEST_FIFO_SIZE);
+        cards[c]->index = c;
+    }
+    merge = tdc_merge_new(cards, 2);
+    tdc_fifo_destroy(merge->fifo);
+    merge->fifo = tdc_fifo_new(1024);
+    merge->nreaders = 1;
+    tdc_merge_attach(merge);
+
+    tdc_fifo_attach(merge->fifo, &cursor, 0);
+    stream_len = 0;
+    replay(cards, 2, merge, &cursor, ~0U);
+
+    memset(s, 0, sizeof(s));
+    s[0].last_seq = s[1].last_seq = -1;
+    stream_parse(s, stream_buf, stream_len, fmt, 1);
+    for (c = 0; c < 2; ++c) {
+        CHECK(cards[c]->measurement.buf_overflow_events > 0);
+        CHECK(s[c].gaps == cards[c]->measurement.buf_overflow_events);
+        CHECK(s[c].events + s[c].empty + s[c].gaps == TEST_NUM_EVENTS);
+    }
+    tdc_fifo_detach(merge->fifo, &cursor);
+    tdc_merge_detach(merge);
+    tdc_merge_destroy(merge);
+    for (c = 0; c < 2; ++c)
+        tdc_destroy(cards[c]);
+}
+
+int main(void)
+{
+    test_fifo_wrap();
+    test_fifo_cursors();
+    test_fifo_marks();
+    test_fifo_reserve();
+    test_stream_formats();
+    test_decode_hits();
+    test_range_filter();
+    test_overflow_policies();
+    test_counting();
+    test_merged();
+    test_merged_pending();
+    test_merged_overflow();
+
+    printf("%u checks, %u failed\n", checks, failures);
+    return failures ? 1 : 0;
+}
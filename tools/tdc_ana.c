@@ -0,0 +1,327 @@
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "tdc_ana.h"
+#include "tdc_event.h"
+
+/*
+ * Sets up the config to calibrate nothing and gate nothing, with no pairs
+ * or images.
+ */
+void tdc_ana_config_init(struct tdc_ana_config *config, int merged,
+    unsigned int format)
+{
+    int i;
+
+    memset(config, 0, sizeof(*config));
+    config->merged = merged;
+    config->format = format;
+    for (i = 0; i < TDC_ANA_CHANNELS; ++i) {
+        config->channels[i].gain = 1.0;
+        config->channels[i].gate_min_ns = -INFINITY;
+        config->channels[i].gate_max_ns = INFINITY;
+    }
+}
+
+static int tdc_ana_find_pair(const struct tdc_ana_config *config,
+    const char *name)
+{
+    int i;
+
+    for (i = 0; i < config->num_pairs; ++i) {
+        if (strcmp(config->pairs[i].name, name) == 0)
+            return i;
+    }
+    return -1;
+}
+
+/*
+ * Reads a config file, with one of these on each line:
+ *   channel N OFFSET_NS GAIN GATE_MIN_NS GATE_MAX_NS
+ *   pair NAME A B MIN_NS MAX_NS
+ *   image X_PAIR Y_PAIR
+ * '#' starts a comment.
+ * Returns 0 on success, -1 on error, reported on stderr.
+ */
+int tdc_ana_config_load(struct tdc_ana_config *config, const char *path)
+{
+    struct tdc_ana_channel ch;
+    struct tdc_ana_pair *pair;
+    char line[256], word[16], x[16], y[16], *p;
+    unsigned int n = 0;
+    int i, retval = -1;
+    FILE *file;
+
+    file = fopen(path, "r");
+    if (!file) {
+        perror(path);
+        return -1;
+    }
+    while (fgets(line, sizeof(line), file)) {
+        ++n;
+        p = strchr(line, '#');
+        if (p)
+            *p = '\0';
+        if (sscanf(line, "%15s", word) != 1)
+            continue;
+        if (strcmp(word, "channel") == 0) {
+            if (sscanf(line, "%*s %d %lf %lf %lf %lf", &i, &ch.offset_ns,
+                    &ch.gain, &ch.gate_min_ns, &ch.gate_max_ns) != 5 ||
+                i < 0 || i >= TDC_ANA_CHANNELS)
+                goto bad;
+            config->channels[i] = ch;
+        } else if (strcmp(word, "pair") == 0) {
+            if (config->num_pairs == TDC_ANA_MAX_PAIRS)
+                goto bad;
+            pair = &config->pairs[config->num_pairs];
+            if (sscanf(line, "%*s %15s %d %d %lf %lf", pair->name, &pair->a,
+                    &pair->b, &pair->min_ns, &pair->max_ns) != 5 ||
+                pair->a < 0 || pair->a >= TDC_ANA_CHANNELS ||
+                pair->b < 0 || pair->b >= TDC_ANA_CHANNELS ||
+                pair->max_ns <= pair->min_ns ||
+                tdc_ana_find_pair(config, pair->name) >= 0)
+                goto bad;
+            config->num_pairs++;
+        } else if (strcmp(word, "image") == 0) {
+            if (config->num_images == TDC_ANA_MAX_IMAGES ||
+                sscanf(line, "%*s %15s %15s", x, y) != 2)
+                goto bad;
+            config->images[config->num_images][0] =
+                tdc_ana_find_pair(config, x);
+            config->images[config->num_images][1] =
+                tdc_ana_find_pair(config, y);
+            if (config->images[config->num_images][0] < 0 ||
+                config->images[config->num_images][1] < 0)
+                goto bad;
+            config->num_images++;
+        } else {
+            goto bad;
+        }
+    }
+    retval = 0;
+    goto out;
+
+bad:
+    fprintf(stderr, "%s:%u: invalid line\n", path, n);
+out:
+    fclose(file);
+    return retval;
+}
+
+/* Allocates histograms, all zero. */
+struct tdc_ana_hist *tdc_ana_hist_new(void)
+{
+    return calloc(1, sizeof(struct tdc_ana_hist));
+}
+
+void tdc_ana_hist_free(struct tdc_ana_hist *hist)
+{
+    free(hist);
+}
+
+void tdc_ana_hist_clear(struct tdc_ana_hist *hist)
+{
+    memset(hist, 0, sizeof(*hist));
+}
+
+/* Adds the histograms hist to sum. */
+void tdc_ana_hist_add(struct tdc_ana_hist *sum, const struct tdc_ana_hist *hist)
+{
+    const uint64_t *from = (const uint64_t *)hist;
+    uint64_t *to = (uint64_t *)sum;
+    size_t i;
+
+    // Nothing but counters in there.
+    for (i = 0; i < sizeof(*hist) / sizeof(uint64_t); ++i)
+        to[i] += from[i];
+}
+
+/*
+ * The bin of value in n bins from min to max, or -1 if outside. The
+ * division can round a value just below max up to n, which is the last
+ * bin.
+ */
+static inline int tdc_ana_bin(double value, double min, double max, int n)
+{
+    int b;
+
+    if (value < min || value >= max)
+        return -1;
+    b = (int)((value - min) / (max - min) * n);
+    return b >= n ? n - 1 : b;
+}
+
+/*
+ * Reconstructs an event with hits: calibrates and gates the hits, keeps
+ * the earliest hit of each channel, and counts it all in.
+ */
+static void tdc_ana_event(const struct tdc_ana_config *config,
+    struct tdc_ana_hist *hist, const struct tdc_event *event)
+{
+    const struct tdc_ana_channel *ch;
+    double t[TDC_ANA_CHANNELS], d[TDC_ANA_MAX_PAIRS], time;
+    uint64_t seen = 0, pairs = 0;
+    unsigned int i;
+    int c, bx, by;
+
+    hist->events++;
+    hist->hits += event->num_hits;
+    hist->mult[event->num_hits]++;
+    if (event->card >= TDC_ANA_MAX_CARDS) {
+        hist->other_cards += event->num_hits;
+        return;
+    }
+    if (event->card >= 0)
+        hist->card_events[event->card]++;
+
+    for (i = 0; i < event->num_hits; ++i) {
+        c = event->channel[i] & 7;
+        if (event->card > 0)
+            c += event->card * 8;
+        ch = &config->channels[c];
+        time = event->delay[i] * 0.5 * ch->gain - ch->offset_ns;
+        if (time < ch->gate_min_ns || time > ch->gate_max_ns)
+            continue;
+        hist->gated++;
+        bx = tdc_ana_bin(time, 0, TDC_ANA_TIME_BINS * TDC_ANA_TIME_BIN_NS,
+            TDC_ANA_TIME_BINS);
+        if (bx >= 0)
+            hist->time[c][bx]++;
+        if (!(seen & (1ULL << c)) || time < t[c]) {
+            t[c] = time;
+            seen |= 1ULL << c;
+        }
+    }
+    if (!seen)
+        return;
+
+    for (i = 0; i < (unsigned int)config->num_pairs; ++i) {
+        const struct tdc_ana_pair *pair = &config->pairs[i];
+
+        if (!(seen & (1ULL << pair->a)) || !(seen & (1ULL << pair->b)))
+            continue;
+        d[i] = t[pair->b] - t[pair->a];
+        pairs |= 1ULL << i;
+        bx = tdc_ana_bin(d[i], pair->min_ns, pair->max_ns, TDC_ANA_PAIR_BINS);
+        if (bx >= 0)
+            hist->pair[i][bx]++;
+    }
+    for (i = 0; i < (unsigned int)config->num_images; ++i) {
+        const struct tdc_ana_pair *x = &config->pairs[config->images[i][0]];
+        const struct tdc_ana_pair *y = &config->pairs[config->images[i][1]];
+
+        if (!(pairs & (1ULL << config->images[i][0])) ||
+            !(pairs & (1ULL << config->images[i][1])))
+            continue;
+        bx = tdc_ana_bin(d[config->images[i][0]], x->min_ns, x->max_ns,
+            TDC_ANA_IMAGE_BINS);
+        by = tdc_ana_bin(d[config->images[i][1]], y->min_ns, y->max_ns,
+            TDC_ANA_IMAGE_BINS);
+        if (bx >= 0 && by >= 0)
+            hist->image[i][by * TDC_ANA_IMAGE_BINS + bx]++;
+    }
+}
+
+/*
+ * Analyzes a block of the stream that starts with an event, into hist.
+ * An event cut off at the end of the block is left out.
+ */
+void tdc_ana_block(const struct tdc_ana_config *config,
+    struct tdc_ana_hist *hist, const unsigned char *data, size_t len)
+{
+    struct tdc_parser parser;
+    struct tdc_event *event = &parser.event;
+    size_t n;
+    int complete;
+
+    tdc_parser_init(&parser, config->merged, config->format);
+    hist->bytes += len;
+    while (len) {
+        n = tdc_parser_feed(&parser, data, len, &complete);
+        data += n;
+        len -= n;
+        if (!complete)
+            continue;
+        if (!tdc_event_is_record(event)) {
+            tdc_ana_event(config, hist, event);
+            continue;
+        }
+        hist->records++;
+        if (event->type == TDC_REC_GAP)
+            hist->gaps += event->count;
+        else if (event->type == TDC_REC_EMPTY)
+            hist->empty += event->count;
+    }
+}
+
+/*
+ * Writes the histograms as text: a line "# NAME" before each, then one
+ * line per bin that is not empty, with the low edge of the bin in ns (x
+ * and y for images) and the count.
+ * Returns 0 on success, -1 on error.
+ */
+int tdc_ana_hist_write(const struct tdc_ana_config *config,
+    const struct tdc_ana_hist *hist, FILE *file)
+{
+    const struct tdc_ana_pair *pair, *x, *y;
+    int i, j;
+
+    fprintf(file, "# bytes %llu events %llu hits %llu gated %llu "
+        "other_cards %llu records %llu gaps %llu empty %llu\n",
+        (unsigned long long)hist->bytes, (unsigned long long)hist->events,
+        (unsigned long long)hist->hits, (unsigned long long)hist->gated,
+        (unsigned long long)hist->other_cards,
+        (unsigned long long)hist->records, (unsigned long long)hist->gaps,
+        (unsigned long long)hist->empty);
+
+    if (config->merged) {
+        fprintf(file, "\n# card\n");
+        for (i = 0; i < TDC_ANA_MAX_CARDS; ++i) {
+            if (hist->card_events[i])
+                fprintf(file, "%d %llu\n", i,
+                    (unsigned long long)hist->card_events[i]);
+        }
+    }
+    fprintf(file, "\n# mult\n");
+    for (i = 0; i < 256; ++i) {
+        if (hist->mult[i])
+            fprintf(file, "%d %llu\n", i, (unsigned long long)hist->mult[i]);
+    }
+    for (i = 0; i < TDC_ANA_CHANNELS; ++i) {
+        for (j = 0; j < TDC_ANA_TIME_BINS && !hist->time[i][j]; ++j)
+            ;
+        if (j == TDC_ANA_TIME_BINS)
+            continue;
+        fprintf(file, "\n# time %d\n", i);
+        for (; j < TDC_ANA_TIME_BINS; ++j) {
+            if (hist->time[i][j])
+                fprintf(file, "%d %llu\n", j * TDC_ANA_TIME_BIN_NS,
+                    (unsigned long long)hist->time[i][j]);
+        }
+    }
+    for (i = 0; i < config->num_pairs; ++i) {
+        pair = &config->pairs[i];
+        fprintf(file, "\n# pair %s\n", pair->name);
+        for (j = 0; j < TDC_ANA_PAIR_BINS; ++j) {
+            if (hist->pair[i][j])
+                fprintf(file, "%g %llu\n", pair->min_ns + j *
+                    (pair->max_ns - pair->min_ns) / TDC_ANA_PAIR_BINS,
+                    (unsigned long long)hist->pair[i][j]);
+        }
+    }
+    for (i = 0; i < config->num_images; ++i) {
+        x = &config->pairs[config->images[i][0]];
+        y = &config->pairs[config->images[i][1]];
+        fprintf(file, "\n# image %s %s\n", x->name, y->name);
+        for (j = 0; j < TDC_ANA_IMAGE_BINS * TDC_ANA_IMAGE_BINS; ++j) {
+            if (hist->image[i][j])
+                fprintf(file, "%g %g %llu\n", x->min_ns +
+                    (j % TDC_ANA_IMAGE_BINS) * (x->max_ns - x->min_ns) /
+                    TDC_ANA_IMAGE_BINS, y->min_ns +
+                    (j / TDC_ANA_IMAGE_BINS) * (y->max_ns - y->min_ns) /
+                    TDC_ANA_IMAGE_BINS, (unsigned long long)hist->image[i][j]);
+        }
+    }
+    return ferror(file) ? -1 : 0;
+}
@@ -0,0 +1,127 @@
+#ifndef _TDC_ANA_H_
+#define _TDC_ANA_H_
+
+/*
+ * Online analysis of the stream, see tdc-analyze.
+ *
+ * A block of whole events is decoded, the delay of each hit calibrated to
+ * a time and gated, and each event reconstructed from the first hit in
+ * the gate of each channel: the time differences of pairs of channels,
+ * e.g. the two ends of a delay line, and images of two such differences.
+ * All of it is counted into histograms. Blocks can be analyzed in
+ * parallel, each thread into its own histograms, which are added up when
+ * the result is wanted.
+ *
+ * Channels are numbered card * 8 + channel in a merged stream, else just
+ * by the channel.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#define TDC_ANA_MAX_CARDS 8
+#define TDC_ANA_CHANNELS (TDC_ANA_MAX_CARDS * 8)
+#define TDC_ANA_MAX_PAIRS 8
+#define TDC_ANA_MAX_IMAGES 2
+
+/* Time spectra of each channel: 0 to 32768 ns, the range of the delay. */
+#define TDC_ANA_TIME_BINS 4096
+#define TDC_ANA_TIME_BIN_NS 8
+
+#define TDC_ANA_PAIR_BINS 1024
+#define TDC_ANA_IMAGE_BINS 256
+
+/**
+ * struct tdc_ana_channel - calibration and gate of a channel
+ * @offset_ns:  Subtracted from the time,
+ * @gain:       after multiplying the delay in ns by this.
+ * @gate_min_ns, @gate_max_ns: Hits with calibrated times outside of this
+ *              range are left out.
+ */
+struct tdc_ana_channel {
+    double offset_ns;
+    double gain;
+    double gate_min_ns, gate_max_ns;
+};
+
+/**
+ * struct tdc_ana_pair - the time difference of two channels
+ * @name:       Name in the config file and the output.
+ * @a, @b:      The channels; the difference is time of b - time of a.
+ * @min_ns, @max_ns: Range of the histogram.
+ */
+struct tdc_ana_pair {
+    char name[16];
+    int a, b;
+    double min_ns, max_ns;
+};
+
+/**
+ * struct tdc_ana_config - what to do with the events
+ * @merged:     1 if each event starts with a card number.
+ * @format:     The stream format, TDC_FMT_* flags.
+ * @channels:   Calibration and gate of each channel.
+ * @pairs:      Pairs of channels,
+ * @num_pairs:  and their number.
+ * @images:     Indexes in @pairs of the x and y of each image,
+ * @num_images: and their number.
+ */
+struct tdc_ana_config {
+    int merged;
+    unsigned int format;
+    struct tdc_ana_channel channels[TDC_ANA_CHANNELS];
+    struct tdc_ana_pair pairs[TDC_ANA_MAX_PAIRS];
+    int num_pairs;
+    int images[TDC_ANA_MAX_IMAGES][2];
+    int num_images;
+};
+
+/**
+ * struct tdc_ana_hist - the results of the analysis
+ * @bytes:      Stream bytes analyzed.
+ * @events:     Events with hits,
+ * @hits:       their hits,
+ * @gated:      and how many of those were in the gates.
+ * @card_events: Events of each card, in a merged stream.
+ * @other_cards: Hits of cards from TDC_ANA_MAX_CARDS on, left out.
+ * @records:    Records in the stream.
+ * @gaps:       Events dropped, from the gap records.
+ * @empty:      COM signals without hits, from the empty records.
+ * @mult:       Number of events by their number of hits.
+ * @time:       Time spectrum of each channel, of the hits in the gate.
+ * @pair:       Time difference of each pair, in each event that has a
+ *              hit in the gate of both channels.
+ * @image:      Each image, y * TDC_ANA_IMAGE_BINS + x.
+ */
+struct tdc_ana_hist {
+    uint64_t bytes;
+    uint64_t events;
+    uint64_t hits;
+    uint64_t gated;
+    uint64_t card_events[TDC_ANA_MAX_CARDS];
+    uint64_t other_cards;
+    uint64_t records;
+    uint64_t gaps;
+    uint64_t empty;
+    uint64_t mult[256];
+    uint64_t time[TDC_ANA_CHANNELS][TDC_ANA_TIME_BINS];
+    uint64_t pair[TDC_ANA_MAX_PAIRS][TDC_ANA_PAIR_BINS];
+    uint64_t image[TDC_ANA_MAX_IMAGES][TDC_ANA_IMAGE_BINS * TDC_ANA_IMAGE_BINS];
+};
+
+void tdc_ana_config_init(struct tdc_ana_config *config, int merged,
+    unsigned int format);
+int tdc_ana_config_load(struct tdc_ana_config *config, const char *path);
+
+struct tdc_ana_hist *tdc_ana_hist_new(void);
+void tdc_ana_hist_free(struct tdc_ana_hist *hist);
+void tdc_ana_hist_clear(struct tdc_ana_hist *hist);
+void tdc_ana_hist_add(struct tdc_ana_hist *sum, const struct tdc_ana_hist *hist);
+int tdc_ana_hist_write(const struct tdc_ana_config *config,
+    const struct tdc_ana_hist *hist, FILE *file);
+
+void tdc_ana_block(const struct tdc_ana_config *config,
+    struct tdc_ana_hist *hist, const unsigned char *data, size_t len);
+
+#endif /* _TDC_ANA_H_ */
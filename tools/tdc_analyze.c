@@ -0,0 +1,555 @@
+/*
+ * tdc-analyze - analyzes the stream online, see tdc_ana.h.
+ *
+ *   tdc-analyze [-d DEVICE | -r RUN | -s SOCKET] [-c CONFIG] [-j THREADS]
+ *               [-b KB] [-o OUT] [-i SECONDS]
+ *   tdc-analyze -B -r RUN [-c CONFIG] [-j THREADS] [-b KB] [-m MB]
+ *
+ * The stream is read in blocks of whole events, from a device, a recorded
+ * run or tdc-serve. The blocks are handed out to a work-stealing pool of
+ * threads (tdc_steal.h), each of which analyzes its blocks into its own
+ * histograms. They are added up for the result, at the end and every
+ * SECONDS into OUT, written anew each time.
+ *
+ * With -B, the run is loaded into memory and analyzed with 1, 2, 4, ...
+ * up to THREADS threads, to see how the analysis scales and how it
+ * compares to the maximum rate of the driver.
+ */
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "tdc_ana.h"
+#include "tdc_serve.h"
+#include "tdc_steal.h"
+
+#define MB (1024 * 1024)
+
+/* TDC_MAX_TRIGGER_RATE_HZ of the driver: the most events a card makes. */
+#define MAX_EVENTS_PER_CARD 100000
+
+static struct {
+    const char *device;
+    const char *run;
+    const char *socket;
+    const char *config;
+    const char *output;
+    int threads;
+    size_t block_size;
+    unsigned int interval;
+    int bench;
+    size_t bench_size;
+} opt = {
+    .block_size = 256 * 1024,
+    .bench_size = 1024 * MB,
+};
+
+/**
+ * struct block - a block of the stream, analyzed by one thread
+ * @data:   Whole events,
+ * @len:    this many bytes of them.
+ * @next:   Next free block.
+ */
+struct block {
+    unsigned char *data;
+    size_t len;
+    struct block *next;
+};
+
+/**
+ * struct analysis - what the threads share
+ * @config:     What to do with the events.
+ * @hist:       Histograms of each thread.
+ * @sum:        The histograms added up.
+ * @lock:       Protects @free,
+ * @freed:      signalled when a block is put there.
+ * @free:       Blocks not in use.
+ * @fd:         The device, when reading one.
+ * @run:        The run, when reading one.
+ * @client:     The client of tdc-serve, when reading from it.
+ * @lost:       Bytes skipped by tdc-serve.
+ */
+static struct analysis {
+    struct tdc_ana_config config;
+    struct tdc_ana_hist **hist;
+    struct tdc_ana_hist *sum;
+    pthread_mutex_t lock;
+    pthread_cond_t freed;
+    struct block *free;
+    int fd;
+    struct tdc_run *run;
+    struct tdc_serve_client *client;
+    uint64_t lost;
+} ana = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .freed = PTHREAD_COND_INITIALIZER,
+    .fd = -1,
+};
+
+static volatile sig_atomic_t stop;
+
+static void on_signal(int sig)
+{
+    stop = 1;
+}
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* Takes a free block, waiting for one. */
+static struct block *get_block(void)
+{
+    struct block *b;
+
+    pthread_mutex_lock(&ana.lock);
+    while (!ana.free)
+        pthread_cond_wait(&ana.freed, &ana.lock);
+    b = ana.free;
+    ana.free = b->next;
+    pthread_mutex_unlock(&ana.lock);
+    return b;
+}
+
+static void put_block(struct block *b)
+{
+    pthread_mutex_lock(&ana.lock);
+    b->next = ana.free;
+    ana.free = b;
+    pthread_cond_signal(&ana.freed);
+    pthread_mutex_unlock(&ana.lock);
+}
+
+/*
+ * Runs on the threads of the pool. arg is NULL if the blocks are not
+ * from the free list.
+ */
+static void analyze(void *arg, int worker, void *task)
+{
+    struct block *b = task;
+
+    tdc_ana_block(&ana.config, ana.hist[worker], b->data, b->len);
+    if (arg)
+        put_block(b);
+}
+
+/*
+ * Adds up the histograms of the threads into ana.sum. The threads must
+ * be idle.
+ */
+static void merge(int threads)
+{
+    int i;
+
+    tdc_ana_hist_clear(ana.sum);
+    for (i = 0; i < threads; ++i)
+        tdc_ana_hist_add(ana.sum, ana.hist[i]);
+}
+
+/*
+ * Writes the sum to opt.output, through a temporary file so a reader
+ * never sees half of it, or to stdout.
+ * Returns 0 on success, -1 on error.
+ */
+static int write_result(void)
+{
+    char tmp[1024];
+    FILE *file;
+
+    if (!opt.output)
+        return tdc_ana_hist_write(&ana.config, ana.sum, stdout);
+    snprintf(tmp, sizeof(tmp), "%s.tmp", opt.output);
+    file = fopen(tmp, "w");
+    if (!file) {
+        perror(tmp);
+        return -1;
+    }
+    if (tdc_ana_hist_write(&ana.config, ana.sum, file) | fclose(file) ||
+        rename(tmp, opt.output)) {
+        perror(opt.output);
+        unlink(tmp);
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Reads up to len bytes of the stream into buf. Sets *resync if bytes
+ * were skipped before them, so buf starts a new event.
+ * Returns the number of bytes, 0 if there are none yet, or -1 at the end
+ * or on error.
+ */
+static long read_stream(unsigned char *buf, size_t len, int *resync)
+{
+    uint64_t lost = 0;
+    long n;
+
+    *resync = 0;
+    if (ana.run) {
+        n = tdc_run_read(ana.run, buf, len);
+        return n ? n : -1;
+    }
+    if (ana.client) {
+        n = tdc_serve_read(ana.client, buf, len, 200, &lost);
+        if (lost) {
+            ana.lost += lost;
+            *resync = 1;
+        }
+        return n;
+    }
+    n = read(ana.fd, buf, len);
+    if (n < 0) {
+        if (errno == EINTR || errno == EAGAIN)
+            return 0;
+        perror(opt.device);
+        return -1;
+    }
+    // At the end of a measurement; look again later.
+    if (n == 0)
+        usleep(100000);
+    return n;
+}
+
+/*
+ * Reads the stream and hands it out in blocks of whole events to the
+ * pool, until the end or interrupted. Writes the result every
+ * opt.interval seconds.
+ */
+static void pump(struct tdc_steal_pool *pool)
+{
+    const uint64_t interval = opt.interval * 1000000000ULL;
+    struct block *b, *next;
+    uint64_t snapshot = now_ns() + interval;
+    size_t fill = 0, whole;
+    int resync;
+    long n;
+
+    b = get_block();
+    while (!stop) {
+        n = read_stream(b->data + fill, opt.block_size - fill, &resync);
+        if (n < 0)
+            break;
+        if (resync) {
+            // The event before is incomplete.
+            memmove(b->data, b->data + fill, n);
+            fill = 0;
+        }
+        fill += n;
+        whole = tdc_codec_events_len(b->data, fill, ana.config.merged,
+            ana.config.format);
+        // Not the stream that was expected; analyze it anyway.
+        if (!whole && fill == opt.block_size)
+            whole = fill;
+        if (whole) {
+            next = get_block();
+            memcpy(next->data, b->data + whole, fill - whole);
+            b->len = whole;
+            tdc_steal_submit(pool, b);
+            b = next;
+            fill -= whole;
+        }
+        if (interval && opt.output && now_ns() >= snapshot) {
+            tdc_steal_wait(pool);
+            merge(opt.threads);
+            write_result();
+            snapshot += interval;
+        }
+    }
+    // What is left of a run that ends in the middle of an event.
+    b->len = fill;
+    tdc_steal_submit(pool, b);
+    tdc_steal_wait(pool);
+}
+
+/*
+ * Opens the device as tdc-record does, and sets up the config for its
+ * stream.
+ * Returns 0 on success, -1 on error.
+ */
+static int open_device(void)
+{
+    struct tdc_run_header header;
+    char cmd[64], path[1024];
+    const char *name;
+    int merged = 0;
+
+    memset(&header, 0, sizeof(header));
+    name = strrchr(opt.device, '/');
+    name = name ? name + 1 : opt.device;
+    if (strncmp(name, "tdcm", 4) == 0) {
+        merged = 1;
+        snprintf(path, sizeof(path), "%.*stdc", (int)(name - opt.device),
+            opt.device);
+    } else {
+        snprintf(path, sizeof(path), "%s", opt.device);
+    }
+    if (tdc_run_read_config(path, &header))
+        fprintf(stderr, "Could not read the configuration of %s\n", path);
+    tdc_ana_config_init(&ana.config, merged, header.stream_format);
+
+    ana.fd = open(opt.device, O_RDWR);
+    if (ana.fd < 0)
+        ana.fd = open(opt.device, O_RDONLY);
+    if (ana.fd < 0) {
+        perror(opt.device);
+        return -1;
+    }
+    snprintf(cmd, sizeof(cmd), "set_low_watermark %lu",
+        (unsigned long)(opt.block_size < 65536 ? opt.block_size : 65536));
+    if (write(ana.fd, cmd, strlen(cmd)) < 0)
+        ; // not needed to analyze
+    return 0;
+}
+
+/*
+ * Opens the source of the stream given in the options, and sets up the
+ * config for it.
+ * Returns 0 on success, -1 on error.
+ */
+static int open_source(void)
+{
+    const struct tdc_run_header *header;
+
+    if (opt.device)
+        return open_device();
+    if (opt.run) {
+        ana.run = tdc_run_open(opt.run);
+        if (!ana.run) {
+            fprintf(stderr, "Could not open the run %s\n", opt.run);
+            return -1;
+        }
+        header = &ana.run->header;
+    } else {
+        ana.client = tdc_serve_attach(opt.socket, "tdc-analyze");
+        if (!ana.client) {
+            fprintf(stderr, "Could not attach to %s\n", opt.socket);
+            return -1;
+        }
+        header = &ana.client->ring->config;
+    }
+    tdc_ana_config_init(&ana.config, !!(header->flags & TDC_RUN_MERGED),
+        header->stream_format);
+    return 0;
+}
+
+static int alloc_hist(int threads)
+{
+    int i;
+
+    ana.hist = calloc(threads, sizeof(*ana.hist));
+    ana.sum = tdc_ana_hist_new();
+    if (!ana.hist || !ana.sum)
+        return -1;
+    for (i = 0; i < threads; ++i) {
+        ana.hist[i] = tdc_ana_hist_new();
+        if (!ana.hist[i])
+            return -1;
+    }
+    return 0;
+}
+
+/* Prints how much was analyzed, and what each thread did. */
+static void print_stats(struct tdc_steal_pool *pool, int threads,
+    uint64_t ns)
+{
+    uint64_t run, stolen;
+    int i;
+
+    fprintf(stderr, "Analyzed %llu bytes, %llu events in %.2f s: "
+        "%.3f GB/s, %.3f Mevents/s\n", (unsigned long long)ana.sum->bytes,
+        (unsigned long long)ana.sum->events, ns / 1e9,
+        ns ? ana.sum->bytes / (double)ns : 0.0,
+        ns ? ana.sum->events * 1e3 / ns : 0.0);
+    if (ana.lost)
+        fprintf(stderr, "Skipped %llu bytes behind tdc-serve\n",
+            (unsigned long long)ana.lost);
+    for (i = 0; i < threads; ++i) {
+        tdc_steal_stats(pool, i, &run, &stolen);
+        fprintf(stderr, "  thread %d: %llu blocks, %llu stolen\n", i,
+            (unsigned long long)run, (unsigned long long)stolen);
+    }
+}
+
+static int analyze_online(void)
+{
+    struct tdc_steal_pool *pool;
+    struct sigaction sa;
+    struct block *blocks;
+    uint64_t start;
+    int i, num_blocks = 4 * opt.threads + 2;
+
+    // Enough blocks to keep the threads busy while one is read.
+    blocks = calloc(num_blocks, sizeof(*blocks));
+    if (!blocks || alloc_hist(opt.threads))
+        goto nomem;
+    for (i = 0; i < num_blocks; ++i) {
+        blocks[i].data = malloc(opt.block_size);
+        if (!blocks[i].data)
+            goto nomem;
+        put_block(&blocks[i]);
+    }
+    pool = tdc_steal_new(opt.threads, num_blocks, analyze, &ana);
+    if (!pool)
+        goto nomem;
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = on_signal;  /* no SA_RESTART: interrupt the read */
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+
+    start = now_ns();
+    pump(pool);
+    merge(opt.threads);
+    print_stats(pool, opt.threads, now_ns() - start);
+    tdc_steal_free(pool);
+    return write_result() ? 1 : 0;
+
+nomem:
+    fprintf(stderr, "Out of memory\n");
+    return 1;
+}
+
+/*
+ * Analyzes the run in memory with more and more threads, and reports the
+ * rate of each.
+ */
+static int bench(void)
+{
+    struct tdc_steal_pool *pool;
+    struct block *blocks;
+    unsigned char *data;
+    size_t size, off, len;
+    uint64_t ns, ns1 = 0, run, stolen, n;
+    int i, t, cards, num_blocks = 0;
+    double rate;
+
+    size = ana.run->size < opt.bench_size ? ana.run->size : opt.bench_size;
+    data = malloc(size);
+    blocks = calloc(size / 16 + 1, sizeof(*blocks));
+    if (!data || !blocks || alloc_hist(opt.threads)) {
+        fprintf(stderr, "Out of memory\n");
+        return 1;
+    }
+    size = tdc_run_read(ana.run, data, size);
+    for (off = 0; off < size; off += len) {
+        len = size - off < opt.block_size ? size - off : opt.block_size;
+        if (off + len < size) {
+            len = tdc_codec_events_len(data + off, len, ana.config.merged,
+                ana.config.format);
+            if (!len)
+                len = opt.block_size;
+        }
+        blocks[num_blocks].data = data + off;
+        blocks[num_blocks++].len = len;
+    }
+
+    fprintf(stderr, "%zu bytes in %d blocks of up to %zu KB\n", size,
+        num_blocks, opt.block_size / 1024);
+    printf("threads      GB/s  Mevents/s  speedup  stolen\n");
+    for (t = 1; ; t = t * 2 < opt.threads ? t * 2 : opt.threads) {
+        pool = tdc_steal_new(t, num_blocks, analyze, NULL);
+        if (!pool) {
+            fprintf(stderr, "Could not start %d threads\n", t);
+            return 1;
+        }
+        for (i = 0; i < t; ++i)
+            tdc_ana_hist_clear(ana.hist[i]);
+        ns = now_ns();
+        for (i = 0; i < num_blocks; ++i)
+            tdc_steal_submit(pool, &blocks[i]);
+        tdc_steal_wait(pool);
+        ns = now_ns() - ns;
+        merge(t);
+        if (t == 1)
+            ns1 = ns;
+        for (i = 0, stolen = 0; i < t; ++i) {
+            tdc_steal_stats(pool, i, &run, &n);
+            stolen += n;
+        }
+        tdc_steal_free(pool);
+        printf("%7d  %8.3f  %9.3f  %7.2f  %6llu\n", t,
+            (double)size / ns, ana.sum->events * 1e3 / ns,
+            (double)ns1 / ns, (unsigned long long)stolen);
+        if (t == opt.threads)
+            break;
+    }
+
+    // The cards seen in the stream, each at most at the maximum rate.
+    for (i = 0, cards = 0; i < TDC_ANA_MAX_CARDS; ++i)
+        cards += !!ana.sum->card_events[i];
+    if (!cards)
+        cards = 1;
+    rate = ana.sum->events * 1e9 / ns;
+    printf("%d card%s at most %d events/s: %.1f times that with %d "
+        "thread%s\n", cards, cards == 1 ? "" : "s", MAX_EVENTS_PER_CARD,
+        rate / (cards * (double)MAX_EVENTS_PER_CARD), opt.threads,
+        opt.threads == 1 ? "" : "s");
+    free(blocks);
+    free(data);
+    return 0;
+}
+
+static void usage(void)
+{
+    fprintf(stderr,
+        "Usage: tdc-analyze [options]\n"
+        "  Analyzes the stream of a device, a run or tdc-serve into\n"
+        "  histograms, see tdc_ana.h.\n"
+        "  -d DEVICE   device to read, default /dev/tdc\n"
+        "  -r RUN      recorded run to read, the prefix given to tdc-record\n"
+        "  -s SOCKET   read from tdc-serve at SOCKET\n"
+        "  -c CONFIG   calibration, gates, pairs and images\n"
+        "  -j THREADS  default the number of CPUs\n"
+        "  -b KB       size of the blocks handed out, default 256\n"
+        "  -o OUT      write the histograms to OUT, default stdout\n"
+        "  -i SECONDS  also write them to OUT this often\n"
+        "  -B          with -r: report the rate with 1 to THREADS threads\n"
+        "  -m MB       most of the run to load for -B, default 1024\n");
+}
+
+int main(int argc, char **argv)
+{
+    int c;
+
+    opt.threads = sysconf(_SC_NPROCESSORS_ONLN);
+    while ((c = getopt(argc, argv, "d:r:s:c:j:b:o:i:Bm:")) != -1) {
+        switch (c) {
+        case 'd': opt.device = optarg; break;
+        case 'r': opt.run = optarg; break;
+        case 's': opt.socket = optarg; break;
+        case 'c': opt.config = optarg; break;
+        case 'j': opt.threads = atoi(optarg); break;
+        case 'b': opt.block_size = strtoul(optarg, NULL, 0) * 1024; break;
+        case 'o': opt.output = optarg; break;
+        case 'i': opt.interval = strtoul(optarg, NULL, 0); break;
+        case 'B': opt.bench = 1; break;
+        case 'm': opt.bench_size = strtoull(optarg, NULL, 0) * MB; break;
+        default: usage(); return 1;
+        }
+    }
+    if (!opt.device && !opt.run && !opt.socket)
+        opt.device = "/dev/tdc";
+    if (optind != argc || opt.threads < 1 || !opt.block_size ||
+        !!opt.device + !!opt.run + !!opt.socket != 1 ||
+        (opt.bench && !opt.run)) {
+        usage();
+        return 1;
+    }
+
+    if (open_source())
+        return 1;
+    if (opt.config && tdc_ana_config_load(&ana.config, opt.config))
+        return 1;
+    return opt.bench ? bench() : analyze_online();
+}
@@ -0,0 +1,352 @@
+/*
+ * tdc-bench - compares ways of reading a TDC device.
+ *
+ * Reads a device until the measurement is stopped, the time is up or it
+ * is interrupted, and throws the data away. The modes are:
+ *   read    one read() into one buffer at a time
+ *   readv   one readv() into several buffers, as for handing the data
+ *           straight to several analysis buffers
+ *   aio     several reads queued with io_submit, completed in batches
+ *           with io_getevents
+ *   splice  splice() into a pipe and on to /dev/null, so the data never
+ *           passes through userspace
+ * It reports the throughput, the bytes per system call, the CPU time per
+ * GB and how many times the driver's buffer was full, so the modes can be
+ * compared at the same event rate.
+ */
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <linux/aio_abi.h>
+
+#include "tdc_run.h"
+
+#define KB 1024
+#define MAX_SEGMENTS 64
+#define MAX_QUEUE 64
+
+enum { MODE_READ, MODE_READV, MODE_AIO, MODE_SPLICE };
+
+static struct {
+    const char *device;
+    int mode;
+    size_t read_size;
+    int segments;
+    int queue;
+    unsigned int seconds;
+    unsigned long low_watermark;
+} opt = {
+    .device = "/dev/tdc",
+    .mode = MODE_READ,
+    .read_size = 64 * KB,
+    .segments = 4,
+    .queue = 8,
+};
+
+static volatile sig_atomic_t stop;
+static uint64_t total_bytes;
+static unsigned long syscalls;
+
+static void on_signal(int sig)
+{
+    stop = 1;
+}
+
+/* Is the run over? n is what the last read returned. */
+static int done(ssize_t n, uint64_t end_ns)
+{
+    if (n < 0 && errno != EINTR && errno != EAGAIN)
+        perror(opt.device);
+    if (n == 0 || (n < 0 && errno != EINTR && errno != EAGAIN) || stop)
+        return 1;
+    return end_ns && tdc_run_now_ns() >= end_ns;
+}
+
+static int bench_read(int dev, uint64_t end_ns)
+{
+    unsigned char *buf = malloc(opt.read_size);
+    ssize_t n;
+
+    if (!buf)
+        return -1;
+    do {
+        n = read(dev, buf, opt.read_size);
+        syscalls++;
+        if (n > 0)
+            total_bytes += n;
+    } while (!done(n, end_ns));
+    free(buf);
+    return 0;
+}
+
+/* Reads into opt.segments buffers, which together take opt.read_size. */
+static int bench_readv(int dev, uint64_t end_ns)
+{
+    struct iovec iov[MAX_SEGMENTS];
+    size_t seg_size = opt.read_size / opt.segments;
+    ssize_t n;
+    int i;
+
+    for (i = 0; i < opt.segments; ++i) {
+        iov[i].iov_base = malloc(seg_size);
+        iov[i].iov_len = seg_size;
+        if (!iov[i].iov_base)
+            return -1;
+    }
+    do {
+        n = readv(dev, iov, opt.segments);
+        syscalls++;
+        if (n > 0)
+            total_bytes += n;
+    } while (!done(n, end_ns));
+    for (i = 0; i < opt.segments; ++i)
+        free(iov[i].iov_base);
+    return 0;
+}
+
+/*
+ * Keeps opt.queue reads of opt.read_size submitted. The completed ones
+ * are collected and submitted again in one system call each.
+ */
+static int bench_aio(int dev, uint64_t end_ns)
+{
+    aio_context_t ctx = 0;
+    struct iocb iocbs[MAX_QUEUE], *todo[MAX_QUEUE];
+    struct io_event events[MAX_QUEUE];
+    long i, n, ntodo;
+    int eof = 0, retval = -1;
+
+    if (syscall(SYS_io_setup, opt.queue, &ctx)) {
+        perror("io_setup");
+        return -1;
+    }
+    memset(iocbs, 0, sizeof(iocbs));
+    for (i = 0; i < opt.queue; ++i) {
+        iocbs[i].aio_fildes = dev;
+        iocbs[i].aio_lio_opcode = IOCB_CMD_PREAD;
+        iocbs[i].aio_buf = (uintptr_t)malloc(opt.read_size);
+        iocbs[i].aio_nbytes = opt.read_size;
+        iocbs[i].aio_data = i;
+        if (!iocbs[i].aio_buf)
+            goto out;
+        todo[i] = &iocbs[i];
+    }
+    ntodo = opt.queue;
+
+    while (!eof) {
+        if (ntodo) {
+            n = syscall(SYS_io_submit, ctx, ntodo, todo);
+            syscalls++;
+            if (n < 0) {
+                if (errno == EINTR || errno == EAGAIN)
+                    continue;
+                perror("io_submit");
+                break;
+            }
+            // Those not taken are submitted again next time.
+            memmove(todo, todo + n, (ntodo - n) * sizeof(*todo));
+            ntodo -= n;
+        }
+        if (ntodo == opt.queue)
+            continue;
+        n = syscall(SYS_io_getevents, ctx, 1, opt.queue - ntodo, events,
+            NULL);
+        syscalls++;
+        if (n < 0) {
+            if (errno != EINTR)
+                perror("io_getevents");
+            if (stop || errno != EINTR)
+                break;
+            continue;
+        }
+        for (i = 0; i < n; ++i) {
+            errno = events[i].res < 0 ? -events[i].res : 0;
+            if (events[i].res > 0)
+                total_bytes += events[i].res;
+            if (done(events[i].res, end_ns))
+                eof = 1;
+            todo[ntodo++] = &iocbs[events[i].data];
+        }
+    }
+    retval = 0;
+out:
+    // Destroying the context waits for the reads still queued.
+    syscall(SYS_io_destroy, ctx);
+    for (i = 0; i < opt.queue; ++i)
+        free((void *)(uintptr_t)iocbs[i].aio_buf);
+    return retval;
+}
+
+/*
+ * Moves opt.read_size at a time from the device into a pipe, and from the
+ * pipe to /dev/null. Both splices count as system calls.
+ */
+static int bench_splice(int dev, uint64_t end_ns)
+{
+    int pipefd[2], null, retval = -1;
+    ssize_t n, m, left;
+
+    null = open("/dev/null", O_WRONLY);
+    if (null < 0) {
+        perror("/dev/null");
+        return -1;
+    }
+    if (pipe(pipefd)) {
+        perror("pipe");
+        close(null);
+        return -1;
+    }
+    do {
+        n = splice(dev, NULL, pipefd[1], NULL, opt.read_size,
+            SPLICE_F_MOVE | SPLICE_F_MORE);
+        syscalls++;
+        for (left = n; left > 0; left -= m) {
+            m = splice(pipefd[0], NULL, null, NULL, left, SPLICE_F_MOVE);
+            syscalls++;
+            if (m < 0) {
+                if (errno != EINTR) {
+                    perror("splice");
+                    goto out;
+                }
+                m = 0;
+            }
+        }
+        if (n > 0)
+            total_bytes += n;
+    } while (!done(n, end_ns));
+    retval = 0;
+out:
+    close(pipefd[0]);
+    close(pipefd[1]);
+    close(null);
+    return retval;
+}
+
+static void usage(const char *name)
+{
+    fprintf(stderr,
+        "Usage: %s [options]\n"
+        "Reads a TDC device until the measurement is stopped, and reports\n"
+        "how fast and at what cost it was read.\n"
+        "  -d DEVICE   device to read, default /dev/tdc\n"
+        "  -m MODE     read (default), readv, aio or splice\n"
+        "  -b KB       bytes per read, default 64\n"
+        "  -v NUM      readv: number of buffers per read, default 4\n"
+        "  -q NUM      aio: number of reads queued, default 8\n"
+        "  -t SECONDS  stop after this many seconds, default never\n"
+        "  -w BYTES    set the low watermark of the reader first\n",
+        name);
+}
+
+int main(int argc, char **argv)
+{
+    struct sigaction sa;
+    struct rusage usage_start, usage_end;
+    uint64_t start_ns, end_ns, elapsed_ns;
+    unsigned long overflow_start, overflow_end;
+    double seconds, cpu, gb;
+    char cmd[64];
+    int c, dev, retval;
+
+    while ((c = getopt(argc, argv, "d:m:b:v:q:t:w:h")) != -1) {
+        switch (c) {
+        case 'd': opt.device = optarg; break;
+        case 'b': opt.read_size = strtoul(optarg, NULL, 0) * KB; break;
+        case 'v': opt.segments = atoi(optarg); break;
+        case 'q': opt.queue = atoi(optarg); break;
+        case 't': opt.seconds = strtoul(optarg, NULL, 0); break;
+        case 'w': opt.low_watermark = strtoul(optarg, NULL, 0); break;
+        case 'm':
+            if (strcmp(optarg, "read") == 0)
+                opt.mode = MODE_READ;
+            else if (strcmp(optarg, "readv") == 0)
+                opt.mode = MODE_READV;
+            else if (strcmp(optarg, "aio") == 0)
+                opt.mode = MODE_AIO;
+            else if (strcmp(optarg, "splice") == 0)
+                opt.mode = MODE_SPLICE;
+            else {
+                usage(argv[0]);
+                return 1;
+            }
+            break;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if (!opt.read_size || opt.segments < 1 || opt.segments > MAX_SEGMENTS ||
+        opt.queue < 1 || opt.queue > MAX_QUEUE ||
+        opt.read_size < (size_t)opt.segments) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    dev = open(opt.device, opt.low_watermark ? O_RDWR : O_RDONLY);
+    if (dev < 0) {
+        perror(opt.device);
+        return 1;
+    }
+    if (opt.low_watermark) {
+        snprintf(cmd, sizeof(cmd), "set_low_watermark %lu",
+            opt.low_watermark);
+        if (write(dev, cmd, strlen(cmd)) < 0)
+            perror("set_low_watermark");
+    }
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = on_signal;  /* no SA_RESTART: interrupt the read */
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+
+    overflow_start = tdc_run_buffer_full(opt.device);
+    start_ns = tdc_run_now_ns();
+    end_ns = opt.seconds ? start_ns + opt.seconds * 1000000000ULL : 0;
+    getrusage(RUSAGE_SELF, &usage_start);
+
+    switch (opt.mode) {
+    case MODE_READV:
+        retval = bench_readv(dev, end_ns);
+        break;
+    case MODE_AIO:
+        retval = bench_aio(dev, end_ns);
+        break;
+    case MODE_SPLICE:
+        retval = bench_splice(dev, end_ns);
+        break;
+    default:
+        retval = bench_read(dev, end_ns);
+    }
+
+    getrusage(RUSAGE_SELF, &usage_end);
+    elapsed_ns = tdc_run_now_ns() - start_ns;
+    overflow_end = tdc_run_buffer_full(opt.device);
+    close(dev);
+
+    seconds = elapsed_ns / 1e9;
+    gb = total_bytes / 1e9;
+    cpu = (usage_end.ru_utime.tv_sec - usage_start.ru_utime.tv_sec) +
+        (usage_end.ru_stime.tv_sec - usage_start.ru_stime.tv_sec) +
+        ((usage_end.ru_utime.tv_usec - usage_start.ru_utime.tv_usec) +
+        (usage_end.ru_stime.tv_usec - usage_start.ru_stime.tv_usec)) / 1e6;
+
+    fprintf(stderr, "Read %llu bytes in %.1f s: %.1f MB/s\n",
+        (unsigned long long)total_bytes, seconds,
+        seconds > 0 ? total_bytes / seconds / (KB * KB) : 0.0);
+    fprintf(stderr, "System calls: %lu, %.0f bytes per call\n", syscalls,
+        syscalls ? (double)total_bytes / syscalls : 0.0);
+    fprintf(stderr, "CPU time: %.2f s, %.2f s per GB\n",
+        cpu, gb > 0 ? cpu / gb : 0.0);
+    fprintf(stderr, "Driver buffer full during the run: %lu times\n",
+        overflow_end - overflow_start);
+
+    return retval ? 1 : 0;
+}
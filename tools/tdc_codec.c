@@ -0,0 +1,906 @@
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "tdc_format.h"
+#include "tdc_codec.h"
+
+/* Fails to compile if the file format changes size by mistake. */
+typedef char tdc_codec_block_size_check
+    [sizeof(struct tdc_codec_block) == 96 ? 1 : -1];
+
+#define TDC_LZ_HASH_BITS 13
+#define TDC_LZ_MIN_MATCH 4
+#define TDC_LZ_MAX_OFFSET 65535
+
+struct tdc_codec *tdc_codec_new(int merged, unsigned int format)
+{
+    struct tdc_codec *codec;
+
+    codec = calloc(1, sizeof(*codec));
+    if (!codec)
+        return NULL;
+    codec->merged = merged;
+    codec->format = format;
+    codec->planes = malloc(TDC_CODEC_BLOCK_SIZE);
+    codec->hash = malloc(sizeof(uint32_t) << TDC_LZ_HASH_BITS);
+    if (!codec->planes || !codec->hash) {
+        tdc_codec_free(codec);
+        return NULL;
+    }
+    return codec;
+}
+
+void tdc_codec_free(struct tdc_codec *codec)
+{
+    if (!codec)
+        return;
+    free(codec->planes);
+    free(codec->hash);
+    free(codec);
+}
+
+static inline uint32_t tdc_get_le32(const unsigned char *p)
+{
+    return p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+static inline uint64_t tdc_get_le64(const unsigned char *p)
+{
+    return tdc_get_le32(p) | (uint64_t)tdc_get_le32(p + 4) << 32;
+}
+
+/*
+ * The length of the event or record at the start of data, with its card
+ * number, or 0 if it is not all there.
+ */
+static inline size_t tdc_codec_event_size(const unsigned char *data,
+    size_t len, int merged, unsigned int format)
+{
+    size_t n = merged;
+
+    if (len <= n)
+        return 0;
+    if (data[n] >= TDC_REC_MIN) {
+        n += TDC_REC_SIZE_OF(data[n]);
+    } else {
+        n += 1 + 3 * data[n];
+        if (format & TDC_FMT_SEQ)
+            n += 4;
+        if (format & TDC_FMT_TIME)
+            n += 8;
+    }
+    return n <= len ? n : 0;
+}
+
+/*
+ * Returns the length of the whole events and records at the start of
+ * data, which must start with one.
+ */
+size_t tdc_codec_events_len(const unsigned char *data, size_t len,
+    int merged, unsigned int format)
+{
+    size_t pos = 0, n;
+
+    while ((n = tdc_codec_event_size(data + pos, len - pos, merged, format)))
+        pos += n;
+    return pos;
+}
+
+/*
+ * The planes of TDC_FILTER_EVENTS follow each other, so each is found from
+ * the lengths of those before it. The bytes of the sequence numbers and
+ * times are found by event, e.g. byte i of that of event e at
+ * seq + i * events + e, and those of the hits by hit.
+ */
+struct tdc_codec_planes {
+    unsigned char *head, *seq, *time, *channel, *lo, *hi, *record, *tail;
+};
+
+static void tdc_codec_planes_find(struct tdc_codec_planes *p,
+    unsigned char *planes, const uint32_t *len)
+{
+    int i;
+
+    p->head = planes;
+    p->seq = p->head + len[TDC_PLANE_HEAD];
+    p->time = p->seq;
+    for (i = 0; i < 4; ++i)
+        p->time += len[TDC_PLANE_SEQ + i];
+    p->channel = p->time;
+    for (i = 0; i < 8; ++i)
+        p->channel += len[TDC_PLANE_TIME + i];
+    p->lo = p->channel + len[TDC_PLANE_CHANNEL];
+    p->hi = p->lo + len[TDC_PLANE_DELAY_LO];
+    p->record = p->hi + len[TDC_PLANE_DELAY_HI];
+    p->tail = p->record + len[TDC_PLANE_RECORD];
+}
+
+/* Sorts the bytes of a block into planes, see tdc_codec.h. */
+static void tdc_codec_filter(struct tdc_codec *codec,
+    const unsigned char *raw, size_t len, uint32_t *planes)
+{
+    const int merged = codec->merged;
+    const int seq = codec->format & TDC_FMT_SEQ;
+    const int time = codec->format & TDC_FMT_TIME;
+    struct tdc_codec_planes pl;
+    unsigned char *head_p, *seq_p, *time_p, *channel_p, *lo_p, *hi_p;
+    const unsigned char *p;
+    uint32_t value, prev_seq = 0, events = 0, hits = 0, e, h;
+    uint64_t value64, prev_time = 0;
+    size_t pos, n, head = 0, record = 0;
+    unsigned int num, i;
+
+    // First count the bytes of each plane, then sort the bytes into them.
+    memset(planes, 0, TDC_NUM_PLANES * sizeof(*planes));
+    for (pos = 0; (n = tdc_codec_event_size(raw + pos, len - pos, merged,
+            codec->format)); pos += n) {
+        num = raw[pos + merged];
+        head += merged + 1;
+        if (num >= TDC_REC_MIN) {
+            record += n - merged - 1;
+        } else {
+            events++;
+            hits += num;
+        }
+    }
+    planes[TDC_PLANE_HEAD] = head;
+    for (i = 0; i < 4; ++i)
+        planes[TDC_PLANE_SEQ + i] = seq ? events : 0;
+    for (i = 0; i < 8; ++i)
+        planes[TDC_PLANE_TIME + i] = time ? events : 0;
+    planes[TDC_PLANE_CHANNEL] = hits;
+    planes[TDC_PLANE_DELAY_LO] = hits;
+    planes[TDC_PLANE_DELAY_HI] = hits;
+    planes[TDC_PLANE_RECORD] = record;
+    planes[TDC_PLANE_TAIL] = len - pos;
+    tdc_codec_planes_find(&pl, codec->planes, planes);
+    // In locals, since the stores to the planes could change pl.
+    head_p = pl.head;
+    seq_p = pl.seq;
+    time_p = pl.time;
+    channel_p = pl.channel;
+    lo_p = pl.lo;
+    hi_p = pl.hi;
+
+    head = record = 0;
+    for (pos = 0, e = h = 0; (n = tdc_codec_event_size(raw + pos,
+            len - pos, merged, codec->format)); pos += n) {
+        p = raw + pos;
+        if (merged)
+            head_p[head++] = *p++;
+        num = *p++;
+        head_p[head++] = num;
+        if (num >= TDC_REC_MIN) {
+            memcpy(pl.record + record, p, n - merged - 1);
+            record += n - merged - 1;
+            continue;
+        }
+        if (seq) {
+            value = tdc_get_le32(p);
+            for (i = 0; i < 4; ++i)
+                seq_p[i * events + e] = (value - prev_seq) >> 8 * i;
+            prev_seq = value;
+            p += 4;
+        }
+        if (time) {
+            value64 = tdc_get_le64(p);
+            for (i = 0; i < 8; ++i)
+                time_p[i * events + e] = (value64 - prev_time) >> 8 * i;
+            prev_time = value64;
+            p += 8;
+        }
+        e++;
+        for (i = 0; i < num; ++i, ++h, p += 3) {
+            channel_p[h] = p[0];
+            lo_p[h] = p[1];
+            hi_p[h] = p[2];
+        }
+    }
+    memcpy(pl.tail, raw + pos, len - pos);
+}
+
+/*
+ * Puts the bytes of the planes back in stream order.
+ * Returns 0 on success, -1 if the planes don't fit together.
+ */
+static int tdc_codec_unfilter(const struct tdc_codec_block *block,
+    const unsigned char *planes, unsigned char *raw)
+{
+    const int merged = block->merged;
+    const int seq = block->format & TDC_FMT_SEQ;
+    const int time = block->format & TDC_FMT_TIME;
+    const size_t num_head = block->planes[TDC_PLANE_HEAD];
+    const size_t num_hits = block->planes[TDC_PLANE_CHANNEL];
+    const size_t num_record = block->planes[TDC_PLANE_RECORD];
+    struct tdc_codec_planes pl;
+    const unsigned char *head_p, *seq_p, *time_p, *channel_p, *lo_p, *hi_p;
+    const uint32_t events = block->planes[TDC_PLANE_SEQ] ?
+        block->planes[TDC_PLANE_SEQ] : block->planes[TDC_PLANE_TIME];
+    unsigned char *out = raw, *out_end = raw + block->raw_len;
+    uint32_t value, prev_seq = 0, e = 0;
+    uint64_t value64, prev_time = 0;
+    size_t n, head = 0, hit = 0, record = 0;
+    unsigned int num, i;
+
+    // The planes the filter makes of the same number of events and hits.
+    for (i = 0; i < 4; ++i)
+        if (block->planes[TDC_PLANE_SEQ + i] != (seq ?
+                block->planes[TDC_PLANE_SEQ] : 0))
+            return -1;
+    for (i = 0; i < 8; ++i)
+        if (block->planes[TDC_PLANE_TIME + i] != (time ?
+                block->planes[TDC_PLANE_TIME] : 0))
+            return -1;
+    if (block->planes[TDC_PLANE_DELAY_LO] != num_hits ||
+        block->planes[TDC_PLANE_DELAY_HI] != num_hits)
+        return -1;
+    tdc_codec_planes_find(&pl, (unsigned char *)planes, block->planes);
+    head_p = pl.head;
+    seq_p = pl.seq;
+    time_p = pl.time;
+    channel_p = pl.channel;
+    lo_p = pl.lo;
+    hi_p = pl.hi;
+
+    while (head < num_head) {
+        if (num_head - head < merged + 1)
+            return -1;
+        num = head_p[head + merged];
+        if (num >= TDC_REC_MIN) {
+            n = TDC_REC_SIZE_OF(num) - 1;
+            if (num_record - record < n || out_end - out < merged + 1 + n)
+                return -1;
+            if (merged)
+                *out++ = head_p[head++];
+            *out++ = head_p[head++];
+            memcpy(out, pl.record + record, n);
+            record += n;
+            out += n;
+            continue;
+        }
+
+        if (((seq || time) && e == events) || num_hits - hit < num ||
+            out_end - out < merged + 1 + (seq ? 4 : 0) + (time ? 8 : 0) +
+                3 * num)
+            return -1;
+        if (merged)
+            *out++ = head_p[head++];
+        *out++ = head_p[head++];
+        if (seq) {
+            value = 0;
+            for (i = 0; i < 4; ++i)
+                value |= (uint32_t)seq_p[i * events + e] << 8 * i;
+            prev_seq += value;
+            for (i = 0; i < 4; ++i)
+                *out++ = prev_seq >> 8 * i;
+        }
+        if (time) {
+            value64 = 0;
+            for (i = 0; i < 8; ++i)
+                value64 |= (uint64_t)time_p[i * events + e] << 8 * i;
+            prev_time += value64;
+            for (i = 0; i < 8; ++i)
+                *out++ = prev_time >> 8 * i;
+        }
+        e++;
+        for (i = 0; i < num; ++i, ++hit) {
+            *out++ = channel_p[hit];
+            *out++ = lo_p[hit];
+            *out++ = hi_p[hit];
+        }
+    }
+
+    n = block->planes[TDC_PLANE_TAIL];
+    if (out_end - out != n)
+        return -1;
+    memcpy(out, pl.tail, n);
+    return 0;
+}
+
+/* The most bytes tdc_lz_compress can make of len bytes. */
+size_t tdc_lz_bound(size_t len)
+{
+    return len + len / 255 + 16;
+}
+
+static inline uint32_t tdc_lz_read32(const unsigned char *p)
+{
+    uint32_t value;
+
+    memcpy(&value, p, sizeof(value));
+    return value;
+}
+
+static inline uint64_t tdc_lz_read64(const unsigned char *p)
+{
+    uint64_t value;
+
+    memcpy(&value, p, sizeof(value));
+    return value;
+}
+
+static inline uint32_t tdc_lz_hash(uint32_t value)
+{
+    return (value * 2654435761U) >> (32 - TDC_LZ_HASH_BITS);
+}
+
+/* Puts the rest of a length that did not fit in its 4 bits. */
+static inline unsigned char *tdc_lz_put_len(unsigned char *op, size_t len)
+{
+    while (len >= 255) {
+        *op++ = 255;
+        len -= 255;
+    }
+    *op++ = len;
+    return op;
+}
+
+/*
+ * Compresses len bytes into out, which must have room for
+ * tdc_lz_bound(len) bytes. The output is a series of sequences, each
+ * with some literal bytes and then a match: a token byte with the number
+ * of literals in the high 4 bits and the length of the match less
+ * TDC_LZ_MIN_MATCH in the low 4 bits (15 meaning that more bytes of the
+ * length follow, each added until one is not 255), the literals, the
+ * distance back to the match in 2 bytes, low byte first, and the rest of
+ * the match length. The last sequence only has literals.
+ * hash is the table of 1 << TDC_LZ_HASH_BITS positions.
+ * Returns the length of the output.
+ */
+size_t tdc_lz_compress(uint32_t *hash, const unsigned char *in, size_t len,
+    unsigned char *out)
+{
+    const unsigned char *ip = in, *anchor = in, *end = in + len, *ref;
+    const unsigned char *limit = len > 12 ? end - 12 : in;
+    unsigned char *op = out, *token;
+    uint32_t value, h;
+    size_t lit, match;
+
+    memset(hash, 0, sizeof(uint32_t) << TDC_LZ_HASH_BITS);
+    while (ip < limit) {
+        value = tdc_lz_read32(ip);
+        h = tdc_lz_hash(value);
+        ref = in + hash[h];
+        hash[h] = ip - in;
+        if (ref >= ip || ip - ref > TDC_LZ_MAX_OFFSET ||
+            tdc_lz_read32(ref) != value) {
+            // Step faster through data that doesn't compress.
+            ip += 1 + ((ip - anchor) >> 6);
+            continue;
+        }
+        while (ip > anchor && ref > in && ip[-1] == ref[-1]) {
+            ip--;
+            ref--;
+        }
+        match = TDC_LZ_MIN_MATCH;
+        while (ip + match + 8 <= end &&
+            tdc_lz_read64(ip + match) == tdc_lz_read64(ref + match))
+            match += 8;
+        while (ip + match < end && ip[match] == ref[match])
+            match++;
+
+        lit = ip - anchor;
+        token = op++;
+        *token = (lit < 15 ? lit : 15) << 4;
+        if (lit >= 15)
+            op = tdc_lz_put_len(op, lit - 15);
+        memcpy(op, anchor, lit);
+        op += lit;
+        *op++ = (ip - ref) & 0xff;
+        *op++ = (ip - ref) >> 8;
+        match -= TDC_LZ_MIN_MATCH;
+        *token |= match < 15 ? match : 15;
+        if (match >= 15)
+            op = tdc_lz_put_len(op, match - 15);
+
+        ip += match + TDC_LZ_MIN_MATCH;
+        anchor = ip;
+        if (ip - 2 > in && ip < limit)
+            hash[tdc_lz_hash(tdc_lz_read32(ip - 2))] = ip - 2 - in;
+    }
+
+    lit = end - anchor;
+    *op++ = (lit < 15 ? lit : 15) << 4;
+    if (lit >= 15)
+        op = tdc_lz_put_len(op, lit - 15);
+    memcpy(op, anchor, lit);
+    op += lit;
+    return op - out;
+}
+
+/*
+ * Decompresses what tdc_lz_compress made of out_len bytes.
+ * Returns the length of the output, or -1 if the input is not valid.
+ */
+long tdc_lz_decompress(const unsigned char *in, size_t len,
+    unsigned char *out, size_t out_len)
+{
+    const unsigned char *ip = in, *end = in + len;
+    unsigned char *op = out, *out_end = out + out_len, *ref;
+    size_t lit, match, offset;
+    unsigned int token, byte;
+
+    while (ip < end) {
+        token = *ip++;
+        lit = token >> 4;
+        if (lit == 15) {
+            do {
+                if (ip == end)
+                    return -1;
+                byte = *ip++;
+                lit += byte;
+            } while (byte == 255);
+        }
+        if (lit > (size_t)(end - ip) || lit > (size_t)(out_end - op))
+            return -1;
+        memcpy(op, ip, lit);
+        ip += lit;
+        op += lit;
+        if (ip == end)
+            break;
+
+        if (end - ip < 2)
+            return -1;
+        offset = ip[0] | ip[1] << 8;
+        ip += 2;
+        match = token & 15;
+        if (match == 15) {
+            do {
+                if (ip == end)
+                    return -1;
+                byte = *ip++;
+                match += byte;
+            } while (byte == 255);
+        }
+        match += TDC_LZ_MIN_MATCH;
+        if (!offset || offset > (size_t)(op - out) ||
+            match > (size_t)(out_end - op))
+            return -1;
+
+        ref = op - offset;
+        if (offset >= match) {
+            memcpy(op, ref, match);
+            op += match;
+        } else if (offset >= 8) {
+            // Each 8 bytes copied are before those being written.
+            while (match >= 8) {
+                memcpy(op, ref, 8);
+                op += 8;
+                ref += 8;
+                match -= 8;
+            }
+            while (match--)
+                *op++ = *ref++;
+        } else {
+            while (match--)
+                *op++ = *ref++;
+        }
+    }
+    return op - out;
+}
+
+/*
+ * The most bytes a compressed block of raw_len stream bytes can take,
+ * padded to align.
+ */
+size_t tdc_codec_bound(size_t raw_len, size_t align)
+{
+    return sizeof(struct tdc_codec_block) + tdc_lz_bound(raw_len) + align;
+}
+
+/*
+ * Compresses len bytes of the stream, at most TDC_CODEC_BLOCK_SIZE, into
+ * a block in out, which must have room for tdc_codec_bound(len, align)
+ * bytes. The block is padded with zeros to a multiple of align, so that it
+ * can be written with O_DIRECT.
+ * Returns the size of the block.
+ */
+size_t tdc_codec_compress(struct tdc_codec *codec, const unsigned char *raw,
+    size_t len, unsigned char *out, size_t align)
+{
+    struct tdc_codec_block *block = (struct tdc_codec_block *)out;
+    unsigned char *data = out + sizeof(*block);
+    size_t n, size;
+
+    memset(block, 0, sizeof(*block));
+    memcpy(block->magic, TDC_CODEC_MAGIC, sizeof(block->magic));
+    block->raw_len = len;
+    block->filter = TDC_FILTER_EVENTS;
+    block->merged = codec->merged;
+    block->format = codec->format;
+    tdc_codec_filter(codec, raw, len, block->planes);
+
+    n = tdc_lz_compress(codec->hash, codec->planes, len, data);
+    if (n < len) {
+        block->method = TDC_METHOD_LZ;
+        block->data_len = n;
+    } else {
+        block->method = TDC_METHOD_STORED;
+        block->data_len = len;
+        memcpy(data, codec->planes, len);
+    }
+
+    size = sizeof(*block) + block->data_len;
+    if (align > 1 && size % align) {
+        memset(out + size, 0, align - size % align);
+        size += align - size % align;
+    }
+    block->size = size;
+    return size;
+}
+
+/*
+ * Checks the header of a compressed block.
+ * Returns 0 if it is one, -1 if not.
+ */
+int tdc_codec_check(const struct tdc_codec_block *block)
+{
+    uint64_t sum = 0;
+    int i;
+
+    if (memcmp(block->magic, TDC_CODEC_MAGIC, sizeof(block->magic)) ||
+        block->raw_len > TDC_CODEC_BLOCK_SIZE ||
+        block->size < sizeof(*block) ||
+        block->size > tdc_codec_bound(TDC_CODEC_BLOCK_SIZE,
+            TDC_CODEC_MAX_ALIGN) ||
+        block->data_len > block->size - sizeof(*block) ||
+        block->filter > TDC_FILTER_EVENTS || block->method > TDC_METHOD_LZ)
+        return -1;
+    for (i = 0; i < TDC_NUM_PLANES; ++i)
+        sum += block->planes[i];
+    if (block->filter == TDC_FILTER_NONE)
+        sum = block->planes[0];
+    return sum == block->raw_len ? 0 : -1;
+}
+
+/*
+ * Decompresses the block in the size bytes at block into raw, which must
+ * have room for TDC_CODEC_BLOCK_SIZE bytes.
+ * Returns the number of stream bytes, or -1 if it is not a valid block.
+ */
+long tdc_codec_decompress(struct tdc_codec *codec,
+    const unsigned char *block, size_t size, unsigned char *raw)
+{
+    const struct tdc_codec_block *header =
+        (const struct tdc_codec_block *)block;
+    const unsigned char *data = block + sizeof(*header), *planes = data;
+
+    if (size < sizeof(*header) || tdc_codec_check(header) ||
+        size < sizeof(*header) + header->data_len)
+        return -1;
+    if (header->method == TDC_METHOD_LZ) {
+        if (tdc_lz_decompress(data, header->data_len, codec->planes,
+                header->raw_len) != header->raw_len)
+            return -1;
+        planes = codec->planes;
+    } else if (header->data_len != header->raw_len) {
+        return -1;
+    }
+
+    if (header->filter == TDC_FILTER_NONE)
+        memcpy(raw, planes, header->raw_len);
+    else if (tdc_codec_unfilter(header, planes, raw))
+        return -1;
+    return header->raw_len;
+}
+
+/**
+ * struct tdc_codec_thread - a thread of a struct tdc_codec_pool
+ * @pool:       The pool.
+ * @codec:      What the thread works with.
+ * @thread:     The thread.
+ */
+struct tdc_codec_thread {
+    struct tdc_codec_pool *pool;
+    struct tdc_codec *codec;
+    pthread_t thread;
+};
+
+/**
+ * struct tdc_codec_pool - threads that compress or decompress blocks
+ * @threads:    The threads, with their codecs. With only one, the jobs are
+ *              run by the caller with its codec.
+ * @nthreads:   Number of threads,
+ * @started:    and how many of them were started.
+ * @align:      What compressed blocks are padded to.
+ * @lock:       Protects the rest.
+ * @work:       Signalled when there are new jobs,
+ * @done:       and when they are all done.
+ * @jobs, @njobs: The jobs being run,
+ * @next:       the next one to be taken,
+ * @finished:   and how many are done.
+ * @quit:       Set to end the threads.
+ */
+struct tdc_codec_pool {
+    struct tdc_codec_thread *threads;
+    int nthreads, started;
+    size_t align;
+    pthread_mutex_t lock;
+    pthread_cond_t work, done;
+    struct tdc_codec_job *jobs;
+    int njobs, next, finished;
+    int quit;
+};
+
+static uint64_t tdc_codec_cpu_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void tdc_codec_run_job(struct tdc_codec *codec,
+    struct tdc_codec_job *job, size_t align)
+{
+    uint64_t start = tdc_codec_cpu_ns();
+    long n;
+
+    job->error = 0;
+    if (job->decompress) {
+        n = tdc_codec_decompress(codec, job->in, job->in_len, job->out);
+        job->error = n < 0;
+        job->out_len = n < 0 ? 0 : n;
+    } else {
+        job->out_len = tdc_codec_compress(codec, job->in, job->in_len,
+            job->out, align);
+    }
+    job->cpu_ns = tdc_codec_cpu_ns() - start;
+}
+
+static void *tdc_codec_worker(void *arg)
+{
+    struct tdc_codec_thread *self = arg;
+    struct tdc_codec_pool *pool = self->pool;
+    struct tdc_codec_job *job;
+
+    pthread_mutex_lock(&pool->lock);
+    for (;;) {
+        while (!pool->quit && pool->next == pool->njobs)
+            pthread_cond_wait(&pool->work, &pool->lock);
+        if (pool->quit)
+            break;
+        job = &pool->jobs[pool->next++];
+        pthread_mutex_unlock(&pool->lock);
+        tdc_codec_run_job(self->codec, job, pool->align);
+        pthread_mutex_lock(&pool->lock);
+        if (++pool->finished == pool->njobs)
+            pthread_cond_signal(&pool->done);
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return NULL;
+}
+
+/*
+ * Starts threads to compress or decompress blocks. With one thread, the
+ * jobs are run by the caller instead. align is what compressed blocks are
+ * padded to, see tdc_codec_compress.
+ * Returns the pool, or NULL on error.
+ */
+struct tdc_codec_pool *tdc_codec_pool_new(int threads, int merged,
+    unsigned int format, size_t align)
+{
+    struct tdc_codec_pool *pool;
+    int i;
+
+    pool = calloc(1, sizeof(*pool));
+    if (!pool)
+        return NULL;
+    pool->nthreads = threads > 1 ? threads : 1;
+    pool->align = align;
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->work, NULL);
+    pthread_cond_init(&pool->done, NULL);
+    pool->threads = calloc(pool->nthreads, sizeof(*pool->threads));
+    if (!pool->threads)
+        goto fail;
+    for (i = 0; i < pool->nthreads; ++i) {
+        pool->threads[i].pool = pool;
+        pool->threads[i].codec = tdc_codec_new(merged, format);
+        if (!pool->threads[i].codec)
+            goto fail;
+    }
+    for (i = 0; pool->nthreads > 1 && i < pool->nthreads; ++i) {
+        if (pthread_create(&pool->threads[i].thread, NULL, tdc_codec_worker,
+                &pool->threads[i]))
+            goto fail;
+        pool->started++;
+    }
+    return pool;
+
+fail:
+    tdc_codec_pool_free(pool);
+    return NULL;
+}
+
+/* Runs the jobs, and returns when they are all done. */
+void tdc_codec_pool_run(struct tdc_codec_pool *pool,
+    struct tdc_codec_job *jobs, int njobs)
+{
+    int i;
+
+    if (pool->nthreads == 1) {
+        for (i = 0; i < njobs; ++i)
+            tdc_codec_run_job(pool->threads[0].codec, &jobs[i], pool->align);
+        return;
+    }
+    pthread_mutex_lock(&pool->lock);
+    pool->jobs = jobs;
+    pool->njobs = njobs;
+    pool->next = 0;
+    pool->finished = 0;
+    pthread_cond_broadcast(&pool->work);
+    while (pool->finished < njobs)
+        pthread_cond_wait(&pool->done, &pool->lock);
+    pool->jobs = NULL;
+    pool->njobs = 0;
+    pool->next = 0;
+    pthread_mutex_unlock(&pool->lock);
+}
+
+void tdc_codec_pool_free(struct tdc_codec_pool *pool)
+{
+    int i;
+
+    if (!pool)
+        return;
+    if (pool->threads) {
+        pthread_mutex_lock(&pool->lock);
+        pool->quit = 1;
+        pthread_cond_broadcast(&pool->work);
+        pthread_mutex_unlock(&pool->lock);
+        for (i = 0; i < pool->started; ++i)
+            pthread_join(pool->threads[i].thread, NULL);
+        for (i = 0; i < pool->nthreads; ++i)
+            tdc_codec_free(pool->threads[i].codec);
+        free(pool->threads);
+    }
+    pthread_mutex_destroy(&pool->lock);
+    pthread_cond_destroy(&pool->work);
+    pthread_cond_destroy(&pool->done);
+    free(pool);
+}
+
+/*
+ * Starts compressing a stream with the given number of threads. The
+ * blocks are padded to align, and given to write in stream order.
+ * Returns the writer, or NULL on error.
+ */
+struct tdc_codec_writer *tdc_codec_writer_open(int threads, int merged,
+    unsigned int format, size_t align, tdc_codec_write_fn write, void *arg)
+{
+    struct tdc_codec_writer *writer;
+    int i;
+
+    writer = calloc(1, sizeof(*writer));
+    if (!writer)
+        return NULL;
+    writer->njobs = threads > 1 ? threads : 1;
+    writer->merged = merged;
+    writer->format = format;
+    writer->write = write;
+    writer->arg = arg;
+    writer->pool = tdc_codec_pool_new(threads, merged, format, align);
+    writer->jobs = calloc(writer->njobs, sizeof(*writer->jobs));
+    writer->raw = malloc((size_t)writer->njobs * TDC_CODEC_BLOCK_SIZE);
+    if (!writer->pool || !writer->jobs || !writer->raw)
+        goto fail;
+    for (i = 0; i < writer->njobs; ++i) {
+        // The blocks may be written with O_DIRECT.
+        if (posix_memalign((void **)&writer->jobs[i].out,
+                align > 64 ? align : 64,
+                tdc_codec_bound(TDC_CODEC_BLOCK_SIZE, align)))
+            goto fail;
+    }
+    return writer;
+
+fail:
+    tdc_codec_writer_free(writer);
+    return NULL;
+}
+
+/* Compresses the blocks that are ready, and writes them. */
+static int tdc_codec_writer_run(struct tdc_codec_writer *writer)
+{
+    struct tdc_codec_job *job;
+    int i, filled = writer->filled;
+
+    writer->filled = 0;
+    tdc_codec_pool_run(writer->pool, writer->jobs, filled);
+    for (i = 0; i < filled; ++i) {
+        job = &writer->jobs[i];
+        writer->cpu_ns += job->cpu_ns;
+        if (writer->write(writer->arg, job->out, job->out_len, job->in_len))
+            return -1;
+        writer->raw_bytes += job->in_len;
+        writer->bytes += job->out_len;
+    }
+    return 0;
+}
+
+/*
+ * Ends the block being filled after its last whole event, and moves the
+ * rest to the next one.
+ */
+static int tdc_codec_writer_cut(struct tdc_codec_writer *writer, int last)
+{
+    unsigned char *raw = writer->raw +
+        (size_t)writer->filled * TDC_CODEC_BLOCK_SIZE;
+    struct tdc_codec_job *job = &writer->jobs[writer->filled];
+    size_t whole = writer->fill;
+
+    if (!last)
+        whole = tdc_codec_events_len(raw, writer->fill, writer->merged,
+            writer->format);
+    // Not the stream that was expected; cut it anyway rather than stall.
+    if (!whole)
+        whole = writer->fill;
+    job->decompress = 0;
+    job->in = raw;
+    job->in_len = whole;
+    writer->filled++;
+    if ((writer->filled == writer->njobs || last) &&
+        tdc_codec_writer_run(writer))
+        return -1;
+
+    writer->fill -= whole;
+    memmove(writer->raw + (size_t)writer->filled * TDC_CODEC_BLOCK_SIZE,
+        raw + whole, writer->fill);
+    return 0;
+}
+
+/*
+ * Adds the next len bytes of the stream. The blocks are compressed once
+ * there is one for each thread.
+ * Returns 0 on success, -1 if a block could not be written.
+ */
+int tdc_codec_writer_feed(struct tdc_codec_writer *writer,
+    const unsigned char *data, size_t len)
+{
+    unsigned char *raw;
+    size_t n;
+
+    while (len > 0) {
+        raw = writer->raw + (size_t)writer->filled * TDC_CODEC_BLOCK_SIZE;
+        n = TDC_CODEC_BLOCK_SIZE - writer->fill;
+        if (n > len)
+            n = len;
+        memcpy(raw + writer->fill, data, n);
+        writer->fill += n;
+        data += n;
+        len -= n;
+        if (writer->fill == TDC_CODEC_BLOCK_SIZE &&
+            tdc_codec_writer_cut(writer, 0))
+            return -1;
+    }
+    return 0;
+}
+
+/*
+ * Compresses and writes the rest of the stream, at the end of it.
+ * Returns 0 on success, -1 on error.
+ */
+int tdc_codec_writer_flush(struct tdc_codec_writer *writer)
+{
+    if (writer->fill > 0)
+        return tdc_codec_writer_cut(writer, 1);
+    if (writer->filled > 0)
+        return tdc_codec_writer_run(writer);
+    return 0;
+}
+
+void tdc_codec_writer_free(struct tdc_codec_writer *writer)
+{
+    int i;
+
+    if (!writer)
+        return;
+    tdc_codec_pool_free(writer->pool);
+    for (i = 0; i < writer->njobs; ++i)
+        free(writer->jobs[i].out);
+    free(writer->jobs);
+    free(writer->raw);
+    free(writer);
+}
@@ -0,0 +1,191 @@
+#ifndef _TDC_CODEC_H_
+#define _TDC_CODEC_H_
+
+/*
+ * Block compression of the event stream, for recording runs compressed.
+ *
+ * The stream is cut into blocks of whole events, of at most
+ * TDC_CODEC_BLOCK_SIZE bytes, and each block is compressed on its own, so
+ * that the blocks of a file can be decoded in any order and in parallel.
+ * A compressed block is a struct tdc_codec_block followed by the data,
+ * and zeros up to its size.
+ *
+ * Compressing a block takes two steps:
+ *  1. The events filter sorts the bytes of the events into planes of the
+ *     same kind of byte: the numbers of hits (and card numbers), each byte
+ *     of the sequence numbers and of the times, the channels, and the low
+ *     and high bytes of the delays. The sequence numbers and times are
+ *     first replaced by their differences to those of the event before,
+ *     so that e.g. the sequence numbers of a run without gaps all become 1.
+ *     The bodies of records go to a plane of their own, and the bytes of
+ *     an event that is not complete at the end of the stream to the last.
+ *  2. The planes are compressed with a fast LZ77 codec, see tdc_lz_*.
+ * If that doesn't make the block smaller, the planes are stored as they
+ * are.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define TDC_CODEC_MAGIC "TDCZ"
+
+/* The most stream bytes in a block. */
+#define TDC_CODEC_BLOCK_SIZE (1024 * 1024)
+
+/* The largest alignment blocks may be padded to, see tdc_codec_compress. */
+#define TDC_CODEC_MAX_ALIGN 4096
+
+enum tdc_codec_filter {
+    TDC_FILTER_NONE = 0,
+    TDC_FILTER_EVENTS
+};
+
+enum tdc_codec_method {
+    TDC_METHOD_STORED = 0,
+    TDC_METHOD_LZ
+};
+
+/* The planes of TDC_FILTER_EVENTS, in the order they are stored. */
+enum tdc_codec_plane {
+    TDC_PLANE_HEAD = 0,                     /* card, number of hits, type */
+    TDC_PLANE_SEQ,                          /* 4 planes, low byte first */
+    TDC_PLANE_TIME = TDC_PLANE_SEQ + 4,     /* 8 planes, low byte first */
+    TDC_PLANE_CHANNEL = TDC_PLANE_TIME + 8,
+    TDC_PLANE_DELAY_LO,
+    TDC_PLANE_DELAY_HI,
+    TDC_PLANE_RECORD,                       /* records, after their type */
+    TDC_PLANE_TAIL,                         /* an incomplete last event */
+    TDC_NUM_PLANES
+};
+
+/**
+ * struct tdc_codec_block - start of a compressed block
+ * @magic:      TDC_CODEC_MAGIC
+ * @size:       Bytes of the block, this header and any padding included.
+ *              The next block starts this many bytes later.
+ * @raw_len:    Bytes of the stream in the block.
+ * @data_len:   Bytes of compressed data after this header.
+ * @filter:     enum tdc_codec_filter
+ * @method:     enum tdc_codec_method
+ * @merged:     1 if each event starts with a card number.
+ * @format:     TDC_FMT_* flags of the stream, see tdc_format.h.
+ * @reserved:   0
+ * @planes:     Bytes in each plane, enum tdc_codec_plane. With
+ *              TDC_FILTER_NONE, only the first is used.
+ */
+struct tdc_codec_block {
+    char magic[4];
+    uint32_t size;
+    uint32_t raw_len;
+    uint32_t data_len;
+    uint8_t filter;
+    uint8_t method;
+    uint8_t merged;
+    uint8_t format;
+    uint32_t reserved;
+    uint32_t planes[TDC_NUM_PLANES];
+};
+
+/**
+ * struct tdc_codec - what one thread needs to compress or decompress
+ * @merged, @format: The stream, see struct tdc_codec_block.
+ * @planes:     TDC_CODEC_BLOCK_SIZE bytes, for the planes of a block.
+ * @hash:       The hash table of tdc_lz_compress.
+ */
+struct tdc_codec {
+    int merged;
+    unsigned int format;
+    unsigned char *planes;
+    uint32_t *hash;
+};
+
+struct tdc_codec *tdc_codec_new(int merged, unsigned int format);
+void tdc_codec_free(struct tdc_codec *codec);
+
+size_t tdc_codec_events_len(const unsigned char *data, size_t len,
+    int merged, unsigned int format);
+size_t tdc_codec_bound(size_t raw_len, size_t align);
+size_t tdc_codec_compress(struct tdc_codec *codec, const unsigned char *raw,
+    size_t len, unsigned char *out, size_t align);
+int tdc_codec_check(const struct tdc_codec_block *block);
+long tdc_codec_decompress(struct tdc_codec *codec,
+    const unsigned char *block, size_t size, unsigned char *raw);
+
+size_t tdc_lz_bound(size_t len);
+size_t tdc_lz_compress(uint32_t *hash, const unsigned char *in, size_t len,
+    unsigned char *out);
+long tdc_lz_decompress(const unsigned char *in, size_t len,
+    unsigned char *out, size_t out_len);
+
+/**
+ * struct tdc_codec_job - a block for a struct tdc_codec_pool
+ * @decompress: 1 to decompress in, 0 to compress it.
+ * @in, @in_len: The stream bytes, or the compressed block.
+ * @out:        Room for the result: tdc_codec_bound(in_len, align) bytes,
+ *              or TDC_CODEC_BLOCK_SIZE to decompress.
+ * @out_len:    Length of the result, set by the pool.
+ * @error:      Set by the pool if a block could not be decompressed.
+ * @cpu_ns:     CPU time the job took, set by the pool.
+ */
+struct tdc_codec_job {
+    int decompress;
+    const unsigned char *in;
+    size_t in_len;
+    unsigned char *out;
+    size_t out_len;
+    int error;
+    uint64_t cpu_ns;
+};
+
+struct tdc_codec_pool;
+
+struct tdc_codec_pool *tdc_codec_pool_new(int threads, int merged,
+    unsigned int format, size_t align);
+void tdc_codec_pool_run(struct tdc_codec_pool *pool,
+    struct tdc_codec_job *jobs, int njobs);
+void tdc_codec_pool_free(struct tdc_codec_pool *pool);
+
+/*
+ * Called by a struct tdc_codec_writer with each compressed block, in
+ * stream order. raw_len is the number of stream bytes in it.
+ * Returns 0 on success, -1 on error.
+ */
+typedef int (*tdc_codec_write_fn)(void *arg, const unsigned char *block,
+    size_t size, size_t raw_len);
+
+/**
+ * struct tdc_codec_writer - compresses a stream given in pieces
+ * @pool:       Compresses the blocks.
+ * @jobs:       A block for each thread of the pool.
+ * @raw:        The stream bytes of each job, TDC_CODEC_BLOCK_SIZE each.
+ * @njobs:      Number of jobs,
+ * @filled:     how many of them are ready to be compressed,
+ * @fill:       and the bytes in the next one so far.
+ * @merged, @format: The stream.
+ * @write:      Called with each compressed block,
+ * @arg:        with this.
+ * @raw_bytes, @bytes: Stream bytes and compressed bytes written.
+ * @cpu_ns:     CPU time used compressing.
+ */
+struct tdc_codec_writer {
+    struct tdc_codec_pool *pool;
+    struct tdc_codec_job *jobs;
+    unsigned char *raw;
+    int njobs, filled;
+    size_t fill;
+    int merged;
+    unsigned int format;
+    tdc_codec_write_fn write;
+    void *arg;
+    uint64_t raw_bytes, bytes;
+    uint64_t cpu_ns;
+};
+
+struct tdc_codec_writer *tdc_codec_writer_open(int threads, int merged,
+    unsigned int format, size_t align, tdc_codec_write_fn write, void *arg);
+int tdc_codec_writer_feed(struct tdc_codec_writer *writer,
+    const unsigned char *data, size_t len);
+int tdc_codec_writer_flush(struct tdc_codec_writer *writer);
+void tdc_codec_writer_free(struct tdc_codec_writer *writer);
+
+#endif /* _TDC_CODEC_H_ */
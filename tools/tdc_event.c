@@ -0,0 +1,216 @@
+#include <string.h>
+
+#include "tdc_event.h"
+
+enum {
+    TDC_PARSE_START = 0,  /* card number, or number of hits */
+    TDC_PARSE_NUM_HITS,
+    TDC_PARSE_SEQ,
+    TDC_PARSE_TIME,
+    TDC_PARSE_CHANNEL,
+    TDC_PARSE_DELAY_LO,
+    TDC_PARSE_DELAY_HI,
+    TDC_PARSE_RECORD
+};
+
+static uint64_t tdc_get_le(const unsigned char *p, int bytes)
+{
+    uint64_t value = 0;
+
+    while (bytes--)
+        value = (value << 8) | p[bytes];
+    return value;
+}
+
+/* Decodes the bytes of a record, after its type. */
+static void tdc_parser_decode_record(struct tdc_parser *parser)
+{
+    struct tdc_event *event = &parser->event;
+    const unsigned char *p = parser->record;
+    int i;
+
+    if (event->type == TDC_REC_COUNTS) {
+        event->seq = tdc_get_le(p, 4);
+        event->count = tdc_get_le(p + 4, 4);
+        event->mono_ns = tdc_get_le(p + 8, 8);
+        event->slice_us = tdc_get_le(p + 16, 4);
+        p += 20;
+        for (i = 0; i < TDC_EVENT_MAX_CHANNELS; ++i, p += 4)
+            event->hits[i] = tdc_get_le(p, 4);
+        for (i = 0; i < TDC_EVENT_MAX_CHANNELS; ++i, p += 4)
+            event->invalid[i] = tdc_get_le(p, 4);
+        for (i = 0; i < TDC_COUNT_MULT_BINS; ++i, p += 4)
+            event->mult[i] = tdc_get_le(p, 4);
+        return;
+    }
+    if (event->type == TDC_REC_CLOCK) {
+        event->time = tdc_get_le(p, 8);
+        event->mono_ns = tdc_get_le(p + 8, 8);
+        event->real_ns = tdc_get_le(p + 16, 8);
+        event->khz = tdc_get_le(p + 24, 4);
+        return;
+    }
+    // The count, then the first sequence number.
+    event->count = tdc_get_le(p, 4);
+    event->seq = tdc_get_le(p + 4, 4);
+}
+
+/* Is the number of hits read the end of the event? */
+static int tdc_parser_hits_next(struct tdc_parser *parser)
+{
+    if (parser->format & TDC_FMT_SEQ) {
+        parser->event.seq = 0;
+        parser->state = TDC_PARSE_SEQ;
+    } else if (parser->format & TDC_FMT_TIME) {
+        parser->event.time = 0;
+        parser->state = TDC_PARSE_TIME;
+    } else if (!parser->event.num_hits) {
+        parser->state = TDC_PARSE_START;
+        return 1;
+    } else {
+        parser->state = TDC_PARSE_CHANNEL;
+    }
+    return 0;
+}
+
+void tdc_parser_init(struct tdc_parser *parser, int merged,
+    unsigned int format)
+{
+    memset(parser, 0, sizeof(*parser));
+    parser->merged = merged;
+    parser->format = format;
+    parser->event.card = -1;
+}
+
+/*
+ * Decodes data until the end of an event or record, or until the data
+ * ends. Sets *complete to 1 if parser->event now holds a whole event or
+ * record, else 0.
+ * Returns the number of bytes used.
+ */
+size_t tdc_parser_feed(struct tdc_parser *parser, const unsigned char *data,
+    size_t len, int *complete)
+{
+    struct tdc_event *event = &parser->event;
+    size_t i;
+
+    *complete = 0;
+    for (i = 0; i < len; ++i) {
+        switch (parser->state) {
+        case TDC_PARSE_START:
+            if (parser->merged) {
+                event->card = data[i];
+                parser->state = TDC_PARSE_NUM_HITS;
+                break;
+            }
+            /* fall through */
+        case TDC_PARSE_NUM_HITS:
+            parser->hit = 0;
+            parser->byte = 0;
+            if (data[i] >= TDC_REC_MIN) {
+                event->type = data[i];
+                event->num_hits = 0;
+                event->count = 0;
+                event->seq = 0;
+                parser->state = TDC_PARSE_RECORD;
+                break;
+            }
+            event->type = TDC_EVENT_HITS;
+            event->num_hits = data[i];
+            event->count = 0;
+            if (tdc_parser_hits_next(parser)) {
+                *complete = 1;
+                return i + 1;
+            }
+            break;
+        case TDC_PARSE_SEQ:
+            event->seq |= (uint32_t)data[i] << (8 * parser->byte);
+            if (++parser->byte < 4)
+                break;
+            if (parser->format & TDC_FMT_TIME) {
+                event->time = 0;
+                parser->byte = 0;
+                parser->state = TDC_PARSE_TIME;
+                break;
+            }
+            if (!event->num_hits) {
+                parser->state = TDC_PARSE_START;
+                *complete = 1;
+                return i + 1;
+            }
+            parser->state = TDC_PARSE_CHANNEL;
+            break;
+        case TDC_PARSE_TIME:
+            event->time |= (uint64_t)data[i] << (8 * parser->byte);
+            if (++parser->byte < 8)
+                break;
+            if (!event->num_hits) {
+                parser->state = TDC_PARSE_START;
+                *complete = 1;
+                return i + 1;
+            }
+            parser->state = TDC_PARSE_CHANNEL;
+            break;
+        case TDC_PARSE_CHANNEL:
+            event->channel[parser->hit] = data[i];
+            parser->state = TDC_PARSE_DELAY_LO;
+            break;
+        case TDC_PARSE_DELAY_LO:
+            event->delay[parser->hit] = data[i];
+            parser->state = TDC_PARSE_DELAY_HI;
+            break;
+        case TDC_PARSE_DELAY_HI:
+            event->delay[parser->hit] |= data[i] << 8;
+            if (++parser->hit == event->num_hits) {
+                parser->state = TDC_PARSE_START;
+                *complete = 1;
+                return i + 1;
+            }
+            parser->state = TDC_PARSE_CHANNEL;
+            break;
+        case TDC_PARSE_RECORD:
+            parser->record[parser->byte] = data[i];
+            if (++parser->byte == TDC_REC_SIZE_OF(event->type) - 1) {
+                tdc_parser_decode_record(parser);
+                parser->state = TDC_PARSE_START;
+                *complete = 1;
+                return i + 1;
+            }
+            break;
+        }
+    }
+    return len;
+}
+
+void tdc_clock_init(struct tdc_clock *clock)
+{
+    memset(clock, 0, sizeof(*clock));
+}
+
+/* Takes a clock record of the card. */
+void tdc_clock_update(struct tdc_clock *clock, const struct tdc_event *record)
+{
+    if (clock->records && record->time > clock->time)
+        clock->ns_per_count = (double)(record->real_ns - clock->real_ns) /
+            (record->time - clock->time);
+    else if (!clock->records && record->khz)
+        clock->ns_per_count = 1e6 / record->khz;
+    clock->time = record->time;
+    clock->real_ns = record->real_ns;
+    clock->records++;
+}
+
+/*
+ * Converts a time of the card to CLOCK_REALTIME in ns, from the latest
+ * clock record.
+ * Returns 0 on success, -1 if there was no clock record yet.
+ */
+int tdc_clock_real_ns(const struct tdc_clock *clock, uint64_t time,
+    int64_t *real_ns)
+{
+    if (!clock->records || !clock->ns_per_count)
+        return -1;
+    *real_ns = clock->real_ns +
+        (int64_t)(((double)time - (double)clock->time) * clock->ns_per_count);
+    return 0;
+}
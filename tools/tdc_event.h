@@ -0,0 +1,114 @@
+#ifndef _TDC_EVENT_H_
+#define _TDC_EVENT_H_
+
+/*
+ * Decoding the stream read from a TDC device.
+ *
+ * Each event is one byte with the number of hits, followed by three bytes
+ * per hit: the channel (0-7) and the delay (unit 0.5 ns), low byte first.
+ * In the merged stream of several cards, each event starts with one more
+ * byte holding the card number. The stream may also have sequence numbers
+ * and records, see tdc_format.h.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "tdc_format.h"
+
+#define TDC_EVENT_MAX_CHANNELS 8
+#define TDC_EVENT_MAX_HITS 255
+
+/* The type of an event that has hits, other types are TDC_REC_*. */
+#define TDC_EVENT_HITS 0
+
+/**
+ * struct tdc_event - a decoded event or record
+ * @card:       Number of the card, or -1 if the stream is not merged.
+ * @type:       TDC_EVENT_HITS, or the TDC_REC_* type of a record.
+ * @seq:        Sequence number of the COM signal, if the stream has them,
+ *              or of the first COM signal of a record.
+ * @time:       When the COM signal was detected, if the stream has times,
+ *              or the counter of a clock record. See tdc_clock_real_ns.
+ * @mono_ns, @real_ns, @khz: The rest of a clock record.
+ * @count:      The count of a record.
+ * @slice_us, @hits, @invalid, @mult: The rest of a count record, whose
+ *              start is in @mono_ns.
+ * @num_hits:   Number of hits, 0 for records.
+ * @channel:    Channel of each hit, 0-7.
+ * @delay:      Delay of each hit, unit 0.5 ns.
+ */
+struct tdc_event {
+    int card;
+    int type;
+    uint32_t seq;
+    uint64_t time;
+    int64_t mono_ns, real_ns;
+    uint32_t khz;
+    uint32_t count;
+    uint32_t slice_us;
+    uint32_t hits[TDC_EVENT_MAX_CHANNELS];
+    uint32_t invalid[TDC_EVENT_MAX_CHANNELS];
+    uint32_t mult[TDC_COUNT_MULT_BINS];
+    unsigned int num_hits;
+    unsigned char channel[TDC_EVENT_MAX_HITS];
+    unsigned short delay[TDC_EVENT_MAX_HITS];
+};
+
+/**
+ * struct tdc_parser - decodes events from a stream given in pieces
+ * @merged:     1 if each event starts with a card number.
+ * @format:     The stream format, TDC_FMT_* flags.
+ * @state:      Which byte of the event comes next.
+ * @byte:       Index of the byte of a sequence number, time or record.
+ * @hit:        Index of the hit being decoded.
+ * @record:     The bytes of the record being decoded, after its type.
+ * @event:      The event being decoded.
+ */
+struct tdc_parser {
+    int merged;
+    unsigned int format;
+    int state;
+    unsigned int byte;
+    unsigned int hit;
+    unsigned char record[TDC_REC_COUNTS_SIZE];
+    struct tdc_event event;
+};
+
+/**
+ * struct tdc_clock - converts the times of a card to CLOCK_REALTIME
+ * @records:    Number of clock records seen.
+ * @time, @real_ns: From the latest clock record.
+ * @ns_per_count: The rate of the counter, from the last two clock records,
+ *              or from the rate in the first one.
+ */
+struct tdc_clock {
+    unsigned long records;
+    uint64_t time;
+    int64_t real_ns;
+    double ns_per_count;
+};
+
+void tdc_parser_init(struct tdc_parser *parser, int merged,
+    unsigned int format);
+size_t tdc_parser_feed(struct tdc_parser *parser, const unsigned char *data,
+    size_t len, int *complete);
+
+void tdc_clock_init(struct tdc_clock *clock);
+void tdc_clock_update(struct tdc_clock *clock, const struct tdc_event *record);
+int tdc_clock_real_ns(const struct tdc_clock *clock, uint64_t time,
+    int64_t *real_ns);
+
+/* Is the parser between two events? */
+static inline int tdc_parser_idle(const struct tdc_parser *parser)
+{
+    return parser->state == 0;
+}
+
+/* Is the decoded event a record rather than an event with hits? */
+static inline int tdc_event_is_record(const struct tdc_event *event)
+{
+    return event->type != TDC_EVENT_HITS;
+}
+
+#endif /* _TDC_EVENT_H_ */
@@ -0,0 +1,291 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "tdc_index.h"
+
+/* Fails to compile if the file format changes size by mistake. */
+typedef char tdc_index_header_size_check
+    [sizeof(struct tdc_index_header) == 40 ? 1 : -1];
+typedef char tdc_index_entry_size_check
+    [sizeof(struct tdc_index_entry) == 32 ? 1 : -1];
+
+void tdc_index_path(const char *prefix, char *path, size_t size)
+{
+    snprintf(path, size, "%s.tdx", prefix);
+}
+
+/*
+ * Creates an index file. block_events 0 means TDC_INDEX_BLOCK_EVENTS.
+ * Returns the writer, or NULL on error.
+ */
+struct tdc_index_writer *tdc_index_writer_open(const char *path,
+    uint32_t block_events, int merged, unsigned int stream_format,
+    enum tdc_index_time time_source)
+{
+    struct tdc_index_writer *writer;
+    struct tdc_index_header header;
+
+    writer = calloc(1, sizeof(*writer));
+    if (!writer)
+        return NULL;
+    writer->file = fopen(path, "w");
+    if (!writer->file) {
+        free(writer);
+        return NULL;
+    }
+    writer->block_events = block_events ? block_events : TDC_INDEX_BLOCK_EVENTS;
+    tdc_parser_init(&writer->parser, merged, stream_format);
+
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, TDC_INDEX_MAGIC, sizeof(header.magic));
+    header.header_size = sizeof(header);
+    header.version = TDC_INDEX_VERSION;
+    header.entry_size = sizeof(struct tdc_index_entry);
+    header.block_events = writer->block_events;
+    header.time_source = time_source;
+    header.merged = merged;
+    header.stream_format = stream_format;
+    if (fwrite(&header, sizeof(header), 1, writer->file) != 1) {
+        fclose(writer->file);
+        free(writer);
+        return NULL;
+    }
+    return writer;
+}
+
+static int tdc_index_writer_flush(struct tdc_index_writer *writer)
+{
+    if (!writer->block_open || !writer->entry.num_events)
+        return 0;
+    writer->block_open = 0;
+    // Written at once, so the index can be used while the run is recorded.
+    if (fwrite(&writer->entry, sizeof(writer->entry), 1, writer->file) != 1 ||
+        fflush(writer->file))
+        return -1;
+    return 0;
+}
+
+/*
+ * Adds the next len bytes of the stream to the index. time_ns is when
+ * they were read, see enum tdc_index_time.
+ * Returns 0 on success, -1 if the index could not be written.
+ */
+int tdc_index_writer_feed(struct tdc_index_writer *writer,
+    const unsigned char *data, size_t len, uint64_t time_ns)
+{
+    struct tdc_index_entry *entry = &writer->entry;
+    struct tdc_event *event = &writer->parser.event;
+    unsigned int i;
+    size_t n;
+    int complete;
+
+    while (len > 0) {
+        if (!writer->block_open && tdc_parser_idle(&writer->parser)) {
+            memset(entry, 0, sizeof(*entry));
+            entry->event = writer->event;
+            entry->offset = writer->offset;
+            entry->time_ns = time_ns;
+            entry->min_hits = 0xff;
+            writer->block_open = 1;
+        }
+
+        n = tdc_parser_feed(&writer->parser, data, len, &complete);
+        data += n;
+        len -= n;
+        writer->offset += n;
+        // Records are not events, they are only skipped.
+        if (!complete || tdc_event_is_record(event))
+            continue;
+
+        for (i = 0; i < event->num_hits; ++i)
+            entry->channels |= 1 << (event->channel[i] & 7);
+        if (event->card >= 0)
+            entry->cards |= 1 << (event->card & 7);
+        if (event->num_hits < entry->min_hits)
+            entry->min_hits = event->num_hits;
+        if (event->num_hits > entry->max_hits)
+            entry->max_hits = event->num_hits;
+        entry->num_events++;
+        writer->event++;
+
+        if (entry->num_events == writer->block_events &&
+            tdc_index_writer_flush(writer))
+            return -1;
+    }
+    return 0;
+}
+
+/*
+ * Writes the last block and closes the index.
+ * Returns 0 on success, -1 on error.
+ */
+int tdc_index_writer_close(struct tdc_index_writer *writer)
+{
+    int retval;
+
+    retval = tdc_index_writer_flush(writer);
+    if (fclose(writer->file))
+        retval = -1;
+    free(writer);
+    return retval;
+}
+
+/*
+ * Reads an index file. The last entry may be incomplete if the index is
+ * being written, it is then ignored.
+ * Returns the index, or NULL on error.
+ */
+struct tdc_index *tdc_index_load(const char *path)
+{
+    struct tdc_index *index;
+    FILE *file;
+    size_t size = 0;
+
+    index = calloc(1, sizeof(*index));
+    if (!index)
+        return NULL;
+    file = fopen(path, "r");
+    if (!file)
+        goto fail;
+    if (fread(&index->header, sizeof(index->header), 1, file) != 1 ||
+        memcmp(index->header.magic, TDC_INDEX_MAGIC, sizeof(index->header.magic)) ||
+        index->header.entry_size != sizeof(struct tdc_index_entry) ||
+        fseek(file, index->header.header_size, SEEK_SET))
+        goto fail_file;
+
+    for (;;) {
+        struct tdc_index_entry *entries;
+
+        if (index->num_entries == size) {
+            size = size ? 2 * size : 1024;
+            entries = realloc(index->entries, size * sizeof(*entries));
+            if (!entries)
+                goto fail_file;
+            index->entries = entries;
+        }
+        if (fread(&index->entries[index->num_entries],
+                sizeof(*index->entries), 1, file) != 1)
+            break;
+        index->num_entries++;
+    }
+    fclose(file);
+    return index;
+
+fail_file:
+    fclose(file);
+fail:
+    tdc_index_free(index);
+    return NULL;
+}
+
+void tdc_index_free(struct tdc_index *index)
+{
+    if (!index)
+        return;
+    free(index->entries);
+    free(index);
+}
+
+/*
+ * Returns the block holding the given event, or -1 if it is not in the run.
+ */
+long tdc_index_find_event(const struct tdc_index *index, uint64_t event)
+{
+    size_t lo = 0, hi = index->num_entries, mid;
+    const struct tdc_index_entry *last;
+
+    if (!index->num_entries)
+        return -1;
+    last = &index->entries[index->num_entries - 1];
+    if (event >= last->event + last->num_events)
+        return -1;
+
+    // find the last block that starts at or before the event
+    while (hi - lo > 1) {
+        mid = lo + (hi - lo) / 2;
+        if (index->entries[mid].event <= event)
+            lo = mid;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+/*
+ * Returns the first block that may hold events from the given time on,
+ * or -1 if the index is empty.
+ */
+long tdc_index_find_time(const struct tdc_index *index, uint64_t time_ns)
+{
+    size_t lo = 0, hi = index->num_entries, mid;
+
+    if (!index->num_entries)
+        return -1;
+
+    // find the first block that starts after the time...
+    while (lo < hi) {
+        mid = lo + (hi - lo) / 2;
+        if (index->entries[mid].time_ns <= time_ns)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    // ...the events at the time may be at the end of the block before it.
+    return lo > 0 ? (long)lo - 1 : 0;
+}
+
+/*
+ * Tells if a block may hold an event with hits on all the given channels
+ * (a bitmap, 0 for any), and with min_hits to max_hits hits.
+ */
+int tdc_index_may_match(const struct tdc_index_entry *entry,
+    unsigned int channels, unsigned int min_hits, unsigned int max_hits)
+{
+    if ((entry->channels & channels) != channels)
+        return 0;
+    return entry->max_hits >= min_hits && entry->min_hits <= max_hits;
+}
+
+int tdc_index_seek_block(const struct tdc_index *index, struct tdc_run *run,
+    struct tdc_parser *parser, long block)
+{
+    if (block < 0 || block >= (long)index->num_entries)
+        return -1;
+    tdc_parser_init(parser, index->header.merged,
+        index->header.stream_format);
+    return tdc_run_seek(run, index->entries[block].offset);
+}
+
+/*
+ * Returns 0 on success, -1 if the event is not in the run.
+ */
+int tdc_index_seek_event(const struct tdc_index *index, struct tdc_run *run,
+    struct tdc_parser *parser, uint64_t event)
+{
+    unsigned char buf[4096];
+    uint64_t skip;
+    long block;
+    size_t len, pos, n;
+    int complete;
+
+    block = tdc_index_find_event(index, event);
+    if (tdc_index_seek_block(index, run, parser, block))
+        return -1;
+
+    // Decode the events before it in the block.
+    skip = event - index->entries[block].event;
+    while (skip > 0) {
+        len = tdc_run_read(run, buf, sizeof(buf));
+        if (!len)
+            return -1;
+        for (pos = 0; pos < len && skip > 0; pos += n) {
+            n = tdc_parser_feed(parser, buf + pos, len - pos, &complete);
+            if (complete && !tdc_event_is_record(&parser->event))
+                skip--;
+        }
+        // Give back what belongs to the event asked for.
+        if (pos < len && tdc_run_seek(run, run->pos - (len - pos)))
+            return -1;
+    }
+    return 0;
+}
@@ -0,0 +1,142 @@
+#ifndef _TDC_INDEX_H_
+#define _TDC_INDEX_H_
+
+/*
+ * Index of a recorded run, for finding events without decoding the run
+ * from the start.
+ *
+ * The index is stored next to the run, in <prefix>.tdx. It is a struct
+ * tdc_index_header followed by one struct tdc_index_entry for each block
+ * of block_events events. An entry tells where its block starts, and
+ * which channels and numbers of hits occur in it, so that a search can
+ * skip the blocks that can't match.
+ *
+ * tdc-record writes the index while recording, and tdc-index builds one
+ * for an existing run.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include "tdc_event.h"
+#include "tdc_run.h"
+
+#define TDC_INDEX_MAGIC "TDCIDX01"
+#define TDC_INDEX_VERSION 1
+#define TDC_INDEX_BLOCK_EVENTS 4096
+
+/*
+ * Where the times in the index come from:
+ * TDC_INDEX_TIME_READ: when the recorder read the event from the device,
+ *      at most the driver's wakeup latency (0.1 s for tdc-record) later
+ *      than the event.
+ * TDC_INDEX_TIME_FILE: when the file holding the event was started. Only
+ *      tells which file an event is in.
+ */
+enum tdc_index_time {
+    TDC_INDEX_TIME_FILE = 0,
+    TDC_INDEX_TIME_READ = 1
+};
+
+/**
+ * struct tdc_index_header - start of an index file
+ * @magic:          TDC_INDEX_MAGIC
+ * @header_size:    Size of the header, the entries start at this offset.
+ * @version:        TDC_INDEX_VERSION
+ * @entry_size:     Size of each entry.
+ * @block_events:   Number of events in each block, except the last.
+ * @time_source:    enum tdc_index_time
+ * @merged:         1 if the run is the merged stream of several cards.
+ * @stream_format:  TDC_FMT_* flags of the run, see tdc_format.h.
+ */
+struct tdc_index_header {
+    char magic[8];
+    uint32_t header_size;
+    uint32_t version;
+    uint32_t entry_size;
+    uint32_t block_events;
+    uint32_t time_source;
+    uint32_t merged;
+    uint32_t stream_format;
+    uint32_t reserved;
+};
+
+/**
+ * struct tdc_index_entry - a block of events
+ * @event:      Number of the first event of the block, from 0.
+ * @offset:     Stream offset of the first event.
+ * @time_ns:    CLOCK_REALTIME of the first event, see enum tdc_index_time.
+ * @num_events: Number of events in the block.
+ * @channels:   Bitmap of the channels with hits in the block.
+ * @cards:      Bitmap of the cards with events in the block (merged
+ *              stream only, cards 0-7).
+ * @min_hits, @max_hits: Range of the number of hits per event.
+ */
+struct tdc_index_entry {
+    uint64_t event;
+    uint64_t offset;
+    uint64_t time_ns;
+    uint32_t num_events;
+    uint8_t channels;
+    uint8_t cards;
+    uint8_t min_hits, max_hits;
+};
+
+/**
+ * struct tdc_index_writer - builds an index from the stream of a run
+ * @file:       The index file.
+ * @parser:     Decodes the stream.
+ * @entry:      The block being built.
+ * @block_open: 1 if entry has been started.
+ * @offset:     Stream offset of the next byte given to the writer.
+ * @event:      Number of the next event.
+ * @block_events: Number of events in each block.
+ */
+struct tdc_index_writer {
+    FILE *file;
+    struct tdc_parser parser;
+    struct tdc_index_entry entry;
+    int block_open;
+    uint64_t offset;
+    uint64_t event;
+    uint32_t block_events;
+};
+
+struct tdc_index_writer *tdc_index_writer_open(const char *path,
+    uint32_t block_events, int merged, unsigned int stream_format,
+    enum tdc_index_time time_source);
+int tdc_index_writer_feed(struct tdc_index_writer *writer,
+    const unsigned char *data, size_t len, uint64_t time_ns);
+int tdc_index_writer_close(struct tdc_index_writer *writer);
+
+/**
+ * struct tdc_index - an index loaded into memory
+ * @header:         The header of the index file.
+ * @entries:        The blocks, in stream order.
+ * @num_entries:    Number of blocks.
+ */
+struct tdc_index {
+    struct tdc_index_header header;
+    struct tdc_index_entry *entries;
+    size_t num_entries;
+};
+
+void tdc_index_path(const char *prefix, char *path, size_t size);
+struct tdc_index *tdc_index_load(const char *path);
+void tdc_index_free(struct tdc_index *index);
+
+long tdc_index_find_event(const struct tdc_index *index, uint64_t event);
+long tdc_index_find_time(const struct tdc_index *index, uint64_t time_ns);
+int tdc_index_may_match(const struct tdc_index_entry *entry,
+    unsigned int channels, unsigned int min_hits, unsigned int max_hits);
+
+/*
+ * Positions run and parser at an event, so that the next event decoded
+ * is the one asked for.
+ */
+int tdc_index_seek_event(const struct tdc_index *index, struct tdc_run *run,
+    struct tdc_parser *parser, uint64_t event);
+int tdc_index_seek_block(const struct tdc_index *index, struct tdc_run *run,
+    struct tdc_parser *parser, long block);
+
+#endif /* _TDC_INDEX_H_ */
@@ -0,0 +1,371 @@
+/*
+ * tdc-index - builds and uses the index of a recorded run, see tdc_index.h.
+ *
+ *   tdc-index build [-e EVENTS] PREFIX
+ *   tdc-index info PREFIX
+ *   tdc-index dump [-e EVENT] [-t SECONDS] [-n COUNT] [-c CHANNELS]
+ *                  [-m MIN_HITS] [-M MAX_HITS] PREFIX
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "tdc_index.h"
+
+static void usage(void)
+{
+    fprintf(stderr,
+        "Usage: tdc-index build [-e EVENTS] PREFIX\n"
+        "  Builds PREFIX.tdx for the run PREFIX_0000.tdc, ..., with EVENTS\n"
+        "  events per block (default %d).\n"
+        "Usage: tdc-index info PREFIX\n"
+        "  Shows the files and index of a run.\n"
+        "Usage: tdc-index dump [options] PREFIX\n"
+        "  Prints the events of a run, using the index to find them.\n"
+        "  -e EVENT     start at this event (from 0)\n"
+        "  -t SECONDS   start this long after the start of the run\n"
+        "  -n COUNT     print at most COUNT events\n"
+        "  -c CHANNELS  only events with hits on all these channels, e.g. 1,3\n"
+        "  -m MIN_HITS  only events with at least MIN_HITS hits\n"
+        "  -M MAX_HITS  only events with at most MAX_HITS hits\n"
+        "  Gap and empty records are printed when no events are left out.\n",
+        TDC_INDEX_BLOCK_EVENTS);
+}
+
+static int build(int argc, char **argv)
+{
+    struct tdc_index_writer *writer;
+    struct tdc_run *run;
+    unsigned char buf[65536];
+    unsigned int block_events = 0;
+    char path[1024];
+    size_t len;
+    int c, retval = 0;
+
+    while ((c = getopt(argc, argv, "e:")) != -1) {
+        switch (c) {
+        case 'e': block_events = strtoul(optarg, NULL, 0); break;
+        default: usage(); return 1;
+        }
+    }
+    if (optind != argc - 1) {
+        usage();
+        return 1;
+    }
+
+    run = tdc_run_open(argv[optind]);
+    if (!run) {
+        fprintf(stderr, "Could not open the run %s\n", argv[optind]);
+        return 1;
+    }
+    tdc_index_path(argv[optind], path, sizeof(path));
+    // Without times in the stream, only the file start times are known.
+    writer = tdc_index_writer_open(path, block_events,
+        !!(run->header.flags & TDC_RUN_MERGED), run->header.stream_format,
+        TDC_INDEX_TIME_FILE);
+    if (!writer) {
+        perror(path);
+        tdc_run_close(run);
+        return 1;
+    }
+
+    while ((len = tdc_run_read(run, buf, sizeof(buf))) > 0) {
+        // Ends at the end of each file, so the time is the file's.
+        if (tdc_index_writer_feed(writer, buf, len,
+                run->files[run->current].time_ns)) {
+            perror(path);
+            retval = 1;
+            break;
+        }
+    }
+    if (!tdc_parser_idle(&writer->parser))
+        fprintf(stderr, "The run ends in the middle of an event\n");
+    fprintf(stderr, "%llu events in %llu bytes\n",
+        (unsigned long long)writer->event,
+        (unsigned long long)writer->offset);
+    if (tdc_index_writer_close(writer))
+        retval = 1;
+    tdc_run_close(run);
+    return retval;
+}
+
+static int info(int argc, char **argv)
+{
+    struct tdc_index *index;
+    struct tdc_run *run;
+    char path[1024];
+    unsigned int i;
+    uint64_t events = 0;
+
+    if (argc != 2) {
+        usage();
+        return 1;
+    }
+    run = tdc_run_open(argv[1]);
+    if (!run) {
+        fprintf(stderr, "Could not open the run %s\n", argv[1]);
+        return 1;
+    }
+    printf("device: %s%s\n", run->header.device,
+        run->header.flags & TDC_RUN_MERGED ? " (merged)" : "");
+    printf("t_min = %d; t_max = %d, num_channels = %d, com_mode = %s\n",
+        run->header.t_min, run->header.t_max, run->header.num_channels,
+        run->header.com_mode ? "common start" : "common stop");
+    printf("stream_format = %#x%s\n", run->header.stream_format,
+        run->header.flags & TDC_RUN_COMPRESSED ? ", compressed" : "");
+    for (i = 0; i < run->num_files; ++i) {
+        printf("%s: %llu bytes from offset %llu", run->files[i].name,
+            (unsigned long long)run->files[i].size,
+            (unsigned long long)run->files[i].stream_offset);
+        if (run->header.flags & TDC_RUN_COMPRESSED)
+            printf(", %u blocks", run->files[i].num_blocks);
+        printf("\n");
+    }
+
+    tdc_index_path(argv[1], path, sizeof(path));
+    index = tdc_index_load(path);
+    if (!index) {
+        printf("%s: no index\n", path);
+    } else {
+        if (index->num_entries) {
+            struct tdc_index_entry *last =
+                &index->entries[index->num_entries - 1];
+            events = last->event + last->num_events;
+        }
+        printf("%s: %lu blocks of %u events, %llu events, times from the %s\n",
+            path, (unsigned long)index->num_entries,
+            index->header.block_events, (unsigned long long)events,
+            index->header.time_source == TDC_INDEX_TIME_READ ?
+            "recorder" : "file headers");
+        tdc_index_free(index);
+    }
+    tdc_run_close(run);
+    return 0;
+}
+
+static unsigned int parse_channels(const char *arg)
+{
+    unsigned int channels = 0;
+    char *end;
+    long ch;
+
+    while (*arg) {
+        ch = strtol(arg, &end, 10);
+        if (end == arg || ch < 1 || ch > TDC_EVENT_MAX_CHANNELS)
+            return 0;
+        channels |= 1 << (ch - 1);
+        arg = *end == ',' ? end + 1 : end;
+    }
+    return channels;
+}
+
+static void print_event(uint64_t number, const struct tdc_event *event,
+    unsigned int format, const struct tdc_clock *clock)
+{
+    unsigned int i;
+    int64_t real_ns;
+
+    printf("%llu", (unsigned long long)number);
+    if (event->card >= 0)
+        printf(" card %d", event->card);
+    if (format & TDC_FMT_SEQ)
+        printf(" COM %u", event->seq);
+    if ((format & TDC_FMT_TIME) &&
+        !tdc_clock_real_ns(clock, event->time, &real_ns))
+        printf(" at %lld.%09lld", (long long)(real_ns / 1000000000),
+            (long long)(real_ns % 1000000000));
+    else if (format & TDC_FMT_TIME)
+        printf(" at cycle %llu", (unsigned long long)event->time);
+    printf(":");
+    for (i = 0; i < event->num_hits; ++i)
+        printf(" CH %d: %u", event->channel[i] + 1, event->delay[i]);
+    printf("\n");
+}
+
+static void print_record(const struct tdc_event *event)
+{
+    int i, last;
+
+    if (event->card >= 0)
+        printf("card %d ", event->card);
+    if (event->type == TDC_REC_CLOCK) {
+        printf("clock: cycle %llu at %lld ns, %lld ns monotonic, %u kHz\n",
+            (unsigned long long)event->time, (long long)event->real_ns,
+            (long long)event->mono_ns, event->khz);
+        return;
+    }
+    if (event->type == TDC_REC_COUNTS) {
+        printf("counts: %u COM signals from COM %u, %u us at %lld ns "
+            "monotonic\n", event->count, event->seq, event->slice_us,
+            (long long)event->mono_ns);
+        printf("  hits:");
+        for (i = 0; i < TDC_EVENT_MAX_CHANNELS; ++i)
+            printf(" %u", event->hits[i]);
+        printf("\n  out of range:");
+        for (i = 0; i < TDC_EVENT_MAX_CHANNELS; ++i)
+            printf(" %u", event->invalid[i]);
+        for (last = TDC_COUNT_MULT_BINS - 1; last > 0; --last)
+            if (event->mult[last])
+                break;
+        printf("\n  multiplicity:");
+        for (i = 0; i <= last; ++i)
+            printf(" %u", event->mult[i]);
+        printf("\n");
+        return;
+    }
+    if (event->type == TDC_REC_GAP)
+        printf("gap: %u events dropped", event->count);
+    else if (event->type == TDC_REC_EMPTY)
+        printf("empty: %u COM signals without hits", event->count);
+    else
+        printf("record %#x: count %u", event->type, event->count);
+    printf(", from COM %u\n", event->seq);
+}
+
+static int event_matches(const struct tdc_event *event, unsigned int channels,
+    unsigned int min_hits, unsigned int max_hits)
+{
+    unsigned int i, seen = 0;
+
+    if (event->num_hits < min_hits || event->num_hits > max_hits)
+        return 0;
+    for (i = 0; i < event->num_hits; ++i)
+        seen |= 1 << (event->channel[i] & 7);
+    return (seen & channels) == channels;
+}
+
+static int dump(int argc, char **argv)
+{
+    struct tdc_index *index;
+    struct tdc_run *run;
+    struct tdc_parser parser;
+    struct tdc_clock clocks[256];  // of each card of a merged run
+    struct tdc_index_entry *entry;
+    unsigned char buf[65536];
+    unsigned long long first = 0, count = ~0ULL, printed = 0;
+    unsigned int channels = 0, min_hits = 0, max_hits = 255;
+    uint64_t number;
+    double seconds = -1;
+    char path[1024];
+    size_t len, pos, n;
+    long block;
+    int c, complete, retval = 1;
+
+    while ((c = getopt(argc, argv, "e:t:n:c:m:M:")) != -1) {
+        switch (c) {
+        case 'e': first = strtoull(optarg, NULL, 0); break;
+        case 't': seconds = atof(optarg); break;
+        case 'n': count = strtoull(optarg, NULL, 0); break;
+        case 'c':
+            channels = parse_channels(optarg);
+            if (!channels) {
+                usage();
+                return 1;
+            }
+            break;
+        case 'm': min_hits = atoi(optarg); break;
+        case 'M': max_hits = atoi(optarg); break;
+        default: usage(); return 1;
+        }
+    }
+    if (optind != argc - 1) {
+        usage();
+        return 1;
+    }
+
+    run = tdc_run_open(argv[optind]);
+    if (!run) {
+        fprintf(stderr, "Could not open the run %s\n", argv[optind]);
+        return 1;
+    }
+    tdc_index_path(argv[optind], path, sizeof(path));
+    index = tdc_index_load(path);
+    if (!index) {
+        fprintf(stderr, "%s: no index, build it with tdc-index build\n", path);
+        goto out_run;
+    }
+
+    if (seconds >= 0) {
+        block = tdc_index_find_time(index,
+            run->header.start_time_ns + (uint64_t)(seconds * 1e9));
+        if (block >= 0)
+            first = index->entries[block].event;
+    }
+    block = tdc_index_find_event(index, first);
+    if (block < 0 || tdc_index_seek_event(index, run, &parser, first)) {
+        retval = 0;  // nothing to print
+        goto out;
+    }
+    number = first;
+    for (c = 0; c < 256; ++c)
+        tdc_clock_init(&clocks[c]);
+
+    while (printed < count) {
+        /* At the start of a block, skip it if it can't have a match. */
+        entry = &index->entries[block];
+        if (number == entry->event &&
+            !tdc_index_may_match(entry, channels, min_hits, max_hits)) {
+            number += entry->num_events;
+            if (++block >= (long)index->num_entries)
+                break;
+            if (tdc_index_seek_block(index, run, &parser, block))
+                goto out;
+            continue;
+        }
+
+        len = tdc_run_read(run, buf, sizeof(buf));
+        if (!len)
+            break;
+        for (pos = 0; pos < len && printed < count; pos += n) {
+            n = tdc_parser_feed(&parser, buf + pos, len - pos, &complete);
+            if (!complete)
+                continue;
+            if (parser.event.type == TDC_REC_CLOCK)
+                tdc_clock_update(&clocks[parser.event.card & 0xff],
+                    &parser.event);
+            if (tdc_event_is_record(&parser.event)) {
+                if (!channels && !min_hits && max_hits >= 255)
+                    print_record(&parser.event);
+                continue;
+            }
+            if (event_matches(&parser.event, channels, min_hits, max_hits)) {
+                print_event(number, &parser.event, parser.format,
+                    &clocks[parser.event.card & 0xff]);
+                printed++;
+            }
+            number++;
+            if (block + 1 < (long)index->num_entries &&
+                number == index->entries[block + 1].event) {
+                block++;
+                pos += n;
+                break;  // so the next block may be skipped
+            }
+        }
+        if (pos < len && tdc_run_seek(run, run->pos - (len - pos)))
+            goto out;
+    }
+    retval = 0;
+
+out:
+    tdc_index_free(index);
+out_run:
+    tdc_run_close(run);
+    return retval;
+}
+
+int main(int argc, char **argv)
+{
+    if (argc < 2) {
+        usage();
+        return 1;
+    }
+    if (strcmp(argv[1], "build") == 0)
+        return build(argc - 1, argv + 1);
+    if (strcmp(argv[1], "info") == 0)
+        return info(argc - 1, argv + 1);
+    if (strcmp(argv[1], "dump") == 0)
+        return dump(argc - 1, argv + 1);
+    usage();
+    return 1;
+}
@@ -0,0 +1,369 @@
+/*
+ * tdc-iotrace - decodes the port I/O trace of a card, see tdc_iotrace.h.
+ *
+ *   echo 1 > /sys/kernel/debug/tdcmod/tdc_iotrace
+ *   ... run a measurement ...
+ *   echo 0 > /sys/kernel/debug/tdcmod/tdc_iotrace
+ *   tdc-iotrace [-d NAME] [-s] [-e] [FILE]
+ *
+ * Prints each port access with its time, the phase of the protocol and
+ * what it means, followed by how long each phase took. With -e the events
+ * read from the card are written to stdout instead, in the format taken
+ * by the simulated card (tdcmod/<name>_sim), so that a trace of a real
+ * card can be replayed through the acquisition code.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "tdc_iotrace.h"
+
+#define DEBUGFS_DIR "/sys/kernel/debug/tdcmod"
+
+/* The ports of the card, relative to its base address. */
+enum { PIA1PA = 0, PIA1PB = 1, CTRL1 = 3, PIA2PA = 4, PIA2PB = 5, CTRL2 = 7 };
+
+/* The bits of the 8255 ports of the card, see TDC_Device.h. */
+#define P_OUT           0x02    /* PIA1PB: hits left */
+#define COM_DISABLED    0x80    /* PIA1PB: a COM signal was seen */
+#define RCLK            0x80    /* PIA2PB */
+
+/* The most hits the card can give for one COM signal. */
+#define MAX_HITS 128
+
+static const char *phase_names[TDC_NUM_IO_PHASES] = {
+    "prepare_wait",
+    "check",
+    "decode",
+    "reset",
+    "setup"
+};
+
+static const char *port_names[8] = {
+    "PIA1PA", "PIA1PB", "?2", "CTRL1", "PIA2PA", "PIA2PB", "?6", "CTRL2"
+};
+
+static const char *dir_names[] = { "out", "in", "inw" };
+
+static const struct {
+    unsigned int bit;
+    const char *name;
+} pia2pb_bits[] = {
+    { 0x80, "RCLK" },
+    { 0x40, "CSTP_TRIG" },
+    { 0x20, "COM_MODE" },
+    { 0x10, "P.in" },
+    { 0x08, "RESET" },
+    { 0x01, "ENABLE" },
+};
+
+static void usage(const char *name)
+{
+    fprintf(stderr,
+        "Usage: %s [options] [FILE]\n"
+        "Decodes a port I/O trace, read from FILE (a copy of it) or from\n"
+        DEBUGFS_DIR "/NAME_iotrace.\n"
+        "  -d NAME     the card, default tdc\n"
+        "  -s          only print how long each phase took\n"
+        "  -e          write the events read from the card to stdout, for\n"
+        "              the simulated card\n",
+        name);
+}
+
+/**
+ * struct decoder - follows the protocol through the trace
+ * @header:     Of the trace.
+ * @phase:      Of the previous entry, or -1 at the start.
+ * @hit_port:   Bit i is set if port i was read for the current hit.
+ * @delay, @status: Of the current hit.
+ * @in_event:   Set from the check of a COM signal until its hits are read.
+ * @num_hits, @channel, @delay_of: The hits of the current event.
+ */
+struct decoder {
+    const struct tdc_iotrace_header *header;
+    int phase;
+    unsigned int hit_port;
+    unsigned int delay, status;
+    int in_event;
+    unsigned int num_hits;
+    unsigned char channel[MAX_HITS];
+    unsigned short delay_of[MAX_HITS];
+};
+
+/**
+ * struct phase_time - how long the runs of a phase took, or the read-outs
+ * @runs:       Number of runs.
+ * @accesses:   Number of port accesses.
+ * @sum, @max:  Of the durations of the runs, in cycles.
+ */
+struct phase_time {
+    unsigned long runs;
+    unsigned long accesses;
+    double sum, max;
+};
+
+static void add_time(struct phase_time *t, double duration)
+{
+    t->runs++;
+    t->sum += duration;
+    if (duration > t->max)
+        t->max = duration;
+}
+
+static double cycles_to_us(const struct tdc_iotrace_header *header,
+    double cycles)
+{
+    return header->khz ? cycles / (header->khz / 1000.0) : cycles;
+}
+
+/* Writes the event read out, for the simulated card. */
+static void put_event(struct decoder *dec)
+{
+    unsigned char buf[1 + 3 * MAX_HITS];
+    unsigned int i, len = 0;
+
+    buf[len++] = dec->num_hits;
+    for (i = 0; i < dec->num_hits; ++i) {
+        buf[len++] = dec->channel[i];
+        buf[len++] = dec->delay_of[i] & 0xff;
+        buf[len++] = dec->delay_of[i] >> 8;
+    }
+    fwrite(buf, 1, len, stdout);
+    dec->in_event = 0;
+}
+
+/* What an entry is to the timing of the phases. */
+enum { SAME_RUN, NEW_RUN, POLL, POLL_COM };
+
+/*
+ * Follows an entry, putting what it means in note. Returns NEW_RUN if it
+ * starts a new run of its phase, SAME_RUN if it continues the run, or
+ * POLL or POLL_COM if it polls for a COM signal.
+ */
+static int decode(struct decoder *dec, const struct tdc_io_entry *entry,
+    char *note, size_t size, int events)
+{
+    unsigned int value = entry->value;
+    int new_run = entry->phase != dec->phase ? NEW_RUN : SAME_RUN;
+    size_t len = 0;
+    unsigned int i;
+
+    note[0] = '\0';
+    if (events && dec->in_event && entry->phase != TDC_IO_CHECK &&
+        entry->phase != TDC_IO_DECODE)
+        put_event(dec);
+    dec->phase = entry->phase;
+
+    if (entry->dir == TDC_IO_OUT) {
+        if (entry->port == PIA2PB) {
+            for (i = 0; i < sizeof(pia2pb_bits) / sizeof(pia2pb_bits[0]); ++i)
+                if (value & pia2pb_bits[i].bit)
+                    len += snprintf(note + len, size - len, "%s ",
+                        pia2pb_bits[i].name);
+            // Each hit is clocked out with a rising edge of RCLK.
+            if (entry->phase == TDC_IO_DECODE && (value & RCLK)) {
+                dec->hit_port = 0;
+                new_run = NEW_RUN;
+            }
+        } else if (entry->port == PIA1PA) {
+            snprintf(note, size, "cfgH");
+        } else if (entry->port == PIA2PA) {
+            snprintf(note, size, "cfgL");
+        } else {
+            snprintf(note, size, "mode word");
+        }
+        return new_run;
+    }
+
+    if (entry->phase == TDC_IO_PREPARE_WAIT && entry->port == PIA1PB) {
+        // Polling for a COM signal, between the runs.
+        snprintf(note, size, "%s", value & COM_DISABLED ? "COM" : "no COM");
+        return value & COM_DISABLED ? POLL_COM : POLL;
+    }
+    if (entry->phase == TDC_IO_CHECK && entry->port == PIA1PB) {
+        snprintf(note, size, "%s", value & P_OUT ? "hits" : "no hits");
+        dec->in_event = 1;
+        dec->num_hits = 0;
+        return new_run;
+    }
+    if (entry->phase != TDC_IO_DECODE)
+        return new_run;
+
+    if (entry->dir == TDC_IO_INW) {
+        dec->delay = (dec->delay & 0xff) | ((value & 0xff) << 8);
+        dec->status = value >> 8;
+        dec->hit_port |= (1 << PIA1PA) | (1 << PIA1PB);
+    } else if (entry->port == PIA1PA) {
+        dec->delay = (dec->delay & 0xff) | (value << 8);
+        dec->hit_port |= 1 << PIA1PA;
+    } else if (entry->port == PIA2PA) {
+        dec->delay = (dec->delay & 0xff00) | value;
+        dec->hit_port |= 1 << PIA2PA;
+    } else if (entry->port == PIA1PB) {
+        dec->status = value;
+        dec->hit_port |= 1 << PIA1PB;
+    }
+    if (dec->hit_port == ((1 << PIA1PA) | (1 << PIA1PB) | (1 << PIA2PA))) {
+        snprintf(note, size, "CH %u: %u%s", ((dec->status >> 2) & 7) + 1,
+            dec->delay, dec->status & P_OUT ? ", more" : "");
+        if (dec->in_event && dec->num_hits < MAX_HITS) {
+            dec->channel[dec->num_hits] = (dec->status >> 2) & 7;
+            dec->delay_of[dec->num_hits++] = dec->delay;
+        }
+        dec->hit_port = 0;
+    }
+    return new_run;
+}
+
+int main(int argc, char **argv)
+{
+    const char *name = "tdc";
+    struct tdc_iotrace_header header;
+    struct tdc_io_entry *entries;
+    struct decoder dec;
+    struct phase_time times[TDC_NUM_IO_PHASES], readout, *t;
+    double run_start = 0, com = -1, prev = 0, start;
+    unsigned long polls = 0, coms = 0;
+    int summary = 0, events = 0, run = -1, kind, c;
+    char path[256], note[128];
+    unsigned long i;
+    FILE *f;
+
+    while ((c = getopt(argc, argv, "d:seh")) != -1) {
+        switch (c) {
+        case 'd': name = optarg; break;
+        case 's': summary = 1; break;
+        case 'e': events = 1; break;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if (optind < argc - 1) {
+        usage(argv[0]);
+        return 1;
+    }
+    if (optind == argc - 1)
+        snprintf(path, sizeof(path), "%s", argv[optind]);
+    else
+        snprintf(path, sizeof(path), DEBUGFS_DIR "/%s_iotrace", name);
+
+    f = fopen(path, "r");
+    if (!f) {
+        perror(path);
+        return 1;
+    }
+    if (fread(&header, sizeof(header), 1, f) != 1 ||
+        header.magic != TDC_IOTRACE_MAGIC ||
+        header.version != TDC_IOTRACE_VERSION ||
+        header.entry_size != sizeof(struct tdc_io_entry)) {
+        fprintf(stderr, "%s: not a port I/O trace of this version\n", path);
+        fclose(f);
+        return 1;
+    }
+    entries = malloc(header.num_entries * sizeof(*entries) + 1);
+    if (!entries || fread(entries, sizeof(*entries), header.num_entries, f) !=
+        header.num_entries) {
+        fprintf(stderr, "%s: the trace is cut short\n", path);
+        fclose(f);
+        return 1;
+    }
+    fclose(f);
+
+    memset(&dec, 0, sizeof(dec));
+    memset(times, 0, sizeof(times));
+    memset(&readout, 0, sizeof(readout));
+    dec.header = &header;
+    dec.phase = -1;
+    start = header.num_entries ? (double)entries[0].cycles : 0;
+    if (!events && !summary) {
+        printf("# %u of %llu port accesses of the card at 0x%x",
+            header.num_entries, (unsigned long long)header.recorded,
+            header.baseport);
+        if (header.khz && header.num_entries)
+            printf(", the first at %.6f s (CLOCK_REALTIME)",
+                (header.real_ns + ((double)entries[0].cycles -
+                (double)header.cycles) * 1e6 / header.khz) / 1e9);
+        printf("\n# %s since the first, and since the previous\n",
+            header.khz ? "us" : "cycles");
+    }
+
+    for (i = 0; i < header.num_entries; ++i) {
+        const struct tdc_io_entry *entry = &entries[i];
+        double now = (double)entry->cycles;
+
+        if (entry->phase >= TDC_NUM_IO_PHASES || entry->port > 7 ||
+            entry->dir > TDC_IO_INW) {
+            fprintf(stderr, "%s: bad entry %lu\n", path, i);
+            return 1;
+        }
+        kind = decode(&dec, entry, note, sizeof(note), events);
+        if (kind != SAME_RUN && run >= 0) {
+            add_time(&times[run], prev - run_start);
+            // From the COM signal being seen until the card is armed again.
+            if (run == TDC_IO_PREPARE_WAIT && com >= 0) {
+                add_time(&readout, prev - com);
+                com = -1;
+            }
+            run = -1;
+        }
+        if (kind == POLL || kind == POLL_COM) {
+            polls++;
+            if (kind == POLL_COM) {
+                coms++;
+                com = now;
+            }
+        } else if (kind == NEW_RUN) {
+            /*
+             * A run of the read-out starts after the port access before
+             * it, so that the work in between is counted. The setup, and
+             * what follows it, is timed from its own first access.
+             */
+            run = entry->phase;
+            run_start = i && run != TDC_IO_SETUP &&
+                entries[i - 1].phase != TDC_IO_SETUP ? prev : now;
+        }
+        if (run >= 0)
+            times[run].accesses++;
+        if (!events && !summary)
+            printf("%14.3f %+10.3f  %-12s %-3s %-6s %#6.*x  %s\n",
+                cycles_to_us(&header, now - start),
+                cycles_to_us(&header, i ? now - prev : 0),
+                phase_names[entry->phase], dir_names[entry->dir],
+                port_names[entry->port], entry->dir == TDC_IO_INW ? 4 : 2,
+                entry->value, note);
+        prev = now;
+    }
+    if (run >= 0)
+        add_time(&times[run], prev - run_start);
+    if (events) {
+        if (dec.in_event)
+            put_event(&dec);
+        free(entries);
+        return 0;
+    }
+
+    printf("%s%-12s %10s %10s %12s %12s\n", summary ? "" : "\n",
+        "phase", "runs", "accesses", header.khz ? "mean us" : "mean cycles",
+        header.khz ? "max us" : "max cycles");
+    for (c = 0; c < TDC_NUM_IO_PHASES; ++c) {
+        t = &times[c];
+        if (!t->runs)
+            continue;
+        printf("%-12s %10lu %10lu %12.3f %12.3f\n", phase_names[c], t->runs,
+            t->accesses, cycles_to_us(&header, t->sum / t->runs),
+            cycles_to_us(&header, t->max));
+    }
+    if (readout.runs)
+        printf("%-12s %10lu %10s %12.3f %12.3f\n", "read-out", readout.runs,
+            "", cycles_to_us(&header, readout.sum / readout.runs),
+            cycles_to_us(&header, readout.max));
+    printf("%lu polls for a COM signal, %lu saw one.\n", polls, coms);
+    printf("A run is timed from the end of the port access before it, so it "
+        "includes the\nwork done in between. Each decode run is one hit. "
+        "The read-out is from the\npoll seeing a COM signal until the card "
+        "is armed again.\n");
+    free(entries);
+    return 0;
+}
@@ -0,0 +1,361 @@
+/*
+ * tdc-pack - compresses and decompresses recorded runs, see tdc_codec.h.
+ *
+ *   tdc-pack [-j THREADS] IN OUT      compresses the run IN to the run OUT
+ *   tdc-pack -d [-j THREADS] IN OUT   decompresses it again
+ *   tdc-pack -t [-j THREADS] IN       compresses and decompresses the run
+ *                                     in memory, checks the result and
+ *                                     reports the ratio and the speed
+ *
+ * OUT is written with the same files as IN, each with the stream bytes of
+ * the file of IN.
+ */
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "tdc_run.h"
+
+static struct {
+    int threads;
+    int decompress;
+    int test;
+} opt = {
+    .threads = 2,
+};
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/*
+ * Starts file i of the run prefix, with the header of the file it is made
+ * of and the given flags.
+ * Returns the file, or NULL on error.
+ */
+static FILE *open_output(const char *prefix, unsigned int i,
+    const char *in_name, uint32_t flags)
+{
+    struct tdc_run_header header;
+    char name[1024];
+    FILE *in, *file;
+
+    in = fopen(in_name, "r");
+    if (!in || tdc_run_read_header(in, &header)) {
+        fprintf(stderr, "%s: not a recorded run\n", in_name);
+        if (in)
+            fclose(in);
+        return NULL;
+    }
+    fclose(in);
+    header.header_size = sizeof(header);
+    header.version = TDC_RUN_VERSION;
+    header.flags = (header.flags & ~TDC_RUN_COMPRESSED) | flags;
+
+    snprintf(name, sizeof(name), "%s_%04u.tdc", prefix, i);
+    file = fopen(name, "w");
+    if (!file || fwrite(&header, sizeof(header), 1, file) != 1) {
+        perror(name);
+        if (file)
+            fclose(file);
+        return NULL;
+    }
+    return file;
+}
+
+static int write_block(void *arg, const unsigned char *block, size_t size,
+    size_t raw_len)
+{
+    return fwrite(block, 1, size, arg) == size ? 0 : -1;
+}
+
+/*
+ * Compresses each file of run into a file of the run prefix.
+ * Returns 0 on success, -1 on error.
+ */
+static int pack(struct tdc_run *run, const char *prefix)
+{
+    struct tdc_codec_writer *writer = NULL;
+    unsigned char *buf;
+    uint64_t left;
+    unsigned int i;
+    size_t len;
+    FILE *file;
+    int retval = -1;
+
+    buf = malloc(TDC_CODEC_BLOCK_SIZE);
+    if (!buf)
+        return -1;
+    for (i = 0; i < run->num_files; ++i) {
+        file = open_output(prefix, i, run->files[i].name,
+            TDC_RUN_COMPRESSED);
+        if (!file)
+            goto out;
+        writer = tdc_codec_writer_open(opt.threads,
+            !!(run->header.flags & TDC_RUN_MERGED), run->header.stream_format,
+            1, write_block, file);
+        if (!writer) {
+            fclose(file);
+            goto out;
+        }
+        // The last block of the file may end in the middle of an event.
+        for (left = run->files[i].size; left > 0; left -= len) {
+            len = left < TDC_CODEC_BLOCK_SIZE ? left : TDC_CODEC_BLOCK_SIZE;
+            if (tdc_run_read(run, buf, len) != len ||
+                tdc_codec_writer_feed(writer, buf, len))
+                break;
+        }
+        if (left || tdc_codec_writer_flush(writer) || fclose(file)) {
+            fprintf(stderr, "%s: could not compress\n", run->files[i].name);
+            goto out;
+        }
+        fprintf(stderr, "%s: %llu bytes, ratio %.2f\n", run->files[i].name,
+            (unsigned long long)writer->raw_bytes, writer->bytes ?
+            (double)writer->raw_bytes / writer->bytes : 0.0);
+        tdc_codec_writer_free(writer);
+        writer = NULL;
+    }
+    retval = 0;
+
+out:
+    tdc_codec_writer_free(writer);
+    free(buf);
+    return retval;
+}
+
+/*
+ * Decompresses each file of the compressed run into a file of the run
+ * prefix, the blocks of a file in parallel.
+ * Returns 0 on success, -1 on error.
+ */
+static int unpack(struct tdc_run *run, const char *prefix)
+{
+    struct tdc_codec_pool *pool;
+    struct tdc_codec_job *jobs;
+    struct tdc_run_block *b;
+    unsigned char *packed, *raw;
+    unsigned int i, next;
+    FILE *in = NULL, *file = NULL;
+    int j, n, retval = -1;
+    size_t packed_size = tdc_codec_bound(TDC_CODEC_BLOCK_SIZE,
+        TDC_CODEC_MAX_ALIGN);
+
+    pool = tdc_codec_pool_new(opt.threads, 0, 0, 1);
+    jobs = calloc(opt.threads, sizeof(*jobs));
+    packed = malloc((size_t)opt.threads * packed_size);
+    raw = malloc((size_t)opt.threads * TDC_CODEC_BLOCK_SIZE);
+    if (!pool || !jobs || !packed || !raw)
+        goto out;
+    for (j = 0; j < opt.threads; ++j) {
+        jobs[j].decompress = 1;
+        jobs[j].in = packed + j * packed_size;
+        jobs[j].out = raw + (size_t)j * TDC_CODEC_BLOCK_SIZE;
+    }
+
+    for (i = 0; i < run->num_files; ++i) {
+        in = fopen(run->files[i].name, "r");
+        if (!in) {
+            perror(run->files[i].name);
+            goto out;
+        }
+        file = open_output(prefix, i, run->files[i].name, 0);
+        if (!file)
+            goto out;
+        for (next = 0; next < run->files[i].num_blocks; next += n) {
+            n = run->files[i].num_blocks - next;
+            if (n > opt.threads)
+                n = opt.threads;
+            for (j = 0; j < n; ++j) {
+                b = &run->files[i].blocks[next + j];
+                jobs[j].in_len = b->size;
+                if (fseeko(in, b->file_offset, SEEK_SET) ||
+                    fread(packed + j * packed_size, 1, b->size, in) != b->size)
+                    goto fail;
+            }
+            tdc_codec_pool_run(pool, jobs, n);
+            for (j = 0; j < n; ++j) {
+                if (jobs[j].error ||
+                    fwrite(jobs[j].out, 1, jobs[j].out_len, file) !=
+                        jobs[j].out_len)
+                    goto fail;
+            }
+        }
+        fclose(in);
+        in = NULL;
+        if (fclose(file)) {
+            file = NULL;
+            goto fail;
+        }
+        file = NULL;
+    }
+    retval = 0;
+    goto out;
+
+fail:
+    fprintf(stderr, "%s: could not decompress\n", run->files[i].name);
+out:
+    if (in)
+        fclose(in);
+    if (file)
+        fclose(file);
+    tdc_codec_pool_free(pool);
+    free(jobs);
+    free(packed);
+    free(raw);
+    return retval;
+}
+
+/*
+ * Compresses and decompresses the stream of the run in memory, a block
+ * for each thread at a time, and checks that it comes back the same.
+ * Returns 0 if it does, -1 if not or on error.
+ */
+static int test(struct tdc_run *run)
+{
+    const int merged = !!(run->header.flags & TDC_RUN_MERGED);
+    const unsigned int format = run->header.stream_format;
+    struct tdc_codec_pool *pool, *unpool;
+    struct tdc_codec_job *jobs, *unjobs;
+    unsigned char *raw, *packed, *back, *slot;
+    uint64_t raw_bytes = 0, bytes = 0, cpu_ns = 0, uncpu_ns = 0, start_ns;
+    size_t fill = 0, whole, packed_size = tdc_codec_bound(TDC_CODEC_BLOCK_SIZE,
+        1);
+    int j, n, eof = 0, retval = -1;
+    double seconds;
+
+    pool = tdc_codec_pool_new(opt.threads, merged, format, 1);
+    unpool = tdc_codec_pool_new(opt.threads, merged, format, 1);
+    jobs = calloc(opt.threads, sizeof(*jobs));
+    unjobs = calloc(opt.threads, sizeof(*unjobs));
+    raw = malloc((size_t)opt.threads * TDC_CODEC_BLOCK_SIZE);
+    packed = malloc((size_t)opt.threads * packed_size);
+    back = malloc((size_t)opt.threads * TDC_CODEC_BLOCK_SIZE);
+    if (!pool || !unpool || !jobs || !unjobs || !raw || !packed || !back)
+        goto out;
+
+    start_ns = now_ns();
+    while (!eof) {
+        // Cut the stream into blocks after whole events, as tdc-record does.
+        for (n = 0; n < opt.threads && !eof; ++n) {
+            slot = raw + (size_t)n * TDC_CODEC_BLOCK_SIZE;
+            fill += tdc_run_read(run, slot + fill,
+                TDC_CODEC_BLOCK_SIZE - fill);
+            eof = fill < TDC_CODEC_BLOCK_SIZE;
+            whole = eof ? fill : tdc_codec_events_len(slot, fill, merged,
+                format);
+            if (!whole)
+                whole = fill;
+            jobs[n].decompress = 0;
+            jobs[n].in = slot;
+            jobs[n].in_len = whole;
+            jobs[n].out = packed + n * packed_size;
+            fill -= whole;
+            if (n + 1 < opt.threads)
+                memcpy(slot + TDC_CODEC_BLOCK_SIZE, slot + whole, fill);
+        }
+        tdc_codec_pool_run(pool, jobs, n);
+
+        for (j = 0; j < n; ++j) {
+            unjobs[j].decompress = 1;
+            unjobs[j].in = jobs[j].out;
+            unjobs[j].in_len = jobs[j].out_len;
+            unjobs[j].out = back + (size_t)j * TDC_CODEC_BLOCK_SIZE;
+        }
+        tdc_codec_pool_run(unpool, unjobs, n);
+        for (j = 0; j < n; ++j) {
+            if (unjobs[j].error || unjobs[j].out_len != jobs[j].in_len ||
+                memcmp(unjobs[j].out, jobs[j].in, jobs[j].in_len)) {
+                fprintf(stderr, "Block at %llu does not decompress to the "
+                    "stream\n", (unsigned long long)raw_bytes);
+                goto out;
+            }
+            raw_bytes += jobs[j].in_len;
+            bytes += jobs[j].out_len;
+            cpu_ns += jobs[j].cpu_ns;
+            uncpu_ns += unjobs[j].cpu_ns;
+        }
+        // The rest of the last block starts the next.
+        memmove(raw, jobs[n - 1].in + jobs[n - 1].in_len, fill);
+    }
+    seconds = (now_ns() - start_ns) / 1e9;
+
+    printf("%llu bytes of the stream to %llu: ratio %.2f\n",
+        (unsigned long long)raw_bytes, (unsigned long long)bytes,
+        bytes ? (double)raw_bytes / bytes : 0.0);
+    printf("compress:   %.2f GB/s per core\n",
+        cpu_ns ? (double)raw_bytes / cpu_ns : 0.0);
+    printf("decompress: %.2f GB/s per core\n",
+        uncpu_ns ? (double)raw_bytes / uncpu_ns : 0.0);
+    printf("both, with reading the run: %.2f GB/s with %d threads\n",
+        seconds > 0 ? raw_bytes / seconds / 1e9 : 0.0, opt.threads);
+    retval = 0;
+
+out:
+    tdc_codec_pool_free(pool);
+    tdc_codec_pool_free(unpool);
+    free(jobs);
+    free(unjobs);
+    free(raw);
+    free(packed);
+    free(back);
+    return retval;
+}
+
+static void usage(void)
+{
+    fprintf(stderr,
+        "Usage: tdc-pack [-j THREADS] IN OUT\n"
+        "  Compresses the run IN_0000.tdc, ... to OUT_0000.tdc, ...\n"
+        "Usage: tdc-pack -d [-j THREADS] IN OUT\n"
+        "  Decompresses the run IN to the run OUT.\n"
+        "Usage: tdc-pack -t [-j THREADS] IN\n"
+        "  Compresses and decompresses the run IN in memory, checks the\n"
+        "  result and reports the ratio and the speed.\n"
+        "  -j THREADS   threads compressing, default 2\n");
+}
+
+int main(int argc, char **argv)
+{
+    struct tdc_run *run;
+    int c, compressed, retval;
+
+    while ((c = getopt(argc, argv, "j:dth")) != -1) {
+        switch (c) {
+        case 'j': opt.threads = atoi(optarg); break;
+        case 'd': opt.decompress = 1; break;
+        case 't': opt.test = 1; break;
+        default: usage(); return 1;
+        }
+    }
+    if (opt.threads < 1 || (opt.decompress && opt.test) ||
+        argc - optind != (opt.test ? 1 : 2)) {
+        usage();
+        return 1;
+    }
+
+    run = tdc_run_open(argv[optind]);
+    if (!run) {
+        fprintf(stderr, "Could not open the run %s\n", argv[optind]);
+        return 1;
+    }
+    compressed = !!(run->header.flags & TDC_RUN_COMPRESSED);
+    if (opt.test) {
+        retval = test(run);
+    } else if (opt.decompress != compressed) {
+        fprintf(stderr, "%s is %scompressed\n", argv[optind],
+            compressed ? "already " : "not ");
+        retval = -1;
+    } else if (opt.decompress) {
+        retval = unpack(run, argv[optind + 1]);
+    } else {
+        retval = pack(run, argv[optind + 1]);
+    }
+    tdc_run_close(run);
+    return retval ? 1 : 0;
+}
@@ -0,0 +1,686 @@
+/*
+ * tdc-record - records the event stream of a TDC card to disk.
+ *
+ * In the default (direct) mode, one thread reads from the device into
+ * large aligned buffers, and another thread writes the full buffers with
+ * O_DIRECT, so that the reading does not wait for the page cache
+ * writeback. The memory is locked and both threads run with real-time
+ * priority.
+ *
+ * For comparison, the splice mode moves the data with splice() through a
+ * pipe, so that it does not pass through userspace (the driver still
+ * copies it once, into the pipe's pages), and the plain mode is a simple
+ * read/write loop.
+ * All modes report the throughput, the CPU time used per GB and how often
+ * the driver's buffer was full; which mode loses the fewest events with a
+ * given card and disk is for these figures to tell.
+ *
+ * The run is split into files of a given size or duration, see tdc_run.h,
+ * and an index of the events is written to <prefix>.tdx, see tdc_index.h.
+ * With -z, the stream is compressed in blocks by several threads before it
+ * is written, see tdc_codec.h.
+ */
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include "tdc_index.h"
+
+#define ALIGNMENT TDC_RUN_HEADER_SIZE
+#define MB (1024 * 1024)
+
+/* How many reads into a buffer have their times remembered for the index. */
+#define BUFFER_READS 64
+
+enum { MODE_DIRECT, MODE_SPLICE, MODE_PLAIN };
+
+static struct {
+    const char *device;
+    const char *prefix;
+    size_t buffer_size;
+    int nbuffers;
+    uint64_t rotate_bytes;
+    unsigned int rotate_secs;
+    unsigned int fsync_secs;
+    int priority;
+    int mode;
+    int index;
+    int compress;
+    int threads;
+} opt = {
+    .device = "/dev/tdc",
+    .prefix = "run",
+    .buffer_size = 4 * MB,
+    .nbuffers = 2,
+    .rotate_bytes = 1024ULL * MB,
+    .rotate_secs = 0,
+    .fsync_secs = 10,
+    .priority = 50,
+    .mode = MODE_DIRECT,
+    .index = 1,
+    .compress = 0,
+    .threads = 2,
+};
+
+/**
+ * struct buffer - a buffer handed from the reader to the writer
+ * @data:   ALIGNMENT aligned memory of opt.buffer_size bytes.
+ * @len:    Number of bytes of data.
+ * @reads:  Where the data of each read ends in the buffer, and when it was
+ *          read, for the index.
+ * @nreads: Number of reads.
+ */
+struct buffer {
+    unsigned char *data;
+    size_t len;
+    struct {
+        size_t end;
+        uint64_t time_ns;
+    } reads[BUFFER_READS];
+    int nreads;
+};
+
+/*
+ * The buffers are passed between the threads through two queues:
+ * free buffers from the writer to the reader, and full buffers from the
+ * reader to the writer. A full buffer with len 0 tells the writer to stop.
+ */
+struct queue {
+    struct buffer **items;
+    int head, count;
+};
+
+static struct buffer *buffers;
+static struct queue free_queue, full_queue;
+static pthread_mutex_t queue_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t queue_cond = PTHREAD_COND_INITIALIZER;
+
+/**
+ * struct output - the file being written
+ * @fd:             File descriptor, -1 if no file is open.
+ * @header:         Run header, updated for each file.
+ * @file_bytes:     Data bytes written to this file.
+ * @file_start_ns:  When this file was started.
+ * @last_sync_ns:   When the file was last synced.
+ * @total_bytes:    Data bytes written in the whole run.
+ * @stream_bytes:   Stream bytes in them, more if they are compressed.
+ * @nfiles:         Number of files started.
+ * @index:          Index of the run, NULL if none is written.
+ * @codec:          Compresses the stream, NULL if it is written as it is.
+ * @config_device:  Device whose /proc file holds the configuration, the
+ *                  first card for the merged device.
+ */
+static struct output {
+    int fd;
+    struct tdc_run_header *header;
+    uint64_t file_bytes;
+    uint64_t file_start_ns;
+    uint64_t last_sync_ns;
+    uint64_t total_bytes;
+    uint64_t stream_bytes;
+    unsigned int nfiles;
+    struct tdc_index_writer *index;
+    struct tdc_codec_writer *codec;
+    char config_device[1024];
+} out = { .fd = -1 };
+
+static volatile sig_atomic_t stop;
+static unsigned long reader_stalls;
+
+static void on_signal(int sig)
+{
+    stop = 1;
+}
+
+static void queue_push(struct queue *q, struct buffer *b)
+{
+    pthread_mutex_lock(&queue_lock);
+    q->items[(q->head + q->count) % opt.nbuffers] = b;
+    q->count++;
+    pthread_cond_broadcast(&queue_cond);
+    pthread_mutex_unlock(&queue_lock);
+}
+
+static struct buffer *queue_pop(struct queue *q, unsigned long *stalls)
+{
+    struct buffer *b;
+
+    pthread_mutex_lock(&queue_lock);
+    if (!q->count && stalls)
+        (*stalls)++;
+    while (!q->count)
+        pthread_cond_wait(&queue_cond, &queue_lock);
+    b = q->items[q->head];
+    q->head = (q->head + 1) % opt.nbuffers;
+    q->count--;
+    pthread_mutex_unlock(&queue_lock);
+    return b;
+}
+
+static int write_all(int fd, const unsigned char *data, size_t len)
+{
+    ssize_t n;
+
+    while (len > 0) {
+        n = write(fd, data, len);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        data += n;
+        len -= n;
+    }
+    return 0;
+}
+
+static void close_file(void)
+{
+    if (out.fd < 0)
+        return;
+    if (fsync(out.fd))
+        perror("fsync");
+    close(out.fd);
+    out.fd = -1;
+}
+
+/*
+ * Starts the next file of the run, and writes its header.
+ * Returns 0 on success, -1 on error.
+ */
+static int open_file(void)
+{
+    char name[1024];
+    int flags = O_WRONLY | O_CREAT | O_TRUNC;
+
+    close_file();
+
+    if (opt.mode == MODE_DIRECT)
+        flags |= O_DIRECT;
+    snprintf(name, sizeof(name), "%s_%04u.tdc", opt.prefix, out.nfiles);
+    out.fd = open(name, flags, 0644);
+    if (out.fd < 0) {
+        perror(name);
+        return -1;
+    }
+
+    /*
+     * The configuration may have changed since the last file. If it can't
+     * be read now, the header keeps what was read last.
+     */
+    tdc_run_read_config(out.config_device, out.header);
+    out.header->file_index = out.nfiles++;
+    out.header->stream_offset = out.stream_bytes;
+    out.header->file_time_ns = out.file_start_ns = out.last_sync_ns =
+        tdc_run_now_ns();
+    out.file_bytes = 0;
+
+    if (write_all(out.fd, (unsigned char *)out.header, sizeof(*out.header))) {
+        perror(name);
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Writes data, which holds raw_len bytes of the stream, to the current
+ * file, starting a new file first if the current one is large or old
+ * enough. Syncs the file every fsync_secs instead of after each write.
+ * Returns 0 on success, -1 on error.
+ */
+static int output_data(const unsigned char *data, size_t len, size_t raw_len)
+{
+    uint64_t now = tdc_run_now_ns();
+
+    if (out.fd < 0 ||
+        (opt.rotate_bytes && out.file_bytes >= opt.rotate_bytes) ||
+        (opt.rotate_secs &&
+         now - out.file_start_ns >= opt.rotate_secs * 1000000000ULL)) {
+        if (open_file())
+            return -1;
+    }
+
+    /* The last piece of a run may not be aligned as O_DIRECT requires. */
+    if (opt.mode == MODE_DIRECT && len % ALIGNMENT)
+        fcntl(out.fd, F_SETFL, fcntl(out.fd, F_GETFL) & ~O_DIRECT);
+
+    if (write_all(out.fd, data, len)) {
+        perror("write");
+        return -1;
+    }
+    out.file_bytes += len;
+    out.total_bytes += len;
+    out.stream_bytes += raw_len;
+
+    if (opt.fsync_secs &&
+        now - out.last_sync_ns >= opt.fsync_secs * 1000000000ULL) {
+        fdatasync(out.fd);
+        out.last_sync_ns = now;
+    }
+    return 0;
+}
+
+/* Writes a compressed block, for the codec writer. */
+static int output_block(void *arg, const unsigned char *block, size_t size,
+    size_t raw_len)
+{
+    return output_data(block, size, raw_len);
+}
+
+/*
+ * Writes the next piece of the stream, compressed if asked to. The files
+ * of a compressed run only ever end after a whole block.
+ * Returns 0 on success, -1 on error.
+ */
+static int output_stream(const unsigned char *data, size_t len)
+{
+    if (out.codec)
+        return tdc_codec_writer_feed(out.codec, data, len);
+    return output_data(data, len, len);
+}
+
+/*
+ * Adds data read at time_ns to the index. Stops writing the index on error,
+ * the run itself is more important.
+ */
+static void index_data(const unsigned char *data, size_t len, uint64_t time_ns)
+{
+    if (!out.index)
+        return;
+    if (tdc_index_writer_feed(out.index, data, len, time_ns)) {
+        perror("index");
+        tdc_index_writer_close(out.index);
+        out.index = NULL;
+    }
+}
+
+static void set_priority(pthread_t thread, int priority)
+{
+    struct sched_param param = { .sched_priority = priority };
+
+    if (priority > 0 && pthread_setschedparam(thread, SCHED_FIFO, &param))
+        fprintf(stderr, "Could not set real-time priority %d\n", priority);
+}
+
+static void *writer_thread(void *arg)
+{
+    struct buffer *b;
+    size_t start;
+    int i, failed = 0;
+
+    for (;;) {
+        b = queue_pop(&full_queue, NULL);
+        if (!b->len) {
+            queue_push(&free_queue, b);
+            break;
+        }
+        for (i = 0, start = 0; i < b->nreads; start = b->reads[i++].end)
+            index_data(b->data + start, b->reads[i].end - start,
+                b->reads[i].time_ns);
+        if (!failed && output_stream(b->data, b->len)) {
+            failed = 1;
+            stop = 1;
+        }
+        queue_push(&free_queue, b);
+    }
+    return NULL;
+}
+
+/*
+ * Reads into the buffers and hands the full ones to the writer thread.
+ */
+static int record_direct(int dev)
+{
+    pthread_t writer;
+    struct buffer *b;
+    ssize_t n;
+    int i, eof = 0;
+
+    buffers = calloc(opt.nbuffers, sizeof(*buffers));
+    free_queue.items = calloc(opt.nbuffers, sizeof(struct buffer *));
+    full_queue.items = calloc(opt.nbuffers, sizeof(struct buffer *));
+    if (!buffers || !free_queue.items || !full_queue.items)
+        return -1;
+    for (i = 0; i < opt.nbuffers; ++i) {
+        if (posix_memalign((void **)&buffers[i].data, ALIGNMENT,
+                opt.buffer_size))
+            return -1;
+        // Touch the memory so that it is really there and locked.
+        memset(buffers[i].data, 0, opt.buffer_size);
+        queue_push(&free_queue, &buffers[i]);
+    }
+
+    if (pthread_create(&writer, NULL, writer_thread, NULL))
+        return -1;
+    set_priority(pthread_self(), opt.priority);
+    set_priority(writer, opt.priority > 1 ? opt.priority - 1 : opt.priority);
+
+    while (!eof && !stop) {
+        b = queue_pop(&free_queue, &reader_stalls);
+        b->len = 0;
+        b->nreads = 0;
+        while (b->len < opt.buffer_size) {
+            n = read(dev, b->data + b->len, opt.buffer_size - b->len);
+            if (n > 0) {
+                b->len += n;
+                /*
+                 * If there are too many reads, the last one is extended.
+                 * Its time is then the later one, so that the times in
+                 * the index are never before the events.
+                 */
+                if (b->nreads < BUFFER_READS)
+                    b->nreads++;
+                b->reads[b->nreads - 1].end = b->len;
+                b->reads[b->nreads - 1].time_ns = tdc_run_now_ns();
+            } else if (n == 0 || !(errno == EINTR || errno == EAGAIN) || stop) {
+                if (n < 0 && errno != EINTR)
+                    perror(opt.device);
+                eof = 1;
+                break;
+            }
+        }
+        if (b->len)
+            queue_push(&full_queue, b);
+        else
+            queue_push(&free_queue, b);
+    }
+
+    // An empty buffer tells the writer to stop.
+    b = queue_pop(&free_queue, NULL);
+    b->len = 0;
+    queue_push(&full_queue, b);
+    pthread_join(writer, NULL);
+    return 0;
+}
+
+/*
+ * Moves the data from the device to the file through a pipe with splice,
+ * without it passing through userspace.
+ */
+static int record_splice(int dev)
+{
+    int pipefd[2];
+    ssize_t n, m;
+
+    if (pipe(pipefd)) {
+        perror("pipe");
+        return -1;
+    }
+    set_priority(pthread_self(), opt.priority);
+
+    while (!stop) {
+        n = splice(dev, NULL, pipefd[1], NULL, opt.buffer_size,
+            SPLICE_F_MOVE | SPLICE_F_MORE);
+        if (n == 0)
+            break;
+        if (n < 0) {
+            if (errno == EINTR || errno == EAGAIN)
+                continue;
+            perror("splice");
+            return -1;
+        }
+        if (out.fd < 0 ||
+            (opt.rotate_bytes && out.file_bytes >= opt.rotate_bytes) ||
+            (opt.rotate_secs && tdc_run_now_ns() - out.file_start_ns >=
+                opt.rotate_secs * 1000000000ULL)) {
+            if (open_file())
+                return -1;
+        }
+        while (n > 0) {
+            m = splice(pipefd[0], NULL, out.fd, NULL, n,
+                SPLICE_F_MOVE | SPLICE_F_MORE);
+            if (m < 0) {
+                if (errno == EINTR)
+                    continue;
+                perror("splice");
+                return -1;
+            }
+            n -= m;
+            out.file_bytes += m;
+            out.total_bytes += m;
+            out.stream_bytes += m;
+        }
+    }
+    close(pipefd[0]);
+    close(pipefd[1]);
+    return 0;
+}
+
+/*
+ * The simplest way to record: read into a buffer, write it to the file.
+ */
+static int record_plain(int dev)
+{
+    unsigned char *buf = malloc(opt.buffer_size);
+    ssize_t n;
+
+    if (!buf)
+        return -1;
+    while (!stop) {
+        n = read(dev, buf, opt.buffer_size);
+        if (n == 0)
+            break;
+        if (n < 0) {
+            if (errno == EINTR || errno == EAGAIN)
+                continue;
+            perror(opt.device);
+            break;
+        }
+        index_data(buf, n, tdc_run_now_ns());
+        if (output_stream(buf, n))
+            break;
+    }
+    free(buf);
+    return 0;
+}
+
+static void usage(const char *name)
+{
+    fprintf(stderr,
+        "Usage: %s [options]\n"
+        "Records the data from a TDC device until the measurement is stopped,\n"
+        "or until interrupted.\n"
+        "  -d DEVICE   device to read, default /dev/tdc\n"
+        "  -o PREFIX   files are named PREFIX_0000.tdc, ..., default run\n"
+        "  -s MB       start a new file after this many MB, default 1024 (0 = never)\n"
+        "  -t SECONDS  start a new file after this many seconds, default never\n"
+        "  -b MB       size of each buffer, default 4\n"
+        "  -n NUM      number of buffers, default 2\n"
+        "  -f SECONDS  sync the file this often, default 10 (0 = only when closed)\n"
+        "  -p PRIO     real-time priority, default 50 (0 = don't change)\n"
+        "  -m MODE     direct (default), splice or plain\n"
+        "  -X          don't write an index (never written in splice mode)\n"
+        "  -z          compress the run (not in splice mode)\n"
+        "  -j NUM      threads compressing, default 2\n",
+        name);
+}
+
+int main(int argc, char **argv)
+{
+    struct sigaction sa;
+    struct rusage usage_start, usage_end;
+    uint64_t start_ns, elapsed_ns;
+    unsigned long overflow_start, overflow_end;
+    double seconds, cpu, gb, ratio;
+    char cmd[64], path[1024];
+    const char *name;
+    int c, dev, retval;
+
+    while ((c = getopt(argc, argv, "d:o:s:t:b:n:f:p:m:Xzj:h")) != -1) {
+        switch (c) {
+        case 'd': opt.device = optarg; break;
+        case 'o': opt.prefix = optarg; break;
+        case 's': opt.rotate_bytes = strtoull(optarg, NULL, 0) * MB; break;
+        case 't': opt.rotate_secs = strtoul(optarg, NULL, 0); break;
+        case 'b': opt.buffer_size = strtoul(optarg, NULL, 0) * MB; break;
+        case 'n': opt.nbuffers = atoi(optarg); break;
+        case 'f': opt.fsync_secs = strtoul(optarg, NULL, 0); break;
+        case 'p': opt.priority = atoi(optarg); break;
+        case 'X': opt.index = 0; break;
+        case 'z': opt.compress = 1; break;
+        case 'j': opt.threads = atoi(optarg); break;
+        case 'm':
+            if (strcmp(optarg, "direct") == 0)
+                opt.mode = MODE_DIRECT;
+            else if (strcmp(optarg, "splice") == 0)
+                opt.mode = MODE_SPLICE;
+            else if (strcmp(optarg, "plain") == 0)
+                opt.mode = MODE_PLAIN;
+            else {
+                usage(argv[0]);
+                return 1;
+            }
+            break;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if (!opt.buffer_size || opt.nbuffers < 2 || opt.threads < 1 ||
+        (opt.compress && opt.mode == MODE_SPLICE)) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    if (posix_memalign((void **)&out.header, ALIGNMENT, sizeof(*out.header)))
+        return 1;
+    memset(out.header, 0, sizeof(*out.header));
+    memcpy(out.header->magic, TDC_RUN_MAGIC, sizeof(out.header->magic));
+    out.header->header_size = sizeof(*out.header);
+    out.header->version = TDC_RUN_VERSION;
+    name = strrchr(opt.device, '/');
+    name = name ? name + 1 : opt.device;
+    if (strncmp(name, "tdcm", 4) == 0) {
+        /*
+         * The merged device has no /proc file, take the configuration of
+         * the first card. The cards get the same commands through it.
+         */
+        out.header->flags |= TDC_RUN_MERGED;
+        snprintf(path, sizeof(path), "%.*stdc", (int)(name - opt.device),
+            opt.device);
+    } else {
+        snprintf(path, sizeof(path), "%s", opt.device);
+    }
+    snprintf(out.config_device, sizeof(out.config_device), "%s", path);
+    tdc_run_default_config(out.header);
+    if (tdc_run_read_config(path, out.header))
+        fprintf(stderr, "Could not read the configuration of %s\n", path);
+    strncpy(out.header->device, opt.device, sizeof(out.header->device) - 1);
+
+    if (opt.compress) {
+        // With O_DIRECT, the blocks are padded to keep the writes aligned.
+        out.codec = tdc_codec_writer_open(opt.threads,
+            !!(out.header->flags & TDC_RUN_MERGED), out.header->stream_format,
+            opt.mode == MODE_DIRECT ? ALIGNMENT : 1, output_block, NULL);
+        if (!out.codec) {
+            fprintf(stderr, "Could not start compressing\n");
+            return 1;
+        }
+        out.header->flags |= TDC_RUN_COMPRESSED;
+    }
+
+    // In splice mode the data never passes through here to be indexed.
+    if (opt.index && opt.mode != MODE_SPLICE) {
+        tdc_index_path(opt.prefix, path, sizeof(path));
+        out.index = tdc_index_writer_open(path, 0,
+            !!(out.header->flags & TDC_RUN_MERGED), out.header->stream_format,
+            TDC_INDEX_TIME_READ);
+        if (!out.index)
+            perror(path);
+    }
+
+    dev = open(opt.device, O_RDWR);
+    if (dev < 0)
+        dev = open(opt.device, O_RDONLY);
+    if (dev < 0) {
+        perror(opt.device);
+        return 1;
+    }
+    /*
+     * Let the driver wake us for large pieces of data only, but at
+     * least every 100 ms. Fails harmlessly if not opened for writing.
+     */
+    snprintf(cmd, sizeof(cmd), "set_low_watermark %lu",
+        (unsigned long)(opt.buffer_size < 65536 ? opt.buffer_size : 65536));
+    if (write(dev, cmd, strlen(cmd)) < 0)
+        ; // not needed for recording
+    snprintf(cmd, sizeof(cmd), "set_max_wait_us 100000");
+    if (write(dev, cmd, strlen(cmd)) < 0)
+        ;
+
+    if (mlockall(MCL_CURRENT | MCL_FUTURE))
+        perror("mlockall");
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = on_signal;  /* no SA_RESTART: interrupt the read */
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+
+    overflow_start = tdc_run_buffer_full(opt.device);
+    out.header->start_time_ns = start_ns = tdc_run_now_ns();
+    getrusage(RUSAGE_SELF, &usage_start);
+
+    switch (opt.mode) {
+    case MODE_SPLICE:
+        retval = record_splice(dev);
+        break;
+    case MODE_PLAIN:
+        retval = record_plain(dev);
+        break;
+    default:
+        retval = record_direct(dev);
+    }
+    if (out.codec && tdc_codec_writer_flush(out.codec)) {
+        fprintf(stderr, "Could not write the last blocks\n");
+        retval = -1;
+    }
+    close_file();
+    if (out.index && tdc_index_writer_close(out.index))
+        perror("index");
+
+    getrusage(RUSAGE_SELF, &usage_end);
+    elapsed_ns = tdc_run_now_ns() - start_ns;
+    overflow_end = tdc_run_buffer_full(opt.device);
+    close(dev);
+
+    seconds = elapsed_ns / 1e9;
+    gb = out.total_bytes / 1e9;
+    cpu = (usage_end.ru_utime.tv_sec - usage_start.ru_utime.tv_sec) +
+        (usage_end.ru_stime.tv_sec - usage_start.ru_stime.tv_sec) +
+        ((usage_end.ru_utime.tv_usec - usage_start.ru_utime.tv_usec) +
+        (usage_end.ru_stime.tv_usec - usage_start.ru_stime.tv_usec)) / 1e6;
+
+    fprintf(stderr, "Recorded %llu bytes in %u files in %.1f s: %.1f MB/s\n",
+        (unsigned long long)out.total_bytes, out.nfiles, seconds,
+        seconds > 0 ? out.total_bytes / seconds / MB : 0.0);
+    fprintf(stderr, "CPU time: %.2f s, %.2f s per GB\n",
+        cpu, gb > 0 ? cpu / gb : 0.0);
+    if (out.codec) {
+        ratio = out.codec->bytes ?
+            (double)out.codec->raw_bytes / out.codec->bytes : 0.0;
+        fprintf(stderr, "Compressed %llu bytes of the stream: ratio %.2f, "
+            "%.2f GB/s per core\n", (unsigned long long)out.codec->raw_bytes,
+            ratio, out.codec->cpu_ns ?
+            (double)out.codec->raw_bytes / out.codec->cpu_ns : 0.0);
+        tdc_codec_writer_free(out.codec);
+    }
+    fprintf(stderr, "Driver buffer full during the run: %lu times%s\n",
+        overflow_end - overflow_start,
+        out.header->flags & TDC_RUN_MERGED ? " (summed over the cards)" : "");
+    if (opt.mode == MODE_DIRECT)
+        fprintf(stderr, "Reader waited for a free buffer: %lu times\n",
+            reader_stalls);
+
+    return retval ? 1 : 0;
+}
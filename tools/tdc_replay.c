@@ -0,0 +1,344 @@
+/*
+ * tdc-replay - replays a recorded run through simulated cards.
+ *
+ * Load the module with tdc_sim=N to simulate N cards. Each card reads
+ * the events written to its feed file in debugfs, and the driver reads
+ * them out of the simulated card as from a real one, so that the whole
+ * acquisition path handles the recorded hit patterns.
+ *
+ * The events are written as recorded (using the times in the run's
+ * index), N times faster, at a fixed rate, or as fast as the cards take
+ * them. The cards take at most one event per timer callback, so the
+ * trigger rate must be high enough for the replay rate.
+ *
+ * The COM signals of an empty record (TDC_REC_EMPTY) are replayed as that
+ * many events without hits, just before the event that follows them, so
+ * the cards see them as recorded. They are not paced themselves: they are
+ * not in the index, and -r counts the events with hits only. The other
+ * records are made by the driver and are not replayed.
+ */
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "tdc_index.h"
+
+#define FEED_BUF_SIZE 65536
+#define MAX_CARDS TDC_EVENT_MAX_CHANNELS /* the card numbers fit in 3 bits */
+
+enum { PACE_RECORDED, PACE_RATE, PACE_MAX };
+
+static struct {
+    const char *dir;
+    int pace;
+    double speed;
+    double rate;
+    int card;
+} opt = {
+    .dir = "/sys/kernel/debug/tdcmod",
+    .pace = PACE_RECORDED,
+    .speed = 1,
+    .card = -1,
+};
+
+/**
+ * struct feed - the feed file of a simulated card
+ * @fd:     File descriptor, -1 until the card has an event.
+ * @buf:    Events not written yet.
+ * @len:    Number of bytes in buf.
+ */
+static struct feed {
+    int fd;
+    unsigned char buf[FEED_BUF_SIZE];
+    size_t len;
+} feeds[MAX_CARDS];
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void sleep_until(uint64_t t)
+{
+    struct timespec ts;
+
+    ts.tv_sec = t / 1000000000ULL;
+    ts.tv_nsec = t % 1000000000ULL;
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+        ;
+}
+
+static int feed_flush(struct feed *feed)
+{
+    size_t done = 0;
+    ssize_t n;
+
+    while (done < feed->len) {
+        n = write(feed->fd, feed->buf + done, feed->len - done);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        done += n;
+    }
+    feed->len = 0;
+    return 0;
+}
+
+static int flush_all(void)
+{
+    int i;
+
+    for (i = 0; i < MAX_CARDS; ++i) {
+        if (feeds[i].len && feed_flush(&feeds[i])) {
+            perror("write");
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Returns the feed of the card of an event, opening it first if needed,
+ * or NULL on error, or if the card can't be simulated.
+ */
+static struct feed *feed_open(const struct tdc_event *event)
+{
+    struct feed *feed;
+    char path[1024];
+    int card = event->card < 0 ? 0 : event->card;
+
+    if (card >= MAX_CARDS)
+        return NULL;
+    feed = &feeds[card];
+    if (feed->fd < 0) {
+        if (card == 0)
+            snprintf(path, sizeof(path), "%s/tdc_sim", opt.dir);
+        else
+            snprintf(path, sizeof(path), "%s/tdc%d_sim", opt.dir, card);
+        feed->fd = open(path, O_WRONLY);
+        if (feed->fd < 0) {
+            perror(path);
+            return NULL;
+        }
+    }
+    return feed;
+}
+
+/*
+ * Queues an event for the feed of its card, without the card number.
+ * Returns 0 on success, -1 on error.
+ */
+static int feed_event(const struct tdc_event *event)
+{
+    struct feed *feed;
+    unsigned int i;
+
+    if (event->card >= MAX_CARDS)
+        return 0;
+    feed = feed_open(event);
+    if (!feed)
+        return -1;
+    if (feed->len + 1 + 3 * event->num_hits > sizeof(feed->buf) &&
+        feed_flush(feed)) {
+        perror("write");
+        return -1;
+    }
+    feed->buf[feed->len++] = event->num_hits;
+    for (i = 0; i < event->num_hits; ++i) {
+        feed->buf[feed->len++] = event->channel[i];
+        feed->buf[feed->len++] = event->delay[i] & 0xff;
+        feed->buf[feed->len++] = event->delay[i] >> 8;
+    }
+    return 0;
+}
+
+/*
+ * Queues the COM signals of an empty record as events without hits.
+ * Returns 0 on success, -1 on error.
+ */
+static int feed_empty(const struct tdc_event *event)
+{
+    struct feed *feed;
+    uint32_t i;
+
+    if (event->card >= MAX_CARDS)
+        return 0;
+    feed = feed_open(event);
+    if (!feed)
+        return -1;
+    for (i = 0; i < event->count; ++i) {
+        if (feed->len == sizeof(feed->buf) && feed_flush(feed)) {
+            perror("write");
+            return -1;
+        }
+        feed->buf[feed->len++] = 0;
+    }
+    return 0;
+}
+
+/*
+ * Returns when the given event was recorded, in ns from the first event,
+ * spreading the events of each index block evenly over the block.
+ */
+static uint64_t recorded_time(const struct tdc_index *index, long *block,
+    uint64_t event)
+{
+    const struct tdc_index_entry *e, *next;
+    uint64_t duration;
+
+    while (*block + 1 < (long)index->num_entries &&
+        index->entries[*block + 1].event <= event)
+        (*block)++;
+    e = &index->entries[*block];
+    if (*block + 1 < (long)index->num_entries) {
+        next = e + 1;
+        duration = next->time_ns - e->time_ns;
+    } else if (*block > 0) {
+        // The last block: assume the rate of the one before.
+        next = e - 1;
+        duration = (e->time_ns - next->time_ns) *
+            (uint64_t)e->num_events / next->num_events;
+    } else {
+        duration = 0;
+    }
+    return e->time_ns - index->entries[0].time_ns +
+        duration * (event - e->event) / e->num_events;
+}
+
+static void usage(const char *name)
+{
+    fprintf(stderr,
+        "Usage: %s [options] PREFIX\n"
+        "Replays the run PREFIX_0000.tdc, ... through the simulated cards of\n"
+        "the module loaded with tdc_sim=N. Empty records are replayed as\n"
+        "events without hits, the other records are not replayed.\n"
+        "  -s SPEED  replay SPEED times faster than recorded, default 1\n"
+        "            (needs the index written by tdc-record)\n"
+        "  -r RATE   replay RATE events per second\n"
+        "  -x        replay as fast as the cards take the events\n"
+        "  -c CARD   only replay the events of this card of a merged run\n"
+        "  -D DIR    the module's debugfs directory, default %s\n",
+        name, opt.dir);
+}
+
+int main(int argc, char **argv)
+{
+    struct tdc_index *index = NULL;
+    struct tdc_parser parser;
+    struct tdc_run *run;
+    unsigned char buf[65536];
+    uint64_t start, due, event = 0, replayed = 0, empty = 0;
+    char path[1024];
+    size_t len, pos, n;
+    long block = 0;
+    int c, i, complete, retval = 1;
+
+    while ((c = getopt(argc, argv, "s:r:xc:D:h")) != -1) {
+        switch (c) {
+        case 's': opt.pace = PACE_RECORDED; opt.speed = atof(optarg); break;
+        case 'r': opt.pace = PACE_RATE; opt.rate = atof(optarg); break;
+        case 'x': opt.pace = PACE_MAX; break;
+        case 'c': opt.card = atoi(optarg); break;
+        case 'D': opt.dir = optarg; break;
+        default: usage(argv[0]); return 1;
+        }
+    }
+    if (optind != argc - 1 || (opt.pace == PACE_RECORDED && opt.speed <= 0) ||
+        (opt.pace == PACE_RATE && opt.rate <= 0)) {
+        usage(argv[0]);
+        return 1;
+    }
+    for (i = 0; i < MAX_CARDS; ++i)
+        feeds[i].fd = -1;
+
+    run = tdc_run_open(argv[optind]);
+    if (!run) {
+        fprintf(stderr, "Could not open the run %s\n", argv[optind]);
+        return 1;
+    }
+    if (opt.pace == PACE_RECORDED) {
+        tdc_index_path(argv[optind], path, sizeof(path));
+        index = tdc_index_load(path);
+        if (!index || index->header.time_source != TDC_INDEX_TIME_READ ||
+            !index->num_entries) {
+            fprintf(stderr, "%s: the times of the events are not known, "
+                "use -r or -x\n", path);
+            goto out;
+        }
+    }
+    tdc_parser_init(&parser, !!(run->header.flags & TDC_RUN_MERGED),
+        run->header.stream_format);
+
+    start = now_ns();
+    while ((len = tdc_run_read(run, buf, sizeof(buf))) > 0) {
+        for (pos = 0; pos < len; pos += n) {
+            n = tdc_parser_feed(&parser, buf + pos, len - pos, &complete);
+            if (!complete)
+                continue;
+            if (opt.card >= 0 && parser.event.card != opt.card) {
+                if (!tdc_event_is_record(&parser.event))
+                    event++;
+                continue;
+            }
+            if (opt.card >= 0)
+                parser.event.card = -1;  // replay it on the first card
+
+            /*
+             * Of the records, only the empty COM signals are replayed,
+             * with the event after them.
+             */
+            if (parser.event.type == TDC_REC_EMPTY) {
+                if (feed_empty(&parser.event))
+                    goto out;
+                empty += parser.event.count;
+                continue;
+            }
+            if (tdc_event_is_record(&parser.event))
+                continue;
+
+            if (opt.pace != PACE_MAX) {
+                if (opt.pace == PACE_RATE)
+                    due = replayed * 1e9 / opt.rate;
+                else
+                    due = recorded_time(index, &block, event) / opt.speed;
+                due += start;
+                /* Write what is due now, and wait for the rest. */
+                if (due > now_ns()) {
+                    if (flush_all())
+                        goto out;
+                    sleep_until(due);
+                }
+            }
+            if (feed_event(&parser.event))
+                goto out;
+            event++;
+            replayed++;
+        }
+    }
+    if (flush_all())
+        goto out;
+
+    fprintf(stderr, "Replayed %llu events and %llu empty COM signals "
+        "in %.1f s\n", (unsigned long long)replayed,
+        (unsigned long long)empty, (now_ns() - start) / 1e9);
+    retval = 0;
+
+out:
+    for (i = 0; i < MAX_CARDS; ++i) {
+        if (feeds[i].fd >= 0)
+            close(feeds[i].fd);
+    }
+    tdc_index_free(index);
+    tdc_run_close(run);
+    return retval;
+}
@@ -0,0 +1,461 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "tdc_run.h"
+
+/* Fails to compile if the header is not exactly TDC_RUN_HEADER_SIZE. */
+typedef char tdc_run_header_size_check
+    [sizeof(struct tdc_run_header) == TDC_RUN_HEADER_SIZE ? 1 : -1];
+
+uint64_t tdc_run_now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/*
+ * Gives the /proc file with the measurement info of a device,
+ * e.g. /proc/tdc1_measurement for /dev/tdc1.
+ * Returns 0 on success, -1 on error.
+ */
+int tdc_run_proc_path(const char *device, char *path, size_t size)
+{
+    const char *name = strrchr(device, '/');
+
+    name = name ? name + 1 : device;
+    if (!*name)
+        return -1;
+    snprintf(path, size, "/proc/%s_measurement", name);
+    return 0;
+}
+
+/*
+ * Returns the number following "key" in the /proc file of the device,
+ * or 0 if it is not found.
+ */
+unsigned long tdc_run_proc_value(const char *device, const char *key)
+{
+    char path[256], line[256], *p;
+    unsigned long value = 0;
+    FILE *file;
+
+    if (tdc_run_proc_path(device, path, sizeof(path)))
+        return 0;
+    file = fopen(path, "r");
+    if (!file)
+        return 0;
+    while (fgets(line, sizeof(line), file)) {
+        p = strstr(line, key);
+        if (p) {
+            value = strtoul(p + strlen(key), NULL, 10);
+            break;
+        }
+    }
+    fclose(file);
+    return value;
+}
+
+/*
+ * Returns how many times the driver's buffer of the device was full, from
+ * its /proc file. The merged device has none, so for it the counts of the
+ * cards are summed: tdc, tdc1, tdc2, ... up to the first one missing.
+ */
+unsigned long tdc_run_buffer_full(const char *device)
+{
+    const char *name = strrchr(device, '/');
+    char card[224], path[256];
+    unsigned long sum = 0;
+    int i, dir_len;
+
+    name = name ? name + 1 : device;
+    if (strncmp(name, "tdcm", 4) != 0)
+        return tdc_run_proc_value(device, "buffer_full: ");
+    dir_len = name - device;
+    for (i = 0; ; ++i) {
+        if (i == 0)
+            snprintf(card, sizeof(card), "%.*stdc", dir_len, device);
+        else
+            snprintf(card, sizeof(card), "%.*stdc%d", dir_len, device, i);
+        if (tdc_run_proc_path(card, path, sizeof(path)) ||
+            access(path, R_OK))
+            break;
+        sum += tdc_run_proc_value(card, "buffer_full: ");
+    }
+    return sum;
+}
+
+/*
+ * Fills in what a run header holds when the configuration of the device
+ * can't be read: the settings the driver starts with.
+ */
+void tdc_run_default_config(struct tdc_run_header *header)
+{
+    header->num_channels = 8;
+    header->t_max = 0xffff;
+    header->com_mode = 1;
+}
+
+/*
+ * Fills in the configuration of the device in header, from its /proc file.
+ * Returns 0 on success, -1 if the /proc file could not be read, in which
+ * case header is left as it was.
+ */
+int tdc_run_read_config(const char *device, struct tdc_run_header *header)
+{
+    char path[256], line[256];
+    size_t len = 0;
+    FILE *file;
+
+    if (tdc_run_proc_path(device, path, sizeof(path)))
+        return -1;
+    file = fopen(path, "r");
+    if (!file)
+        return -1;
+
+    // Always NUL terminated, as at most sizeof - 1 bytes are copied.
+    memset(header->config, 0, sizeof(header->config));
+    while (fgets(line, sizeof(line), file)) {
+        unsigned long rate;
+        int format;
+        int a, b;
+
+        if (sscanf(line, "t_min = %d; t_max = %d.", &a, &b) == 2) {
+            header->t_min = a;
+            header->t_max = b;
+        } else if (sscanf(line, "num_channels = %d.", &a) == 1) {
+            header->num_channels = a;
+        } else if (strncmp(line, "com_mode = ", 11) == 0) {
+            header->com_mode = strstr(line, "common start") != NULL;
+        } else if (sscanf(line, "current timer callback frequency: %lu Hz",
+                &rate) == 1) {
+            header->trigger_rate_hz = rate;
+        } else if (sscanf(line, "stream_format = %i.", &format) == 1) {
+            header->stream_format = format;
+        }
+        if (len + strlen(line) < sizeof(header->config)) {
+            memcpy(header->config + len, line, strlen(line));
+            len += strlen(line);
+        }
+    }
+    fclose(file);
+    return 0;
+}
+
+/*
+ * Reads and checks the header at the start of a recorded file, and leaves
+ * the file positioned at the start of the data.
+ * Returns 0 on success, -1 if the file does not start with a run header.
+ */
+int tdc_run_read_header(FILE *file, struct tdc_run_header *header)
+{
+    if (fread(header, sizeof(*header), 1, file) != 1)
+        return -1;
+    if (memcmp(header->magic, TDC_RUN_MAGIC, sizeof(header->magic)))
+        return -1;
+    // The end of the config in older versions.
+    if (header->version < 2) {
+        header->stream_format = 0;
+        header->reserved = 0;
+    }
+    if (header->header_size != sizeof(*header))
+        return fseek(file, header->header_size, SEEK_SET);
+    return 0;
+}
+
+/*
+ * Finds the blocks of a compressed file, up to the first one that is not
+ * complete, e.g. the last of a file still being written.
+ * Returns 0 on success, -1 if out of memory.
+ */
+static int tdc_run_scan_blocks(FILE *file, struct tdc_run_file *f,
+    uint64_t file_size)
+{
+    struct tdc_codec_block block;
+    struct tdc_run_block *blocks;
+    uint64_t offset = f->header_size;
+
+    f->size = 0;
+    while (file_size - offset >= sizeof(block)) {
+        if (fseeko(file, offset, SEEK_SET) ||
+            fread(&block, sizeof(block), 1, file) != 1 ||
+            tdc_codec_check(&block) || block.size > file_size - offset)
+            break;
+        if (!(f->num_blocks & (f->num_blocks - 1))) {
+            blocks = realloc(f->blocks, (f->num_blocks ? 2 * f->num_blocks :
+                1) * sizeof(*blocks));
+            if (!blocks)
+                return -1;
+            f->blocks = blocks;
+        }
+        blocks = &f->blocks[f->num_blocks++];
+        blocks->stream_offset = f->stream_offset + f->size;
+        blocks->file_offset = offset;
+        blocks->raw_len = block.raw_len;
+        blocks->size = block.size;
+        f->size += block.raw_len;
+        offset += block.size;
+    }
+    return 0;
+}
+
+/*
+ * Opens the files of a run, <prefix>_0000.tdc, <prefix>_0001.tdc, ...
+ * up to the first one that is missing.
+ * Returns the run, or NULL if its first file can't be read.
+ */
+struct tdc_run *tdc_run_open(const char *prefix)
+{
+    struct tdc_run_header *header;
+    struct tdc_run_file *files;
+    struct tdc_run *run;
+    struct stat st;
+    char name[1024];
+    FILE *file;
+
+    run = calloc(1, sizeof(*run));
+    header = malloc(sizeof(*header));
+    if (!run || !header)
+        goto fail;
+
+    for (;;) {
+        snprintf(name, sizeof(name), "%s_%04u.tdc", prefix, run->num_files);
+        file = fopen(name, "r");
+        if (!file)
+            break;
+        if (tdc_run_read_header(file, header) || fstat(fileno(file), &st) ||
+            st.st_size < header->header_size) {
+            fprintf(stderr, "%s: not a recorded run\n", name);
+            fclose(file);
+            break;
+        }
+        if (run->num_files && (header->flags ^ run->header.flags) &
+                TDC_RUN_COMPRESSED) {
+            fprintf(stderr, "%s: compressed unlike the rest of the run\n",
+                name);
+            fclose(file);
+            break;
+        }
+
+        files = realloc(run->files, (run->num_files + 1) * sizeof(*files));
+        if (!files) {
+            fclose(file);
+            goto fail;
+        }
+        run->files = files;
+        files += run->num_files;
+        memset(files, 0, sizeof(*files));
+        files->name = strdup(name);
+        files->stream_offset = run->size;
+        files->size = st.st_size - header->header_size;
+        files->header_size = header->header_size;
+        files->time_ns = header->file_time_ns;
+        if (!run->num_files)
+            run->header = *header;
+        run->num_files++;
+        if ((header->flags & TDC_RUN_COMPRESSED) &&
+            tdc_run_scan_blocks(file, files, st.st_size)) {
+            fclose(file);
+            goto fail;
+        }
+        fclose(file);
+        run->size += files->size;
+    }
+    if (!run->num_files)
+        goto fail;
+
+    if (run->header.flags & TDC_RUN_COMPRESSED) {
+        run->codec = tdc_codec_new(run->header.flags & TDC_RUN_MERGED,
+            run->header.stream_format);
+        run->block = malloc(TDC_CODEC_BLOCK_SIZE);
+        run->packed = malloc(tdc_codec_bound(TDC_CODEC_BLOCK_SIZE,
+            TDC_CODEC_MAX_ALIGN));
+        if (!run->codec || !run->block || !run->packed)
+            goto fail;
+    }
+
+    free(header);
+    if (tdc_run_seek(run, 0))
+        goto fail_run;
+    return run;
+
+fail:
+    free(header);
+fail_run:
+    tdc_run_close(run);
+    return NULL;
+}
+
+void tdc_run_close(struct tdc_run *run)
+{
+    unsigned int i;
+
+    if (!run)
+        return;
+    if (run->file)
+        fclose(run->file);
+    for (i = 0; i < run->num_files; ++i) {
+        free(run->files[i].name);
+        free(run->files[i].blocks);
+    }
+    free(run->files);
+    tdc_codec_free(run->codec);
+    free(run->block);
+    free(run->packed);
+    free(run);
+}
+
+/*
+ * Returns the index of the file holding the given stream offset.
+ */
+int tdc_run_file_at(struct tdc_run *run, uint64_t offset)
+{
+    unsigned int lo = 0, hi = run->num_files, mid;
+
+    // find the last file that starts at or before offset
+    while (hi - lo > 1) {
+        mid = lo + (hi - lo) / 2;
+        if (run->files[mid].stream_offset <= offset)
+            lo = mid;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+/*
+ * Makes file i the open file.
+ * Returns 0 on success, -1 on error.
+ */
+static int tdc_run_open_file(struct tdc_run *run, unsigned int i)
+{
+    if (run->file && run->current == i)
+        return 0;
+    if (run->file)
+        fclose(run->file);
+    run->file = fopen(run->files[i].name, "r");
+    if (!run->file)
+        return -1;
+    run->current = i;
+    return 0;
+}
+
+/*
+ * Moves to the given offset in the stream.
+ * Returns 0 on success, -1 on error.
+ */
+int tdc_run_seek(struct tdc_run *run, uint64_t offset)
+{
+    struct tdc_run_file *f;
+    unsigned int i;
+
+    if (offset > run->size)
+        return -1;
+    i = tdc_run_file_at(run, offset);
+    f = &run->files[i];
+
+    if (tdc_run_open_file(run, i))
+        return -1;
+    // The blocks of a compressed run are read when needed.
+    if (!run->codec && fseeko(run->file,
+            f->header_size + (offset - f->stream_offset), SEEK_SET))
+        return -1;
+    run->pos = offset;
+    return 0;
+}
+
+/*
+ * Reads and decompresses the block holding the given stream offset.
+ * Returns 0 on success, -1 on error.
+ */
+static int tdc_run_load_block(struct tdc_run *run, uint64_t offset)
+{
+    unsigned int i = tdc_run_file_at(run, offset), lo = 0, hi, mid;
+    struct tdc_run_file *f = &run->files[i];
+    struct tdc_run_block *b;
+
+    hi = f->num_blocks;
+    if (!hi)
+        return -1;
+    // find the last block that starts at or before offset
+    while (hi - lo > 1) {
+        mid = lo + (hi - lo) / 2;
+        if (f->blocks[mid].stream_offset <= offset)
+            lo = mid;
+        else
+            hi = mid;
+    }
+    b = &f->blocks[lo];
+
+    run->block_len = 0;
+    if (tdc_run_open_file(run, i) ||
+        fseeko(run->file, b->file_offset, SEEK_SET) ||
+        fread(run->packed, 1, b->size, run->file) != b->size ||
+        tdc_codec_decompress(run->codec, run->packed, b->size,
+            run->block) != b->raw_len) {
+        fprintf(stderr, "%s: bad block at %llu\n", f->name,
+            (unsigned long long)b->file_offset);
+        return -1;
+    }
+    run->block_start = b->stream_offset;
+    run->block_len = b->raw_len;
+    return 0;
+}
+
+/* tdc_run_read for a compressed run. */
+static size_t tdc_run_read_blocks(struct tdc_run *run, void *buf, size_t len)
+{
+    size_t done = 0, n;
+
+    while (done < len && run->pos < run->size) {
+        if (run->pos < run->block_start ||
+            run->pos >= run->block_start + run->block_len) {
+            if (tdc_run_load_block(run, run->pos))
+                break;
+        }
+        n = len - done;
+        if (n > run->block_start + run->block_len - run->pos)
+            n = run->block_start + run->block_len - run->pos;
+        memcpy((char *)buf + done, run->block + (run->pos - run->block_start),
+            n);
+        done += n;
+        run->pos += n;
+    }
+    return done;
+}
+
+/*
+ * Reads up to len bytes of the stream, continuing in the next file at the
+ * end of each file.
+ * Returns the number of bytes read, 0 at the end of the run.
+ */
+size_t tdc_run_read(struct tdc_run *run, void *buf, size_t len)
+{
+    struct tdc_run_file *f;
+    size_t done = 0, n;
+
+    if (run->codec)
+        return tdc_run_read_blocks(run, buf, len);
+    while (done < len && run->pos < run->size) {
+        f = &run->files[run->current];
+        if (run->pos >= f->stream_offset + f->size) {
+            if (tdc_run_seek(run, run->pos))
+                break;
+            continue;
+        }
+        n = len - done;
+        if (n > f->stream_offset + f->size - run->pos)
+            n = f->stream_offset + f->size - run->pos;
+        n = fread((char *)buf + done, 1, n, run->file);
+        if (!n)
+            break;
+        done += n;
+        run->pos += n;
+    }
+    return done;
+}
@@ -0,0 +1,155 @@
+#ifndef _TDC_RUN_H_
+#define _TDC_RUN_H_
+
+/*
+ * Recorded runs, as written by tdc-record.
+ *
+ * A run is stored in one or more files, named <prefix>_0000.tdc,
+ * <prefix>_0001.tdc, etc. Each file starts with a struct tdc_run_header,
+ * padded to TDC_RUN_HEADER_SIZE bytes, followed by the data exactly as
+ * it was read from the device. Concatenating the data of all files of a
+ * run gives the whole stream; an event may continue in the next file.
+ *
+ * In a compressed run (TDC_RUN_COMPRESSED), the data of each file is a
+ * series of blocks made by tdc_codec_compress, see tdc_codec.h, instead.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include "tdc_codec.h"
+
+#define TDC_RUN_MAGIC "TDCRUN01"
+#define TDC_RUN_VERSION 3
+
+#define TDC_RUN_MERGED 0x1
+#define TDC_RUN_COMPRESSED 0x2
+
+/* Also the alignment needed by O_DIRECT, so the data stays aligned. */
+#define TDC_RUN_HEADER_SIZE 4096
+
+/**
+ * struct tdc_run_header - start of each file of a recorded run
+ * @magic:          TDC_RUN_MAGIC
+ * @header_size:    Size of the header, data starts at this offset.
+ * @version:        TDC_RUN_VERSION
+ * @file_index:     0 for the first file of the run, then 1, 2, ...
+ * @flags:          TDC_RUN_MERGED if this is the merged stream of several
+ *                  cards, where each event starts with the card number.
+ *                  TDC_RUN_COMPRESSED if the data is compressed (version 3).
+ * @stream_offset:  Number of stream bytes in the earlier files of the run.
+ * @start_time_ns:  CLOCK_REALTIME when the run was started.
+ * @file_time_ns:   CLOCK_REALTIME when this file was started.
+ * @t_min, @t_max:  Time range of valid hits, unit 0.5 ns.
+ * @com_mode:       1 if common start, 0 if common stop.
+ * @num_channels:   Number of channels of the card.
+ * @trigger_rate_hz: The timer callback frequency (trigger rate) of the card.
+ * @device:         The device that was recorded, e.g. "/dev/tdc".
+ * @config:         The contents of /proc/tdc_measurement when the file
+ *                  was started, for reference.
+ * @stream_format:  TDC_FMT_* flags of the stream, see tdc_format.h. Added
+ *                  in version 2, 0 when read from older files.
+ */
+struct tdc_run_header {
+    char magic[8];
+    uint32_t header_size;
+    uint32_t version;
+    uint32_t file_index;
+    uint32_t flags;
+    uint64_t stream_offset;
+    uint64_t start_time_ns;
+    uint64_t file_time_ns;
+    int32_t t_min, t_max;
+    int32_t com_mode;
+    int32_t num_channels;
+    uint64_t trigger_rate_hz;
+    char device[64];
+    char config[TDC_RUN_HEADER_SIZE - 144];
+    uint32_t stream_format;
+    uint32_t reserved;
+};
+
+int tdc_run_proc_path(const char *device, char *path, size_t size);
+void tdc_run_default_config(struct tdc_run_header *header);
+int tdc_run_read_config(const char *device, struct tdc_run_header *header);
+unsigned long tdc_run_proc_value(const char *device, const char *key);
+unsigned long tdc_run_buffer_full(const char *device);
+int tdc_run_read_header(FILE *file, struct tdc_run_header *header);
+uint64_t tdc_run_now_ns(void);
+
+/**
+ * struct tdc_run_block - a compressed block of a file
+ * @stream_offset:  Offset of its stream bytes in the whole stream.
+ * @file_offset:    Where it starts in the file.
+ * @raw_len:        Number of stream bytes in it.
+ * @size:           Size of the block in the file.
+ */
+struct tdc_run_block {
+    uint64_t stream_offset;
+    uint64_t file_offset;
+    uint32_t raw_len;
+    uint32_t size;
+};
+
+/**
+ * struct tdc_run_file - one file of a recorded run
+ * @name:           File name.
+ * @stream_offset:  Offset of the file's data in the whole stream.
+ * @size:           Number of stream bytes in the file.
+ * @header_size:    Where the data starts in the file.
+ * @time_ns:        When the file was started, from its header.
+ * @blocks:         The blocks of a compressed file, in order, up to the
+ *                  first one that is not complete,
+ * @num_blocks:     and their number.
+ */
+struct tdc_run_file {
+    char *name;
+    uint64_t stream_offset;
+    uint64_t size;
+    uint32_t header_size;
+    uint64_t time_ns;
+    struct tdc_run_block *blocks;
+    unsigned int num_blocks;
+};
+
+/**
+ * struct tdc_run - a recorded run opened for reading
+ * @header:     Header of the first file.
+ * @files:      The files of the run, in order.
+ * @num_files:  Number of files.
+ * @size:       Number of data bytes in the whole run.
+ * @current:    Index of the open file.
+ * @file:       The open file.
+ * @pos:        Stream offset of the next byte to read.
+ * @codec:      Decompresses the blocks of a compressed run.
+ * @block:      The stream bytes of the last block decompressed,
+ * @block_start: their offset in the stream,
+ * @block_len:  and their number, 0 if none.
+ * @packed:     The last block as read from the file.
+ */
+struct tdc_run {
+    struct tdc_run_header header;
+    struct tdc_run_file *files;
+    unsigned int num_files;
+    uint64_t size;
+    unsigned int current;
+    FILE *file;
+    uint64_t pos;
+    struct tdc_codec *codec;
+    unsigned char *block;
+    uint64_t block_start;
+    size_t block_len;
+    unsigned char *packed;
+};
+
+/*
+ * Reading a run as one stream, across its files. tdc_run_open takes the
+ * prefix given to tdc-record, e.g. "run" for run_0000.tdc, run_0001.tdc, ...
+ */
+struct tdc_run *tdc_run_open(const char *prefix);
+void tdc_run_close(struct tdc_run *run);
+int tdc_run_seek(struct tdc_run *run, uint64_t offset);
+size_t tdc_run_read(struct tdc_run *run, void *buf, size_t len);
+int tdc_run_file_at(struct tdc_run *run, uint64_t offset);
+
+#endif /* _TDC_RUN_H_ */
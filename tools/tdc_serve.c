@@ -0,0 +1,679 @@
+/*
+ * tdc-serve - serves the stream of a device to several local clients,
+ * see tdc_serve.h.
+ *
+ *   tdc-serve run [-d DEVICE] [-s SOCKET] [-r MB] [-b KB] [-w MS] [-p PRIO]
+ *   tdc-serve stats [-s SOCKET]
+ *   tdc-serve dev [-s SOCKET] COMMAND
+ *   tdc-serve tap [-s SOCKET] [-n NAME]
+ *
+ * The server reads the device in pieces of whole events and publishes
+ * each piece once into the shared ring, whatever the clients do. A
+ * thread answers the clients on the socket.
+ */
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <limits.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <linux/futex.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/un.h>
+
+#include "tdc_serve.h"
+
+#define MB (1024 * 1024)
+
+static struct {
+    const char *device;
+    const char *socket;
+    uint64_t ring_size;
+    size_t piece_size;
+    unsigned int max_wait_ms;
+    int priority;
+} opt = {
+    .device = "/dev/tdc",
+    .socket = TDC_SERVE_SOCKET,
+    .ring_size = 64 * MB,
+    .piece_size = 1 * MB,
+    .max_wait_ms = 10,
+    .priority = 50,
+};
+
+/**
+ * struct conn - a connection to a client
+ * @fd:     The socket, 0 if not in use (0 is never a socket here).
+ * @slot:   Index of the client's slot, -1 if it has not attached.
+ * @line:   The command being received,
+ * @len:    and its length so far.
+ */
+struct conn {
+    int fd;
+    int slot;
+    char line[256];
+    size_t len;
+};
+
+/**
+ * struct server - what the threads of the server share
+ * @dev:        The device.
+ * @ring:       The ring, mapped read-write,
+ * @map_size:   of this many bytes.
+ * @data:       The data of the ring.
+ * @ring_fd:    The ring opened read-only, for the clients.
+ * @slots:      The slots of the clients,
+ * @slots_fd:   and its memory.
+ * @listen_fd:  The socket clients connect to.
+ * @conns:      The connections, one for each slot.
+ */
+static struct server {
+    int dev;
+    struct tdc_serve_ring *ring;
+    size_t map_size;
+    unsigned char *data;
+    int ring_fd;
+    struct tdc_serve_slot *slots;
+    int slots_fd;
+    int listen_fd;
+    struct conn conns[TDC_SERVE_MAX_CLIENTS];
+} srv;
+
+static volatile sig_atomic_t stop;
+
+static void on_signal(int sig)
+{
+    stop = 1;
+}
+
+static void set_priority(pthread_t thread, int priority)
+{
+    struct sched_param param = { .sched_priority = priority };
+
+    if (priority > 0 && pthread_setschedparam(thread, SCHED_FIFO, &param))
+        fprintf(stderr, "Could not set real-time priority %d\n", priority);
+}
+
+static void futex_wake(uint32_t *futex)
+{
+    syscall(SYS_futex, futex, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+}
+
+/*
+ * Copies a piece of whole events into the ring, then lets the clients
+ * see it and wakes them.
+ */
+static void publish(const unsigned char *data, size_t len)
+{
+    struct tdc_serve_ring *ring = srv.ring;
+    uint64_t head = ring->head, off = head & (ring->size - 1);
+    size_t first = ring->size - off < len ? ring->size - off : len;
+
+    memcpy(srv.data + off, data, first);
+    memcpy(srv.data, data + first, len - first);
+    __atomic_store_n(&ring->marks[ring->num_marks % TDC_SERVE_MARKS], head,
+        __ATOMIC_RELAXED);
+    __atomic_store_n(&ring->num_marks, ring->num_marks + 1, __ATOMIC_RELEASE);
+    __atomic_store_n(&ring->head, head + len, __ATOMIC_RELEASE);
+    __atomic_add_fetch(&ring->futex, 1, __ATOMIC_RELEASE);
+    futex_wake(&ring->futex);
+}
+
+/*
+ * Creates the ring and the slots in shared memory, and a read-only file
+ * descriptor of the ring to hand to the clients.
+ * Returns 0 on success, -1 on error.
+ */
+static int create_ring(const struct tdc_run_header *config)
+{
+    size_t header_size = (sizeof(*srv.ring) + 4095) & ~(size_t)4095;
+    size_t slots_size = TDC_SERVE_MAX_CLIENTS * sizeof(*srv.slots);
+    char path[64];
+    int fd;
+
+    srv.map_size = header_size + opt.ring_size;
+    fd = memfd_create("tdc-serve-ring", MFD_CLOEXEC);
+    if (fd < 0 || ftruncate(fd, srv.map_size))
+        return -1;
+    srv.ring = mmap(NULL, srv.map_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+        fd, 0);
+    if (srv.ring == MAP_FAILED)
+        return -1;
+    // The clients get a descriptor that can't be mapped writable.
+    snprintf(path, sizeof(path), "/proc/self/fd/%d", fd);
+    srv.ring_fd = open(path, O_RDONLY | O_CLOEXEC);
+    close(fd);
+    if (srv.ring_fd < 0)
+        return -1;
+
+    srv.slots_fd = memfd_create("tdc-serve-slots", MFD_CLOEXEC);
+    if (srv.slots_fd < 0 || ftruncate(srv.slots_fd, slots_size))
+        return -1;
+    srv.slots = mmap(NULL, slots_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+        srv.slots_fd, 0);
+    if (srv.slots == MAP_FAILED)
+        return -1;
+
+    srv.ring->config = *config;
+    memcpy(srv.ring->magic, TDC_SERVE_MAGIC, sizeof(srv.ring->magic));
+    srv.ring->header_size = header_size;
+    srv.ring->size = opt.ring_size;
+    srv.ring->max_piece = opt.piece_size;
+    srv.data = (unsigned char *)srv.ring + header_size;
+    return 0;
+}
+
+/*
+ * Sends a reply, and the ring and slots file descriptors with it if fds.
+ * Returns 0 on success, -1 on error.
+ */
+static int reply(int fd, const char *text, int fds)
+{
+    char control[CMSG_SPACE(2 * sizeof(int))];
+    struct cmsghdr *cmsg;
+    struct msghdr msg;
+    struct iovec iov;
+    int send_fds[2] = { srv.ring_fd, srv.slots_fd };
+
+    memset(&msg, 0, sizeof(msg));
+    iov.iov_base = (void *)text;
+    iov.iov_len = strlen(text);
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    if (fds) {
+        memset(control, 0, sizeof(control));
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(send_fds));
+        memcpy(CMSG_DATA(cmsg), send_fds, sizeof(send_fds));
+    }
+    return sendmsg(fd, &msg, MSG_NOSIGNAL) == (ssize_t)iov.iov_len ? 0 : -1;
+}
+
+/* Replies to stats with a line for each client. */
+static int reply_stats(int fd)
+{
+    const struct tdc_serve_ring *ring = srv.ring;
+    uint64_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+    uint64_t window = ring->size - ring->max_piece, lag;
+    char *text, *p;
+    size_t size = 256 * (TDC_SERVE_MAX_CLIENTS + 2);
+    int i, retval;
+
+    text = p = malloc(size);
+    if (!text)
+        return reply(fd, "error out of memory\n\n", 0);
+    p += sprintf(p, "ok\npublished %llu bytes in %llu pieces, ring of "
+        "%llu MB\n", (unsigned long long)head,
+        (unsigned long long)ring->num_marks,
+        (unsigned long long)ring->size / MB);
+    for (i = 0; i < TDC_SERVE_MAX_CLIENTS; ++i) {
+        const struct tdc_serve_slot *slot = &srv.slots[i];
+
+        if (!srv.conns[i].fd || srv.conns[i].slot < 0)
+            continue;
+        lag = head - __atomic_load_n(&slot->pos, __ATOMIC_RELAXED);
+        p += sprintf(p, "%.27s (pid %d): %llu bytes behind (%.0f%% of the "
+            "ring), skipped %llu times, %llu bytes lost, %llu bytes read\n",
+            slot->name, slot->pid, (unsigned long long)lag,
+            lag < window ? 100.0 * lag / window : 100.0,
+            (unsigned long long)slot->skips, (unsigned long long)slot->lost,
+            (unsigned long long)slot->bytes);
+    }
+    strcpy(p, "\n");
+    retval = reply(fd, text, 0);
+    free(text);
+    return retval;
+}
+
+/*
+ * The device commands that change what the stream holds. The clients
+ * parse the stream as the ring's config says, which is read once when
+ * the server starts, so these are refused.
+ */
+static const char *const stream_commands[] = {
+    "set_stream_format",
+    "set_count_slice_us",
+};
+
+/*
+ * Tells if the device command cmd changes what the stream holds. The
+ * keyword is found as the driver does, up to the first white space.
+ */
+static int is_stream_command(const char *cmd)
+{
+    size_t i, len;
+
+    while (isspace((unsigned char)*cmd))
+        ++cmd;
+    for (i = 0; i < sizeof(stream_commands) / sizeof(*stream_commands); ++i) {
+        len = strlen(stream_commands[i]);
+        if (strncmp(cmd, stream_commands[i], len) == 0 &&
+            (!cmd[len] || isspace((unsigned char)cmd[len])))
+            return 1;
+    }
+    return 0;
+}
+
+/*
+ * Carries out a command of the client on connection i.
+ * Returns 0 on success, -1 if the connection is to be closed.
+ */
+static int command(int i)
+{
+    struct conn *conn = &srv.conns[i];
+    struct tdc_serve_slot *slot = &srv.slots[i];
+    char *line = conn->line, text[300];
+    struct ucred cred;
+    socklen_t len = sizeof(cred);
+
+    if (strncmp(line, "attach ", 7) == 0) {
+        if (conn->slot >= 0)
+            return reply(conn->fd, "error already attached\n\n", 0);
+        if (getsockopt(conn->fd, SOL_SOCKET, SO_PEERCRED, &cred, &len))
+            cred.pid = -1;
+        memset(slot, 0, sizeof(*slot));
+        strncpy(slot->name, line + 7, sizeof(slot->name) - 1);
+        slot->pos = srv.ring->head;
+        slot->pid = cred.pid;
+        conn->slot = i;
+        snprintf(text, sizeof(text), "ok %d\n\n", i);
+        return reply(conn->fd, text, 1);
+    }
+    if (strcmp(line, "stats") == 0)
+        return reply_stats(conn->fd);
+    if (strncmp(line, "dev ", 4) == 0) {
+        if (is_stream_command(line + 4))
+            return reply(conn->fd, "error the stream format can't be "
+                "changed while serving; restart the server\n\n", 0);
+        if (write(srv.dev, line + 4, strlen(line + 4)) < 0)
+            snprintf(text, sizeof(text), "error %s\n\n", strerror(errno));
+        else
+            snprintf(text, sizeof(text), "ok\n\n");
+        return reply(conn->fd, text, 0);
+    }
+    return reply(conn->fd, "error unknown command\n\n", 0);
+}
+
+static void close_conn(int i)
+{
+    struct conn *conn = &srv.conns[i];
+
+    close(conn->fd);
+    conn->fd = 0;
+    if (conn->slot >= 0)
+        srv.slots[conn->slot].pid = 0;
+    conn->slot = -1;
+}
+
+/* Reads what the client on connection i sent, and carries out its commands. */
+static void receive(int i)
+{
+    struct conn *conn = &srv.conns[i];
+    char *end;
+    ssize_t n;
+
+    n = read(conn->fd, conn->line + conn->len,
+        sizeof(conn->line) - 1 - conn->len);
+    if (n <= 0) {
+        close_conn(i);
+        return;
+    }
+    conn->len += n;
+    conn->line[conn->len] = '\0';
+    while ((end = strchr(conn->line, '\n'))) {
+        *end = '\0';
+        if (end > conn->line && end[-1] == '\r')
+            end[-1] = '\0';
+        if (command(i)) {
+            close_conn(i);
+            return;
+        }
+        conn->len -= end + 1 - conn->line;
+        memmove(conn->line, end + 1, conn->len + 1);
+    }
+    if (conn->len == sizeof(conn->line) - 1)
+        close_conn(i);
+}
+
+/* Answers the clients until the server stops. */
+static void *control_thread(void *arg)
+{
+    struct pollfd fds[TDC_SERVE_MAX_CLIENTS + 1];
+    int i, fd;
+
+    for (i = 0; i < TDC_SERVE_MAX_CLIENTS; ++i)
+        srv.conns[i].slot = -1;
+    while (!stop) {
+        fds[0].fd = srv.listen_fd;
+        fds[0].events = POLLIN;
+        for (i = 0; i < TDC_SERVE_MAX_CLIENTS; ++i) {
+            fds[i + 1].fd = srv.conns[i].fd ? srv.conns[i].fd : -1;
+            fds[i + 1].events = POLLIN;
+        }
+        if (poll(fds, TDC_SERVE_MAX_CLIENTS + 1, 200) <= 0)
+            continue;
+        for (i = 0; i < TDC_SERVE_MAX_CLIENTS; ++i) {
+            if (fds[i + 1].fd >= 0 && fds[i + 1].revents)
+                receive(i);
+        }
+        if (fds[0].revents & POLLIN) {
+            fd = accept4(srv.listen_fd, NULL, NULL, SOCK_CLOEXEC);
+            if (fd < 0)
+                continue;
+            for (i = 0; i < TDC_SERVE_MAX_CLIENTS && srv.conns[i].fd; ++i)
+                ;
+            if (i == TDC_SERVE_MAX_CLIENTS) {
+                reply(fd, "error too many clients\n\n", 0);
+                close(fd);
+                continue;
+            }
+            srv.conns[i].fd = fd;
+            srv.conns[i].len = 0;
+        }
+    }
+    for (i = 0; i < TDC_SERVE_MAX_CLIENTS; ++i) {
+        if (srv.conns[i].fd)
+            close_conn(i);
+    }
+    return NULL;
+}
+
+static int listen_socket(const char *path)
+{
+    struct sockaddr_un addr;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "%s: name too long\n", path);
+        return -1;
+    }
+    strcpy(addr.sun_path, path);
+    srv.listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (srv.listen_fd < 0)
+        return -1;
+    unlink(path);
+    if (bind(srv.listen_fd, (struct sockaddr *)&addr, sizeof(addr)) ||
+        listen(srv.listen_fd, 16)) {
+        perror(path);
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Reads the device in pieces of whole events and publishes them, until
+ * interrupted. While the measurement is stopped, the device is at its
+ * end; it is read again every 100 ms.
+ */
+static int serve(void)
+{
+    const int merged = !!(srv.ring->config.flags & TDC_RUN_MERGED);
+    const unsigned int format = srv.ring->config.stream_format;
+    unsigned char *buf;
+    size_t fill = 0, whole;
+    ssize_t n;
+
+    buf = malloc(opt.piece_size);
+    if (!buf)
+        return -1;
+    while (!stop) {
+        n = read(srv.dev, buf + fill, opt.piece_size - fill);
+        if (n < 0) {
+            if (errno == EINTR || errno == EAGAIN)
+                continue;
+            perror(opt.device);
+            break;
+        }
+        if (n == 0) {
+            // The end of the stream of a measurement holds whole events.
+            if (fill)
+                publish(buf, fill);
+            fill = 0;
+            usleep(100000);
+            continue;
+        }
+        fill += n;
+        whole = tdc_codec_events_len(buf, fill, merged, format);
+        // Not the stream that was expected; pass it on anyway.
+        if (!whole && fill == opt.piece_size)
+            whole = fill;
+        if (whole)
+            publish(buf, whole);
+        fill -= whole;
+        memmove(buf, buf + whole, fill);
+    }
+    free(buf);
+    return 0;
+}
+
+static void usage(void)
+{
+    fprintf(stderr,
+        "Usage: tdc-serve run [options]\n"
+        "  Serves the stream of a device to the clients on a socket.\n"
+        "  -d DEVICE   device to read, default /dev/tdc\n"
+        "  -s SOCKET   default " TDC_SERVE_SOCKET "\n"
+        "  -r MB       size of the ring, a power of 2, default 64\n"
+        "  -b KB       most bytes read and published at once, default 1024\n"
+        "  -w MS       publish at least this often, default 10\n"
+        "  -p PRIO     real-time priority, default 50 (0 = don't change)\n"
+        "Usage: tdc-serve stats [-s SOCKET]\n"
+        "  Shows how far behind each client is.\n"
+        "Usage: tdc-serve dev [-s SOCKET] COMMAND\n"
+        "  Writes COMMAND to the served device, e.g. start or stop.\n"
+        "  set_stream_format and set_count_slice_us are refused.\n"
+        "Usage: tdc-serve tap [-s SOCKET] [-n NAME]\n"
+        "  Writes the stream to stdout, as a client named NAME (default\n"
+        "  tap). Skips are reported on stderr.\n");
+}
+
+static int run(int argc, char **argv)
+{
+    struct tdc_run_header config;
+    struct sigaction sa;
+    pthread_t control;
+    char cmd[64], path[1024];
+    const char *name;
+    int c, retval;
+
+    while ((c = getopt(argc, argv, "d:s:r:b:w:p:")) != -1) {
+        switch (c) {
+        case 'd': opt.device = optarg; break;
+        case 's': opt.socket = optarg; break;
+        case 'r': opt.ring_size = strtoull(optarg, NULL, 0) * MB; break;
+        case 'b': opt.piece_size = strtoul(optarg, NULL, 0) * 1024; break;
+        case 'w': opt.max_wait_ms = strtoul(optarg, NULL, 0); break;
+        case 'p': opt.priority = atoi(optarg); break;
+        default: usage(); return 1;
+        }
+    }
+    // A client must be able to copy what it can read before it is reused.
+    if (optind != argc || !opt.piece_size ||
+        (opt.ring_size & (opt.ring_size - 1)) ||
+        opt.ring_size < 2 * opt.piece_size) {
+        usage();
+        return 1;
+    }
+
+    // As tdc-record does, see there.
+    memset(&config, 0, sizeof(config));
+    memcpy(config.magic, TDC_RUN_MAGIC, sizeof(config.magic));
+    config.header_size = sizeof(config);
+    config.version = TDC_RUN_VERSION;
+    name = strrchr(opt.device, '/');
+    name = name ? name + 1 : opt.device;
+    if (strncmp(name, "tdcm", 4) == 0) {
+        config.flags |= TDC_RUN_MERGED;
+        snprintf(path, sizeof(path), "%.*stdc", (int)(name - opt.device),
+            opt.device);
+    } else {
+        snprintf(path, sizeof(path), "%s", opt.device);
+    }
+    tdc_run_default_config(&config);
+    if (tdc_run_read_config(path, &config))
+        fprintf(stderr, "Could not read the configuration of %s\n", path);
+    strncpy(config.device, opt.device, sizeof(config.device) - 1);
+    config.start_time_ns = tdc_run_now_ns();
+
+    srv.dev = open(opt.device, O_RDWR);
+    if (srv.dev < 0)
+        srv.dev = open(opt.device, O_RDONLY);
+    if (srv.dev < 0) {
+        perror(opt.device);
+        return 1;
+    }
+    snprintf(cmd, sizeof(cmd), "set_low_watermark %lu",
+        (unsigned long)(opt.piece_size < 65536 ? opt.piece_size : 65536));
+    if (write(srv.dev, cmd, strlen(cmd)) < 0)
+        ; // not needed to serve
+    snprintf(cmd, sizeof(cmd), "set_max_wait_us %u", opt.max_wait_ms * 1000);
+    if (write(srv.dev, cmd, strlen(cmd)) < 0)
+        ;
+
+    if (create_ring(&config)) {
+        perror("shared memory");
+        return 1;
+    }
+    if (listen_socket(opt.socket))
+        return 1;
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = on_signal;  /* no SA_RESTART: interrupt the read */
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+
+    if (pthread_create(&control, NULL, control_thread, NULL))
+        return 1;
+    set_priority(pthread_self(), opt.priority);
+    retval = serve();
+
+    stop = 1;
+    __atomic_store_n(&srv.ring->closed, 1, __ATOMIC_RELEASE);
+    __atomic_add_fetch(&srv.ring->futex, 1, __ATOMIC_RELEASE);
+    futex_wake(&srv.ring->futex);
+    pthread_join(control, NULL);
+    unlink(opt.socket);
+    close(srv.dev);
+    fprintf(stderr, "Published %llu bytes in %llu pieces\n",
+        (unsigned long long)srv.ring->head,
+        (unsigned long long)srv.ring->num_marks);
+    return retval ? 1 : 0;
+}
+
+/* Sends one command, stats or dev, and prints the reply. */
+static int request(int argc, char **argv, int dev)
+{
+    char cmd[256], reply[256 * (TDC_SERVE_MAX_CLIENTS + 2)];
+    int c, sock, retval;
+
+    while ((c = getopt(argc, argv, "s:")) != -1) {
+        switch (c) {
+        case 's': opt.socket = optarg; break;
+        default: usage(); return 1;
+        }
+    }
+    if (optind != argc - (dev ? 1 : 0)) {
+        usage();
+        return 1;
+    }
+    snprintf(cmd, sizeof(cmd), dev ? "dev %s" : "stats", argv[optind]);
+
+    sock = tdc_serve_connect(opt.socket);
+    if (sock < 0) {
+        perror(opt.socket);
+        return 1;
+    }
+    reply[0] = '\0';
+    retval = tdc_serve_command(sock, cmd, reply, sizeof(reply));
+    close(sock);
+    // Without the "ok" line and the empty line at the end.
+    if (*reply)
+        reply[strlen(reply) - 1] = '\0';
+    if (retval)
+        fprintf(stderr, "%s", *reply ? reply : "No reply\n");
+    else if (strchr(reply, '\n'))
+        printf("%s", strchr(reply, '\n') + 1);
+    return retval ? 1 : 0;
+}
+
+/* Writes the stream to stdout as a client. */
+static int tap(int argc, char **argv)
+{
+    struct tdc_serve_client *client;
+    struct sigaction sa;
+    const char *name = "tap";
+    unsigned char *buf;
+    uint64_t lost;
+    long n;
+    int c, retval = 0;
+
+    while ((c = getopt(argc, argv, "s:n:")) != -1) {
+        switch (c) {
+        case 's': opt.socket = optarg; break;
+        case 'n': name = optarg; break;
+        default: usage(); return 1;
+        }
+    }
+    if (optind != argc) {
+        usage();
+        return 1;
+    }
+    client = tdc_serve_attach(opt.socket, name);
+    buf = malloc(MB);
+    if (!client || !buf) {
+        fprintf(stderr, "Could not attach to %s\n", opt.socket);
+        return 1;
+    }
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = on_signal;
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+    while (!stop) {
+        n = tdc_serve_read(client, buf, MB, 200, &lost);
+        if (n < 0)
+            break;
+        if (lost)
+            fprintf(stderr, "Skipped %llu bytes\n", (unsigned long long)lost);
+        if (n > 0 && fwrite(buf, 1, n, stdout) != (size_t)n) {
+            retval = 1;
+            break;
+        }
+    }
+    fflush(stdout);
+    tdc_serve_detach(client);
+    free(buf);
+    return retval;
+}
+
+int main(int argc, char **argv)
+{
+    if (argc < 2) {
+        usage();
+        return 1;
+    }
+    if (strcmp(argv[1], "run") == 0)
+        return run(argc - 1, argv + 1);
+    if (strcmp(argv[1], "stats") == 0)
+        return request(argc - 1, argv + 1, 0);
+    if (strcmp(argv[1], "dev") == 0)
+        return request(argc - 1, argv + 1, 1);
+    if (strcmp(argv[1], "tap") == 0)
+        return tap(argc - 1, argv + 1);
+    usage();
+    return 1;
+}
@@ -0,0 +1,118 @@
+#ifndef _TDC_SERVE_H_
+#define _TDC_SERVE_H_
+
+/*
+ * Serving the stream of a device to local clients, see tdc-serve.
+ *
+ * tdc-serve reads the device and copies the stream once into a ring in
+ * shared memory, which each client maps read-only. The clients read it
+ * at their own pace, each with its own cursor. The server never waits
+ * for them: a client that falls more than the ring behind is skipped
+ * ahead to the start of a recent piece, losing what it did not read.
+ * Clients wait for data on a futex in the ring, which the server wakes
+ * after each piece.
+ *
+ * Clients talk to the server over a Unix socket, one line per command:
+ *   attach NAME    get the ring and a slot for the client's metrics,
+ *                  as two file descriptors sent with the reply
+ *   stats          how far behind each client is
+ *   dev COMMAND    write COMMAND to the device, e.g. "dev start", but
+ *                  not set_stream_format or set_count_slice_us: the
+ *                  stream must stay as @config of the ring says
+ * Each reply is "ok ..." or "error ...", maybe more lines, and an empty
+ * line.
+ */
+
+#include <stdint.h>
+
+#include "tdc_run.h"
+
+#define TDC_SERVE_MAGIC "TDCSHM01"
+#define TDC_SERVE_SOCKET "/tmp/tdc-serve.sock"
+
+/* How many of the latest pieces are remembered to resync on. */
+#define TDC_SERVE_MARKS 256
+
+#define TDC_SERVE_MAX_CLIENTS 64
+
+/**
+ * struct tdc_serve_ring - start of the shared memory, followed by the data
+ * @config:     Configuration of the device when the server was started,
+ *              e.g. its flags and stream_format, as in a recorded run.
+ * @magic:      TDC_SERVE_MAGIC
+ * @header_size: The data starts this many bytes into the shared memory.
+ * @size:       Bytes of data in the ring, a power of 2. Byte n of the
+ *              stream is at n % size.
+ * @max_piece:  The most bytes published at once. Bytes of the stream
+ *              from head - size + max_piece on can't be overwritten while
+ *              they are copied.
+ * @head:       Number of bytes of the stream published so far.
+ * @marks:      Where the latest pieces start in the stream, piece n at
+ *              n % TDC_SERVE_MARKS. Each piece starts with an event.
+ * @num_marks:  Number of pieces published.
+ * @futex:      Incremented and woken after each piece.
+ * @closed:     Set when the server stops.
+ */
+struct tdc_serve_ring {
+    struct tdc_run_header config;
+    char magic[8];
+    uint32_t header_size;
+    uint32_t reserved;
+    uint64_t size;
+    uint64_t max_piece;
+    uint64_t head;
+    uint64_t marks[TDC_SERVE_MARKS];
+    uint64_t num_marks;
+    uint32_t futex;
+    uint32_t closed;
+};
+
+/**
+ * struct tdc_serve_slot - metrics of a client, in memory it shares with
+ * the server
+ * @pid:        Process of the client, 0 if the slot is free. Set by the
+ *              server, the rest by the client.
+ * @name:       Name the client attached with.
+ * @pos:        Stream offset of the next byte the client reads.
+ * @skips:      How many times it was skipped ahead,
+ * @lost:       and the bytes it lost.
+ * @bytes:      Bytes it has read.
+ */
+struct tdc_serve_slot {
+    int32_t pid;
+    char name[28];
+    uint64_t pos;
+    uint64_t skips;
+    uint64_t lost;
+    uint64_t bytes;
+};
+
+/**
+ * struct tdc_serve_client - a client attached to tdc-serve
+ * @sock:       The connection to the server.
+ * @ring:       The ring, mapped read-only,
+ * @map_size:   of this many bytes.
+ * @data:       The data of the ring.
+ * @slots:      The slots of all clients,
+ * @slot:       and that of this one.
+ * @pos:        Stream offset of the next byte to read.
+ */
+struct tdc_serve_client {
+    int sock;
+    const struct tdc_serve_ring *ring;
+    size_t map_size;
+    const unsigned char *data;
+    struct tdc_serve_slot *slots;
+    struct tdc_serve_slot *slot;
+    uint64_t pos;
+};
+
+int tdc_serve_connect(const char *path);
+int tdc_serve_command(int sock, const char *cmd, char *reply, size_t size);
+
+struct tdc_serve_client *tdc_serve_attach(const char *path, const char *name);
+void tdc_serve_detach(struct tdc_serve_client *client);
+long tdc_serve_read(struct tdc_serve_client *client, void *buf, size_t len,
+    int timeout_ms, uint64_t *lost);
+
+#endif /* _TDC_SERVE_H_ */
@@ -0,0 +1,288 @@
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <linux/futex.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/un.h>
+
+#include "tdc_serve.h"
+
+/*
+ * Connects to the socket of tdc-serve.
+ * Returns the socket, or -1 on error.
+ */
+int tdc_serve_connect(const char *path)
+{
+    struct sockaddr_un addr;
+    int sock;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    strcpy(addr.sun_path, path);
+    sock = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (sock < 0)
+        return -1;
+    if (connect(sock, (struct sockaddr *)&addr, sizeof(addr))) {
+        close(sock);
+        return -1;
+    }
+    return sock;
+}
+
+/*
+ * Sends a command and reads the reply, up to the empty line that ends it,
+ * into reply, and up to nfds file descriptors sent with it into fds.
+ * Returns the number of file descriptors, or -1 on error or if the reply
+ * does not start with "ok".
+ */
+static int tdc_serve_request(int sock, const char *cmd, char *reply,
+    size_t size, int *fds, int nfds)
+{
+    char line[256], control[CMSG_SPACE(2 * sizeof(int))];
+    struct cmsghdr *cmsg;
+    struct msghdr msg;
+    struct iovec iov;
+    size_t len = 0;
+    ssize_t n;
+    int got = 0, i;
+
+    if (!size || nfds > 2)
+        return -1;
+    snprintf(line, sizeof(line), "%s\n", cmd);
+    if (send(sock, line, strlen(line), MSG_NOSIGNAL) != (ssize_t)strlen(line))
+        return -1;
+
+    while (len < 2 || memcmp(reply + len - 2, "\n\n", 2)) {
+        if (len == size - 1)
+            return -1;
+        memset(&msg, 0, sizeof(msg));
+        iov.iov_base = reply + len;
+        iov.iov_len = size - 1 - len;
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        n = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC);
+        if (n <= 0)
+            return -1;
+        len += n;
+        for (cmsg = CMSG_FIRSTHDR(&msg); cmsg;
+                cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+            if (cmsg->cmsg_level != SOL_SOCKET ||
+                cmsg->cmsg_type != SCM_RIGHTS)
+                continue;
+            for (i = 0; i < (int)((cmsg->cmsg_len - CMSG_LEN(0)) /
+                    sizeof(int)); ++i) {
+                int fd;
+
+                memcpy(&fd, CMSG_DATA(cmsg) + i * sizeof(int), sizeof(fd));
+                if (got < nfds)
+                    fds[got++] = fd;
+                else
+                    close(fd);
+            }
+        }
+    }
+    reply[len] = '\0';
+    if (strncmp(reply, "ok", 2)) {
+        while (got > 0)
+            close(fds[--got]);
+        return -1;
+    }
+    return got;
+}
+
+/*
+ * Sends a command to tdc-serve, see tdc_serve.h, and reads its reply
+ * into reply.
+ * Returns 0 if the reply is "ok ...", -1 if not or on error.
+ */
+int tdc_serve_command(int sock, const char *cmd, char *reply, size_t size)
+{
+    return tdc_serve_request(sock, cmd, reply, size, NULL, 0) < 0 ? -1 : 0;
+}
+
+/*
+ * Attaches to tdc-serve at the socket path, as name. Reading starts at the
+ * latest piece the server has published.
+ * Returns the client, or NULL on error.
+ */
+struct tdc_serve_client *tdc_serve_attach(const char *path, const char *name)
+{
+    struct tdc_serve_client *client;
+    char cmd[64], reply[256];
+    struct stat st;
+    void *map;
+    uint64_t marks;
+    int fds[2], slot;
+
+    client = calloc(1, sizeof(*client));
+    if (!client)
+        return NULL;
+    fds[0] = fds[1] = -1;
+    client->sock = tdc_serve_connect(path);
+    if (client->sock < 0)
+        goto fail;
+    snprintf(cmd, sizeof(cmd), "attach %.27s", name);
+    if (tdc_serve_request(client->sock, cmd, reply, sizeof(reply), fds, 2)
+            != 2 || sscanf(reply, "ok %d", &slot) != 1 ||
+        slot < 0 || slot >= TDC_SERVE_MAX_CLIENTS)
+        goto fail;
+
+    // The ring can only be mapped read-only, the slots can be written.
+    if (fstat(fds[0], &st) || st.st_size < (off_t)sizeof(*client->ring))
+        goto fail;
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fds[0], 0);
+    if (map == MAP_FAILED)
+        goto fail;
+    client->ring = map;
+    client->map_size = st.st_size;
+    if (memcmp(client->ring->magic, TDC_SERVE_MAGIC, 8) ||
+        client->ring->header_size + client->ring->size > client->map_size)
+        goto fail;
+    client->data = (const unsigned char *)map + client->ring->header_size;
+    map = mmap(NULL, TDC_SERVE_MAX_CLIENTS * sizeof(*client->slots),
+        PROT_READ | PROT_WRITE, MAP_SHARED, fds[1], 0);
+    if (map == MAP_FAILED)
+        goto fail;
+    client->slots = map;
+    client->slot = &client->slots[slot];
+    close(fds[0]);
+    close(fds[1]);
+
+    marks = __atomic_load_n(&client->ring->num_marks, __ATOMIC_ACQUIRE);
+    client->pos = marks ? __atomic_load_n(&client->ring->marks[(marks - 1) %
+        TDC_SERVE_MARKS], __ATOMIC_RELAXED) : 0;
+    __atomic_store_n(&client->slot->pos, client->pos, __ATOMIC_RELAXED);
+    return client;
+
+fail:
+    if (fds[0] >= 0)
+        close(fds[0]);
+    if (fds[1] >= 0)
+        close(fds[1]);
+    tdc_serve_detach(client);
+    return NULL;
+}
+
+void tdc_serve_detach(struct tdc_serve_client *client)
+{
+    if (!client)
+        return;
+    if (client->ring)
+        munmap((void *)client->ring, client->map_size);
+    if (client->slots)
+        munmap(client->slots, TDC_SERVE_MAX_CLIENTS * sizeof(*client->slots));
+    // The server frees the slot when the connection is closed.
+    if (client->sock >= 0)
+        close(client->sock);
+    free(client);
+}
+
+/*
+ * Waits up to timeout_ms (forever if negative) for the ring to change
+ * from futex.
+ * Returns 0 when woken or on a signal, -1 on timeout.
+ */
+static int tdc_serve_wait(const struct tdc_serve_ring *ring, uint32_t futex,
+    int timeout_ms)
+{
+    struct timespec ts, *tsp = NULL;
+
+    if (timeout_ms >= 0) {
+        ts.tv_sec = timeout_ms / 1000;
+        ts.tv_nsec = (timeout_ms % 1000) * 1000000L;
+        tsp = &ts;
+    }
+    if (syscall(SYS_futex, &ring->futex, FUTEX_WAIT, futex, tsp, NULL, 0) &&
+        errno == ETIMEDOUT)
+        return -1;
+    return 0;
+}
+
+/*
+ * Skips the client ahead to the oldest piece that it can still read.
+ * Adds the bytes skipped to lost.
+ */
+static void tdc_serve_skip(struct tdc_serve_client *client, uint64_t head,
+    uint64_t *lost)
+{
+    const struct tdc_serve_ring *ring = client->ring;
+    uint64_t window = ring->size - ring->max_piece;
+    uint64_t n, first, mark = head;
+
+    n = __atomic_load_n(&ring->num_marks, __ATOMIC_ACQUIRE);
+    first = n > TDC_SERVE_MARKS ? n - TDC_SERVE_MARKS : 0;
+    for (; first < n; ++first) {
+        mark = __atomic_load_n(&ring->marks[first % TDC_SERVE_MARKS],
+            __ATOMIC_RELAXED);
+        // May have been replaced by a newer piece, which is as good.
+        if (mark > client->pos && mark <= head && head - mark <= window)
+            break;
+        mark = head;
+    }
+    *lost += mark - client->pos;
+    client->pos = mark;
+    client->slot->skips++;
+}
+
+/*
+ * Reads up to len bytes of the stream, waiting up to timeout_ms for them
+ * (forever if negative). If the client fell too far behind, it is first
+ * skipped ahead to the start of an event, and lost is set to the number
+ * of bytes skipped; a parser of the stream must then be restarted.
+ * Returns the number of bytes read, 0 on timeout, or -1 if the server
+ * has stopped and all was read.
+ */
+long tdc_serve_read(struct tdc_serve_client *client, void *buf, size_t len,
+    int timeout_ms, uint64_t *lost)
+{
+    const struct tdc_serve_ring *ring = client->ring;
+    uint64_t window = ring->size - ring->max_piece;
+    uint64_t head, off;
+    uint32_t futex;
+    size_t n, first;
+
+    *lost = 0;
+    for (;;) {
+        futex = __atomic_load_n(&ring->futex, __ATOMIC_ACQUIRE);
+        head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+        if (head != client->pos)
+            break;
+        if (__atomic_load_n(&ring->closed, __ATOMIC_ACQUIRE))
+            return -1;
+        if (tdc_serve_wait(ring, futex, timeout_ms))
+            return 0;
+    }
+
+    for (;;) {
+        if (head - client->pos > window)
+            tdc_serve_skip(client, head, lost);
+        n = head - client->pos < len ? head - client->pos : len;
+        off = client->pos & (ring->size - 1);
+        first = ring->size - off < n ? ring->size - off : n;
+        memcpy(buf, client->data + off, first);
+        memcpy((char *)buf + first, client->data, n - first);
+        // Copied before the server got too close to overwrite it?
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+        if (head - client->pos <= window)
+            break;
+    }
+
+    client->pos += n;
+    client->slot->lost += *lost;
+    client->slot->bytes += n;
+    __atomic_store_n(&client->slot->pos, client->pos, __ATOMIC_RELAXED);
+    return n;
+}
@@ -0,0 +1,221 @@
+#include <pthread.h>
+#include <stdlib.h>
+
+#include "tdc_steal.h"
+
+/**
+ * struct tdc_steal_queue - the tasks of one thread
+ * @lock:       Protects the queue.
+ * @tasks:      Ring of max_tasks tasks,
+ * @first:      the oldest at this index,
+ * @count:      and how many there are.
+ * @run:        Tasks the thread has run,
+ * @stolen:     and how many of them it took from other queues.
+ * @thread:     The thread.
+ * @pool:       The pool.
+ * @index:      Index of the thread.
+ */
+struct tdc_steal_queue {
+    pthread_mutex_t lock;
+    void **tasks;
+    int first, count;
+    uint64_t run, stolen;
+    pthread_t thread;
+    struct tdc_steal_pool *pool;
+    int index;
+};
+
+/**
+ * struct tdc_steal_pool - see tdc_steal.h
+ * @queues:     A queue for each thread,
+ * @nthreads:   their number,
+ * @started:    and how many threads were started.
+ * @max_tasks:  The most tasks submitted and not finished.
+ * @next:       The queue the next task goes to.
+ * @fn, @arg:   Run the tasks.
+ * @lock:       Protects the rest.
+ * @work:       Signalled when a task is submitted,
+ * @idle:       and when all are finished.
+ * @queued:     Tasks in the queues.
+ * @pending:    Tasks submitted and not finished.
+ * @quit:       Set to end the threads.
+ */
+struct tdc_steal_pool {
+    struct tdc_steal_queue *queues;
+    int nthreads, started;
+    int max_tasks;
+    int next;
+    tdc_steal_fn fn;
+    void *arg;
+    pthread_mutex_t lock;
+    pthread_cond_t work, idle;
+    int queued, pending;
+    int quit;
+};
+
+/* Takes the newest task of the queue, or the oldest if stealing. */
+static void *tdc_steal_take(struct tdc_steal_pool *pool,
+    struct tdc_steal_queue *q, int steal)
+{
+    void *task = NULL;
+
+    pthread_mutex_lock(&q->lock);
+    if (q->count) {
+        q->count--;
+        if (steal) {
+            task = q->tasks[q->first];
+            q->first = (q->first + 1) % pool->max_tasks;
+        } else {
+            task = q->tasks[(q->first + q->count) % pool->max_tasks];
+        }
+    }
+    pthread_mutex_unlock(&q->lock);
+    return task;
+}
+
+static void *tdc_steal_worker(void *arg)
+{
+    struct tdc_steal_queue *q = arg, *other;
+    struct tdc_steal_pool *pool = q->pool;
+    void *task;
+    int i, stolen;
+
+    for (;;) {
+        pthread_mutex_lock(&pool->lock);
+        while (!pool->queued && !pool->quit)
+            pthread_cond_wait(&pool->work, &pool->lock);
+        if (!pool->queued) {
+            pthread_mutex_unlock(&pool->lock);
+            break;
+        }
+        pthread_mutex_unlock(&pool->lock);
+
+        // Another thread may get there first; then look again.
+        task = tdc_steal_take(pool, q, 0);
+        stolen = 0;
+        for (i = 1; !task && i < pool->nthreads; ++i) {
+            other = &pool->queues[(q->index + i) % pool->nthreads];
+            task = tdc_steal_take(pool, other, 1);
+            stolen = 1;
+        }
+        if (!task)
+            continue;
+        pthread_mutex_lock(&pool->lock);
+        pool->queued--;
+        pthread_mutex_unlock(&pool->lock);
+
+        pool->fn(pool->arg, q->index, task);
+        q->run++;
+        q->stolen += stolen;
+
+        pthread_mutex_lock(&pool->lock);
+        if (!--pool->pending)
+            pthread_cond_broadcast(&pool->idle);
+        pthread_mutex_unlock(&pool->lock);
+    }
+    return NULL;
+}
+
+/*
+ * Starts threads that run fn on the tasks submitted. At most max_tasks
+ * may be submitted and not finished at a time.
+ * Returns the pool, or NULL on error.
+ */
+struct tdc_steal_pool *tdc_steal_new(int threads, int max_tasks,
+    tdc_steal_fn fn, void *arg)
+{
+    struct tdc_steal_pool *pool;
+    int i;
+
+    pool = calloc(1, sizeof(*pool));
+    if (!pool)
+        return NULL;
+    pool->nthreads = threads > 1 ? threads : 1;
+    pool->max_tasks = max_tasks;
+    pool->fn = fn;
+    pool->arg = arg;
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->work, NULL);
+    pthread_cond_init(&pool->idle, NULL);
+    pool->queues = calloc(pool->nthreads, sizeof(*pool->queues));
+    if (!pool->queues)
+        goto fail;
+    for (i = 0; i < pool->nthreads; ++i) {
+        pthread_mutex_init(&pool->queues[i].lock, NULL);
+        pool->queues[i].pool = pool;
+        pool->queues[i].index = i;
+        pool->queues[i].tasks = calloc(max_tasks, sizeof(void *));
+        if (!pool->queues[i].tasks)
+            goto fail;
+    }
+    for (i = 0; i < pool->nthreads; ++i) {
+        if (pthread_create(&pool->queues[i].thread, NULL, tdc_steal_worker,
+                &pool->queues[i]))
+            goto fail;
+        pool->started++;
+    }
+    return pool;
+
+fail:
+    tdc_steal_free(pool);
+    return NULL;
+}
+
+/*
+ * Hands a task to the next thread in turn. The caller must not have more
+ * than max_tasks unfinished.
+ */
+void tdc_steal_submit(struct tdc_steal_pool *pool, void *task)
+{
+    struct tdc_steal_queue *q = &pool->queues[pool->next];
+
+    pool->next = (pool->next + 1) % pool->nthreads;
+    pthread_mutex_lock(&q->lock);
+    q->tasks[(q->first + q->count) % pool->max_tasks] = task;
+    q->count++;
+    pthread_mutex_unlock(&q->lock);
+
+    pthread_mutex_lock(&pool->lock);
+    pool->queued++;
+    pool->pending++;
+    pthread_cond_signal(&pool->work);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+/* Waits until all tasks submitted are finished. */
+void tdc_steal_wait(struct tdc_steal_pool *pool)
+{
+    pthread_mutex_lock(&pool->lock);
+    while (pool->pending)
+        pthread_cond_wait(&pool->idle, &pool->lock);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+/* How many tasks a thread has run, and how many of them it stole. */
+void tdc_steal_stats(struct tdc_steal_pool *pool, int worker, uint64_t *run,
+    uint64_t *stolen)
+{
+    *run = pool->queues[worker].run;
+    *stolen = pool->queues[worker].stolen;
+}
+
+/* Runs the tasks left, then ends the threads. */
+void tdc_steal_free(struct tdc_steal_pool *pool)
+{
+    int i;
+
+    if (!pool)
+        return;
+    pthread_mutex_lock(&pool->lock);
+    pool->quit = 1;
+    pthread_cond_broadcast(&pool->work);
+    pthread_mutex_unlock(&pool->lock);
+    for (i = 0; i < pool->started; ++i)
+        pthread_join(pool->queues[i].thread, NULL);
+    if (pool->queues) {
+        for (i = 0; i < pool->nthreads; ++i)
+            free(pool->queues[i].tasks);
+    }
+    free(pool->queues);
+    free(pool);
+}
@@ -0,0 +1,32 @@
+#ifndef _TDC_STEAL_H_
+#define _TDC_STEAL_H_
+
+/*
+ * A work-stealing thread pool.
+ *
+ * Each thread has its own queue of tasks. Tasks are handed out to the
+ * queues in turn, and a thread takes the newest task of its own queue,
+ * or when that is empty, steals the oldest task of another queue, so
+ * that no thread is idle while another has a backlog, e.g. of blocks
+ * with more events to analyze.
+ */
+
+#include <stdint.h>
+
+/*
+ * Runs a task, on the thread with index worker (from 0). arg is that
+ * given to tdc_steal_new.
+ */
+typedef void (*tdc_steal_fn)(void *arg, int worker, void *task);
+
+struct tdc_steal_pool;
+
+struct tdc_steal_pool *tdc_steal_new(int threads, int max_tasks,
+    tdc_steal_fn fn, void *arg);
+void tdc_steal_submit(struct tdc_steal_pool *pool, void *task);
+void tdc_steal_wait(struct tdc_steal_pool *pool);
+void tdc_steal_stats(struct tdc_steal_pool *pool, int worker, uint64_t *run,
+    uint64_t *stolen);
+void tdc_steal_free(struct tdc_steal_pool *pool);
+
+#endif /* _TDC_STEAL_H_ */